@@ -0,0 +1,54 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Objects methods dispatch modes microbenchmark
+--
+
+local coap = require("copua")
+
+local N = 1000000
+
+--
+-- Call msg's method N times; return time (usec) and memory (bytes) spent
+-- per call.
+--
+local function bench(msg, colon)
+    collectgarbage("collect")
+    collectgarbage("stop")
+
+    local mem = collectgarbage("count")
+    local t = os.clock()
+
+    if colon then
+        for i = 1, N do
+            msg:get_type()
+        end
+    else
+        for i = 1, N do
+            msg.get_type()
+        end
+    end
+
+    t = os.clock() - t
+    mem = collectgarbage("count") - mem
+
+    collectgarbage("restart")
+    return (t * 1e6) / N, (mem * 1024) / N
+end
+
+local function main()
+    local msg = coap.new_msg(CoapType.CON, CoapCode.GET, 1)
+
+    coap.set_dispatch_mode(DispatchMode.CLOSURE)
+    print(string.format("CLOSURE obj.method(): %.3f usec, %.1f bytes per call",
+        bench(msg, false)))
+    print(string.format("CLOSURE obj:method(): %.3f usec, %.1f bytes per call",
+        bench(msg, true)))
+
+    coap.set_dispatch_mode(DispatchMode.CACHED)
+    print(string.format("CACHED  obj:method(): %.3f usec, %.1f bytes per call",
+        bench(msg, true)))
+end
+
+main()
@@ -0,0 +1,43 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Sample CoAP client sending concurrent requests from coroutines
+--
+
+local coap = require("copua")
+
+-- number of concurrent requests
+local N_REQS = 10
+
+local function get(conn, path)
+    local msg = coap.new_msg(
+        CoapType.CON, CoapCode.GET, math.random(0, 0xffff))
+    msg.set_uri_path(path)
+
+    -- suspends the coroutine until the response arrives
+    local resp, reason = conn.request(msg)
+    if (not resp) then
+        return nil, NackReasonCodeName[reason]
+    end
+    return CoapCodeName[resp.get_code()], resp.get_payload()
+end
+
+local function main()
+    local conn = coap.new_connection("coap.me", 5683)
+    local n_done = 0
+
+    for i = 1, N_REQS do
+        coroutine.wrap(function()
+            local code, payload = get(conn, "/hello")
+            print(string.format("#%d: %s %s", i, code, payload))
+            n_done = n_done + 1
+        end)()
+    end
+
+    repeat
+        coap.process_step()
+    until n_done == N_REQS
+end
+
+main()
@@ -0,0 +1,46 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Sample CoAP server with an observable resource
+--
+
+local coap = require("copua")
+
+-- notification period (msecs)
+local PERIOD = 1000
+
+local function time_json()
+    return string.format("{\"time\":%d}", os.time())
+end
+
+--
+-- CoAP request handler
+--
+local function req_handler(req, resp)
+    if (req.get_uri_path() == "time") then
+        resp.set_option(CoapOption.CONTENT_FORMAT, CoapFormat.APPLICATION_JSON)
+        resp.send(time_json())
+    else
+        resp.send(404)
+    end
+end
+
+local function main()
+    coap.bind_server("0.0.0.0", 5683, req_handler)
+
+    -- GET /time with Observe option registers an observer
+    local rsrc = coap.new_resource("time")
+
+    coap.timer(PERIOD, function()
+        if (rsrc.get_observers() > 0) then
+            rsrc.notify(time_json(), CoapFormat.APPLICATION_JSON)
+        end
+    end, true)
+
+    repeat
+        coap.process_step()
+    until false;
+end
+
+main()
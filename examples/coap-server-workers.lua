@@ -0,0 +1,45 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Sample multi-core CoAP server
+--
+
+local coap = require("copua")
+
+-- number of workers
+local N_WORKERS = 4
+
+--
+-- CoAP request handler
+--
+local function req_handler(req, resp)
+    local conn = req.get_connection()
+    print(string.format("Worker %d: %s %s from %s:%d",
+        coap.get_worker_id(), CoapCodeName[req.get_code()],
+        req.get_uri_path() or "/", conn.get_addr(), conn.get_port()))
+
+    if (req.get_type() == CoapType.CON) then
+        resp.set_option(CoapOption.CONTENT_FORMAT, CoapFormat.APPLICATION_JSON)
+        resp.send(string.format("{\"worker\":%d}", coap.get_worker_id()))
+    end
+end
+
+local function main(...)
+    if (coap.get_worker_id() == nil) then
+        -- main Lua state; run workers executing this script
+        local n = tonumber(...) or N_WORKERS
+        print(string.format("Starting %d workers", n))
+        coap.run_workers(n, arg[0])
+        return
+    end
+
+    -- worker; all workers bind to the same port (SO_REUSEPORT)
+    coap.bind_server("0.0.0.0", 5683, req_handler)
+
+    repeat
+        coap.process_step()
+    until false;
+end
+
+main(...)
@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lauxlib.h"
+#include "common.h"
+#include "buffer.h"
+#include "block.h"
+
+/*
+ * Space reserved for Block2 (up to 4 bytes) and Size2 (up to 5 bytes)
+ * options plus possible growth of the following option's delta.
+ */
+#define BLK_OPTS_RESERVE    13
+
+/* max block size exponent (1024 bytes block) */
+#define BLK_SZX_MAX         6
+
+/* check if option takes part in the transfer key */
+static int _is_key_opt(uint16_t type)
+{
+    return (type != COAP_OPTION_BLOCK1 && type != COAP_OPTION_BLOCK2 &&
+        type != COAP_OPTION_SIZE1 && type != COAP_OPTION_SIZE2 &&
+        type != COAP_OPTION_OBSERVE);
+}
+
+/* FNV-1a hash */
+static uint32_t _fnv1a(uint32_t h, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        h ^= *data++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* request key: hash of the request code and options */
+static uint32_t _req_key(coap_pdu_t *req)
+{
+    uint8_t hdr[4];
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    uint32_t h = _fnv1a(2166136261U, &req->code, 1);
+
+    coap_option_iterator_init(req, &it, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&it)))
+    {
+        if (!_is_key_opt(it.type))
+            continue;
+
+        hdr[0] = it.type >> 8;
+        hdr[1] = it.type & 0xff;
+        hdr[2] = coap_opt_length(opt) >> 8;
+        hdr[3] = coap_opt_length(opt) & 0xff;
+        h = _fnv1a(h, hdr, sizeof(hdr));
+        h = _fnv1a(h, coap_opt_value(opt), coap_opt_length(opt));
+    }
+    return h;
+}
+
+void blk_cache_init(blk_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    cache->block_sz = BLK_DEF_SIZE;
+    cache->max = BLK_DEF_MAX_XFERS;
+    cache->timeout = BLK_DEF_TIMEOUT;
+
+    cache->up.max_sz = BLK1_DEF_MAX_SIZE;
+    cache->up.max = BLK1_DEF_MAX_XFERS;
+    cache->up.timeout = BLK_DEF_TIMEOUT;
+}
+
+void blk_cache_clear(lua_State *L, blk_cache_t *cache)
+{
+    blk_xfer_t *xfer, *next;
+    blk_upload_t *up, *up_next;
+
+    for (xfer = cache->xfers; xfer; xfer = next) {
+        next = xfer->next;
+        blk_xfer_free(L, xfer);
+    }
+    cache->xfers = NULL;
+    cache->n = 0;
+
+    if (cache->pending) {
+        blk_xfer_free(L, cache->pending);
+        cache->pending = NULL;
+    }
+
+    for (up = cache->up.ups; up; up = up_next) {
+        up_next = up->next;
+        free(up->data);
+        free(up);
+    }
+    cache->up.ups = NULL;
+    cache->up.n = 0;
+
+    blk_upload_done(cache);
+}
+
+blk_xfer_t *blk_xfer_new(const coap_pdu_t *resp)
+{
+    blk_xfer_t *xfer;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    uint8_t *p;
+    size_t opts_len = 0, len;
+
+    /* calculate options snapshot length */
+    coap_option_iterator_init(resp, &it, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&it))) {
+        if (it.type != COAP_OPTION_BLOCK2 && it.type != COAP_OPTION_SIZE2)
+            opts_len += 4 + coap_opt_length(opt);
+    }
+
+    if (!(xfer = (blk_xfer_t*)malloc(sizeof(blk_xfer_t) + opts_len)))
+        return NULL;
+
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->ref = LUA_NOREF;
+    xfer->code = resp->code;
+    xfer->opts_len = opts_len;
+
+    /* encoded options length (the response contains no payload yet) */
+    xfer->opts_enc = (resp->data ?
+        (size_t)(resp->data - resp->token) - 1 : resp->used_size) -
+        resp->token_length;
+
+    p = xfer->opts;
+    coap_option_iterator_init(resp, &it, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&it)))
+    {
+        if (it.type == COAP_OPTION_BLOCK2 || it.type == COAP_OPTION_SIZE2)
+            continue;
+
+        len = coap_opt_length(opt);
+        p[0] = it.type >> 8;
+        p[1] = it.type & 0xff;
+        p[2] = len >> 8;
+        p[3] = len & 0xff;
+        memcpy(p + 4, coap_opt_value(opt), len);
+        p += 4 + len;
+    }
+    return xfer;
+}
+
+void blk_xfer_free(lua_State *L, blk_xfer_t *xfer)
+{
+    if (xfer->src == BLK_SRC_MMAP) {
+        if (xfer->len > 0)
+            munmap((void*)xfer->data, xfer->len);
+    } else {
+        luaL_unref(L, LUA_REGISTRYINDEX, xfer->ref);
+    }
+    free(xfer);
+}
+
+/* remove transfer from the cache (if there) and free it */
+static void _xfer_drop(lua_State *L, blk_cache_t *cache, blk_xfer_t *xfer)
+{
+    blk_xfer_t **pp;
+
+    for (pp = &cache->xfers; *pp; pp = &(*pp)->next) {
+        if (*pp == xfer) {
+            *pp = xfer->next;
+            cache->n--;
+            break;
+        }
+    }
+    blk_xfer_free(L, xfer);
+}
+
+/* put transfer (as the most recently used) into the cache */
+static void _xfer_cache(lua_State *L, blk_cache_t *cache, blk_xfer_t *xfer,
+    const coap_session_t *session, uint32_t rkey)
+{
+    coap_tick_t now;
+    blk_xfer_t **pp, *old;
+
+    /* unlink the transfer itself and drop superseded ones */
+    for (pp = &cache->xfers; (old = *pp);)
+    {
+        if (old == xfer) {
+            *pp = old->next;
+            cache->n--;
+        } else
+        if (old->session == session && old->rkey == rkey) {
+            *pp = old->next;
+            cache->n--;
+            blk_xfer_free(L, old);
+        } else
+            pp = &old->next;
+    }
+
+    /* drop the least recently used transfer if the cache is full */
+    if (cache->n && cache->n >= cache->max)
+    {
+        for (pp = &cache->xfers; (*pp)->next; pp = &(*pp)->next);
+        log_info("Block2 transfers cache full; dropping transfer\n");
+        blk_xfer_free(L, *pp);
+        *pp = NULL;
+        cache->n--;
+    }
+
+    coap_ticks(&now);
+    xfer->session = session;
+    xfer->rkey = rkey;
+    xfer->expire = now + (coap_tick_t)cache->timeout * COAP_TICKS_PER_SECOND;
+
+    xfer->next = cache->xfers;
+    cache->xfers = xfer;
+    cache->n++;
+}
+
+blk_xfer_t *blk_xfer_find(lua_State *L,
+    blk_cache_t *cache, const coap_session_t *session, coap_pdu_t *req)
+{
+    uint32_t rkey;
+    coap_tick_t now;
+    coap_block_t blk;
+    blk_xfer_t **pp, *xfer;
+
+    if (!cache->xfers ||
+        !coap_get_block(req, COAP_OPTION_BLOCK2, &blk) || !blk.num)
+    {
+        return NULL;
+    }
+
+    coap_ticks(&now);
+    rkey = _req_key(req);
+
+    for (pp = &cache->xfers; (xfer = *pp);)
+    {
+        if (xfer->expire <= now) {
+            *pp = xfer->next;
+            cache->n--;
+            blk_xfer_free(L, xfer);
+            continue;
+        }
+
+        if (xfer->session == session && xfer->rkey == rkey)
+            return xfer;
+        pp = &xfer->next;
+    }
+    return NULL;
+}
+
+/* add snapshot options along with Block2 and Size2 (if provided) ones */
+static int _add_opts(coap_pdu_t *resp,
+    const blk_xfer_t *xfer, const coap_block_t *blk, size_t size2)
+{
+    uint8_t b2[4], s2[4];
+    unsigned b2_len = 0, s2_len = 0, num, len;
+    const uint8_t *p = xfer->opts, *end = xfer->opts + xfer->opts_len;
+    int b2_add = (blk != NULL), s2_add = (size2 != BLK_SIZE_UNKNOWN);
+
+    if (b2_add) {
+        b2_len = coap_encode_var_safe(b2, sizeof(b2),
+            (blk->num << 4) | (blk->m << 3) | blk->szx);
+    }
+    if (s2_add) {
+        s2_len = coap_encode_var_safe(s2, sizeof(s2),
+            (size2 > UINT_MAX ? UINT_MAX : (unsigned)size2));
+    }
+
+    /* options need to be added in ascending order */
+    for (;;)
+    {
+        num = (p < end ? (unsigned)(p[0] << 8 | p[1]) : UINT_MAX);
+
+        if (b2_add && COAP_OPTION_BLOCK2 < num) {
+            if (!coap_add_option(resp, COAP_OPTION_BLOCK2, b2_len, b2))
+                return -1;
+            b2_add = 0;
+        }
+        if (s2_add && COAP_OPTION_SIZE2 < num) {
+            if (!coap_add_option(resp, COAP_OPTION_SIZE2, s2_len, s2))
+                return -1;
+            s2_add = 0;
+        }
+
+        if (p >= end)
+            break;
+
+        len = p[2] << 8 | p[3];
+        if (!coap_add_option(resp, num, len, p + 4))
+            return -1;
+        p += 4 + len;
+    }
+    return 0;
+}
+
+/* reset response to an empty one with a given code */
+static void _reset_resp(coap_pdu_t *resp, const coap_pdu_t *req, int code)
+{
+    uint8_t type = resp->type;
+    uint16_t tid = resp->tid;
+
+    coap_pdu_clear(resp, resp->max_size);
+    resp->type = type;
+    resp->tid = tid;
+    resp->code = COAP_RESPONSE_CODE(code);
+    coap_add_token(resp, req->token_length, req->token);
+}
+
+int blk_xfer_respond(lua_State *L, blk_cache_t *cache, blk_xfer_t *xfer,
+    const coap_session_t *session, coap_pdu_t *req, coap_pdu_t *resp)
+{
+    ud_buffer_t *ud_buf;
+    coap_opt_iterator_t it;
+    coap_block_t blk = {0, 0, BLK_SZX_MAX};
+    const uint8_t *data = NULL;
+    int has_blk, more, code = 500, top = lua_gettop(L);
+    unsigned szx;
+    size_t max, hdr, off, bsz, n = 0, size2 = BLK_SIZE_UNKNOWN;
+
+    has_blk = coap_get_block(req, COAP_OPTION_BLOCK2, &blk);
+
+    if (!(max = resp->max_size))
+        max = coap_session_max_pdu_size(session);
+    hdr = 4 + req->token_length + xfer->opts_enc + 1;
+
+    /* rebuild the response header */
+    _reset_resp(resp, req, 0);
+    resp->code = xfer->code;
+
+    /* small payload goes in a single PDU */
+    if (!has_blk &&
+        xfer->len != BLK_SIZE_UNKNOWN && hdr + xfer->len <= max)
+    {
+        if (_add_opts(resp, xfer, NULL, BLK_SIZE_UNKNOWN) ||
+            (xfer->len > 0 && !coap_add_data(resp, xfer->len, xfer->data)))
+        {
+            log_error("Can't build response\n");
+            goto err;
+        }
+        _xfer_drop(L, cache, xfer);
+        return 0;
+    }
+
+    if (max < hdr + BLK_OPTS_RESERVE + 16) {
+        log_error("Max PDU size too small for block-wise transfer\n");
+        goto err;
+    }
+
+    /* block size: fitting the PDU, configured and requested one */
+    for (szx = BLK_SZX_MAX; szx > 0 &&
+        ((size_t)16 << szx) > max - hdr - BLK_OPTS_RESERVE; szx--);
+    while (szx > 0 && (16U << szx) > cache->block_sz) szx--;
+    if (has_blk && blk.szx < szx) szx = blk.szx;
+
+    off = (size_t)blk.num << (blk.szx + 4);
+    bsz = (size_t)16 << szx;
+    blk.num = off >> (szx + 4);
+    blk.szx = szx;
+
+    if (xfer->src == BLK_SRC_FUNC)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, xfer->ref);
+        lua_pushinteger(L, (lua_Integer)off);
+        lua_pushinteger(L, (lua_Integer)bsz);
+
+        if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+            log_error("Block2 producer error: %s\n", lua_tostring(L, -1));
+            goto err;
+        }
+
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            data = (const uint8_t*)lua_tolstring(L, -1, &n);
+        } else
+        if ((ud_buf = buffer_test(L, -1))) {
+            data = ud_buf->data;
+            n = ud_buf->len;
+        } else
+        if (!lua_isnil(L, -1)) {
+            log_error("Invalid Block2 producer result\n");
+            goto err;
+        }
+
+        more = (n >= bsz &&
+            (xfer->len == BLK_SIZE_UNKNOWN || off + bsz < xfer->len));
+        if (n > bsz) n = bsz;
+    } else
+    {
+        if (off > xfer->len || (off > 0 && off == xfer->len)) {
+            code = 402;     /* Bad Option */
+            goto err;
+        }
+
+        data = xfer->data + off;
+        n = xfer->len - off;
+        if (n > bsz) n = bsz;
+        more = (off + n < xfer->len);
+    }
+    blk.m = more;
+
+    if (xfer->len != BLK_SIZE_UNKNOWN &&
+        (!blk.num || coap_check_option(req, COAP_OPTION_SIZE2, &it)))
+    {
+        size2 = xfer->len;
+    }
+
+    if (_add_opts(resp, xfer, &blk, size2) ||
+        (n > 0 && !coap_add_data(resp, n, data)))
+    {
+        log_error("Can't build Block2 response\n");
+        goto err;
+    }
+    lua_settop(L, top);
+
+    log_debug("Block2 %u/%u/%u served\n", blk.num, more, (unsigned)bsz);
+
+    if (more) {
+        _xfer_cache(L, cache, xfer, session, _req_key(req));
+    } else {
+        _xfer_drop(L, cache, xfer);
+    }
+    return 0;
+
+err:
+    lua_settop(L, top);
+    _reset_resp(resp, req, code);
+    _xfer_drop(L, cache, xfer);
+    return -1;
+}
+
+/* set error response of Block1 request */
+static int _upload_error(coap_pdu_t *resp, int code, size_t size1)
+{
+    uint8_t buf[4];
+
+    resp->code = COAP_RESPONSE_CODE(code);
+
+    if (size1) {
+        coap_add_option(resp, COAP_OPTION_SIZE1,
+            coap_encode_var_safe(buf, sizeof(buf), (unsigned)size1), buf);
+    }
+    return BLK1_ERROR;
+}
+
+/* make sure the reassembly buffer fits 'len' bytes */
+static int _upload_fit(blk_upload_t *up, size_t len, size_t max_sz)
+{
+    uint8_t *data;
+    size_t size = (up->size ? up->size : 4 * ((size_t)16 << up->blk.szx));
+
+    if (len <= up->size)
+        return 0;
+
+    /* the buffer grows geometrically, so reassembly is O(n) */
+    while (size < len) size *= 2;
+    if (size > max_sz) size = max_sz;
+
+    if (!(data = (uint8_t*)realloc(up->data, size)))
+        return -1;
+
+    up->data = data;
+    up->size = size;
+    return 0;
+}
+
+int blk_upload_rx(blk_cache_t *cache, const coap_session_t *session,
+    coap_pdu_t *req, coap_pdu_t *resp, size_t *off)
+{
+    uint8_t buf[4];
+    uint8_t *data = NULL;
+    uint32_t rkey;
+    coap_tick_t now;
+    coap_block_t blk;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    blk_upload_t **pp, *up, *found = NULL;
+    size_t len = 0, size1 = 0;
+
+    if (!cache->up.max_sz || !coap_get_block(req, COAP_OPTION_BLOCK1, &blk))
+        return BLK1_NONE;
+
+    coap_get_data(req, &len, &data);
+    coap_ticks(&now);
+    rkey = _req_key(req);
+    *off = (size_t)blk.num << (blk.szx + 4);
+
+    /* look for the upload; drop expired ones */
+    for (pp = &cache->up.ups; (up = *pp);)
+    {
+        if (up->expire <= now || (!blk.num &&
+            up->session == session && up->rkey == rkey))
+        {
+            /* expired or restarted */
+            *pp = up->next;
+            cache->up.n--;
+            free(up->data);
+            free(up);
+            continue;
+        }
+
+        if (up->session == session && up->rkey == rkey)
+            found = up;
+        pp = &up->next;
+    }
+
+    if ((opt = coap_check_option(req, COAP_OPTION_SIZE1, &it)))
+        size1 = coap_decode_var_bytes(
+            coap_opt_value(opt), coap_opt_length(opt));
+
+    if (size1 > cache->up.max_sz || *off + len > cache->up.max_sz) {
+        log_info("Block1 upload exceeds max size %zu\n", cache->up.max_sz);
+        if (found) {
+            for (pp = &cache->up.ups; *pp != found; pp = &(*pp)->next);
+            *pp = found->next;
+            cache->up.n--;
+            free(found->data);
+            free(found);
+        }
+        return _upload_error(resp, 413, cache->up.max_sz);
+    }
+
+    /* non-last block must be of the block size */
+    if (blk.m && len != ((size_t)16 << blk.szx))
+        return _upload_error(resp, 400, 0);
+
+    if (!blk.num)
+    {
+        if (cache->up.n >= cache->up.max) {
+            log_info("Max number of Block1 uploads in progress reached\n");
+            return _upload_error(resp, 503, 0);
+        }
+
+        if (!(found = (blk_upload_t*)calloc(1, sizeof(blk_upload_t))))
+            return _upload_error(resp, 500, 0);
+
+        found->session = session;
+        found->rkey = rkey;
+        found->blk = blk;
+
+        /* Size1 is a hint of the whole payload size */
+        if (!cache->up.stream && size1 > 0) {
+            if (!(found->data = (uint8_t*)malloc(size1))) {
+                free(found);
+                return _upload_error(resp, 500, 0);
+            }
+            found->size = size1;
+        }
+
+        found->next = cache->up.ups;
+        cache->up.ups = found;
+        cache->up.n++;
+    } else
+    if (!found || found->len != *off) {
+        /* missing or out of order block */
+        return _upload_error(resp, 408, 0);
+    }
+
+    if (!cache->up.stream && len > 0) {
+        if (_upload_fit(found, *off + len, cache->up.max_sz))
+            return _upload_error(resp, 500, 0);
+        memcpy(found->data + *off, data, len);
+    }
+
+    found->len = *off + len;
+    found->blk = blk;
+    found->expire =
+        now + (coap_tick_t)cache->up.timeout * COAP_TICKS_PER_SECOND;
+
+    if (blk.m) {
+        resp->code = COAP_RESPONSE_CODE(231);
+        coap_add_option(resp, COAP_OPTION_BLOCK1, coap_encode_var_safe(
+            buf, sizeof(buf), (blk.num << 4) | (1 << 3) | blk.szx), buf);
+        return BLK1_CONTINUE;
+    }
+
+    /* upload completed */
+    for (pp = &cache->up.ups; *pp != found; pp = &(*pp)->next);
+    *pp = found->next;
+    cache->up.n--;
+
+    blk_upload_done(cache);
+    cache->up.done = found;
+
+    return BLK1_DONE;
+}
+
+void blk_upload_done(blk_cache_t *cache)
+{
+    if (cache->up.done) {
+        free(cache->up.done->data);
+        free(cache->up.done);
+        cache->up.done = NULL;
+    }
+}
+
+void blk_upload_ack(const blk_cache_t *cache, coap_pdu_t *resp)
+{
+    uint8_t buf[4];
+    const blk_upload_t *up = cache->up.done;
+
+    if (!up)
+        return;
+
+    /* the response options and payload may be already set */
+    if (!pdu_insert_opt(resp, COAP_OPTION_BLOCK1, coap_encode_var_safe(
+        buf, sizeof(buf), (up->blk.num << 4) | up->blk.szx), buf))
+    {
+        log_warn("Block1 option can't be added to the response\n");
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include "coap2/coap.h"
+#include "lua.h"
+
+/* Block2 transfer defaults */
+#define BLK_DEF_SIZE        1024
+#define BLK_DEF_MAX_XFERS   32
+#define BLK_DEF_TIMEOUT     30  /* secs */
+
+/* Block1 upload defaults */
+#define BLK1_DEF_MAX_SIZE   (1024 * 1024)
+#define BLK1_DEF_MAX_XFERS  8
+
+/* Block1 upload block processing results */
+#define BLK1_NONE       0   /* not a Block1 request; handled as usual */
+#define BLK1_CONTINUE   1   /* block accepted; 2.31 Continue response set */
+#define BLK1_DONE       2   /* last block received; upload completed */
+#define BLK1_ERROR      3   /* block rejected; error response set */
+
+/* Block2 payload sources */
+#define BLK_SRC_MEM     0   /* memory of a Lua string or buffer object */
+#define BLK_SRC_MMAP    1   /* memory mapped file */
+#define BLK_SRC_FUNC    2   /* Lua producer function */
+
+/* payload size not known in advance (producer function) */
+#define BLK_SIZE_UNKNOWN ((size_t)-1)
+
+/*
+ * Block2 transfer state. The transfer is keyed by the session and a hash of
+ * the request options (except block-wise specific ones), since RFC 7959
+ * clients are allowed to change tokens between blocks requests.
+ */
+typedef struct blk_xfer_t
+{
+    struct blk_xfer_t *next;
+
+    /* transfer key */
+    const coap_session_t *session;
+    uint32_t rkey;
+    coap_tick_t expire;
+
+    /* payload source */
+    int src;
+    const uint8_t *data;    /* BLK_SRC_MEM, BLK_SRC_MMAP */
+    size_t len;             /* payload size; BLK_SIZE_UNKNOWN if not known */
+    int ref;                /* Lua registry reference of the source object */
+
+    /* response header snapshot (code and options) */
+    uint8_t code;
+    size_t opts_enc;        /* encoded options length in the response */
+    size_t opts_len;
+    uint8_t opts[];         /* options as: number(2), length(2), value */
+} blk_xfer_t;
+
+/*
+ * Block1 upload state. Uploads are keyed the same way as Block2 transfers.
+ */
+typedef struct blk_upload_t
+{
+    struct blk_upload_t *next;
+
+    /* upload key */
+    const coap_session_t *session;
+    uint32_t rkey;
+    coap_tick_t expire;
+
+    coap_block_t blk;       /* last received block */
+    size_t len;             /* received payload length */
+    size_t size;            /* reassembly buffer size */
+    uint8_t *data;          /* reassembly buffer; NULL in streaming mode */
+} blk_upload_t;
+
+/* Block-wise transfers cache */
+typedef struct
+{
+    unsigned block_sz;      /* max block size; 0: block-wise disabled */
+    unsigned max;           /* max number of cached transfers */
+    unsigned timeout;       /* transfer expiration (secs) */
+
+    unsigned n;             /* number of cached transfers */
+    blk_xfer_t *xfers;      /* cached transfers (most recently used first) */
+
+    /* request being handled and its response transfer (set by send()) */
+    coap_pdu_t *req;
+    blk_xfer_t *pending;
+
+    /* Block1 uploads */
+    struct {
+        size_t max_sz;      /* max upload size; 0: reassembly disabled */
+        unsigned max;       /* max number of uploads in progress */
+        unsigned timeout;   /* upload expiration (secs) */
+        int stream;         /* streaming mode (no reassembly) */
+
+        unsigned n;         /* number of uploads in progress */
+        blk_upload_t *ups;  /* uploads in progress */
+        blk_upload_t *done; /* completed upload being handled */
+    } up;
+} blk_cache_t;
+
+/**
+ * Initialize block-wise transfers cache with defaults.
+ */
+void blk_cache_init(blk_cache_t *cache);
+
+/**
+ * Free all cached transfers (and the pending one) and uploads.
+ */
+void blk_cache_clear(lua_State *L, blk_cache_t *cache);
+
+/**
+ * Create Block2 transfer with the response header (code and options) taken
+ * from 'resp'. The payload source shall be set by the caller. Returns NULL
+ * on error.
+ */
+blk_xfer_t *blk_xfer_new(const coap_pdu_t *resp);
+
+/**
+ * Free Block2 transfer along with its payload source.
+ */
+void blk_xfer_free(lua_State *L, blk_xfer_t *xfer);
+
+/**
+ * Find cached transfer for a request of block number > 0. Expired transfers
+ * are removed. Returns NULL if not found.
+ */
+blk_xfer_t *blk_xfer_find(lua_State *L,
+    blk_cache_t *cache, const coap_session_t *session, coap_pdu_t *req);
+
+/**
+ * Fill 'resp' with the block requested by 'req'. Small payload is sent in
+ * a single PDU (with no Block2 option) if the request doesn't ask for a
+ * block. The transfer is kept in the cache if there are more blocks to
+ * serve, freed otherwise. Returns 0 on success, -1 on error (the response
+ * code is set to reflect the error then).
+ */
+int blk_xfer_respond(lua_State *L, blk_cache_t *cache, blk_xfer_t *xfer,
+    const coap_session_t *session, coap_pdu_t *req, coap_pdu_t *resp);
+
+/**
+ * Process Block1 request (if the reassembly is enabled). Non-last blocks
+ * are acknowledged by 2.31 Continue response set in 'resp'. Completed
+ * upload is set as cache->up.done (to be freed by blk_upload_done()).
+ * Offset of an accepted block is written under 'off'. Returns BLK1_XXX.
+ */
+int blk_upload_rx(blk_cache_t *cache, const coap_session_t *session,
+    coap_pdu_t *req, coap_pdu_t *resp, size_t *off);
+
+/**
+ * Free completed upload (cache->up.done) if set.
+ */
+void blk_upload_done(blk_cache_t *cache);
+
+/**
+ * Add Block1 option of the completed upload (if set) to 'resp', which may
+ * be already finalized (with its options and payload set).
+ */
+void blk_upload_ack(const blk_cache_t *cache, coap_pdu_t *resp);
+
+#endif
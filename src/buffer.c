@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <string.h>
+
+#include "lauxlib.h"
+#include "buffer.h"
+
+ud_buffer_t *buffer_push(lua_State *L, const uint8_t *data, size_t len)
+{
+    ud_buffer_t *ud_buf =
+        (ud_buffer_t*)lua_newuserdata(L, sizeof(ud_buffer_t) + len);
+
+    ud_buf->data = ud_buf->mem;
+    ud_buf->len = len;
+    ud_buf->gen = NULL;
+
+    if (data) {
+        memcpy(ud_buf->mem, data, len);
+    } else {
+        memset(ud_buf->mem, 0, len);
+    }
+
+    luaL_setmetatable(L, MT_BUFFER);
+    return ud_buf;
+}
+
+ud_buffer_t *buffer_push_view(lua_State *L,
+    const uint8_t *data, size_t len, const unsigned *gen, int owner_idx)
+{
+    ud_buffer_t *ud_buf;
+
+    owner_idx = lua_absindex(L, owner_idx);
+    ud_buf = (ud_buffer_t*)lua_newuserdata(L, sizeof(ud_buffer_t));
+
+    ud_buf->data = (uint8_t*)data;
+    ud_buf->len = len;
+    ud_buf->gen = gen;
+    ud_buf->gen_snap = *gen;
+
+    lua_pushvalue(L, owner_idx);
+    lua_setuservalue(L, -2);
+
+    luaL_setmetatable(L, MT_BUFFER);
+    return ud_buf;
+}
+
+/* check view validity */
+static ud_buffer_t *_check_view(lua_State *L, ud_buffer_t *ud_buf)
+{
+    if (ud_buf && ud_buf->gen && *ud_buf->gen != ud_buf->gen_snap)
+        luaL_error(L, "View expired; it's valid during the handler call only");
+    return ud_buf;
+}
+
+/* check buffer object argument */
+static ud_buffer_t *_check_buf(lua_State *L, int idx)
+{
+    return _check_view(L, (ud_buffer_t*)luaL_checkudata(L, idx, MT_BUFFER));
+}
+
+/* check writable buffer object argument */
+static ud_buffer_t *_check_wbuf(lua_State *L, int idx)
+{
+    ud_buffer_t *ud_buf = _check_buf(L, idx);
+
+    if (ud_buf->gen)
+        luaL_error(L, "View is read-only");
+    return ud_buf;
+}
+
+ud_buffer_t *buffer_test(lua_State *L, int idx)
+{
+    return _check_view(L, (ud_buffer_t*)luaL_testudata(L, idx, MT_BUFFER));
+}
+
+int bytes_type_opt(lua_State *L, int idx, int def)
+{
+    int type;
+
+    switch (lua_type(L, idx))
+    {
+    case LUA_TNONE:
+    case LUA_TNIL:
+        return def;
+
+    case LUA_TBOOLEAN:
+        return (lua_toboolean(L, idx) ? BYTES_ARRAY : BYTES_STRING);
+
+    default:
+        type = luaL_checkinteger(L, idx);
+        if (type < BYTES_STRING || type > BYTES_BUFFER)
+            luaL_argerror(L, idx, "Invalid bytes type");
+        return type;
+    }
+}
+
+void bytes_push(lua_State *L, const uint8_t *data, size_t len, int type)
+{
+    size_t i;
+
+    switch (type)
+    {
+    case BYTES_ARRAY:
+        lua_createtable(L, len, 0);
+        for (i = 0; i < len; i++) {
+            lua_pushinteger(L, data[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+        break;
+
+    case BYTES_BUFFER:
+        buffer_push(L, data, len);
+        break;
+
+    default:
+        lua_pushlstring(L, (const char*)data, len);
+        break;
+    }
+}
+
+const uint8_t *bytes_to(
+    lua_State *L, int idx, uint8_t *arr_buf, size_t arr_sz, size_t *len)
+{
+    size_t i;
+    ud_buffer_t *ud_buf;
+
+    switch (lua_type(L, idx))
+    {
+    case LUA_TSTRING:
+        return (const uint8_t*)lua_tolstring(L, idx, len);
+
+    case LUA_TUSERDATA:
+        if (!(ud_buf = buffer_test(L, idx)))
+            break;
+        *len = ud_buf->len;
+        return ud_buf->data;
+
+    case LUA_TTABLE:
+        *len = luaL_len(L, idx);
+        if (*len > arr_sz) {
+            luaL_error(L,
+                "Invalid argument: array size larger than %d bytes",
+                (int)arr_sz);
+        }
+
+        for (i = 0; i < *len; i++) {
+            if (lua_rawgeti(L, idx, i+1) != LUA_TNUMBER) {
+                luaL_error(L, "Invalid argument: bytes-array expected");
+            }
+            arr_buf[i] = (uint8_t)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+        return arr_buf;
+
+    default:;
+    }
+    return NULL;
+}
+
+/* translate 1-based (possibly negative) position to 0-based offset */
+static size_t _pos2off(lua_Integer pos, size_t len)
+{
+    if (pos > 0) return (size_t)pos - 1;
+    else if (pos == 0) return 0;
+    else if (pos < -(lua_Integer)len) return 0;
+    return len + (size_t)pos;
+}
+
+/* get [i, j] bytes range of the buffer; string.sub() semantics */
+static void _get_range(lua_State *L, ud_buffer_t *ud_buf,
+    int arg_i, int arg_j, size_t *off, size_t *n)
+{
+    size_t s = _pos2off(luaL_optinteger(L, arg_i, 1), ud_buf->len);
+    lua_Integer j = luaL_optinteger(L, arg_j, -1);
+    size_t e;
+
+    /* end position before the buffer start gives an empty range */
+    if (j < -(lua_Integer)ud_buf->len) e = 0;
+    else if (j < 0) e = ud_buf->len + (size_t)j + 1;
+    else e = ((size_t)j > ud_buf->len ? ud_buf->len : (size_t)j);
+
+    if (s > ud_buf->len) s = ud_buf->len;
+
+    *off = s;
+    *n = (s < e ? e - s : 0);
+}
+
+/* check integer field at 1-based 'pos' of 'size' bytes */
+static size_t _check_int_field(lua_State *L,
+    ud_buffer_t *ud_buf, int arg_pos, int arg_size, int *size)
+{
+    lua_Integer pos = luaL_checkinteger(L, arg_pos);
+
+    *size = luaL_checkinteger(L, arg_size);
+    if (*size < 1 || *size > 8)
+        luaL_argerror(L, arg_size, "Integer size must be 1..8 bytes");
+
+    if (pos < 1 || (size_t)pos - 1 + *size > ud_buf->len)
+        luaL_argerror(L, arg_pos, "Position out of buffer");
+
+    return (size_t)pos - 1;
+}
+
+/**
+ * Get buffer length (also available by # operator).
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     len [int]: Buffer length.
+ */
+static int l_coap_buf_len(lua_State *L)
+{
+    lua_pushinteger(L, _check_buf(L, 1)->len);
+    return 1;
+}
+
+/**
+ * Get buffer sub-range as a new buffer (with string.sub() semantics).
+ *
+ * Lua arguments:
+ *     i [int|none]: Start position (default: 1).
+ *     j [int|none]: End position (default: -1).
+ *
+ * Lua return:
+ *     buf [userdata]: Buffer object.
+ */
+static int l_coap_buf_sub(lua_State *L)
+{
+    size_t off, n;
+    ud_buffer_t *ud_buf = _check_buf(L, 1);
+
+    _get_range(L, ud_buf, 2, 3, &off, &n);
+    buffer_push(L, ud_buf->data + off, n);
+    return 1;
+}
+
+/**
+ * Get buffer (or its sub-range) as a string.
+ *
+ * Lua arguments:
+ *     i [int|none]: Start position (default: 1).
+ *     j [int|none]: End position (default: -1).
+ *
+ * Lua return:
+ *     str [string]: Buffer content.
+ */
+static int l_coap_buf_tostring(lua_State *L)
+{
+    size_t off, n;
+    ud_buffer_t *ud_buf = _check_buf(L, 1);
+
+    _get_range(L, ud_buf, 2, 3, &off, &n);
+    lua_pushlstring(L, (const char*)ud_buf->data + off, n);
+    return 1;
+}
+
+/* read integer of 'size' (1..8) bytes */
+static uint64_t _read_int(const uint8_t *p, int size, int le, int sign)
+{
+    int i;
+    uint64_t v = 0;
+
+    if (le) {
+        for (i = size-1; i >= 0; i--) v = (v << 8) | p[i];
+    } else {
+        for (i = 0; i < size; i++) v = (v << 8) | p[i];
+    }
+
+    /* sign extension */
+    if (sign && size < 8 && (v & ((uint64_t)1 << (size*8 - 1))))
+        v |= ~(uint64_t)0 << (size*8);
+
+    return v;
+}
+
+/* read integer field */
+static int _buf_get_int(lua_State *L, int sign)
+{
+    int size;
+    ud_buffer_t *ud_buf = _check_buf(L, 1);
+    size_t off = _check_int_field(L, ud_buf, 2, 3, &size);
+
+    lua_pushinteger(L, (lua_Integer)
+        _read_int(ud_buf->data + off, size, lua_toboolean(L, 4), sign));
+    return 1;
+}
+
+/**
+ * Read unsigned integer.
+ *
+ * Lua arguments:
+ *     pos [int]: Position (1-based) of the integer.
+ *     size [int]: Integer size (1..8 bytes).
+ *     le [bool|none]: If true the integer is little endian, big endian
+ *         otherwise (default).
+ *
+ * Lua return:
+ *     val [int]: Integer value.
+ */
+static int l_coap_buf_get_uint(lua_State *L)
+{
+    return _buf_get_int(L, 0);
+}
+
+/**
+ * Read signed integer. See get_uint() for arguments.
+ */
+static int l_coap_buf_get_int(lua_State *L)
+{
+    return _buf_get_int(L, 1);
+}
+
+/**
+ * Write integer (signed or unsigned).
+ *
+ * Lua arguments:
+ *     pos [int]: Position (1-based) of the integer.
+ *     size [int]: Integer size (1..8 bytes).
+ *     val [int]: Integer value.
+ *     le [bool|none]: If true write little endian, big endian otherwise
+ *         (default).
+ *
+ * Lua return: None
+ */
+static int l_coap_buf_set_int(lua_State *L)
+{
+    int i, size;
+    ud_buffer_t *ud_buf = _check_wbuf(L, 1);
+    size_t off = _check_int_field(L, ud_buf, 2, 3, &size);
+    uint64_t v = (uint64_t)luaL_checkinteger(L, 4);
+    uint8_t *p = ud_buf->data + off;
+
+    if (lua_toboolean(L, 5)) {
+        for (i = 0; i < size; i++, v >>= 8) p[i] = (uint8_t)v;
+    } else {
+        for (i = size-1; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+    }
+    return 0;
+}
+
+/**
+ * Find bytes (plain search, no patterns).
+ *
+ * Lua arguments:
+ *     bytes [string|buffer]: Bytes to find.
+ *     init [int|none]: Search start position (default: 1).
+ *
+ * Lua return:
+ *     pos [int|nil]: Position (1-based) of the found bytes, nil if not found.
+ */
+static int l_coap_buf_find(lua_State *L)
+{
+    size_t n, off;
+    const uint8_t *b, *p;
+    ud_buffer_t *ud_buf = _check_buf(L, 1);
+
+    if (lua_istable(L, 2) || !(b = bytes_to(L, 2, NULL, 0, &n)))
+        return luaL_argerror(L, 2, "string or buffer expected");
+
+    off = _pos2off(luaL_optinteger(L, 3, 1), ud_buf->len);
+    if (off > ud_buf->len) off = ud_buf->len;
+
+    if ((p = (const uint8_t*)memmem(
+        ud_buf->data + off, ud_buf->len - off, b, n)))
+    {
+        lua_pushinteger(L, (p - ud_buf->data) + 1);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* read optional size of a format option */
+static size_t _fmt_num(const char **fmt, size_t def)
+{
+    size_t n = 0;
+
+    if (**fmt < '0' || **fmt > '9')
+        return def;
+
+    while (**fmt >= '0' && **fmt <= '9')
+        n = n * 10 + (*(*fmt)++ - '0');
+    return n;
+}
+
+/**
+ * Decode values out of the buffer according to the format string. The
+ * routine works as string.unpack() (with no copy of the buffer into a
+ * string) and supports the following subset of its format options:
+ * < > = ! b B h H i[n] I[n] l L j J T f d n s[n] z x c[n] and spaces.
+ * Integers up to 8 bytes are supported. Alignment (!) is ignored.
+ *
+ * Lua arguments:
+ *     fmt [string]: Format string.
+ *     pos [int|none]: Position to start decoding from (default: 1).
+ *
+ * Lua return:
+ *     val(s) [int|number|string]: Decoded values.
+ *     next [int]: Position of the first not read byte.
+ */
+static int l_coap_buf_unpack(lua_State *L)
+{
+    char opt;
+    int n = 0, sign;
+    union { uint32_t i; float f; } f32;
+    union { uint64_t i; double d; } f64;
+    const uint16_t endian = 1;
+    int le = *(const uint8_t*)&endian;
+    size_t size, len;
+
+    ud_buffer_t *ud_buf = _check_buf(L, 1);
+    const char *fmt = luaL_checkstring(L, 2);
+    size_t pos = _pos2off(luaL_optinteger(L, 3, 1), ud_buf->len);
+    const uint8_t *data = ud_buf->data;
+
+    luaL_argcheck(L, pos <= ud_buf->len, 3, "initial position out of buffer");
+
+#define __NEED(__n) \
+    if ((__n) > ud_buf->len - pos) \
+        return luaL_error(L, "Data too short at position %d", (int)pos+1);
+
+    while ((opt = *fmt++))
+    {
+        sign = 0;
+        switch (opt)
+        {
+        case ' ': continue;
+        case '!': _fmt_num(&fmt, 0); continue;
+        case '<': le = 1; continue;
+        case '>': le = 0; continue;
+        case '=': le = *(const uint8_t*)&endian; continue;
+
+        case 'x':
+            __NEED(1);
+            pos++;
+            continue;
+
+        case 'b': sign = 1; /* fall through */
+        case 'B': size = 1; break;
+        case 'h': sign = 1; /* fall through */
+        case 'H': size = 2; break;
+        case 'i': sign = 1; /* fall through */
+        case 'I': size = _fmt_num(&fmt, sizeof(int)); break;
+        case 'l': sign = 1; /* fall through */
+        case 'L': size = sizeof(long); break;
+        case 'j': sign = 1; /* fall through */
+        case 'J': size = sizeof(lua_Integer); break;
+        case 'T': size = sizeof(size_t); break;
+
+        case 'f':
+            __NEED(4);
+            f32.i = (uint32_t)_read_int(data + pos, 4, le, 0);
+            lua_pushnumber(L, f32.f);
+            pos += 4;
+            goto next;
+
+        case 'd':
+        case 'n':
+            __NEED(8);
+            f64.i = _read_int(data + pos, 8, le, 0);
+            lua_pushnumber(L, f64.d);
+            pos += 8;
+            goto next;
+
+        case 's':
+            size = _fmt_num(&fmt, sizeof(size_t));
+            luaL_argcheck(L, size >= 1 && size <= 8, 2, "Invalid size");
+            __NEED(size);
+            len = (size_t)_read_int(data + pos, size, le, 0);
+            pos += size;
+            __NEED(len);
+            lua_pushlstring(L, (const char*)data + pos, len);
+            pos += len;
+            goto next;
+
+        case 'z':
+            len = strnlen((const char*)data + pos, ud_buf->len - pos);
+            __NEED(len + 1);
+            lua_pushlstring(L, (const char*)data + pos, len);
+            pos += len + 1;
+            goto next;
+
+        case 'c':
+            len = _fmt_num(&fmt, (size_t)-1);
+            luaL_argcheck(L, len != (size_t)-1, 2, "Missing size for 'c'");
+            __NEED(len);
+            lua_pushlstring(L, (const char*)data + pos, len);
+            pos += len;
+            goto next;
+
+        default:
+            return luaL_error(L, "Invalid format option '%c'", opt);
+        }
+
+        /* integer */
+        luaL_argcheck(L, size >= 1 && size <= 8, 2, "Invalid integer size");
+        __NEED(size);
+        lua_pushinteger(L, (lua_Integer)_read_int(data + pos, size, le, sign));
+        pos += size;
+
+next:
+        n++;
+        luaL_checkstack(L, 2, "Too many results");
+    }
+#undef __NEED
+
+    lua_pushinteger(L, pos + 1);
+    return n + 1;
+}
+
+/* buf[i] */
+static int _buf_index(lua_State *L)
+{
+    lua_Integer i;
+    ud_buffer_t *ud_buf = (ud_buffer_t*)lua_touserdata(L, 1);
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        _check_view(L, ud_buf);
+
+        i = lua_tointeger(L, 2);
+        if (i >= 1 && (size_t)i <= ud_buf->len) {
+            lua_pushinteger(L, ud_buf->data[i-1]);
+        } else {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+
+    /* method */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+/* buf[i] = v */
+static int _buf_newindex(lua_State *L)
+{
+    ud_buffer_t *ud_buf = _check_wbuf(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+
+    if (i < 1 || (size_t)i > ud_buf->len)
+        return luaL_error(L, "Index %d out of buffer", (int)i);
+
+    ud_buf->data[i-1] = (uint8_t)luaL_checkinteger(L, 3);
+    return 0;
+}
+
+static int _buf_eq(lua_State *L)
+{
+    ud_buffer_t *a = buffer_test(L, 1), *b = buffer_test(L, 2);
+
+    lua_pushboolean(L, (a && b && a->len == b->len &&
+        !memcmp(a->data, b->data, a->len)));
+    return 1;
+}
+
+/**
+ * Create buffer object.
+ *
+ * Lua arguments:
+ *     init [int|string|buffer|bytes-array (1-based)]: Buffer size (zero
+ *         filled) or its initial content.
+ *
+ * Lua return:
+ *     buf [userdata]: Buffer object.
+ */
+int l_coap_new_buffer(lua_State *L)
+{
+    size_t len;
+    const uint8_t *data;
+
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        lua_Integer sz = luaL_checkinteger(L, 1);
+
+        if (sz < 0)
+            return luaL_argerror(L, 1, "Invalid buffer size");
+        buffer_push(L, NULL, (size_t)sz);
+    } else
+    if (lua_istable(L, 1)) {
+        /* the array bytes are written directly into the buffer */
+        ud_buffer_t *ud_buf = buffer_push(L, NULL, luaL_len(L, 1));
+        bytes_to(L, 1, ud_buf->data, ud_buf->len, &len);
+    } else
+    if ((data = bytes_to(L, 1, NULL, 0, &len))) {
+        buffer_push(L, data, len);
+    } else {
+        return luaL_argerror(L, 1, "Invalid buffer initializer");
+    }
+    return 1;
+}
+
+void buffer_open(lua_State *L)
+{
+    static const luaL_Reg buf_funcs[] = {
+        {"len", l_coap_buf_len},
+        {"sub", l_coap_buf_sub},
+        {"tostring", l_coap_buf_tostring},
+        {"get_uint", l_coap_buf_get_uint},
+        {"get_int", l_coap_buf_get_int},
+        {"set_int", l_coap_buf_set_int},
+        {"find", l_coap_buf_find},
+        {"unpack", l_coap_buf_unpack},
+        {NULL, NULL}
+    };
+
+    if (!luaL_newmetatable(L, MT_BUFFER)) {
+        /* already registered */
+        lua_pop(L, 1);
+        return;
+    }
+
+    /* methods table is the __index upvalue */
+    luaL_newlib(L, buf_funcs);
+    lua_pushcclosure(L, _buf_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, _buf_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, l_coap_buf_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, l_coap_buf_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, _buf_eq);
+    lua_setfield(L, -2, "__eq");
+
+    lua_pop(L, 1);
+}
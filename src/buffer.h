@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+#include "common.h"
+
+/* buffer object metatable */
+#define MT_BUFFER   XSTR(LIB_NAME) ".buffer"
+
+/* bytes representation types (BytesType) */
+#define BYTES_STRING    0
+#define BYTES_ARRAY     1   /* bytes-array (1-based) */
+#define BYTES_BUFFER    2   /* buffer object */
+
+/* byte-buffer userdata object */
+typedef struct
+{
+    uint8_t *data;      /* buffer data */
+    size_t len;         /* data length */
+
+    /*
+     * Read-only view of an external memory (NULL for a buffer owning its
+     * memory). The view is valid as long as the owner's generation counter
+     * is equal to the generation the view was created for.
+     */
+    const unsigned *gen;
+    unsigned gen_snap;
+
+    uint8_t mem[];      /* buffer memory (if owned by the object) */
+} ud_buffer_t;
+
+/**
+ * Create buffer object of 'len' bytes with content copied from 'data' (zero
+ * filled if NULL) and push it on the stack.
+ */
+ud_buffer_t *buffer_push(lua_State *L, const uint8_t *data, size_t len);
+
+/**
+ * Create read-only view of 'len' bytes of 'data' and push it on the stack.
+ * The view is valid as long as *gen is not changed. The owner object at
+ * 'owner_idx' (containing the viewed memory) is kept alive by the view.
+ */
+ud_buffer_t *buffer_push_view(lua_State *L,
+    const uint8_t *data, size_t len, const unsigned *gen, int owner_idx);
+
+/**
+ * Get buffer object at 'idx'. Returns NULL if not a buffer. Error is raised
+ * for expired views.
+ */
+ud_buffer_t *buffer_test(lua_State *L, int idx);
+
+/**
+ * Get bytes type argument at 'idx' (BytesType or boolean: true for bytes-
+ * array, false for string). 'def' is returned if the argument is absent.
+ */
+int bytes_type_opt(lua_State *L, int idx, int def);
+
+/**
+ * Push bytes on the stack as 'type' (BytesType).
+ */
+void bytes_push(lua_State *L, const uint8_t *data, size_t len, int type);
+
+/**
+ * Get bytes out of string, buffer object or bytes-array at 'idx'. Bytes of
+ * bytes-array are written to 'arr_buf' of 'arr_sz' size (error is raised if
+ * the array doesn't fit). Returns NULL if the argument is not of any of
+ * these types. Returned bytes length is written under 'len'.
+ */
+const uint8_t *bytes_to(
+    lua_State *L, int idx, uint8_t *arr_buf, size_t arr_sz, size_t *len);
+
+/**
+ * Register buffer object metatable.
+ */
+void buffer_open(lua_State *L);
+
+/* Lua API */
+int l_coap_new_buffer(lua_State *L);
+
+#endif
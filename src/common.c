@@ -11,7 +11,10 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 
@@ -29,3 +32,74 @@ const char *strtrim(const char *s, size_t *len)
     *len = (e >= s ? e - s + 1 : 0);
     return s;
 }
+
+int pdu_insert_opt(
+    coap_pdu_t *pdu, uint16_t num, size_t len, const uint8_t *val)
+{
+    int ret = 0, added = 0;
+    unsigned t, l;
+    size_t opts_len = 0, data_len = 0;
+    uint8_t *buf, *p, *end;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+
+    /* option in order with no payload added yet is simply appended */
+    if (num >= pdu->max_delta && !pdu->data)
+        return (coap_add_option(pdu, num, len, val) != 0);
+
+    coap_option_iterator_init(pdu, &it, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&it)))
+        opts_len += 4 + coap_opt_length(opt);
+
+    if (pdu->data)
+        data_len = pdu->used_size - (size_t)(pdu->data - pdu->token);
+
+    if (!(buf = (uint8_t*)malloc(opts_len + data_len + 1)))
+        return 0;
+
+    /* snapshot options as: number(2), length(2), value; then the payload */
+    p = buf;
+    coap_option_iterator_init(pdu, &it, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&it))) {
+        l = coap_opt_length(opt);
+        p[0] = (uint8_t)(it.type >> 8);
+        p[1] = (uint8_t)it.type;
+        p[2] = (uint8_t)(l >> 8);
+        p[3] = (uint8_t)l;
+        memcpy(p + 4, coap_opt_value(opt), l);
+        p += 4 + l;
+    }
+    end = p;
+    if (data_len)
+        memcpy(end, pdu->data, data_len);
+
+    /* rebuild the PDU past its token */
+    pdu->used_size = pdu->token_length;
+    pdu->max_delta = 0;
+    pdu->data = NULL;
+
+    for (p = buf;;)
+    {
+        t = (p < end ? (unsigned)(p[0] << 8 | p[1]) : UINT_MAX);
+
+        if (!added && num < t) {
+            if (!coap_add_option(pdu, num, len, val))
+                goto finish;
+            added = 1;
+        }
+
+        if (p >= end)
+            break;
+
+        l = p[2] << 8 | p[3];
+        if (!coap_add_option(pdu, t, l, p + 4))
+            goto finish;
+        p += 4 + l;
+    }
+
+    ret = (!data_len || coap_add_data(pdu, data_len, end));
+
+finish:
+    free(buf);
+    return ret;
+}
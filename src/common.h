@@ -13,6 +13,7 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include "coap2/coap.h"
 #include "log.h"
 
 /* preprocessor stringizers */
@@ -35,4 +36,12 @@
  */
 const char *strtrim(const char *s, size_t *len);
 
+/**
+ * Add option to a PDU regardless of the order of options already added and
+ * the payload presence (the option is inserted at its ordered position).
+ * Returns 0 on error (the PDU may be left incomplete then).
+ */
+int pdu_insert_opt(
+    coap_pdu_t *pdu, uint16_t num, size_t len, const uint8_t *val);
+
 #endif
@@ -12,17 +12,39 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "coap2/coap.h"
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
 #include "common.h"
+#include "block.h"
+#include "buffer.h"
+#include "mmsg.h"
+#include "observe.h"
+#include "pending.h"
+#include "route.h"
+#include "resolve.h"
+#include "shared.h"
+#include "timer.h"
+#include "uring.h"
 
 
 /* default value if not configured otherwise */
@@ -41,10 +63,38 @@
 #define RESP_HANDLER  "coap_resp_handler"
 #define NACK_HANDLER  "coap_nack_handler"
 
+/* max number of sockets handled by the external event loop integration */
+#ifndef EV_MAX_SOCKS
+# define EV_MAX_SOCKS   64
+#endif
+
+/* max number of client sockets shared by connections (per address family) */
+#ifndef SHR_MAX_SOCKS
+# define SHR_MAX_SOCKS  16
+#endif
+
+/* period (secs) of libcoap sessions housekeeping in the epoll mode */
+#define POLL_SWEEP_INTV 1
+
+/* connection pool defaults (see connection_pool()) */
+#define POOL_DEF_MAX    32  /* max number of pooled connections */
+#define POOL_DEF_IDLE   60  /* idle connection expiration time (secs) */
+
+/* period (secs) of pooled connections idle expiration checks */
+#define POOL_SWEEP_INTV 1
+
+/* registry key of worker id (set for Lua states of workers only) */
+#define REG_WORKER_ID MOD_NAME_STR ".worker"
+
 /* library metatables */
 #define MT_CONTEXT    MOD_NAME_STR ".ctx"
 #define MT_PDU        MOD_NAME_STR ".pdu"
 #define MT_CONNECTION MOD_NAME_STR ".conn"
+#define MT_ENDPOINT   MOD_NAME_STR ".ep"
+#define MT_RESOURCE   MOD_NAME_STR ".rsrc"
+#define MT_SUBSCRIPTION MOD_NAME_STR ".sub"
+#define MT_TIMER      MOD_NAME_STR ".tmr"
+#define MT_POOL       MOD_NAME_STR ".pool"
 
 
 typedef enum
@@ -58,22 +108,105 @@ typedef enum
 /* library context */
 typedef struct
 {
+    /* Lua state the context is associated with */
+    lua_State *L;
+
     /* configuration */
     struct {
         size_t max_pdu_sz;
+        unsigned pool_sz;   /* max number of pooled objects; 0: no pooling */
+        int reuse_port;     /* bind endpoints with SO_REUSEPORT by default */
     } cfg;
 
+    /* batched datagrams I/O */
+    struct {
+        mmsg_ctx_t *mmsg;   /* NULL: batching disabled */
+        unsigned batch;     /* batch size */
+        int tx_defer;       /* queue outgoing datagrams until flush */
+    } io;
+
+    /* client connections sharing sockets (see set_shared_sockets()) */
+    struct {
+        unsigned n;         /* number of shared sockets; 0: not shared */
+        unsigned next;      /* next socket to assign (round-robin) */
+        coap_endpoint_t *eps[2][SHR_MAX_SOCKS];  /* IPv4, IPv6 endpoints */
+        shr_tab_t tab;      /* shared sockets sessions (demultiplexing) */
+    } shr;
+
+    /* external event loop integration */
+    struct {
+        int epfd;           /* epoll fd; -1 if not created */
+        unsigned n_fds;     /* number of sockets registered in epfd */
+        struct {
+            const coap_socket_t *sock;
+            int fd;
+        } fds[EV_MAX_SOCKS];
+        int res;            /* resolver fd registered in epfd */
+    } ev;
+
+    /* epoll based CoAP processing (see set_poll_mode()) */
+    struct {
+        int mode;
+        int epfd;           /* -1 for POLL_SELECT mode */
+        uring_ctx_t *uring; /* endpoints I/O ring (POLL_URING mode) */
+        int n_ev;           /* number of events being processed */
+        int i_ev;           /* index of the event being processed */
+        struct epoll_event evs[EV_MAX_SOCKS];
+        coap_tick_t sweep;  /* next sessions housekeeping time */
+    } poll;
+
+    /* names resolution (see connect()) */
+    struct {
+        res_ctx_t *ctx;     /* NULL if not created */
+        int wait_ref;       /* awaiting coroutines table; LUA_NOREF: none */
+    } res;
+
     /* Lua handlers references (LUA_NOREF for default handler) */
     struct {
         int reqh;
         int resph;
         int nackh;
+        int chunkh;         /* Block1 upload chunk handler */
+        int logh;           /* Lua function log sink (see set_log_sink()) */
     } ref;
 
+    /* pools of recycled handlers' objects (tables used as objects stacks with
+       their max size set as 'max' field) */
+    struct {
+        int ref;            /* PDU objects pool */
+        int conn_ref;       /* connection objects pool */
+    } pool;
+
+    /* Block2 transfers of request handlers' responses */
+    blk_cache_t blk;
+
+    /* observable resources */
+    obs_resource_t *obs;
+
+    /* observer registration request being handled (its response gets Observe
+       option once finalized); NULL: none */
+    coap_pdu_t *obs_req;
+
+    /* client subscriptions (remote resources observations) */
+    obs_sub_tab_t subs;
+
+    /* request routes trie; NULL: no routes */
+    rt_node_t *routes;
+
+    /* client requests awaited by coroutines (see conn.request()) */
+    pnd_tab_t reqs;
+
+    /* Lua timers (see timer()) */
+    tmr_wheel_t tmrs;
+
+    /* open connection pools (see connection_pool()) and their idle
+       connections expiration checks */
+    struct ud_pool_t *pools;
+    tmr_wheel_t sweeps;
+
     /* libcoap specific */
     struct {
         coap_context_t  *ctx;
-        coap_endpoint_t *ep;    /* CoAP server endpoint */
         coap_resource_t *rsrc;
     } coap;
 } lib_ctx_t;
@@ -82,6 +215,24 @@ typedef struct
 #define ACS_REQ_HNDLR   1U
 #define ACS_RESP_HNDLR  2U
 #define ACS_NACK_HNDLR  3U
+#define ACS_DFR_RESP    4U  /* deferred (separate) response */
+
+/* CoAP PDU object access profiles (indexes of prebuilt methods tables) */
+#define PROF_NEW_MSG    0   /* created by new_msg() */
+#define PROF_RO         1   /* read-only handler's object */
+#define PROF_REQH       2   /* request handler's response */
+#define PROF_RESPH      3   /* response/NACK handler's writable object */
+#define PROF_DEFERRED   4   /* deferred response (see defer()) */
+
+/* CoAP processing poll modes (see set_poll_mode()) */
+#define POLL_SELECT     0   /* libcoap's coap_run_once() */
+#define POLL_EPOLL      1   /* epoll(7), level-triggered */
+#define POLL_EPOLL_ET   2   /* epoll(7), edge-triggered */
+#define POLL_URING      3   /* POLL_EPOLL with endpoints I/O by io_uring */
+
+/* objects methods dispatch modes */
+#define DISP_CLOSURE    0   /* method closure created per call */
+#define DISP_CACHED     1   /* prebuilt methods; obj:method() syntax only */
 
 /* CoAP PDU userdata object (request/response) */
 typedef struct
@@ -99,7 +250,22 @@ typedef struct
         unsigned ro:    1; /* read-only */
         unsigned lck:   1; /* locked; can not be accessed anymore */
         unsigned hndlr: 3; /* object associated with a specific handler */
+        unsigned pool:  1; /* pooled object; recycled once garbage collected */
     } access;
+
+    /* reassembled (Block1) payload replacing the PDU's one if set */
+    struct {
+        int set;
+        uint8_t *data;
+        size_t len;
+    } blk1;
+
+    /*
+     * Generation counter; incremented each time the handler's object is
+     * released. Payload views are valid for the generation they were
+     * created for.
+     */
+    unsigned gen;
 } ud_coap_pdu_t;
 
 /* connection userdata object */
@@ -109,8 +275,77 @@ typedef struct
 
     /* the object shall be garbage collected flag */
     int gc;
+
+    /* locked; can not be accessed anymore */
+    int lck;
+
+    /* pooled object; recycled once garbage collected */
+    int pool;
+
+    /* session of a shared socket (see set_shared_sockets()) */
+    int shared;
 } ud_connection_t;
 
+/* CoAP server endpoint userdata object */
+typedef struct
+{
+    /* NULL for closed endpoint */
+    coap_endpoint_t *ep;
+} ud_endpoint_t;
+
+/* observable resource userdata object */
+typedef struct
+{
+    /* NULL for closed resource */
+    obs_resource_t *rsrc;
+} ud_resource_t;
+
+/* client subscription userdata object */
+typedef struct
+{
+    /* NULL for cancelled or ended subscription */
+    obs_sub_t *sub;
+} ud_subscription_t;
+
+/* timer userdata object */
+typedef struct
+{
+    /* NULL for cancelled or fired one-shot timer */
+    tmr_t *tmr;
+} ud_timer_t;
+
+/* pooled connection */
+typedef struct pool_conn_t
+{
+    /* pool's LRU list; the head is the most recently used */
+    struct pool_conn_t *prev;
+    struct pool_conn_t *next;
+
+    int obj_ref;                /* connection object reference */
+    coap_session_t *session;
+    coap_tick_t last_used;      /* last time handed out by the pool */
+    char key[];                 /* "host:port" */
+} pool_conn_t;
+
+/* connection pool userdata object */
+typedef struct ud_pool_t
+{
+    /* next open pool of the library context */
+    struct ud_pool_t *next;
+
+    /* closed pool can not be accessed anymore */
+    int closed;
+
+    unsigned max;               /* max number of pooled connections */
+    coap_tick_t idle;           /* idle connection expiration time */
+    tmr_t sweep;                /* idle connections expiration check */
+
+    unsigned n;
+    int map_ref;                /* keys to pooled connections (table) */
+    pool_conn_t *head;
+    pool_conn_t *tail;
+} ud_pool_t;
+
 #define MAX_QSTR_PARAMS_ARGS 10
 
 /* CoAP query string parameter iteration state */
@@ -124,28 +359,45 @@ typedef struct
 } coap_qstr_param_iter_state_t;
 
 
-/* get the library context */
-static lib_ctx_t *_get_lib_ctx(lua_State *L)
-{
-    lib_ctx_t *lib_ctx = NULL;
-
-    lua_pushstring(L, MT_CONTEXT);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-
-    lib_ctx = (lib_ctx_t*)lua_touserdata(L, -1);
-    if (!lib_ctx)
-        luaL_error(L, "No library context in registry");
-
-    lua_pop(L, 1);
-
-    return lib_ctx;
-}
 
 /* get object (userdata pointer) of its running method (C-closure) */
 static void *_get_self(lua_State *L, int *arg_base)
 {
     void *obj;
-    int ab = 0;
+    int ab = 0, prof;
+
+    if (lua_type(L, lua_upvalueindex(1)) == LUA_TTABLE)
+    {
+        /* Cached method (DISP_CACHED dispatch mode) is shared between all
+           objects of a given type; its upvalues are the objects metatable,
+           mask of access profiles providing the method and the objects
+           profile getter (C-function). The object is passed as the 1st
+           argument (obj:method() syntax). */
+        obj = lua_touserdata(L, 1);
+        if (!obj || !lua_getmetatable(L, 1) ||
+            !lua_rawequal(L, -1, lua_upvalueindex(1)))
+        {
+            luaL_error(L, "Invalid call context; obj:method() syntax expected");
+        }
+        lua_pop(L, 1);
+
+        /* the method may be kept and called on any object of the type,
+           therefore the object's access is checked on each call; the getter
+           (called directly on the object at index 1) pushes the object's
+           access profile (index of its methods table) or -1 if the object
+           can't be accessed anymore (locked or closed) */
+        lua_tocfunction(L, lua_upvalueindex(3))(L);
+        prof = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        if (prof < 0)
+            luaL_error(L, "Object can not be accessed anymore");
+        if (!((lua_tointeger(L, lua_upvalueindex(2)) >> prof) & 1))
+            luaL_error(L, "Method not permitted for the object");
+
+        if (arg_base) *arg_base = 1;
+        return obj;
+    }
 
     obj = lua_touserdata(L, lua_upvalueindex(1));
     if (!obj)
@@ -165,18 +417,139 @@ static void *_get_self(lua_State *L, int *arg_base)
     return obj;
 }
 
-/* log CoAP PDU */
-static void _log_pdu(
+/*
+ * Get the library context of a running library function. The library
+ * functions are either the context object's methods or the library module
+ * functions having the default context set as their upvalue during the
+ * library registration. In both cases the context is the function's self.
+ */
+static lib_ctx_t *_get_lib_ctx(lua_State *L, int *arg_base)
+{
+    return (lib_ctx_t*)_get_self(L, arg_base);
+}
+
+/* get library context of a session */
+static inline lib_ctx_t *_get_session_lib_ctx(const coap_session_t *session)
+{
+    return (lib_ctx_t*)coap_get_app_data(session->context);
+}
+
+/* convert libcoap ticks to msecs */
+static inline uint64_t _ticks_ms(coap_tick_t t)
+{
+    return (uint64_t)t * 1000 / COAP_TICKS_PER_SECOND;
+}
+
+/* stack index of self object of a running method (see _get_self()) */
+#define SELF_IDX(__arg_base) ((__arg_base) ? 1 : lua_upvalueindex(1))
+
+/* libcoap log handler; libcoap messages are written to the library sink */
+static void _coap_log_hndlr(coap_log_t level, const char *message)
+{
+    int lvl;
+
+    switch (level)
+    {
+    case LOG_WARNING: lvl = LOG_WARN; break;
+    case LOG_NOTICE:  lvl = LOG_NOTE; break;
+    case LOG_INFO:    lvl = LOG_INF; break;
+    case LOG_DEBUG:   lvl = LOG_DBG; break;
+    default:          lvl = LOG_ERROR; break;
+    }
+
+    if (log_enabled(lvl))
+        log_write(lvl, "libcoap: %s", message);
+}
+
+/* append formatted string to the PDU dump buffer (truncated if full) */
+static void _dump_cat(char *buf, size_t *len, const char *fmt, ...)
+{
+    int n;
+    va_list args;
+
+    if (*len >= LOG_LINE_MAX - 1)
+        return;
+
+    va_start(args, fmt);
+    n = vsnprintf(buf + *len, LOG_LINE_MAX - *len, fmt, args);
+    va_end(args);
+
+    if (n > 0) {
+        *len += (size_t)n;
+        if (*len > LOG_LINE_MAX - 1)
+            *len = LOG_LINE_MAX - 1;
+    }
+}
+
+/* append binary value to the PDU dump buffer; printable one as text */
+static void _dump_val(char *buf, size_t *len, const uint8_t *val, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && val[i] >= 0x20 && val[i] < 0x7f; i++);
+
+    if (i >= n) {
+        _dump_cat(buf, len, "'%.*s'", (int)n, (const char*)val);
+    } else {
+        for (i = 0; i < n; i++)
+            _dump_cat(buf, len, "%02x", val[i]);
+    }
+}
+
+/*
+ * Dump CoAP PDU to the log sink of the calling thread. The PDU is formatted
+ * by the library (not by coap_show_pdu()), so libcoap's process-wide log
+ * level is not touched while dumping.
+ */
+static void _show_pdu(
     int level, const char *hndlr_name, coap_pdu_t *pdu, int recv)
 {
-    int logl;
+    static const char *types[] = {"CON", "NON", "ACK", "RST"};
+
+    size_t len = 0, data_len;
+    uint8_t *data;
+    coap_opt_t *opt;
+    coap_opt_iterator_t oi;
+    char buf[LOG_LINE_MAX];
+
+    _dump_cat(buf, &len, "v:1 t:%s c:%d.%02d i:%04x {",
+        types[pdu->type & 3], pdu->code >> 5, pdu->code & 0x1f, pdu->tid);
+    _dump_val(buf, &len, pdu->token, pdu->token_length);
+    _dump_cat(buf, &len, "} [");
+
+    if (coap_option_iterator_init(pdu, &oi, COAP_OPT_ALL)) {
+        for (opt = coap_option_next(&oi); opt; opt = coap_option_next(&oi)) {
+            _dump_cat(buf, &len, " %d:", oi.type);
+            _dump_val(buf, &len, coap_opt_value(opt), coap_opt_length(opt));
+        }
+    }
+    _dump_cat(buf, &len, " ]");
+
+    if (coap_get_data(pdu, &data_len, &data)) {
+        _dump_cat(buf, &len, " :: ");
+        _dump_val(buf, &len, data, data_len);
+    }
+
+    log_write(level, "(%s) %s %s", hndlr_name, (recv ? "->" : "<-"), buf);
+}
+
+/*
+ * Log CoAP PDU (received from or sent to session's peer; session may be
+ * NULL). The PDU is formatted only if the log level is enabled. The trace
+ * sink gets the PDU as a binary record.
+ */
+static inline void _log_pdu(int level, const char *hndlr_name,
+    coap_pdu_t *pdu, const coap_session_t *session, int recv)
+{
+    if (!log_enabled(level))
+        return;
 
-    if (LOG_LEVEL >= level) {
-        log_info("(%s) %s ", hndlr_name, (recv ? "-> " : "<- "));
-        logl = coap_get_log_level();
-        coap_set_log_level(LOG_INFO);
-        coap_show_pdu(LOG_INFO, pdu);
-        coap_set_log_level(logl);
+    if (log_get_sink(NULL) == LOG_SINK_TRACE) {
+        log_pdu_rec(level, hndlr_name, recv, pdu->type, pdu->code, pdu->tid,
+            pdu->token, pdu->token_length,
+            (session ? &session->addr_info.remote.addr.sa : NULL));
+    } else {
+        _show_pdu(level, hndlr_name, pdu, recv);
     }
 }
 
@@ -278,40 +651,32 @@ int l_coap_pdu_set_msg_id(lua_State *L)
 /**
  * Get CoAP message token.
  *
- * NOTE: For performance reason for string token it's always better to use
- *     get_token(false).
+ * NOTE: For performance reason for binary token it's always better to use
+ *     get_token(BytesType.BUFFER) than get_token(true).
  *
  * Lua arguments:
- *     as_arr [bool|none]: If true return token as bytes-array, false - as
- *         string (default if not provided).
+ *     as [bool|int|none]: Returned token type (BytesType). true for
+ *         bytes-array, false for string (default if not provided).
  *
  * Lua return:
- *     payload [nil|string|bytes-array (1-based)] Token. nil for no token.
+ *     payload [nil|string|bytes-array (1-based)|buffer] Token. nil for no
+ *         token.
  */
 int l_coap_pdu_get_token(lua_State *L)
 {
-    int arg_base, as_arr = 0;
+    int arg_base, as;
     coap_pdu_t *pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base))->pdu;
-    size_t i, len = pdu->token_length;
+    size_t len = pdu->token_length;
     uint8_t *token = pdu->token;
 
-    if (lua_gettop(L) >= arg_base+1)
-        as_arr = lua_toboolean(L, arg_base+1);
+    as = bytes_type_opt(L, arg_base+1, BYTES_STRING);
 
     if (!len || !token) {
         lua_pushnil(L);
         return 1;
     }
 
-    if (as_arr) {
-        lua_createtable(L, len, 0);
-        for (i = 0; i < len; i++) {
-            lua_pushinteger(L, token[i]);
-            lua_rawseti(L, -2, i+1);
-        }
-    } else {
-        lua_pushlstring(L, (const char*)token, len);
-    }
+    bytes_push(L, token, len, as);
     return 1;
 }
 
@@ -321,44 +686,27 @@ int l_coap_pdu_get_token(lua_State *L)
  * NOTE: Due to libcoap library constraints token must be added before CoAP
  *     options. Otherwise the library fails.
  * NOTE: Passing payload as bytes-array should be avoided due to its performance
- *     penalty.
+ *     penalty. Use string or buffer object instead.
  *
  * Lua arguments:
- *     token [string|bytes-array (1-based)|none] Token to be set. No token if
- *         the argument is not provided.
+ *     token [string|bytes-array (1-based)|buffer|none] Token to be set. No
+ *         token if the argument is not provided.
  *
  * Lua return: None
  */
 int l_coap_pdu_set_token(lua_State *L)
 {
     int arg_base;
-    size_t i, len = 0;
-    uint8_t *token = NULL;
+    size_t len = 0;
+    const uint8_t *token = NULL;
     uint8_t tkn[8];
     coap_pdu_t *pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base))->pdu;
 
-    if (lua_type(L, arg_base+1) == LUA_TSTRING) {
-        len = luaL_len(L, arg_base+1);
-        token = (uint8_t*)lua_tostring(L, arg_base+1);
-    } else
-    if (lua_type(L, arg_base+1) == LUA_TTABLE)
+    if (lua_gettop(L) >= arg_base+1 &&
+        !(token = bytes_to(L, arg_base+1, tkn, sizeof(tkn), &len)))
     {
-        len = luaL_len(L, arg_base+1);
-        token = tkn;
-
-        if (len > 0 && len <= sizeof(tkn)) {
-            for (i = 0; i < len; i++) {
-                if (lua_rawgeti(L, arg_base+1, i+1) != LUA_TNUMBER) {
-                    return luaL_error(L,
-                        "Invalid argument: bytes-array expected");
-                }
-                tkn[i] = (uint8_t)lua_tointeger(L, -1);
-                lua_pop(L, 1);
-            }
-        }
-    } else
-    if (lua_gettop(L) >= arg_base+1)
         return luaL_error(L, "Invalid argument passed");
+    }
 
     if (len > sizeof(tkn))
         return luaL_error(L, "Token must be 8 bytes long max");
@@ -407,8 +755,12 @@ static coap_optval_type_t _get_coap_optval_type(int opt_type)
     return OPTVAL_UNKNWN;
 }
 
-/* push CoAP option's value on the stack */
-static void _push_coap_opt_val(lua_State *L, coap_opt_t *opt, int opt_type)
+/*
+ * Push CoAP option's value on the stack. Opaque values are pushed as 'as'
+ * bytes type.
+ */
+static void _push_coap_opt_val(
+    lua_State *L, coap_opt_t *opt, int opt_type, int as)
 {
     int i;
     const uint8_t *opt_val = coap_opt_value(opt);
@@ -440,17 +792,11 @@ static void _push_coap_opt_val(lua_State *L, coap_opt_t *opt, int opt_type)
         break;
       }
 
-    /* opaque (raw data) represented by an integer indexed array */
+    /* opaque (raw data) represented by an integer indexed array (default) */
     case OPTVAL_OPAQUE:
     case OPTVAL_UNKNWN:
-      {
-          lua_createtable(L, opt_len, 0);
-          for (i = 0; i < opt_len; i++) {
-              lua_pushinteger(L, opt_val[i]);
-              lua_rawseti(L, -2, i+1);
-          }
-          break;
-      }
+        bytes_push(L, opt_val, opt_len, as);
+        break;
     }
     return;
 }
@@ -476,7 +822,7 @@ static int _coap_option_iter(lua_State *L)
     lua_pushinteger(L, opt_iter->type);
 
     /* 2nd returned value: option value */
-    _push_coap_opt_val(L, opt, opt_iter->type);
+    _push_coap_opt_val(L, opt, opt_iter->type, BYTES_ARRAY);
 
     return 2;
 }
@@ -530,16 +876,18 @@ int l_coap_pdu_options(lua_State *L)
  *
  * Lua arguments:
  *     opt_type [int]: Option type.
+ *     as [bool|int|none]: Type of returned opaque option value (BytesType).
+ *         Bytes-array if not provided.
  *
  * Lua return:
- *     value [nil|int|string|bytes-array (1-based)]: nil is returned in case
- *         option value is empty or option doesn't exists. Next returned value
- *         allows to distinguish between these cases.
+ *     value [nil|int|string|bytes-array (1-based)|buffer]: nil is returned in
+ *         case option value is empty or option doesn't exists. Next returned
+ *         value allows to distinguish between these cases.
  *     exist [bool]: true in case option exists, false otherwise.
  */
 int l_coap_pdu_get_option(lua_State *L)
 {
-    int arg_base, opt_type;
+    int arg_base, opt_type, as;
     coap_pdu_t *pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base))->pdu;
 
     coap_opt_t *opt;
@@ -551,9 +899,11 @@ int l_coap_pdu_get_option(lua_State *L)
     opt_type = luaL_checkinteger(L, arg_base+1);
     coap_option_filter_set(filter, opt_type);
 
+    as = bytes_type_opt(L, arg_base+2, BYTES_ARRAY);
+
     if (coap_option_iterator_init(pdu, &oi, filter)) {
         for (opt = coap_option_next(&oi); opt; opt = coap_option_next(&oi)) {
-            _push_coap_opt_val(L, opt, opt_type);
+            _push_coap_opt_val(L, opt, opt_type, as);
             lua_pushboolean(L, 1);
             return 2;
         }
@@ -573,9 +923,9 @@ int l_coap_pdu_get_option(lua_State *L)
  *
  * Lua arguments:
  *     opt_type [int]: Option type to be set.
- *     opt_val [none|int|string|bytes-array (1-based)]: Option value (depends on
- *         the option type being set). To send option with an empty value omit
- *         the argument.
+ *     opt_val [none|int|string|bytes-array (1-based)|buffer]: Option value
+ *         (depends on the option type being set). To send option with an
+ *         empty value omit the argument.
  *
  * Lua return: None
  */
@@ -604,11 +954,12 @@ int l_coap_pdu_set_option(lua_State *L)
                 optval_type = OPTVAL_STRING;
                 break;
             case LUA_TTABLE:
+            case LUA_TUSERDATA:
                 optval_type = OPTVAL_OPAQUE;
                 break;
             default:
-                return luaL_error(L, "Invalid argument: "
-                    "number, string or bytes-array expected as an option value");
+                return luaL_error(L, "Invalid argument: number, string, "
+                    "bytes-array or buffer expected as an option value");
             }
         }
 
@@ -639,27 +990,12 @@ int l_coap_pdu_set_option(lua_State *L)
           }
 
         case OPTVAL_OPAQUE:
-          {
-            luaL_checktype(L, arg_base+2, LUA_TTABLE);
-
-            opt_len = luaL_len(L, arg_base+2);
-            if (opt_len > sizeof(val_b)) {
-                return luaL_error(L, "Invalid argument: "
-                    "array size larger than %d bytes", (int)sizeof(val_b));
-            }
-
-            for (i = 0; i < opt_len; i++) {
-                if (lua_rawgeti(L, arg_base+2, i+1) != LUA_TNUMBER) {
-                    return luaL_error(L,
-                        "Invalid argument: bytes-array expected");
-                }
-                val_b[i] = (uint8_t)lua_tointeger(L, -1);
-                lua_pop(L, 1);
+            opt_val = bytes_to(L, arg_base+2, val_b, sizeof(val_b), &opt_len);
+            if (!opt_val) {
+                return luaL_error(L,
+                    "Invalid argument: bytes-array or buffer expected");
             }
-
-            opt_val = val_b;
             break;
-          }
 
         default:;
         }
@@ -1065,48 +1401,160 @@ next_iter:
     return 2;
 }
 
+/* get PDU object's payload (reassembled one for completed Block1 upload) */
+static void _get_pdu_data(ud_coap_pdu_t *ud_pdu, size_t *len, uint8_t **data)
+{
+    if (ud_pdu->blk1.set) {
+        *len = ud_pdu->blk1.len;
+        *data = ud_pdu->blk1.data;
+    } else {
+        coap_get_data(ud_pdu->pdu, len, data);
+    }
+}
+
 /**
  * Get CoAP message payload.
  *
- * NOTE: For performance reason for string payload it's always better to use
- *     get_payload(false).
+ * NOTE: For performance reason for binary payload it's always better to use
+ *     get_payload(BytesType.BUFFER) than get_payload(true).
  *
  * Lua arguments:
- *     as_arr [bool|none]: If true return payload as bytes-array, false - as
- *         string (default if not provided).
+ *     as [bool|int|none]: Returned payload type (BytesType). true for
+ *         bytes-array, false for string (default if not provided).
  *
  * Lua return:
- *     payload [nil|string|bytes-array (1-based)] Payload.
+ *     payload [nil|string|bytes-array (1-based)|buffer] Payload.
  *         nil for an empty payload.
  */
 int l_coap_pdu_get_payload(lua_State *L)
 {
-    int arg_base, as_arr = 0;
-    size_t i, len = 0;
+    int arg_base, as;
+    size_t len = 0;
     uint8_t *data = NULL;
-    coap_pdu_t *pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base))->pdu;
+    ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base));
 
-    if (lua_gettop(L) >= arg_base+1)
-        as_arr = lua_toboolean(L, arg_base+1);
+    as = bytes_type_opt(L, arg_base+1, BYTES_STRING);
 
-    coap_get_data(pdu, &len, &data);
+    _get_pdu_data(ud_pdu, &len, &data);
     if (!len) {
         lua_pushnil(L);
         return 1;
     }
 
-    if (as_arr) {
-        lua_createtable(L, len, 0);
-        for (i = 0; i < len; i++) {
-            lua_pushinteger(L, data[i]);
-            lua_rawseti(L, -2, i+1);
-        }
-    } else {
-        lua_pushlstring(L, (const char*)data, len);
+    bytes_push(L, data, len, as);
+    return 1;
+}
+
+/**
+ * Get read-only view of the message payload. The view is a buffer object
+ * referencing the payload memory directly (no copy is made).
+ *
+ * NOTE: The routine is request/response handlers specific. The view is valid
+ *     during the handler call only; accessing it afterwards raises an error.
+ *     Use get_payload() or buffer's sub() to keep the payload longer.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     payload [nil|buffer] Payload view. nil for an empty payload.
+ */
+int l_coap_pdu_payload_view(lua_State *L)
+{
+    int arg_base;
+    size_t len = 0;
+    uint8_t *data = NULL;
+    ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base));
+
+    _get_pdu_data(ud_pdu, &len, &data);
+    if (!len) {
+        lua_pushnil(L);
+        return 1;
     }
+
+    buffer_push_view(L, data, len, &ud_pdu->gen, SELF_IDX(arg_base));
     return 1;
 }
 
+/*
+ * Push object taken from a pool of recycled objects (table referenced by
+ * 'ref'); new object of size 'sz' with metatable 'tname' is created if the
+ * pool is empty. Pooled objects have their pool as the 1st user value. The
+ * returned object is zeroed.
+ *
+ * NOTE: Objects get into the pool by their destructors (see
+ *     _objs_pool_recycle()), therefore a pooled object is not referenced by
+ *     anyone.
+ */
+static void *_objs_pool_pop(lua_State *L, int ref, size_t sz, const char *tname)
+{
+    void *obj;
+    lua_Unsigned n;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+
+    if ((n = lua_rawlen(L, -1)) > 0) {
+        lua_rawgeti(L, -1, (lua_Integer)n);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, (lua_Integer)n);
+        lua_remove(L, -2);
+        obj = lua_touserdata(L, -1);
+    } else {
+        obj = lua_newuserdatauv(L, sz, 2);
+        lua_insert(L, -2);
+        lua_setiuservalue(L, -2, 1);
+        luaL_setmetatable(L, tname);
+    }
+
+    memset(obj, 0, sz);
+    return obj;
+}
+
+/*
+ * Recycle pooled object being finalized (destructor's argument with
+ * metatable 'tname'). The object is pushed to its pool unless the pool is
+ * full and re-armed for finalization (the destructor is called once
+ * otherwise). Returns 1 if the object has been recycled.
+ */
+static int _objs_pool_recycle(lua_State *L, const char *tname)
+{
+    int ret = 0;
+    lua_Unsigned n;
+
+    lua_getiuservalue(L, 1, 1);
+    n = lua_rawlen(L, -1);
+
+    if (lua_getfield(L, -1, "max") == LUA_TNUMBER &&
+        n < (lua_Unsigned)lua_tointeger(L, -1))
+    {
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -3, (lua_Integer)n + 1);
+
+        lua_pushvalue(L, 1);
+        luaL_setmetatable(L, tname);
+        lua_pop(L, 1);
+        ret = 1;
+    }
+    lua_pop(L, 2);
+
+    return ret;
+}
+
+/* set max size of a pool of recycled objects; exceeding objects are dropped */
+static void _objs_pool_resize(lua_State *L, int ref, unsigned max)
+{
+    lua_Unsigned n;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pushinteger(L, max);
+    lua_setfield(L, -2, "max");
+
+    for (n = lua_rawlen(L, -1); n > max; n--) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, (lua_Integer)n);
+    }
+    lua_pop(L, 1);
+}
+
 /**
  * Get connection object associated with a given message. The object may be
  * later used to send CoAP request over the connection.
@@ -1121,10 +1569,30 @@ int l_coap_pdu_get_payload(lua_State *L)
  */
 int l_coap_pdu_get_connection(lua_State *L)
 {
-    ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, NULL));
-    ud_connection_t *ud_conn =
-        (ud_connection_t*)lua_newuserdata(L, sizeof(ud_connection_t));
+    int arg_base;
+    ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, &arg_base));
+    ud_connection_t *ud_conn;
+
+    if (ud_pdu->access.pool)
+    {
+        /* connection object handed out by a pooled object is kept as its
+           2nd user value (and locked along with the object) */
+        if (lua_getiuservalue(L, SELF_IDX(arg_base), 2) == LUA_TUSERDATA)
+            return 1;
+        lua_pop(L, 1);
+
+        ud_conn = (ud_connection_t*)_objs_pool_pop(
+            L, _get_session_lib_ctx(ud_pdu->session)->pool.conn_ref,
+            sizeof(ud_connection_t), MT_CONNECTION);
+        ud_conn->session = ud_pdu->session;
+        ud_conn->pool = 1;
+
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, SELF_IDX(arg_base), 2);
+        return 1;
+    }
 
+    ud_conn = (ud_connection_t*)lua_newuserdata(L, sizeof(ud_connection_t));
     memset(ud_conn, 0, sizeof(ud_connection_t));
     ud_conn->session = ud_pdu->session;
 
@@ -1141,47 +1609,163 @@ int l_coap_pdu_get_connection(lua_State *L)
 /* set PDU payload from arg on the stack */
 static void _set_payload(lua_State *L, coap_pdu_t *pdu, int arg)
 {
-    size_t i, len = 0;
-    uint8_t *data = NULL;
+    size_t len = 0, arr_sz = 0;
+    uint8_t *arr_buf = NULL;
+    const uint8_t *data = NULL;
 
-    if (lua_type(L, arg) == LUA_TSTRING) {
-        len = luaL_len(L, arg);
-        data = (uint8_t*)lua_tostring(L, arg);
-    } else
     if (lua_type(L, arg) == LUA_TTABLE)
     {
-        len = luaL_len(L, arg);
-        if (len > 0) {
-            if (!(data = alloca(len)))
-                luaL_error(L, "No memory");
+        arr_sz = luaL_len(L, arg);
+        if (arr_sz > 0 && !(arr_buf = alloca(arr_sz)))
+            luaL_error(L, "No memory");
+    }
 
-            for (i = 0; i < len; i++) {
-                if (lua_rawgeti(L, arg, i+1) != LUA_TNUMBER) {
-                    luaL_error(L, "Invalid argument: bytes-array expected");
-                }
-                data[i] = (uint8_t)lua_tointeger(L, -1);
-                lua_pop(L, 1);
-            }
-        }
-    } else
-    if (lua_gettop(L) >= arg)
+    if (lua_gettop(L) >= arg &&
+        !(data = bytes_to(L, arg, arr_buf, arr_sz, &len)))
+    {
         luaL_error(L, "Invalid argument passed");
+    }
 
-    coap_add_data(pdu, len, data);
+    if (len > 0)
+        coap_add_data(pdu, len, data);
 }
 
-/**
- * Send CoAP message with a given payload.
- *
- * NOTE: The routine is request handler specific. The message being sent is
- *     always CoAP response for the handled request.
- * NOTE: After the routine is called the PDU object is locked and can not be
- *     accessed anymore.
- * NOTE: The routine doesn't actually send the message rather than sets its
+/*
+ * Set response payload (arg on the stack) as Block2 transfer if required
+ * (payload not fitting a single PDU, block requested by the client or the
+ * payload provided by a file or a producer function). The transfer is set
+ * as pending and served on the request handler exit. Returns 0 if the
+ * payload shall be set as a regular one.
+ */
+static int _set_blk_payload(
+    lua_State *L, lib_ctx_t *lib_ctx, coap_pdu_t *pdu, int arg)
+{
+    struct stat st;
+    luaL_Stream *fh;
+    blk_xfer_t *xfer;
+    coap_block_t req_blk;
+    ud_buffer_t *ud_buf = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    blk_cache_t *blk = &lib_ctx->blk;
+    int type = lua_type(L, arg);
+
+    if (type == LUA_TFUNCTION || (fh = luaL_testudata(L, arg, LUA_FILEHANDLE)))
+    {
+        if (!blk->block_sz)
+            luaL_error(L, "Block-wise transfer disabled");
+    } else
+    {
+        if (type == LUA_TSTRING) {
+            lua_tolstring(L, arg, &len);
+        } else
+        if ((ud_buf = buffer_test(L, arg))) {
+            len = ud_buf->len;
+        } else
+        if (type == LUA_TTABLE) {
+            len = luaL_len(L, arg);
+        } else
+            return 0;
+
+        /* regular payload fitting the response */
+        if (!blk->block_sz || !pdu->max_size ||
+            (pdu->used_size + len + 5 <= pdu->max_size && !(blk->req &&
+                coap_get_block(blk->req, COAP_OPTION_BLOCK2, &req_blk))))
+        {
+            return 0;
+        }
+    }
+
+    if (type == LUA_TFUNCTION)
+    {
+        if (!(xfer = blk_xfer_new(pdu)))
+            luaL_error(L, "No memory");
+
+        /* size [int|none] argument follows the producer */
+        xfer->src = BLK_SRC_FUNC;
+        xfer->len = (lua_isinteger(L, arg+1) ?
+            (size_t)lua_tointeger(L, arg+1) : BLK_SIZE_UNKNOWN);
+        lua_pushvalue(L, arg);
+        xfer->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else
+    if (type == LUA_TUSERDATA && !ud_buf)
+    {
+        if (!fh->closef)
+            luaL_error(L, "Attempt to use a closed file");
+
+        if (fstat(fileno(fh->f), &st) < 0)
+            luaL_error(L, "fstat() failed; errno: %d", errno);
+
+        len = (size_t)st.st_size;
+        if (len > 0) {
+            data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fh->f), 0);
+            if (data == MAP_FAILED)
+                luaL_error(L, "mmap() failed; errno: %d", errno);
+        }
+
+        if (!(xfer = blk_xfer_new(pdu))) {
+            if (len > 0) munmap((void*)data, len);
+            luaL_error(L, "No memory");
+        }
+
+        xfer->src = BLK_SRC_MMAP;
+        xfer->data = data;
+        xfer->len = len;
+    } else
+    {
+        if (type == LUA_TSTRING) {
+            /* immutable string is referenced */
+            lua_pushvalue(L, arg);
+            data = (const uint8_t*)lua_tostring(L, arg);
+        } else
+        if (ud_buf) {
+            /* buffer may be modified (or be a payload view valid for the
+               handler call only) while the transfer is served; snapshot
+               its content */
+            data = (const uint8_t*)lua_pushlstring(
+                L, (const char*)ud_buf->data, len);
+        } else {
+            ud_buf = buffer_push(L, NULL, len);
+            bytes_to(L, arg, ud_buf->data, len, &len);
+            data = ud_buf->data;
+        }
+
+        if (!(xfer = blk_xfer_new(pdu)))
+            luaL_error(L, "No memory");
+
+        xfer->src = BLK_SRC_MEM;
+        xfer->data = data;
+        xfer->len = len;
+        xfer->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    if (blk->pending)
+        blk_xfer_free(L, blk->pending);
+    blk->pending = xfer;
+
+    return 1;
+}
+
+/**
+ * Send CoAP message with a given payload.
+ *
+ * NOTE: The routine is request handler specific. The message being sent is
+ *     always CoAP response for the handled request.
+ * NOTE: After the routine is called the PDU object is locked and can not be
+ *     accessed anymore.
+ * NOTE: The routine doesn't actually send the message rather than sets its
  *     payload via coap_add_data() libcoap routine. The message will be sent
  *     automatically on request handler exit (_coap_req_hndlr() routine).
  * NOTE: Passing payload as bytes-array should be avoided due to its performance
- *     penalty.
+ *     penalty. Use string or buffer object instead.
+ * NOTE: Payload not fitting a single PDU is sent by block-wise transfer
+ *     (RFC 7959) if enabled (see set_block_transfer()). Subsequent blocks are
+ *     served out of the cached transfer with no request handler call.
+ *     Payload may be also provided by a file (opened by io.open(), the file
+ *     is mapped into memory) or a producer function called per block as
+ *     producer(offset, size) and returning up to size bytes (string or
+ *     buffer) of the payload at offset; less than size bytes (or nil) marks
+ *     the last block.
  *
  * Lua arguments:
  *     code [int|none]: CoAP code. If not provided default code is set
@@ -1189,12 +1773,136 @@ static void _set_payload(lua_State *L, coap_pdu_t *pdu, int arg)
  *         automatically to ACK or NON according to the handled request. If
  *         there is a need to change this type, set_type() function shall be
  *         used before calling this routine.
- *     payload [string|bytes-array (1-based)|none]: Payload. Send empty payload
- *         if not provided.
+ *     payload [string|bytes-array (1-based)|buffer|file|function|none]:
+ *         Payload. Send empty payload if not provided.
+ *     size [int|none]: Payload size if provided by a producer function (sent
+ *         as Size2 option). Unknown if not provided.
  *
  * Lua return: None
  */
 int l_coap_pdu_send_reqh(lua_State *L)
+{
+    int arg;
+    ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, &arg));
+    coap_pdu_t *pdu = ud_pdu->pdu;
+    lib_ctx_t *lib_ctx =
+        (lib_ctx_t*)coap_get_app_data(ud_pdu->session->context);
+
+    arg++;
+    if (lua_type(L, arg) == LUA_TNUMBER) {
+        int code = lua_tointeger(L, arg);
+        pdu->code = COAP_RESPONSE_CODE(code);
+        arg++;
+    }
+
+    if (!pdu->code) {
+        pdu->code = COAP_RESPONSE_CODE(ud_pdu->def_code);
+        log_info("CoAP code not provided for a message being sent; using %d\n",
+            ud_pdu->def_code);
+    }
+
+    if (!_set_blk_payload(L, lib_ctx, pdu, arg))
+        _set_payload(L, pdu, arg);
+
+    /* lock for access */
+    ud_pdu->access.lck = 1;
+
+    return 0;
+}
+
+/**
+ * Defer the response of the handled request. Empty ACK is sent for CON
+ * request on the request handler exit (nothing is sent for NON request),
+ * and the returned deferred response object is to be sent later (as
+ * a separate response) by its send() method, e.g. from another callback or
+ * a coroutine, after the handler returned.
+ *
+ * NOTE: The deferred response inherits the token and the options set in the
+ *     response so far (with Observe option added for an observer
+ *     registration). The response object is locked afterwards.
+ * NOTE: Deferred response payload is not sent by block-wise transfer.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     dfr [userdata]: Deferred response PDU object (writable). CON message
+ *         for CON request, NON otherwise; the type may be changed by
+ *         set_type().
+ */
+int l_coap_pdu_defer(lua_State *L)
+{
+    uint16_t tid;
+    uint8_t type, obs_buf[4];
+    coap_pdu_t *dfr;
+    obs_resource_t *rsrc;
+    ud_coap_pdu_t *ud_dfr;
+    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)_get_self(L, NULL);
+    coap_pdu_t *resp = ud_pdu->pdu;
+    coap_session_t *session = ud_pdu->session;
+    lib_ctx_t *lib_ctx = _get_session_lib_ctx(session);
+
+    type = (resp->type == COAP_MESSAGE_ACK ?
+        COAP_MESSAGE_CON : COAP_MESSAGE_NON);
+
+    dfr = coap_pdu_init(
+        type, 0, coap_new_message_id(session), lib_ctx->cfg.max_pdu_sz);
+
+    /* copy the token and options as is */
+    if (!dfr || !coap_pdu_resize(dfr, resp->used_size)) {
+        coap_delete_pdu(dfr);
+        return luaL_error(L, "No memory");
+    }
+    memcpy(dfr->token, resp->token, resp->used_size);
+    dfr->token_length = resp->token_length;
+    dfr->used_size = resp->used_size;
+    dfr->max_delta = resp->max_delta;
+
+    /* the deferred response acknowledges completed Block1 upload and
+       observer registration */
+    blk_upload_ack(&lib_ctx->blk, dfr);
+    if (lib_ctx->obs_req &&
+        (rsrc = obs_rsrc_find(lib_ctx->obs, lib_ctx->obs_req)))
+    {
+        pdu_insert_opt(dfr, COAP_OPTION_OBSERVE,
+            obs_encode_seq(rsrc, obs_buf), obs_buf);
+    }
+
+    ud_dfr = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
+    memset(ud_dfr, 0, sizeof(ud_coap_pdu_t));
+    ud_dfr->pdu = dfr;
+    ud_dfr->session = coap_session_reference(session);
+    ud_dfr->def_code = ud_pdu->def_code;
+    ud_dfr->access.hndlr = ACS_DFR_RESP;
+    luaL_setmetatable(L, MT_PDU);
+
+    /* empty response: ACK is sent on the handler exit for CON request */
+    type = resp->type;
+    tid = resp->tid;
+    coap_pdu_clear(resp, resp->max_size);
+    resp->type = type;
+    resp->tid = tid;
+
+    /* lock for access */
+    ud_pdu->access.lck = 1;
+
+    return 1;
+}
+
+/**
+ * Send deferred response (see defer()).
+ *
+ * NOTE: After the routine is called the PDU object is locked and can not be
+ *     accessed anymore.
+ *
+ * Lua arguments:
+ *     code [int|none]: CoAP code. If not provided default code is set
+ *         (according to the handled request).
+ *     payload [string|bytes-array (1-based)|buffer|none]: Payload. Send
+ *         empty payload if not provided.
+ *
+ * Lua return: None
+ */
+int l_coap_pdu_send_dfr(lua_State *L)
 {
     int arg;
     ud_coap_pdu_t *ud_pdu = ((ud_coap_pdu_t*)_get_self(L, &arg));
@@ -1214,13 +1922,45 @@ int l_coap_pdu_send_reqh(lua_State *L)
     }
 
     _set_payload(L, pdu, arg);
+    _log_pdu(LOG_INF, "deferred", pdu, ud_pdu->session, 0);
 
     /* lock for access */
     ud_pdu->access.lck = 1;
 
+    if (coap_send(ud_pdu->session, pdu) == COAP_INVALID_TID) {
+        log_error("coap_send() failed\n");
+    }
     return 0;
 }
 
+/* push libcoap address (as string) on the stack; nil on error */
+static void _push_coap_addr(lua_State *L, const coap_address_t *caddr)
+{
+    char addr_b[64];
+    const void *saddr;
+    int fa = caddr->addr.sa.sa_family;
+
+    saddr = (fa == AF_INET ?  (const void*)&caddr->addr.sin.sin_addr :
+        (fa == AF_INET6 ? (const void*)&caddr->addr.sin6.sin6_addr : NULL));
+
+    if (!inet_ntop(fa, saddr, addr_b, sizeof(addr_b)))
+    {
+        log_error("inet_ntop() failed: %s\n", strerror(errno));
+        lua_pushnil(L);
+    } else {
+        lua_pushstring(L, addr_b);
+    }
+}
+
+/* get port number of libcoap address; 0 on error */
+static int _get_coap_port(const coap_address_t *caddr)
+{
+    int fa = caddr->addr.sa.sa_family;
+
+    return ntohs(fa == AF_INET ? caddr->addr.sin.sin_port :
+        (fa == AF_INET6 ? caddr->addr.sin6.sin6_port : 0));
+}
+
 /**
  * Get connection's remote/local address.
  *
@@ -1233,10 +1973,7 @@ int l_coap_pdu_send_reqh(lua_State *L)
  */
 int l_coap_conn_get_addr(lua_State *L)
 {
-    void *saddr;
-    char addr_b[64];
-    coap_address_t *caddr;
-    int arg_base, local = 0, fa;
+    int arg_base, local = 0;
 
     coap_session_t *session =
         ((ud_connection_t*)_get_self(L, &arg_base))->session;
@@ -1244,19 +1981,8 @@ int l_coap_conn_get_addr(lua_State *L)
     if (lua_gettop(L) >= arg_base+1)
         local = lua_toboolean(L, arg_base+1);
 
-    caddr = (local ? &session->addr_info.local : &session->addr_info.remote);
-    fa = caddr->addr.sa.sa_family;
-
-    saddr = (fa == AF_INET ?  (void*)&caddr->addr.sin.sin_addr :
-        (fa == AF_INET6 ? (void*)&caddr->addr.sin6.sin6_addr : NULL));
-
-    if (!inet_ntop(fa, saddr, addr_b, sizeof(addr_b)))
-    {
-        log_error("inet_ntop() failed: %s\n", strerror(errno));
-        lua_pushnil(L);
-    } else {
-        lua_pushstring(L, addr_b);
-    }
+    _push_coap_addr(L,
+        (local ? &session->addr_info.local : &session->addr_info.remote));
     return 1;
 }
 
@@ -1272,8 +1998,7 @@ int l_coap_conn_get_addr(lua_State *L)
  */
 int l_coap_conn_get_port(lua_State *L)
 {
-    coap_address_t *caddr;
-    int arg_base, local = 0, port = 0, fa;
+    int arg_base, local = 0;
 
     coap_session_t *session =
         ((ud_connection_t*)_get_self(L, &arg_base))->session;
@@ -1281,13 +2006,8 @@ int l_coap_conn_get_port(lua_State *L)
     if (lua_gettop(L) >= arg_base+1)
         local = lua_toboolean(L, arg_base+1);
 
-    caddr = (local ? &session->addr_info.local : &session->addr_info.remote);
-    fa = caddr->addr.sa.sa_family;
-
-    port = ntohs(fa == AF_INET ? caddr->addr.sin.sin_port :
-        (fa == AF_INET6 ? caddr->addr.sin6.sin6_port : 0));
-
-    lua_pushinteger(L, port);
+    lua_pushinteger(L, _get_coap_port(
+        (local ? &session->addr_info.local : &session->addr_info.remote)));
     return 1;
 }
 
@@ -1387,15 +2107,15 @@ int l_coap_conn_set_ack_timeout(lua_State *L)
  * Send CoAP message over a connection.
  *
  * NOTE: Passing payload as bytes-array should be avoided due to its performance
- *     penalty.
+ *     penalty. Use string or buffer object instead.
  * NOTE: After calling this routine process_step() shall be used to finalize
  *     the sending process and wait for a response (if required). The PDU object
  *     is locked and can not be accessed anymore.
  *
  * Lua arguments:
  *     msg [userdata]: PDU object to send.
- *     payload [string|bytes-array (1-based)|none]: Payload. Send empty payload
- *         if not provided.
+ *     payload [string|bytes-array (1-based)|buffer|none]: Payload. Send
+ *         empty payload if not provided.
  *
  * Lua return: None
  */
@@ -1414,7 +2134,7 @@ int l_coap_conn_send(lua_State *L)
     }
 
     _set_payload(L, pdu, arg_base+2);
-    _log_pdu(LOG_INF, "new", pdu, 0);
+    _log_pdu(LOG_INF, "new", pdu, NULL, 0);
 
     if (coap_send(session, pdu) == COAP_INVALID_TID) {
         log_error("coap_send() failed\n");
@@ -1426,6 +2146,114 @@ int l_coap_conn_send(lua_State *L)
     return 0;
 }
 
+/* insert token into a PDU with options (and payload) already added */
+static int _insert_token(coap_pdu_t *pdu, const uint8_t *token, size_t len)
+{
+    if (!coap_pdu_resize(pdu, pdu->used_size + len))
+        return 0;
+
+    memmove(pdu->token + len, pdu->token, pdu->used_size);
+    memcpy(pdu->token, token, len);
+
+    pdu->token_length = (uint8_t)len;
+    pdu->used_size += len;
+    if (pdu->data)
+        pdu->data += len;
+
+    return 1;
+}
+
+/**
+ * Send CoAP request and wait for its response. The routine must be called
+ * from a coroutine, which is suspended until the response, NACK or timeout
+ * arrives. Responses are matched by the request token (a random one is set
+ * if the request has no token), so any number of requests may be awaited
+ * concurrently by separate coroutines. Awaited responses are not passed to
+ * the response handler.
+ *
+ * NOTE: The coroutine is resumed by process_step() or process_ready(); it
+ *     shall not be resumed by other means while awaiting the response.
+ *
+ * Lua arguments:
+ *     msg [userdata]: Request PDU object created by new_msg().
+ *     payload [string|bytes-array (1-based)|buffer|none]: Payload.
+ *     timeout [int|none]: Timeout (msecs); 30000 by default, 0 to wait for
+ *         the response or NACK with no timeout.
+ *
+ * Lua return:
+ *     resp [userdata|nil]: Read-only response PDU object, valid until the
+ *         coroutine yields or ends; nil on failure.
+ *     reason [int|none]: NACK reason code (NackReasonCode) on failure;
+ *         NACK_TIMEOUT on timeout.
+ */
+int l_coap_conn_request(lua_State *L)
+{
+    int arg_base;
+    uint8_t token[8];
+    coap_tick_t now;
+    lua_Integer timeout;
+    pnd_req_t *req;
+    coap_session_t *session =
+        ((ud_connection_t*)_get_self(L, &arg_base))->session;
+    lib_ctx_t *lib_ctx = _get_session_lib_ctx(session);
+    ud_coap_pdu_t *ud_pdu =
+        (ud_coap_pdu_t*)luaL_checkudata(L, arg_base+1, MT_PDU);
+    coap_pdu_t *pdu = ud_pdu->pdu;
+
+    if (ud_pdu->access.hndlr != ACS_NO_HNDLR) {
+        return luaL_error(L,
+            "Use this routine for messages created by new_msg()");
+    }
+
+    if (!lua_isyieldable(L))
+        return luaL_error(L, "request() must be called from a coroutine");
+
+    timeout = luaL_optinteger(L, arg_base+3, PND_DEF_TIMEOUT * 1000);
+    if (timeout < 0)
+        return luaL_error(L, "Invalid timeout %d", (int)timeout);
+
+    /* the token identifies the response */
+    if (!pdu->token_length)
+    {
+        prng(token, sizeof(token));
+        if (!(pdu->used_size ? _insert_token(pdu, token, sizeof(token)) :
+            coap_add_token(pdu, sizeof(token), token)))
+        {
+            return luaL_error(L, "Request token can't be set");
+        }
+    }
+
+    /* the message is completed before the request is awaited, so an error
+       raised while setting the payload leaves no pending entry behind */
+    _set_payload(L, pdu, arg_base+2);
+
+    coap_ticks(&now);
+    if (!(req = pnd_add(&lib_ctx->reqs, session, pdu,
+        (timeout > 0 ? _ticks_ms(now) + (uint64_t)timeout : 0),
+        _ticks_ms(now))))
+        return luaL_error(L, "Request token already awaited or no memory");
+
+    _log_pdu(LOG_INF, "request", pdu, session, 0);
+
+    /* lock for access */
+    ud_pdu->access.lck = 1;
+
+    if (coap_send(session, pdu) == COAP_INVALID_TID) {
+        log_error("coap_send() failed\n");
+
+        pnd_remove(&lib_ctx->reqs, req);
+        lua_pushnil(L);
+        lua_pushinteger(L, COAP_NACK_NOT_DELIVERABLE);
+        return 2;
+    }
+
+    /* the running coroutine is resumed with the routine's results */
+    lua_pushthread(L);
+    req->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return lua_yield(L, 0);
+}
+
 /**
  * Create a new CoAP message.
  *
@@ -1441,13 +2269,14 @@ int l_coap_conn_send(lua_State *L)
  */
 int l_coap_new_msg(lua_State *L)
 {
+    int arg_base;
     coap_pdu_t *pdu;
     ud_coap_pdu_t *ud_pdu;
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
 
-    int type = luaL_checkinteger(L, 1);
-    int code = luaL_checkinteger(L, 2);
-    int msg_id = luaL_checkinteger(L, 3);
+    int type = luaL_checkinteger(L, arg_base+1);
+    int code = luaL_checkinteger(L, arg_base+2);
+    int msg_id = luaL_checkinteger(L, arg_base+3);
 
     pdu = coap_pdu_init(
         type, COAP_RESPONSE_CODE(code), msg_id, lib_ctx->cfg.max_pdu_sz);
@@ -1560,319 +2389,3167 @@ static int _set_hndlr_ref(lua_State *L, int arg, int def)
     return ref;
 }
 
-/**
- * Bind the CoAP server for a given interface and port.
- *
- * Lua arguments:
- *     intf_addr [string]: Interface address the server is bind to e.g.
- *         "0.0.0.0" (IPv4), "::" (IPv6).
- *     port [int]: Port number the server is listening on.
- *     req_handler [Lua function|string|none]: Request handler (Lua function
- *         or function global name). If not provided don't change the handler
- *         (use default or the one already set by set_req_handler() method).
- *
- * Lua return: None
+/*
+ * Register socket in the epoll set of the library context. Registered socket's
+ * events refer to the socket directly.
  */
-int l_coap_bind_server(lua_State *L)
+static int _poll_add(lib_ctx_t *lib_ctx, coap_socket_t *sock)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    coap_address_t bind_addr;
+    struct epoll_event ev;
 
-    const char *intf_addr = luaL_checkstring(L, 1);
-    int reqh, port = luaL_checkinteger(L, 2);
+    /* endpoints datagrams are received by the ring */
+    if (lib_ctx->poll.uring && !(sock->flags & COAP_SOCKET_CONNECTED))
+        return uring_add_sock(lib_ctx->poll.uring, sock);
 
-    if (port < 0 || port >= 65535)
-        return luaL_error(L, "Invalid port number %d", port);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (lib_ctx->poll.mode == POLL_EPOLL_ET ? EPOLLET : 0);
+    ev.data.ptr = sock;
 
-    if (!_get_coap_addr(intf_addr, port, &bind_addr))
-        return luaL_error(L, "Can't resolve address %s:%d", intf_addr, port);
+    if (epoll_ctl(lib_ctx->poll.epfd, EPOLL_CTL_ADD, sock->fd, &ev)) {
+        log_error("epoll_ctl() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-    /* free previous endpoint if set */
-    if (lib_ctx->coap.ep)
-        coap_free_endpoint(lib_ctx->coap.ep);
+#define _EV_SOCK_MATCH(lib_ctx, i, s) \
+    ((lib_ctx)->ev.fds[i].sock == (s) && (lib_ctx)->ev.fds[i].fd == (s)->fd)
 
-    lib_ctx->coap.ep = coap_new_endpoint(
-        lib_ctx->coap.ctx, &bind_addr, COAP_PROTO_UDP);
+/* unregister i-th socket from the external event loop epoll set */
+static void _ev_del(lib_ctx_t *lib_ctx, unsigned i)
+{
+    epoll_ctl(lib_ctx->ev.epfd, EPOLL_CTL_DEL, lib_ctx->ev.fds[i].fd, NULL);
+    lib_ctx->ev.fds[i] = lib_ctx->ev.fds[--lib_ctx->ev.n_fds];
+}
 
-    if (!lib_ctx->coap.ep)
-        return luaL_error(L, "coap_new_endpoint() failed");
+/*
+ * Unregister socket from the external event loop epoll set. To be called
+ * before the socket close, so its fd reused by another socket is not treated
+ * as already registered.
+ */
+static void _ev_del_sock(lib_ctx_t *lib_ctx, const coap_socket_t *sock)
+{
+    unsigned i;
 
-    reqh = _set_hndlr_ref(L, 3, lib_ctx->ref.reqh);
+    for (i = 0; i < lib_ctx->ev.n_fds; i++) {
+        if (_EV_SOCK_MATCH(lib_ctx, i, sock)) {
+            _ev_del(lib_ctx, i);
+            break;
+        }
+    }
+}
 
-    if (reqh != lib_ctx->ref.reqh) {
-        /* unref previous handler if set */
-        if (lib_ctx->ref.reqh != LUA_NOREF)
-            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.reqh);
+/*
+ * Unregister socket from the epoll set. The socket's events not processed yet
+ * are dropped.
+ */
+static void _poll_del(lib_ctx_t *lib_ctx, coap_socket_t *sock)
+{
+    int i;
 
-        lib_ctx->ref.reqh = reqh;
+    if (lib_ctx->poll.epfd < 0)
+        return;
+
+    if (lib_ctx->poll.uring && !(sock->flags & COAP_SOCKET_CONNECTED)) {
+        uring_del_sock(lib_ctx->poll.uring, sock);
+        return;
     }
 
-    log_info("Server bound to %s:%d\n", intf_addr, port);
+    epoll_ctl(lib_ctx->poll.epfd, EPOLL_CTL_DEL, sock->fd, NULL);
 
-    return 0;
+    for (i = lib_ctx->poll.i_ev; i < lib_ctx->poll.n_ev; i++) {
+        if (lib_ctx->poll.evs[i].data.ptr == sock)
+            lib_ctx->poll.evs[i].data.ptr = NULL;
+    }
 }
 
-/**
- * Create new CoAP client connection for a given CoAP server address and port.
- *
- * Lua arguments:
- *     addr [string]: CoAP server address.
- *     port [int]: CoAP server port.
- *
- * Lua return:
- *     conn [userdata] Connection object.
+/*
+ * Register client session's socket in the epoll set. The session is
+ * referenced as long as registered (marked by its app data), therefore
+ * events of the socket never refer to a freed session.
  */
-int l_coap_new_connection(lua_State *L)
+static void _poll_add_session(lib_ctx_t *lib_ctx, coap_session_t *session)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    ud_connection_t *ud_conn;
-    coap_address_t srv_addr;
-    coap_session_t *session;
+    if (lib_ctx->poll.epfd < 0 ||
+        !(session->sock.flags & COAP_SOCKET_CONNECTED) ||
+        coap_session_get_app_data(session))
+    {
+        return;
+    }
 
-    const char *addr = luaL_checkstring(L, 1);
-    int port = luaL_checkinteger(L, 2);
+    if (!_poll_add(lib_ctx, &session->sock)) {
+        coap_session_set_app_data(session, lib_ctx);
+        coap_session_reference(session);
+    }
+}
 
-    if (port < 0 || port >= 65535)
-        return luaL_error(L, "Invalid port number %d", port);
+/*
+ * Unregister client session's socket from the epoll set. The session may be
+ * freed by the call.
+ */
+static void _poll_del_session(lib_ctx_t *lib_ctx, coap_session_t *session)
+{
+    if (!coap_session_get_app_data(session))
+        return;
+
+    _poll_del(lib_ctx, &session->sock);
+    coap_session_set_app_data(session, NULL);
+    coap_session_release(session);
+}
+
+/*
+ * Create endpoint object for libcoap endpoint 'ep' of library context at
+ * 'ctx_idx' stack index. The object is pushed on the stack and added to the
+ * context's endpoints set.
+ */
+static void _push_ep_obj(lua_State *L, int ctx_idx, coap_endpoint_t *ep)
+{
+    ud_endpoint_t *ud_ep;
+
+    ctx_idx = lua_absindex(L, ctx_idx);
+
+    ud_ep = (ud_endpoint_t*)lua_newuserdata(L, sizeof(ud_endpoint_t));
+    ud_ep->ep = ep;
+    luaL_setmetatable(L, MT_ENDPOINT);
+
+    /* the endpoint object refers to its context */
+    lua_pushvalue(L, ctx_idx);
+    lua_setuservalue(L, -2);
+
+    /* endpoints set (context's user value) */
+    lua_getuservalue(L, ctx_idx);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/**
+ * Get endpoint's local address.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     addr [string]: Address the endpoint is bound to. nil in case of error
+ *         (unlikely).
+ */
+int l_coap_ep_get_addr(lua_State *L)
+{
+    coap_endpoint_t *ep = ((ud_endpoint_t*)_get_self(L, NULL))->ep;
+    _push_coap_addr(L, &ep->bind_addr);
+    return 1;
+}
+
+/**
+ * Get endpoint's local port.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     port [int]: Port number the endpoint is bound to.
+ */
+int l_coap_ep_get_port(lua_State *L)
+{
+    coap_endpoint_t *ep = ((ud_endpoint_t*)_get_self(L, NULL))->ep;
+    lua_pushinteger(L, _get_coap_port(&ep->bind_addr));
+    return 1;
+}
+
+/**
+ * Close the endpoint. The endpoint object can not be accessed anymore.
+ *
+ * Lua arguments: None
+ *
+ * Lua return: None
+ */
+int l_coap_ep_close(lua_State *L)
+{
+    int arg_base, self_idx;
+    lib_ctx_t *lib_ctx;
+    ud_endpoint_t *ud_ep = (ud_endpoint_t*)_get_self(L, &arg_base);
+
+    self_idx = SELF_IDX(arg_base);
+
+    /* endpoint's context */
+    lua_getuservalue(L, self_idx);
+    lib_ctx = (lib_ctx_t*)lua_touserdata(L, -1);
+
+    if (lib_ctx->io.mmsg) {
+        mmsg_rx_drop(lib_ctx->io.mmsg, &ud_ep->ep->sock);
+        mmsg_tx_drop(lib_ctx->io.mmsg, &ud_ep->ep->sock);
+    }
+
+    _poll_del(lib_ctx, &ud_ep->ep->sock);
+    _ev_del_sock(lib_ctx, &ud_ep->ep->sock);
+    coap_free_endpoint(ud_ep->ep);
+    ud_ep->ep = NULL;
+
+    /* remove from the context's endpoints set */
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, self_idx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+
+    log_debug("Endpoint object [%p] closed\n", ud_ep);
+
+    return 0;
+}
+
+/*
+ * Create libcoap UDP endpoint bound to 'addr' with SO_REUSEPORT socket option
+ * set. libcoap doesn't provide a way to set socket options before binding its
+ * endpoint's socket, therefore the endpoint is created on an ephemeral port
+ * and its socket is replaced (dup2) by the one bound with the option set.
+ * Returns NULL on error.
+ */
+static coap_endpoint_t *_new_reuseport_ep(
+    coap_context_t *ctx, const coap_address_t *addr)
+{
+    int fd, on = 1, off = 0;
+    coap_address_t eph_addr;
+    coap_endpoint_t *ep = NULL;
+    int fa = addr->addr.sa.sa_family;
+
+    if ((fd = socket(fa, SOCK_DGRAM, 0)) < 0) {
+        log_error("socket() failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    /* set the socket the same way as libcoap does for its endpoints */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        log_error("Socket setup failed: %s\n", strerror(errno));
+        goto finish;
+    }
+
+    if (fa == AF_INET6) {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0 ||
+            setsockopt(fd,
+                IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0)
+        {
+            log_error("Socket setup failed: %s\n", strerror(errno));
+            goto finish;
+        }
+        /* needed for IPv4 mapped addresses; ignore failure */
+        setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    } else
+    if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0) {
+        log_error("Socket setup failed: %s\n", strerror(errno));
+        goto finish;
+    }
+
+    if (bind(fd, &addr->addr.sa, addr->size) < 0) {
+        log_error("bind() failed: %s\n", strerror(errno));
+        goto finish;
+    }
+
+    eph_addr = *addr;
+    if (fa == AF_INET6) {
+        eph_addr.addr.sin6.sin6_port = 0;
+    } else {
+        eph_addr.addr.sin.sin_port = 0;
+    }
+
+    if (!(ep = coap_new_endpoint(ctx, &eph_addr, COAP_PROTO_UDP)))
+        goto finish;
+
+    if (dup2(fd, ep->sock.fd) < 0) {
+        log_error("dup2() failed: %s\n", strerror(errno));
+        coap_free_endpoint(ep);
+        ep = NULL;
+        goto finish;
+    }
+
+    ep->bind_addr.size = sizeof(ep->bind_addr.addr);
+    if (getsockname(ep->sock.fd, &ep->bind_addr.addr.sa, &ep->bind_addr.size))
+        ep->bind_addr = *addr;
+
+finish:
+    close(fd);
+    return ep;
+}
+
+/* check if host is a numeric (IPv4 or IPv6) address */
+static int _is_numeric_host(const char *host)
+{
+    struct in6_addr addr;
+
+    return (inet_pton(AF_INET, host, &addr) == 1 ||
+        inet_pton(AF_INET6, host, &addr) == 1);
+}
+
+/*
+ * Register the resolver's fd in the epoll set; completed names resolutions
+ * wake up the processing (see _lib_timers_run()).
+ */
+static void _poll_add_res(lib_ctx_t *lib_ctx)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = lib_ctx->res.ctx;
+
+    if (epoll_ctl(lib_ctx->poll.epfd,
+        EPOLL_CTL_ADD, res_fd(lib_ctx->res.ctx), &ev))
+    {
+        log_error("epoll_ctl() failed: %s\n", strerror(errno));
+    }
+}
+
+/* get resolver context (created on demand); NULL on error */
+static res_ctx_t *_get_res_ctx(lib_ctx_t *lib_ctx)
+{
+    if (!lib_ctx->res.ctx)
+    {
+        if (!(lib_ctx->res.ctx = res_new())) {
+            log_error("Resolver context creation failed\n");
+        } else if (lib_ctx->poll.epfd >= 0) {
+            _poll_add_res(lib_ctx);
+        }
+    }
+    return lib_ctx->res.ctx;
+}
+
+/*
+ * Get CoAP address 'dst' for given host and port. Host names are resolved
+ * through the resolver cache (synchronously if not cached); addresses of a
+ * name with many of them are handed out in turn. A name being resolved
+ * asynchronously is not waited for (see connect()). Returns NULL on error.
+ */
+static coap_address_t *_get_srv_addr(
+    lib_ctx_t *lib_ctx, const char *host, int port, coap_address_t *dst)
+{
+    coap_tick_t now;
+    res_ctx_t *rctx;
+    res_entry_t *ent;
+
+    if (_is_numeric_host(host))
+        return _get_coap_addr(host, port, dst);
+
+    if (!(rctx = _get_res_ctx(lib_ctx)))
+        return NULL;
+
+    coap_ticks(&now);
+    if (!(ent = res_lookup(rctx, host, now)) &&
+        !(ent = res_resolve(rctx, host, 1, now)))
+    {
+        log_error("Resolution of %s failed\n", host);
+        return NULL;
+    }
+
+    if (ent->state == RES_PENDING) {
+        log_error("Resolution of %s in progress; use connect()\n", host);
+        return NULL;
+    }
+
+    if (ent->err) {
+        log_error("getaddrinfo() failed: %s\n", gai_strerror(ent->err));
+        return NULL;
+    }
+    return res_get_addr(ent, port, dst);
+}
+
+/*
+ * Look up resolution of a host name for the calling coroutine; the name's
+ * asynchronous resolution is started if not cached. Returns the name's entry
+ * (pending if the coroutine has to wait for it, see _res_wait()). Raises Lua
+ * error on failure.
+ */
+static res_entry_t *_res_start(
+    lua_State *L, lib_ctx_t *lib_ctx, const char *host)
+{
+    coap_tick_t now;
+    res_ctx_t *rctx;
+    res_entry_t *ent;
+
+    if (!(rctx = _get_res_ctx(lib_ctx)))
+        luaL_error(L, "Resolver context creation failed");
+
+    coap_ticks(&now);
+    if (!(ent = res_lookup(rctx, host, now)) &&
+        !(ent = res_resolve(rctx, host, 0, now)))
+    {
+        luaL_error(L, "Resolution of %s failed", host);
+    }
+    return ent;
+}
+
+/**
+ * Bind the CoAP server for a given interface and port. The routine may be
+ * called many times to listen on many interfaces/ports (e.g. IPv4 and IPv6)
+ * simultaneously.
+ *
+ * Lua arguments:
+ *     intf_addr [string]: Interface address the server is bind to e.g.
+ *         "0.0.0.0" (IPv4), "::" (IPv6).
+ *     port [int]: Port number the server is listening on.
+ *     req_handler [Lua function|string|none]: Request handler (Lua function
+ *         or function global name). If not provided don't change the handler
+ *         (use default or the one already set by set_req_handler() method).
+ *     reuse_port [bool|none]: If true bind the endpoint with SO_REUSEPORT
+ *         socket option set, allowing many sockets (e.g. of workers, see
+ *         run_workers()) to be bound to the same address and port. If not
+ *         provided the option is set for workers' Lua states only.
+ *
+ * Lua return:
+ *     ep [userdata]: Endpoint object. The endpoint remains open (regardless
+ *         of the object's lifetime) until closed by its close() method or
+ *         the library context is freed.
+ */
+int l_coap_bind_server(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    coap_address_t bind_addr;
+    coap_endpoint_t *ep;
+
+    const char *intf_addr = luaL_checkstring(L, arg_base+1);
+    int reqh, port = luaL_checkinteger(L, arg_base+2);
+    int reuse_port = lib_ctx->cfg.reuse_port;
+
+    if (lua_gettop(L) >= arg_base+4)
+        reuse_port = lua_toboolean(L, arg_base+4);
+
+    if (port < 0 || port >= 65535)
+        return luaL_error(L, "Invalid port number %d", port);
+
+    if (!_get_srv_addr(lib_ctx, intf_addr, port, &bind_addr))
+        return luaL_error(L, "Can't resolve address %s:%d", intf_addr, port);
+
+    /* the handler is checked before the bind, but installed after it */
+    reqh = _set_hndlr_ref(L, arg_base+3, lib_ctx->ref.reqh);
+
+    if (reuse_port) {
+        ep = _new_reuseport_ep(lib_ctx->coap.ctx, &bind_addr);
+    } else {
+        ep = coap_new_endpoint(lib_ctx->coap.ctx, &bind_addr, COAP_PROTO_UDP);
+    }
+    if (!ep) {
+        if (reqh != lib_ctx->ref.reqh && reqh != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, reqh);
+        return luaL_error(L, "coap_new_endpoint() failed");
+    }
+
+    if (reqh != lib_ctx->ref.reqh) {
+        /* unref previous handler if set */
+        if (lib_ctx->ref.reqh != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.reqh);
+
+        lib_ctx->ref.reqh = reqh;
+    }
+
+    if (lib_ctx->poll.epfd >= 0)
+        _poll_add(lib_ctx, &ep->sock);
+
+    _push_ep_obj(L, SELF_IDX(arg_base), ep);
+
+    log_info("Server bound to %s:%d%s\n",
+        intf_addr, port, (reuse_port ? " (SO_REUSEPORT)" : ""));
+
+    return 1;
+}
+
+/**
+ * Get CoAP server endpoints bound by bind_server().
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     eps [array of userdata (1-based)]: Endpoint objects.
+ */
+int l_coap_get_endpoints(lua_State *L)
+{
+    int arg_base, i = 0;
+
+    _get_lib_ctx(L, &arg_base);
+
+    lua_newtable(L);
+
+    /* library context's user value is the set of its endpoint objects */
+    lua_getuservalue(L, SELF_IDX(arg_base));
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -4, ++i);
+    }
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+/*
+ * Create client session on a shared socket. The socket is a libcoap endpoint
+ * (bound to an ephemeral port) and the session is its server-type session
+ * registered in the shared sockets sessions table, which demultiplexes the
+ * server's datagrams (see _coap_network_read()). Sessions are shared by
+ * connections to the same server assigned to the same socket. Returns NULL
+ * on error.
+ */
+static coap_session_t *_new_shared_session(
+    lib_ctx_t *lib_ctx, const coap_address_t *srv_addr)
+{
+    coap_tick_t now;
+    coap_packet_t packet;
+    coap_address_t bind_addr;
+    coap_session_t *session;
+    int ipv6 = (srv_addr->addr.sa.sa_family == AF_INET6);
+    coap_endpoint_t **ep =
+        &lib_ctx->shr.eps[ipv6][lib_ctx->shr.next++ % lib_ctx->shr.n];
+
+    if (!*ep)
+    {
+        if (!_get_coap_addr(ipv6 ? "::" : "0.0.0.0", 0, &bind_addr))
+            return NULL;
+
+        *ep = coap_new_endpoint(
+            lib_ctx->coap.ctx, &bind_addr, COAP_PROTO_UDP);
+        if (!*ep) {
+            log_error("coap_new_endpoint() failed\n");
+            return NULL;
+        }
+
+        if (lib_ctx->poll.epfd >= 0)
+            _poll_add(lib_ctx, &(*ep)->sock);
+    }
+
+    if (!(session = shr_find(&lib_ctx->shr.tab, *ep, srv_addr)))
+    {
+        memset(&packet, 0, offsetof(coap_packet_t, payload));
+        packet.addr_info.remote = *srv_addr;
+        packet.addr_info.local = (*ep)->bind_addr;
+
+        coap_ticks(&now);
+        if (!(session = coap_endpoint_get_session(*ep, &packet, now)))
+            return NULL;
+    }
+
+    if (shr_add(&lib_ctx->shr.tab, session)) {
+        log_error("No memory\n");
+        return NULL;
+    }
+
+    /* the connection owns the session the same way as a client one */
+    return coap_session_reference(session);
+}
+
+/*
+ * Create connection object for a given CoAP server address and push it on
+ * the stack. Library context object is expected at 'ctx_idx'. Returns 0 if
+ * the client session creation failed (nothing is pushed).
+ */
+static int _new_conn_obj(lua_State *L,
+    int ctx_idx, lib_ctx_t *lib_ctx, coap_address_t *srv_addr)
+{
+    ud_connection_t *ud_conn;
+    coap_session_t *session;
+
+    ctx_idx = lua_absindex(L, ctx_idx);
+
+    if (lib_ctx->shr.n) {
+        session = _new_shared_session(lib_ctx, srv_addr);
+    } else {
+        session = coap_new_client_session(
+            lib_ctx->coap.ctx, NULL, srv_addr, COAP_PROTO_UDP);
+    }
+    if (!session)
+        return 0;
+
+    _poll_add_session(lib_ctx, session);
+
+    ud_conn = (ud_connection_t*)lua_newuserdata(L, sizeof(ud_connection_t));
+    memset(ud_conn, 0, sizeof(ud_connection_t));
+    ud_conn->session = session; 
+    ud_conn->shared = (lib_ctx->shr.n != 0);
+
+    /* Connection is automatically closed by its destructor (garbage
+       collector's callback) on the end of object's lifetime. */
+    ud_conn->gc = 1; 
+    luaL_setmetatable(L, MT_CONNECTION);
+
+    /* the connection's session is owned by the library context, therefore
+       the context must outlive the connection object */
+    lua_pushvalue(L, ctx_idx);
+    lua_setuservalue(L, -2);
+
+    log_debug("New connection object [%p] created\n", ud_conn);
+
+    return 1;
+}
+
+/**
+ * Create new CoAP client connection for a given CoAP server address and port.
+ *
+ * NOTE: Host names not cached are resolved synchronously. A name being
+ *     resolved by connect() is not waited for (an error is raised).
+ *
+ * Lua arguments:
+ *     addr [string]: CoAP server address.
+ *     port [int]: CoAP server port.
+ *
+ * Lua return:
+ *     conn [userdata] Connection object.
+ */
+int l_coap_new_connection(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    coap_address_t srv_addr;
+
+    const char *addr = luaL_checkstring(L, arg_base+1);
+    int port = luaL_checkinteger(L, arg_base+2);
+
+    if (port < 0 || port >= 65535)
+        return luaL_error(L, "Invalid port number %d", port);
+
+    if (!_get_srv_addr(lib_ctx, addr, port, &srv_addr))
+        return luaL_error(L, "Can't resolve address %s:%d", addr, port);
+
+    if (!_new_conn_obj(L, SELF_IDX(arg_base), lib_ctx, &srv_addr))
+        return luaL_error(L, "Client session creation failed");
+
+    return 1;
+}
+
+/*
+ * Push connect() results: connection object for a given CoAP server address
+ * or nil and error message 'err' if the address is NULL. Library context
+ * object is expected at 'ctx_idx'. Returns number of pushed values.
+ */
+static int _push_connect_res(lua_State *L, int ctx_idx,
+    lib_ctx_t *lib_ctx, coap_address_t *srv_addr, const char *err)
+{
+    if (srv_addr) {
+        if (_new_conn_obj(L, ctx_idx, lib_ctx, srv_addr))
+            return 1;
+        err = "Client session creation failed";
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/*
+ * Add the calling coroutine to the waiters of a pending name resolution.
+ * The waiters are kept in the waiters table under the resolution's entry
+ * as a list of (coroutine, port, library context object, pool object)
+ * quadruples. The pool object (at 'pool_idx'; 0: none) gets the connection
+ * created on the resolution completion (see pool:get()).
+ */
+static void _res_wait(lua_State *L, lib_ctx_t *lib_ctx,
+    const res_entry_t *ent, int port, int ctx_idx, int pool_idx)
+{
+    int n;
+
+    ctx_idx = lua_absindex(L, ctx_idx);
+    if (pool_idx)
+        pool_idx = lua_absindex(L, pool_idx);
+
+    if (lib_ctx->res.wait_ref == LUA_NOREF) {
+        lua_newtable(L);
+        lib_ctx->res.wait_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lib_ctx->res.wait_ref);
+
+    if (lua_rawgetp(L, -1, ent) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, ent);
+    }
+    n = (int)lua_rawlen(L, -1);
+
+    lua_pushthread(L);
+    lua_rawseti(L, -2, n + 1);
+    lua_pushinteger(L, port);
+    lua_rawseti(L, -2, n + 2);
+    lua_pushvalue(L, ctx_idx);
+    lua_rawseti(L, -2, n + 3);
+    if (pool_idx) {
+        lua_pushvalue(L, pool_idx);
+    } else {
+        lua_pushboolean(L, 0);
+    }
+    lua_rawseti(L, -2, n + 4);
+
+    lua_pop(L, 2);
+}
+
+/**
+ * Create new CoAP client connection for a given CoAP server host name (or
+ * address) and port. Contrary to new_connection() the name is resolved
+ * asynchronously (by resolver threads), with the calling coroutine suspended
+ * till the resolution completes and the CoAP processing not blocked.
+ * Resolutions are cached (see set_dns_ttl()) and concurrent resolutions of
+ * the same name are merged. Connections to a name resolving to many addresses
+ * are assigned the addresses in turn.
+ *
+ * NOTE: The function must be called from a coroutine.
+ *
+ * Lua arguments:
+ *     host [string]: CoAP server host name or address.
+ *     port [int]: CoAP server port.
+ *
+ * Lua return:
+ *     conn [userdata|nil]: Connection object, nil on error.
+ *     err [string|none]: Error message.
+ */
+int l_coap_connect(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    coap_address_t srv_addr, *addr;
+    res_entry_t *ent;
+
+    const char *host = luaL_checkstring(L, arg_base+1);
+    int port = luaL_checkinteger(L, arg_base+2);
+
+    if (port < 0 || port >= 65535)
+        return luaL_error(L, "Invalid port number %d", port);
+
+    if (!lua_isyieldable(L))
+        return luaL_error(L, "connect() must be called from a coroutine");
+
+    if (_is_numeric_host(host)) {
+        addr = _get_coap_addr(host, port, &srv_addr);
+        return _push_connect_res(
+            L, SELF_IDX(arg_base), lib_ctx, addr, "Invalid address");
+    }
+
+    ent = _res_start(L, lib_ctx, host);
+
+    if (ent->state == RES_PENDING) {
+        _res_wait(L, lib_ctx, ent, port, SELF_IDX(arg_base), 0);
+        log_debug("Awaiting resolution of %s\n", host);
+        return lua_yield(L, 0);
+    }
+
+    return _push_connect_res(L, SELF_IDX(arg_base), lib_ctx,
+        res_get_addr(ent, port, &srv_addr), gai_strerror(ent->err));
+}
+
+/*
+ * Send subscription's (de)registration request. Failed registration is
+ * scheduled for a retry.
+ */
+static void _sub_send(lib_ctx_t *lib_ctx, obs_sub_t *sub, unsigned observe)
+{
+    coap_tick_t now;
+    coap_pdu_t *pdu = obs_sub_req(sub, observe, lib_ctx->cfg.max_pdu_sz);
+
+    if (pdu) {
+        _log_pdu(LOG_INF, "observe", pdu, sub->session, 0);
+    }
+    if (!pdu || coap_send(sub->session, pdu) == COAP_INVALID_TID)
+    {
+        log_error("coap_send() failed\n");
+
+        if (observe == COAP_OBSERVE_ESTABLISH) {
+            coap_ticks(&now);
+            obs_sub_schedule(&lib_ctx->subs, sub,
+                _ticks_ms(now) + OBS_SUB_RETRY * 1000, _ticks_ms(now));
+        }
+    }
+}
+
+/*
+ * Close subscription; the subscription object is released and the
+ * subscription freed.
+ */
+static void _sub_close(lua_State *L, lib_ctx_t *lib_ctx, obs_sub_t *sub)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sub->obj_ref);
+    ((ud_subscription_t*)lua_touserdata(L, -1))->sub = NULL;
+    lua_pop(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, sub->obj_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, sub->cb_ref);
+    obs_sub_free(&lib_ctx->subs, sub);
+}
+
+/* re-register subscriptions due at 'now' (msecs) */
+static void _sub_refresh(lib_ctx_t *lib_ctx, uint64_t now)
+{
+    obs_sub_t *sub;
+
+    /* rescheduled by the response */
+    while ((sub = obs_sub_due(&lib_ctx->subs, now))) {
+        log_debug("Re-registering subscription of /%s\n", sub->path);
+        _sub_send(lib_ctx, sub, COAP_OBSERVE_ESTABLISH);
+    }
+}
+
+/*
+ * Resume coroutine placed on the stack just below its 'nargs' arguments (all
+ * popped). Errors raised by the coroutine are logged ('what' describes the
+ * coroutine).
+ */
+static void _co_resume(lua_State *L, int nargs, const char *what)
+{
+    int nres, status;
+    lua_State *co = lua_tothread(L, -(nargs + 1));
+
+    lua_xmove(L, co, nargs);
+    status = lua_resume(co, L, nargs, &nres);
+
+    if (status == LUA_OK || status == LUA_YIELD) {
+        lua_pop(co, nres);
+    } else {
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        log_error("%s coroutine failed: %s\n", what, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/*
+ * Resume coroutine of a pending request with 'nargs' arguments on the stack
+ * top (popped). The request is removed before the resumption. Errors raised
+ * by the coroutine are logged.
+ */
+static void _req_resume(lib_ctx_t *lib_ctx, pnd_req_t *req, int nargs)
+{
+    lua_State *L = lib_ctx->L;
+
+    /* keep the coroutine below the arguments while resumed */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, req->co_ref);
+    lua_insert(L, -(nargs + 1));
+
+    luaL_unref(L, LUA_REGISTRYINDEX, req->co_ref);
+    pnd_remove(&lib_ctx->reqs, req);
+
+    _co_resume(L, nargs, "Request");
+}
+
+/* unlink pooled connection from the pool's LRU list */
+static void _pool_unlink(ud_pool_t *pool, pool_conn_t *pc)
+{
+    if (pc->prev)
+        pc->prev->next = pc->next;
+    else
+        pool->head = pc->next;
+
+    if (pc->next)
+        pc->next->prev = pc->prev;
+    else
+        pool->tail = pc->prev;
+}
+
+/* link pooled connection as the most recently used one */
+static void _pool_link(ud_pool_t *pool, pool_conn_t *pc)
+{
+    pc->prev = NULL;
+    if ((pc->next = pool->head))
+        pc->next->prev = pc;
+    else
+        pool->tail = pc;
+    pool->head = pc;
+}
+
+/*
+ * Remove connection from the pool. The connection object is released by the
+ * pool and closed once not referenced anymore.
+ */
+static void _pool_remove(lua_State *L, ud_pool_t *pool, pool_conn_t *pc)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->map_ref);
+    lua_pushnil(L);
+    lua_setfield(L, -2, pc->key);
+    lua_pop(L, 1);
+
+    _pool_unlink(pool, pc);
+    pool->n--;
+
+    log_debug("Connection to %s removed from pool [%p]\n", pc->key, pool);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, pc->obj_ref);
+    free(pc);
+}
+
+/* close connection pool; pooled connections are released */
+static void _pool_close(lua_State *L, lib_ctx_t *lib_ctx, ud_pool_t *pool)
+{
+    ud_pool_t **pp;
+
+    while (pool->head)
+        _pool_remove(L, pool, pool->head);
+    tmr_del(&lib_ctx->sweeps, &pool->sweep);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, pool->map_ref);
+    pool->map_ref = LUA_NOREF;
+
+    for (pp = &lib_ctx->pools; *pp; pp = &(*pp)->next) {
+        if (*pp == pool) {
+            *pp = pool->next;
+            break;
+        }
+    }
+    pool->closed = 1;
+}
+
+/*
+ * Push connection pooled under 'key', which becomes the most recently used
+ * one. Returns 0 if the pool doesn't contain the connection (nothing is
+ * pushed).
+ */
+static int _pool_take(
+    lua_State *L, ud_pool_t *pool, const char *key, coap_tick_t now)
+{
+    pool_conn_t *pc;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->map_ref);
+    lua_getfield(L, -1, key);
+    pc = (pool_conn_t*)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    if (!pc)
+        return 0;
+
+    _pool_unlink(pool, pc);
+    _pool_link(pool, pc);
+    pc->last_used = now;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pc->obj_ref);
+    return 1;
+}
+
+/*
+ * Add connection object on the stack top to the pool under 'key'. If the
+ * pool meanwhile got a connection for the key (while the name was being
+ * resolved) the object is replaced by the pooled one. Connections are not
+ * added to closed pools. Returns -1 on no memory.
+ */
+static int _pool_put(lua_State *L,
+    lib_ctx_t *lib_ctx, ud_pool_t *pool, const char *key, coap_tick_t now)
+{
+    pool_conn_t *pc;
+    size_t len = strlen(key);
+
+    if (pool->closed)
+        return 0;
+
+    if (_pool_take(L, pool, key, now)) {
+        lua_remove(L, -2);
+        return 0;
+    }
+
+    if (!(pc = (pool_conn_t*)malloc(sizeof(pool_conn_t) + len + 1)))
+        return -1;
+
+    /* evict the least recently used connection if the pool is full */
+    if (pool->n >= pool->max)
+        _pool_remove(L, pool, pool->tail);
+
+    memcpy(pc->key, key, len + 1);
+    pc->session = ((ud_connection_t*)lua_touserdata(L, -1))->session;
+    pc->last_used = now;
+    lua_pushvalue(L, -1);
+    pc->obj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->map_ref);
+    lua_pushlightuserdata(L, pc);
+    lua_setfield(L, -2, key);
+    lua_pop(L, 1);
+
+    if (!pool->n++) {
+        tmr_add(&lib_ctx->sweeps, &pool->sweep,
+            _ticks_ms(now) + POOL_SWEEP_INTV * 1000, _ticks_ms(now));
+    }
+    _pool_link(pool, pc);
+
+    log_debug("Connection to %s added to pool [%p]\n", key, pool);
+
+    return 0;
+}
+
+/*
+ * Resume coroutines awaiting names resolutions completed by the resolver
+ * threads (see connect(), pool:get()).
+ */
+static void _res_complete(lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    int i, n, err, resolved = 0, nres;
+    coap_address_t *addrs;
+    res_entry_t *ent;
+    ud_pool_t *pool;
+    lua_State *L = lib_ctx->L;
+
+    while ((ent = res_done(lib_ctx->res.ctx, now)))
+    {
+        log_debug("Resolution of %s completed: %s\n",
+            ent->host, (ent->err ? gai_strerror(ent->err) : "OK"));
+
+        if (lib_ctx->res.wait_ref == LUA_NOREF)
+            continue;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lib_ctx->res.wait_ref);
+        lua_rawgetp(L, -1, ent);
+        lua_pushnil(L);
+        lua_rawsetp(L, -3, ent);
+        lua_remove(L, -2);
+
+        n = (lua_istable(L, -1) ? (int)lua_rawlen(L, -1) / 4 : 0);
+
+        /* addresses are handed out by the cached entry (in turn) before the
+           coroutines are resumed, since they may free the (expired) entry */
+        err = ent->err;
+        addrs = (coap_address_t*)lua_newuserdata(L,
+            (n ? n : 1) * sizeof(coap_address_t));
+
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, -2, 4 * i + 2);
+            resolved = (res_get_addr(
+                ent, (int)lua_tointeger(L, -1), &addrs[i]) != NULL);
+            lua_pop(L, 1);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            lua_rawgeti(L, -2, 4 * i + 1);
+            lua_rawgeti(L, -3, 4 * i + 4);
+            pool = (ud_pool_t*)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            lua_rawgeti(L, -3, 4 * i + 3);
+
+            nres = _push_connect_res(L, -1, lib_ctx,
+                (resolved ? &addrs[i] : NULL), gai_strerror(err));
+
+            if (pool && nres == 1)
+            {
+                /* pool key goes below the connection object */
+                lua_rawgeti(L, -5, 4 * i + 2);
+                lua_pushfstring(L,
+                    "%s:%d", ent->host, (int)lua_tointeger(L, -1));
+                lua_replace(L, -2);
+                lua_insert(L, -2);
+
+                if (_pool_put(L, lib_ctx, pool, lua_tostring(L, -2), now))
+                    log_error("Connection pooling failed\n");
+                lua_remove(L, -2);
+            }
+
+            /* remove the library context object */
+            lua_remove(L, -(nres + 1));
+            _co_resume(L, nres, "Connect");
+        }
+        lua_pop(L, 2);
+    }
+}
+
+/*
+ * Release pooled connections idle (not handed out by the pool and with no
+ * traffic on their sessions) for the pools' idle time. Pools are checked
+ * when due on the sweeps timer wheel.
+ */
+static void _pools_expire(lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    tmr_t *tmr;
+    ud_pool_t *pool;
+    pool_conn_t *pc, *prev;
+    coap_tick_t last;
+
+    tmr_advance(&lib_ctx->sweeps, _ticks_ms(now));
+
+    while ((tmr = tmr_pop_due(&lib_ctx->sweeps)))
+    {
+        pool = (ud_pool_t*)((char*)tmr - offsetof(ud_pool_t, sweep));
+
+        for (pc = pool->tail; pc; pc = prev)
+        {
+            prev = pc->prev;
+
+            last = pc->last_used;
+            if (pc->session->last_rx_tx > last)
+                last = pc->session->last_rx_tx;
+
+            if (last + pool->idle <= now)
+                _pool_remove(lib_ctx->L, pool, pc);
+        }
+
+        if (pool->n) {
+            tmr_add(&lib_ctx->sweeps, &pool->sweep,
+                _ticks_ms(now) + POOL_SWEEP_INTV * 1000, _ticks_ms(now));
+        }
+    }
+}
+
+/*
+ * Close timer; the timer object is released and the timer freed.
+ */
+static void _tmr_close(lua_State *L, lib_ctx_t *lib_ctx, tmr_t *tmr)
+{
+    tmr_del(&lib_ctx->tmrs, tmr);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->obj_ref);
+    ((ud_timer_t*)lua_touserdata(L, -1))->tmr = NULL;
+    lua_pop(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, tmr->obj_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, tmr->cb_ref);
+    free(tmr);
+}
+
+/* check if there are library timers armed */
+static inline int _lib_timers_armed(const lib_ctx_t *lib_ctx)
+{
+    return (lib_ctx->subs.refresh.n || lib_ctx->subs.refresh.due ||
+        lib_ctx->reqs.n || lib_ctx->tmrs.n || lib_ctx->tmrs.due ||
+        lib_ctx->sweeps.n || lib_ctx->sweeps.due ||
+        (lib_ctx->res.ctx && res_pending(lib_ctx->res.ctx)));
+}
+
+/*
+ * Run library timers (Lua timers, subscriptions re-registration, requests
+ * timeouts, names resolutions completion, pooled connections expiration).
+ * Errors raised by Lua timers callbacks are propagated.
+ */
+static void _lib_timers_run(lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    tmr_t *tmr;
+    pnd_req_t *req;
+    uint64_t exp, now_ms = _ticks_ms(now);
+    lua_State *L = lib_ctx->L;
+
+    tmr_advance(&lib_ctx->tmrs, now_ms);
+
+    while ((tmr = tmr_pop_due(&lib_ctx->tmrs)))
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->cb_ref);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->obj_ref);
+
+        if (tmr->period) {
+            /* re-armed with no drift; missed periods are skipped */
+            exp = tmr->expire + tmr->period;
+            if (exp <= now_ms)
+                exp = now_ms + tmr->period;
+            tmr_add(&lib_ctx->tmrs, tmr, exp, now_ms);
+        } else {
+            _tmr_close(L, lib_ctx, tmr);
+        }
+
+        lua_call(L, 1, 0);
+    }
+
+    _sub_refresh(lib_ctx, now_ms);
+
+    while ((req = pnd_expired(&lib_ctx->reqs, now_ms))) {
+        lua_pushnil(L);
+        lua_pushinteger(L, PND_NACK_TIMEOUT);
+        _req_resume(lib_ctx, req, 2);
+    }
+
+    if (lib_ctx->res.ctx)
+        _res_complete(lib_ctx, now);
+
+    _pools_expire(lib_ctx, now);
+}
+
+/*
+ * Get time (msecs) to the nearest library timer (Lua timer, subscription
+ * re-registration, request timeout or pooled connections expiration); 0 if
+ * there is no one scheduled. Completed names resolutions are signalled by
+ * the resolver's fd polled along with the CoAP sockets.
+ */
+static unsigned _lib_timers_timeout(const lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    unsigned i;
+    uint64_t t, next = 0, now_ms = _ticks_ms(now);
+    uint64_t nexts[] = {
+        tmr_next(&lib_ctx->tmrs),
+        pnd_next_expire(&lib_ctx->reqs),
+        obs_sub_next(&lib_ctx->subs),
+        tmr_next(&lib_ctx->sweeps)
+    };
+
+    for (i = 0; i < ARR_SZ(nexts); i++) {
+        if ((t = nexts[i]) && (!next || t < next))
+            next = t;
+    }
+
+    if (!next)
+        return 0;
+    if (next <= now_ms)
+        return 1;
+    return (unsigned)(next - now_ms) + 1;
+}
+
+/*
+ * libcoap network read hook. Datagrams of endpoints sockets are read in
+ * batches if batched I/O is enabled. Datagrams of shared sockets sessions
+ * (see set_shared_sockets()) are passed to libcoap directly and 0 is
+ * returned, so the libcoap's endpoint sessions lookup (not matching the
+ * sessions by local address and interface of the datagram, and linear) is
+ * bypassed.
+ */
+static ssize_t _coap_network_read(coap_socket_t *sock, coap_packet_t *packet)
+{
+    ssize_t len;
+    coap_tick_t now;
+    lib_ctx_t *lib_ctx;
+    coap_session_t *session;
+    coap_endpoint_t *ep;
+
+    if (sock->flags & COAP_SOCKET_CONNECTED)
+        return coap_network_read(sock, packet);
+
+    ep = (coap_endpoint_t*)((char*)sock - offsetof(coap_endpoint_t, sock));
+    lib_ctx = (lib_ctx_t*)coap_get_app_data(ep->context);
+
+    if (!lib_ctx->io.mmsg) {
+        len = coap_network_read(sock, packet);
+    } else
+    if ((len = mmsg_read(lib_ctx->io.mmsg, sock, packet)) > 0) {
+        /* responses to the read datagrams are sent in a batch */
+        lib_ctx->io.tx_defer = 1;
+    }
+
+    if (len > 0 &&
+        (session = shr_find(&lib_ctx->shr.tab, ep, &packet->addr_info.remote)))
+    {
+        coap_ticks(&now);
+        session->last_rx_tx = now;
+        coap_handle_dgram(ep->context, session, packet->payload, (size_t)len);
+        return 0;
+    }
+    return len;
+}
+
+/*
+ * libcoap network send hook. Datagrams sent via endpoints sockets while
+ * processing a batch of received datagrams are queued. In the POLL_URING mode
+ * endpoints datagrams are submitted to the ring.
+ */
+static ssize_t _coap_network_send(coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen)
+{
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)coap_get_app_data(session->context);
+
+    if (lib_ctx->poll.uring && !(sock->flags & COAP_SOCKET_CONNECTED))
+        return uring_send(lib_ctx->poll.uring, sock, session, data, datalen);
+
+    if (!lib_ctx->io.tx_defer || (sock->flags & COAP_SOCKET_CONNECTED))
+        return coap_network_send(sock, session, data, datalen);
+
+    return mmsg_send(lib_ctx->io.mmsg, sock, session, data, datalen);
+}
+
+/* set libcoap network hooks as required by the batched/io_uring I/O */
+static void _set_net_hooks(lib_ctx_t *lib_ctx)
+{
+    coap_context_t *ctx = lib_ctx->coap.ctx;
+
+    ctx->network_read =
+        ((lib_ctx->io.mmsg || lib_ctx->shr.n || lib_ctx->shr.tab.n) ?
+            _coap_network_read : coap_network_read);
+    ctx->network_send = ((lib_ctx->io.mmsg || lib_ctx->poll.uring) ?
+        _coap_network_send : coap_network_send);
+}
+
+/*
+ * Process datagrams left in the received batches and send the queued
+ * responses.
+ */
+static void _io_batch_process(lib_ctx_t *lib_ctx)
+{
+    int pending;
+    coap_tick_t now;
+    coap_endpoint_t *ep;
+    coap_context_t *ctx = lib_ctx->coap.ctx;
+
+    if (!lib_ctx->io.mmsg)
+        return;
+
+    do {
+        pending = 0;
+        for (ep = ctx->endpoint; ep; ep = ep->next) {
+            if (mmsg_rx_pending(lib_ctx->io.mmsg, &ep->sock)) {
+                /* coap_read() reads marked sockets only */
+                ep->sock.flags |= COAP_SOCKET_CAN_READ;
+                pending = 1;
+            }
+        }
+
+        if (pending) {
+            coap_ticks(&now);
+            coap_read(ctx, now);
+        }
+    } while (pending);
+
+    lib_ctx->io.tx_defer = 0;
+    mmsg_flush(lib_ctx->io.mmsg);
+}
+
+/*
+ * Read datagrams of a socket reported by the epoll event being processed and
+ * pass them to libcoap. Edge-triggered socket is drained, datagrams already
+ * received in a batch (see set_io_batch()) are processed at once.
+ */
+static void _poll_read(lib_ctx_t *lib_ctx, coap_socket_t *sock, coap_tick_t now)
+{
+    ssize_t len;
+    coap_packet_t packet;
+    coap_session_t *session;
+    coap_context_t *ctx = lib_ctx->coap.ctx;
+    const struct epoll_event *ev = &lib_ctx->poll.evs[lib_ctx->poll.i_ev];
+    int connected = ((sock->flags & COAP_SOCKET_CONNECTED) != 0);
+
+    do {
+        session = (connected ?
+            (coap_session_t*)((char*)sock - offsetof(coap_session_t, sock)) :
+            NULL);
+
+        /* the read patches the addresses only; the local one is the
+           endpoint's bind address unless provided by the packet info (as
+           set by libcoap's coap_read_endpoint()) */
+        memset(&packet, 0, offsetof(coap_packet_t, payload));
+        if (!connected) {
+            packet.addr_info.local = ((coap_endpoint_t*)
+                ((char*)sock - offsetof(coap_endpoint_t, sock)))->bind_addr;
+        }
+
+        /* libcoap reads sockets marked as readable only */
+        sock->flags |= COAP_SOCKET_CAN_READ;
+
+        if ((len = ctx->network_read(sock, &packet)) < 0) {
+            if (len == -2 && session) {
+                /* ICMP error reported by the connected socket */
+                coap_session_disconnected(session, COAP_NACK_ICMP_ISSUE);
+                break;
+            }
+
+            /* a datagram failed (e.g. truncated); the socket is drained
+               till no more datagrams are queued (edge-triggered mode) */
+            continue;
+        }
+
+        if (session) {
+            session->last_rx_tx = now;
+        } else if (len > 0) {
+            /* datagrams of shared sockets sessions are already handled */
+            session = coap_endpoint_get_session((coap_endpoint_t*)
+                ((char*)sock - offsetof(coap_endpoint_t, sock)), &packet, now);
+        }
+
+        if (session && len > 0)
+            coap_handle_dgram(ctx, session, packet.payload, (size_t)len);
+
+        /* the socket might be closed by a handler */
+        if (ev->data.ptr != sock)
+            break;
+    } while ((lib_ctx->io.mmsg && mmsg_rx_pending(lib_ctx->io.mmsg, sock)) ||
+        (lib_ctx->poll.mode == POLL_EPOLL_ET &&
+            recv(sock->fd, NULL, 0, MSG_PEEK | MSG_DONTWAIT) >= 0));
+}
+
+/* pass datagrams received by the ring to libcoap */
+static void _poll_uring(lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    coap_packet_t packet;
+    coap_endpoint_t *ep;
+    coap_session_t *session;
+    const uring_dgram_t *dgram;
+
+    while ((dgram = uring_rx_next(lib_ctx->poll.uring, &packet)))
+    {
+        ep = (coap_endpoint_t*)
+            ((char*)dgram->sock - offsetof(coap_endpoint_t, sock));
+
+        /* shared sockets sessions are demultiplexed by the library */
+        if ((session = shr_find(
+            &lib_ctx->shr.tab, ep, &packet.addr_info.remote)))
+        {
+            session->last_rx_tx = now;
+        } else {
+            session = coap_endpoint_get_session(ep, &packet, now);
+        }
+
+        /* handled directly out of the ring buffer */
+        if (session && dgram->len > 0) {
+            coap_handle_dgram(lib_ctx->coap.ctx,
+                session, (uint8_t*)dgram->data, dgram->len);
+        }
+
+        uring_rx_done(lib_ctx->poll.uring, dgram);
+    }
+}
+
+/*
+ * Handle libcoap timers in the epoll mode: observers notifications,
+ * retransmissions due at 'now' and (periodically) sessions housekeeping.
+ * Returns timeout (msec) to the next retransmission; 0 if there is no one.
+ */
+static unsigned _poll_coap_timers(lib_ctx_t *lib_ctx, coap_tick_t now)
+{
+    unsigned n_socks;
+    coap_tick_t due;
+    coap_queue_t *next;
+    coap_socket_t *socks[1];
+    coap_session_t *session, *tmp;
+    coap_context_t *ctx = lib_ctx->coap.ctx;
+
+    if (now >= lib_ctx->poll.sweep)
+    {
+        /* release sessions owned by their epoll registration only */
+        for (session = ctx->sessions; session; session = tmp) {
+            tmp = session->next;
+            if (coap_session_get_app_data(session) && session->ref == 1)
+                _poll_del_session(lib_ctx, session);
+        }
+
+        /* idle sessions cleanup; sockets set is not collected */
+        coap_write(ctx, socks, 0, &n_socks, now);
+
+        lib_ctx->poll.sweep = now + POLL_SWEEP_INTV * COAP_TICKS_PER_SECOND;
+    }
+
+    coap_check_notify(ctx);
+
+    while ((next = coap_peek_next(ctx)) &&
+        ctx->sendqueue_basetime + next->t <= now)
+    {
+        coap_retransmit(ctx, coap_pop_next(ctx));
+    }
+
+    if (!next)
+        return 0;
+
+    due = ctx->sendqueue_basetime + next->t;
+    return (unsigned)((due - now) * 1000 / COAP_TICKS_PER_SECOND) + 1;
+}
+
+/*
+ * Single step of the epoll mode processing. Waits up to 'timeout' msecs
+ * (-1: infinite) for sockets events, bounded by the next libcoap timer.
+ * Returns number of events processed, -1 on error.
+ */
+static int _poll_step(lib_ctx_t *lib_ctx, int timeout)
+{
+    int n_ev;
+    void *ptr;
+    unsigned tmo;
+    coap_tick_t now;
+
+    coap_ticks(&now);
+    tmo = _poll_coap_timers(lib_ctx, now);
+
+    if (tmo && (timeout < 0 || (int)tmo < timeout))
+        timeout = (int)tmo;
+
+    /* submit queued sends and receive buffers before sleeping */
+    if (lib_ctx->poll.uring)
+        uring_flush(lib_ctx->poll.uring);
+
+    n_ev = epoll_wait(lib_ctx->poll.epfd, lib_ctx->poll.evs, EV_MAX_SOCKS,
+        (timeout > 0 ? timeout : (timeout < 0 ? -1 : 0)));
+    if (n_ev < 0) {
+        if (errno == EINTR)
+            return 0;
+        log_error("epoll_wait() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    coap_ticks(&now);
+    lib_ctx->poll.n_ev = n_ev;
+
+    for (lib_ctx->poll.i_ev = 0;
+        lib_ctx->poll.i_ev < lib_ctx->poll.n_ev; lib_ctx->poll.i_ev++)
+    {
+        ptr = lib_ctx->poll.evs[lib_ctx->poll.i_ev].data.ptr;
+
+        /* completed resolutions are handled by _lib_timers_run() */
+        if (ptr && ptr == lib_ctx->poll.uring) {
+            _poll_uring(lib_ctx, now);
+        } else if (ptr && ptr != lib_ctx->res.ctx) {
+            _poll_read(lib_ctx, (coap_socket_t*)ptr, now);
+        }
+    }
+
+    lib_ctx->poll.n_ev = lib_ctx->poll.i_ev = 0;
+
+    if (lib_ctx->poll.uring)
+        uring_flush(lib_ctx->poll.uring);
+
+    return n_ev;
+}
+
+/*
+ * Set the poll mode. Sockets of existing endpoints and client connections are
+ * (un)registered in the epoll set as needed.
+ */
+static void _poll_set_mode(lua_State *L, lib_ctx_t *lib_ctx, int mode)
+{
+    coap_endpoint_t *ep;
+    struct epoll_event ev;
+    coap_session_t *session, *tmp;
+    coap_context_t *ctx = lib_ctx->coap.ctx;
+
+    if (lib_ctx->poll.epfd >= 0)
+    {
+        for (session = ctx->sessions; session; session = tmp) {
+            tmp = session->next;
+            _poll_del_session(lib_ctx, session);
+        }
+
+        if (lib_ctx->poll.uring) {
+            uring_free(lib_ctx->poll.uring);
+            lib_ctx->poll.uring = NULL;
+            _set_net_hooks(lib_ctx);
+        }
+
+        close(lib_ctx->poll.epfd);
+        lib_ctx->poll.epfd = -1;
+    }
+
+    lib_ctx->poll.mode = POLL_SELECT;
+    if (mode == POLL_SELECT)
+        return;
+
+    if ((lib_ctx->poll.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        luaL_error(L, "epoll_create1() failed: %s", strerror(errno));
+    }
+    lib_ctx->poll.sweep = 0;
+
+    if (mode == POLL_URING)
+    {
+        if ((lib_ctx->poll.uring = uring_new()))
+        {
+            /* the ring signals its completions on its fd */
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = lib_ctx->poll.uring;
+
+            if (epoll_ctl(lib_ctx->poll.epfd,
+                EPOLL_CTL_ADD, uring_fd(lib_ctx->poll.uring), &ev))
+            {
+                log_error("epoll_ctl() failed: %s\n", strerror(errno));
+                uring_free(lib_ctx->poll.uring);
+                lib_ctx->poll.uring = NULL;
+            }
+        }
+
+        if (lib_ctx->poll.uring) {
+            _set_net_hooks(lib_ctx);
+        } else {
+            log_warn("io_uring not available; epoll mode used instead\n");
+            mode = POLL_EPOLL;
+        }
+    }
+    lib_ctx->poll.mode = mode;
+
+    for (ep = ctx->endpoint; ep; ep = ep->next)
+        _poll_add(lib_ctx, &ep->sock);
+
+    for (session = ctx->sessions; session; session = session->next)
+        _poll_add_session(lib_ctx, session);
+
+    if (lib_ctx->res.ctx)
+        _poll_add_res(lib_ctx);
+}
+
+/*
+ * Handle CoAP timers (retransmissions, sessions timeouts) due at 'now' and
+ * synchronize the epoll set with the CoAP sockets. Returns timeout (msec) to
+ * the next timer event; 0 if there are no pending timers.
+ */
+static unsigned _ev_prepare(lib_ctx_t *lib_ctx,
+    coap_socket_t **socks, unsigned *n_socks, coap_tick_t now)
+{
+    unsigned i, j, timeout;
+    struct epoll_event ev;
+
+    timeout = coap_write(lib_ctx->coap.ctx, socks, EV_MAX_SOCKS, n_socks, now);
+
+    /* unregister sockets gone; closed fds are removed by the kernel,
+       therefore errors are ignored */
+    for (i = 0; i < lib_ctx->ev.n_fds;) {
+        for (j = 0; j < *n_socks && !_EV_SOCK_MATCH(lib_ctx, i, socks[j]); j++);
+
+        if (j >= *n_socks) {
+            _ev_del(lib_ctx, i);
+        } else {
+            i++;
+        }
+    }
+
+    /* register new sockets; socket and fd are matched both since a closed
+       socket's fd may be reused by a new one */
+    for (j = 0; j < *n_socks; j++) {
+        for (i = 0; i < lib_ctx->ev.n_fds &&
+            !_EV_SOCK_MATCH(lib_ctx, i, socks[j]); i++);
+
+        if (i >= lib_ctx->ev.n_fds) {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = socks[j]->fd;
+
+            /* the fd may be still registered if its previous socket has been
+               closed with the underlying file kept open (e.g. by dup(2)) */
+            if (!epoll_ctl(lib_ctx->ev.epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) ||
+                (errno == EEXIST &&
+                !epoll_ctl(lib_ctx->ev.epfd, EPOLL_CTL_MOD, ev.data.fd, &ev)))
+            {
+                lib_ctx->ev.fds[lib_ctx->ev.n_fds].sock = socks[j];
+                lib_ctx->ev.fds[lib_ctx->ev.n_fds++].fd = ev.data.fd;
+            } else {
+                log_error("epoll_ctl() failed: %s\n", strerror(errno));
+            }
+        }
+    }
+
+    /* completed names resolutions wake up the loop as well */
+    if (lib_ctx->res.ctx && !lib_ctx->ev.res)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = res_fd(lib_ctx->res.ctx);
+
+        if (!epoll_ctl(lib_ctx->ev.epfd, EPOLL_CTL_ADD, ev.data.fd, &ev)) {
+            lib_ctx->ev.res = 1;
+        } else {
+            log_error("epoll_ctl() failed: %s\n", strerror(errno));
+        }
+    }
+    return timeout;
+}
+
+/* create epoll fd of the library context (if not already created) */
+static void _ev_init(lua_State *L, lib_ctx_t *lib_ctx)
+{
+    if (lib_ctx->ev.epfd < 0 &&
+        (lib_ctx->ev.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        luaL_error(L, "epoll_create1() failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * Single step of the external event loop epoll set processing. Waits up to
+ * 'timeout' msecs (-1: infinite) for the CoAP sockets (and the resolver's
+ * fd) readability, bounded by the next libcoap timer. Returns number of
+ * events processed.
+ */
+static int _ev_step(lib_ctx_t *lib_ctx, int timeout)
+{
+    int i, n_ev;
+    unsigned j, n_socks, tmo;
+    coap_tick_t now;
+    coap_socket_t *socks[EV_MAX_SOCKS];
+    struct epoll_event evs[EV_MAX_SOCKS];
+
+    coap_ticks(&now);
+    tmo = _ev_prepare(lib_ctx, socks, &n_socks, now);
+
+    if (tmo && (timeout < 0 || (int)tmo < timeout))
+        timeout = (int)tmo;
+
+    n_ev = epoll_wait(lib_ctx->ev.epfd, evs, EV_MAX_SOCKS, timeout);
+    if (n_ev < 0) {
+        if (errno != EINTR)
+            log_error("epoll_wait() failed: %s\n", strerror(errno));
+        n_ev = 0;
+    }
+
+    /* mark ready sockets to be read by libcoap */
+    for (i = 0; i < n_ev; i++) {
+        for (j = 0; j < n_socks; j++) {
+            if (socks[j]->fd == evs[i].data.fd)
+                socks[j]->flags |= COAP_SOCKET_CAN_READ;
+        }
+    }
+
+    if (n_ev > 0) {
+        coap_ticks(&now);
+        coap_read(lib_ctx->coap.ctx, now);
+        _io_batch_process(lib_ctx);
+
+        /* send responses, update timers & sockets set */
+        coap_ticks(&now);
+        _ev_prepare(lib_ctx, socks, &n_socks, now);
+    }
+    return n_ev;
+}
+
+/**
+ * CoAP messages processing loop. The routine must be called periodically in
+ * a script main loop.
+ *
+ * Lua arguments:
+ *     timeout [int]: Incomming message timeout (msec). If not provided - block
+ *         until some message arrives.
+ *
+ * Lua return:
+ *      time_spent [int]: Number of msecs spent in the routine. Negative value
+ *          as an error indicator.
+ */
+int l_coap_process_step(lua_State *L)
+{
+    int arg_base, time_spent, timeout = COAP_RUN_BLOCK;
+    unsigned tmr_tmo;
+    coap_tick_t now;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+
+    if (lua_gettop(L) > arg_base) {
+        timeout = luaL_checkinteger(L, arg_base+1);
+        if (timeout <= 0)
+            timeout = COAP_RUN_NONBLOCK;
+    }
+
+    /* don't sleep past the nearest library timer */
+    if (_lib_timers_armed(lib_ctx) && timeout != COAP_RUN_NONBLOCK)
+    {
+        coap_ticks(&now);
+        tmr_tmo = _lib_timers_timeout(lib_ctx, now);
+
+        if (tmr_tmo &&
+            (timeout == COAP_RUN_BLOCK || (int)tmr_tmo < timeout))
+        {
+            timeout = (int)tmr_tmo;
+        }
+    }
+
+    if (lib_ctx->poll.mode != POLL_SELECT)
+    {
+        coap_tick_t start;
+
+        coap_ticks(&start);
+        time_spent = _poll_step(lib_ctx, (timeout == COAP_RUN_BLOCK ? -1 :
+            (timeout == COAP_RUN_NONBLOCK ? 0 : timeout)));
+
+        if (time_spent >= 0) {
+            coap_ticks(&now);
+            time_spent = (int)((now - start) * 1000 / COAP_TICKS_PER_SECOND);
+        }
+    } else
+    if (lib_ctx->res.ctx && res_pending(lib_ctx->res.ctx))
+    {
+        /* coap_run_once() doesn't wait for completed names resolutions,
+           therefore the CoAP sockets are waited for along with the
+           resolver's fd in the external event loop epoll set */
+        coap_tick_t start;
+
+        _ev_init(L, lib_ctx);
+
+        coap_ticks(&start);
+        _ev_step(lib_ctx, (timeout == COAP_RUN_BLOCK ? -1 :
+            (timeout == COAP_RUN_NONBLOCK ? 0 : timeout)));
+
+        coap_ticks(&now);
+        time_spent = (int)((now - start) * 1000 / COAP_TICKS_PER_SECOND);
+    } else {
+        time_spent = coap_run_once(lib_ctx->coap.ctx, timeout);
+
+        if (time_spent < 0) {
+            log_error("coap_run_once() failed\n");
+        }
+    }
+
+    _io_batch_process(lib_ctx);
+
+    if (_lib_timers_armed(lib_ctx)) {
+        coap_ticks(&now);
+        _lib_timers_run(lib_ctx, now);
+    }
+
+    lua_pushinteger(L, time_spent);
+    return 1;
+}
+
+/**
+ * Get file descriptor to be polled for readability by an external event loop
+ * (e.g. epoll or libuv based). If the descriptor is readable process_ready()
+ * shall be called. Along with get_next_timeout() the routine allows to drive
+ * the CoAP processing with no process_step() calls.
+ *
+ * NOTE: The descriptor is an epoll(7) one grouping the context's sockets. The
+ *     set of the sockets is updated on each get_next_timeout() and
+ *     process_ready() call, so one of them shall be called before the
+ *     descriptor is polled again.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     fd [int]: File descriptor.
+ */
+int l_coap_get_fd(lua_State *L)
+{
+    int arg_base;
+    unsigned n_socks;
+    coap_tick_t now;
+    coap_socket_t *socks[EV_MAX_SOCKS];
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+
+    /* the epoll mode set is polled directly */
+    if (lib_ctx->poll.mode != POLL_SELECT) {
+        lua_pushinteger(L, lib_ctx->poll.epfd);
+        return 1;
+    }
+
+    if (lib_ctx->ev.epfd < 0) {
+        _ev_init(L, lib_ctx);
+
+        coap_ticks(&now);
+        _ev_prepare(lib_ctx, socks, &n_socks, now);
+    }
+
+    lua_pushinteger(L, lib_ctx->ev.epfd);
+    return 1;
+}
+
+/**
+ * Get timeout to the next CoAP timer event (e.g. CON message
+ * retransmission). An external event loop shall call process_ready() after
+ * the timeout expires, even if get_fd() descriptor is not readable. Timers
+ * already due are handled by the routine.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     timeout [int]: Timeout (msec); -1 if there are no pending timers.
+ */
+int l_coap_get_next_timeout(lua_State *L)
+{
+    int arg_base;
+    unsigned n_socks, timeout, tmr_tmo;
+    coap_tick_t now;
+    coap_socket_t *socks[EV_MAX_SOCKS];
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+
+    coap_ticks(&now);
+
+    if (lib_ctx->poll.mode != POLL_SELECT) {
+        timeout = _poll_coap_timers(lib_ctx, now);
+    } else {
+        _ev_init(L, lib_ctx);
+        timeout = _ev_prepare(lib_ctx, socks, &n_socks, now);
+    }
+
+    /* library timers (subscriptions, requests timeouts) */
+    tmr_tmo = _lib_timers_timeout(lib_ctx, now);
+    if (tmr_tmo && (!timeout || tmr_tmo < timeout))
+        timeout = tmr_tmo;
+
+    lua_pushinteger(L, (timeout ? (lua_Integer)timeout : -1));
+    return 1;
+}
+
+/**
+ * Non-blocking CoAP processing for an external event loop integration (see
+ * get_fd()). Handles CoAP messages already received and expired timers. The
+ * routine doesn't wait for any I/O.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     n_ready [int]: Number of sockets with received messages processed.
+ */
+int l_coap_process_ready(lua_State *L)
+{
+    int arg_base, n_ev;
+    coap_tick_t now;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+
+    if (lib_ctx->poll.mode != POLL_SELECT)
+    {
+        if ((n_ev = _poll_step(lib_ctx, 0)) > 0)
+            _io_batch_process(lib_ctx);
+
+        if (_lib_timers_armed(lib_ctx)) {
+            coap_ticks(&now);
+            _lib_timers_run(lib_ctx, now);
+        }
+
+        lua_pushinteger(L, (n_ev > 0 ? n_ev : 0));
+        return 1;
+    }
+
+    _ev_init(L, lib_ctx);
+    n_ev = _ev_step(lib_ctx, 0);
+
+    if (_lib_timers_armed(lib_ctx)) {
+        coap_ticks(&now);
+        _lib_timers_run(lib_ctx, now);
+    }
+
+    lua_pushinteger(L, n_ev);
+    return 1;
+}
+
+/**
+ * Get libcoap log level.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     log_level [int]: libcoap log level.
+ */
+int l_coap_get_libcoap_log_level(lua_State *L)
+{
+    lua_pushinteger(L, coap_get_log_level());
+    return 1;
+}
+
+/**
+ * Set libcoap log level (default: WARNING).
+ *
+ * NOTE: libcoap messages are written to the library log sink (see
+ *     set_log_sink()) and are filtered by the library log level as well.
+ *
+ * Lua arguments:
+ *     log_level [int]: libcoap log level.
+ *
+ * Lua return: None
+ */
+int l_coap_set_libcoap_log_level(lua_State *L)
+{
+    int log_level = luaL_checkinteger(L, 1);
+    assert(log_level >= LOG_EMERG && log_level <= LOG_DEBUG);
+    coap_set_log_level(log_level);
+    return 0;
+}
+
+/**
+ * Get library log level.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     log_level [int]: Log level (LogLevel).
+ */
+int l_coap_get_log_level(lua_State *L)
+{
+    lua_pushinteger(L, log_level);
+    return 1;
+}
+
+/**
+ * Set library log level (default: DEBUG). Messages of disabled levels are
+ * neither formatted nor written to the log sink.
+ *
+ * NOTE: The log level and the log sink are set for the calling Lua state
+ *     worker (see run_workers()) only.
+ *
+ * Lua arguments:
+ *     log_level [int]: Log level (LogLevel).
+ *
+ * Lua return: None
+ */
+int l_coap_set_log_level(lua_State *L)
+{
+    int level = luaL_checkinteger(L, 1);
+
+    if (level < LOG_ERROR || level > LOG_DBG)
+        return luaL_error(L, "Invalid log level %d", level);
+
+    log_level = level;
+    return 0;
+}
+
+/* Lua function log sink; called in the main thread of the library context's
+   Lua state, the function is referenced by the context */
+static void _lua_log_sink(int level, const char *msg, void *arg)
+{
+    static __thread int busy;
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)arg;
+    lua_State *L = lib_ctx->L;
+
+    /* messages logged by the sink function itself are discarded */
+    if (busy || !lua_checkstack(L, 3)) return;
+    busy = 1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lib_ctx->ref.logh);
+    lua_pushinteger(L, level);
+    lua_pushstring(L, msg);
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+        lua_pop(L, 1);
+    }
+
+    busy = 0;
+}
+
+/*
+ * Release log sink of the library context. The sink is reset to stdout if
+ * still owned by the context.
+ */
+static void _free_log_sink(lua_State *L, lib_ctx_t *lib_ctx)
+{
+    void *owner;
+
+    log_get_sink(&owner);
+    if (owner == lib_ctx)
+        log_sink_stdout();
+
+    if (lib_ctx->ref.logh != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.logh);
+        lib_ctx->ref.logh = LUA_NOREF;
+    }
+}
+
+/**
+ * Set library log sink (default: STDOUT).
+ *
+ * Lua arguments:
+ *     sink [int]: Log sink type (LogSink).
+ *     arg [string|function|int|none]: Sink argument:
+ *         FILE: Log file path. The file is opened in append mode.
+ *         FUNC: Lua function called with log level and message arguments.
+ *             Messages logged while the function runs are discarded.
+ *         RING: Max number of messages kept in memory. The messages are
+ *             read by get_log_ring().
+ *         TRACE: Size of the trace records ring (see below).
+ *     path [string|nil|none]: TRACE only. Trace output file path; standard
+ *         output if not provided.
+ *     flush_ms [int|none]: TRACE only. Trace flush period (msec). If
+ *         provided (and > 0) the trace is flushed by a background thread,
+ *         otherwise it's flushed by flush_log() calls only.
+ *
+ * TRACE sink writes log messages and CoAP PDUs as fixed-size binary records
+ * (timestamp, level, message id, code, token, peer) into a preallocated
+ * lock-free ring. The records are formatted and written out on flush, so no
+ * I/O is performed while logging. Records not fitting in the ring are
+ * dropped (reported on flush).
+ *
+ * Lua return: None
+ */
+int l_coap_set_log_sink(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    int sink = luaL_checkinteger(L, arg_base+1);
+
+    switch (sink)
+    {
+    case LOG_SINK_STDOUT:
+        log_sink_stdout();
+        break;
+
+    case LOG_SINK_FILE:
+      {
+        const char *path = luaL_checkstring(L, arg_base+2);
+
+        if (log_sink_file(path))
+            return luaL_error(L, "Can't open log file %s", path);
+        break;
+      }
+
+    case LOG_SINK_FUNC:
+        luaL_checktype(L, arg_base+2, LUA_TFUNCTION);
+
+        _free_log_sink(L, lib_ctx);
+        lua_pushvalue(L, arg_base+2);
+        lib_ctx->ref.logh = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        /* the function is kept till replaced or the context is freed */
+        log_sink_func(_lua_log_sink, lib_ctx);
+        return 0;
+
+    case LOG_SINK_TRACE:
+      {
+        lua_Integer n = luaL_checkinteger(L, arg_base+2);
+        const char *path = luaL_optstring(L, arg_base+3, NULL);
+        lua_Integer flush_ms = luaL_optinteger(L, arg_base+4, 0);
+
+        if (n <= 0 || flush_ms < 0)
+            return luaL_error(L, "Invalid trace sink parameters");
+
+        if (log_sink_trace((unsigned)n, path, (unsigned)flush_ms, lib_ctx))
+            return luaL_error(L, "Can't create trace sink");
+        break;
+      }
+
+    case LOG_SINK_RING:
+      {
+        lua_Integer n = luaL_checkinteger(L, arg_base+2);
+
+        if (n <= 0 || log_sink_ring((unsigned)n))
+            return luaL_error(L, "Can't create log ring of size %d", (int)n);
+        break;
+      }
+
+    default:
+        return luaL_error(L, "Invalid log sink %d", sink);
+    }
+
+    /* release Lua function sink (if set) */
+    if (lib_ctx->ref.logh != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.logh);
+        lib_ctx->ref.logh = LUA_NOREF;
+    }
+    return 0;
+}
+
+static void _push_log_msg(const char *msg, void *arg)
+{
+    lua_State *L = (lua_State*)arg;
+
+    lua_pushstring(L, msg);
+    lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+}
+
+/**
+ * Flush TRACE log sink (see set_log_sink()).
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     n [int]: Number of written trace records.
+ */
+int l_coap_flush_log(lua_State *L)
+{
+    lua_pushinteger(L, log_flush());
+    return 1;
+}
+
+/**
+ * Read messages kept by the RING log sink. Read messages are removed from
+ * the ring.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     msgs [table]: Array of messages (from the oldest one); empty if no
+ *         messages or the RING sink is not set.
+ */
+int l_coap_get_log_ring(lua_State *L)
+{
+    lua_newtable(L);
+    log_ring_read(_push_log_msg, L);
+    return 1;
+}
+
+/**
+ * Get CoAP request handler.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     req_handler [Lua function|nil]: Handler function or nil (for default
+ *         handler).
+ */
+int l_coap_get_req_handler(lua_State *L)
+{
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, NULL);
+
+    if (lib_ctx->ref.reqh != LUA_NOREF) {
+        lua_pushinteger(L, lib_ctx->ref.reqh);
+        lua_gettable(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/**
+ * Set CoAP request handler.
+ *
+ * Lua arguments:
+ *     req_handler [Lua function|string|nil|none]: Request handler (Lua function
+ *         or function global name). If not provided or nil use default handler.
+ *
+ * Lua return: None
+ */
+int l_coap_set_req_handler(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    int reqh = _set_hndlr_ref(L, arg_base+1, LUA_NOREF);
+
+    if (reqh != lib_ctx->ref.reqh) {
+        /* unref previous handler if set */
+        if (lib_ctx->ref.reqh != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.reqh);
+
+        lib_ctx->ref.reqh = reqh;
+    }
+    return 0;
+}
+
+/**
+ * Get CoAP response handler.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     resp_handler [Lua function|nil]: Handler function or nil (for default
+ *         handler).
+ */
+int l_coap_get_resp_handler(lua_State *L)
+{
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, NULL);
+
+    if (lib_ctx->ref.resph != LUA_NOREF) {
+        lua_pushinteger(L, lib_ctx->ref.resph);
+        lua_gettable(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/**
+ * Set CoAP response handler.
+ *
+ * Lua arguments:
+ *     resp_handler [Lua function|string|nil|none]: Response handler (Lua
+ *         function or function global name). If not provided or nil use default
+ *         handler.
+ *
+ * Lua return: None
+ */
+int l_coap_set_resp_handler(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    int resph = _set_hndlr_ref(L, arg_base+1, LUA_NOREF);
+
+    if (resph != lib_ctx->ref.resph) {
+        /* unref previous handler if set */
+        if (lib_ctx->ref.resph != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.resph);
+
+        lib_ctx->ref.resph = resph;
+    }
+    return 0;
+}
+
+/**
+ * Get CoAP NACK handler.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     nack_handler [Lua function|nil]: Handler function or nil (for default
+ *         handler).
+ */
+int l_coap_get_nack_handler(lua_State *L)
+{
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, NULL);
+
+    if (lib_ctx->ref.nackh != LUA_NOREF) {
+        lua_pushinteger(L, lib_ctx->ref.nackh);
+        lua_gettable(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/**
+ * Set CoAP NACK handler.
+ *
+ * Lua arguments:
+ *     resp_handler [Lua function|string|nil|none]: Response handler (Lua
+ *         function or function global name). If not provided or nil use default
+ *         handler.
+ *
+ * Lua return: None
+ */
+int l_coap_set_nack_handler(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    int nackh = _set_hndlr_ref(L, arg_base+1, LUA_NOREF);
+
+    if (nackh != lib_ctx->ref.nackh) {
+        /* unref previous handler if set */
+        if (lib_ctx->ref.nackh != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.nackh);
+
+        lib_ctx->ref.nackh = nackh;
+    }
+    return 0;
+}
+
+/**
+ * Set max PDU size for newly created messeges.
+ *
+ * Lua arguments:
+ *     max_pdu_sz [int]: Max PDU size. If not configured default value is used
+ *         as specified by MAX_COAP_PDU_SIZE.
+ *
+ * Lua return: None
+ */
+int l_coap_set_max_pdu_size(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lib_ctx->cfg.max_pdu_sz = luaL_checkinteger(L, arg_base+1);
+    return 0;
+}
+
+/**
+ * Set max number of handlers' PDU objects (and separately their connection
+ * objects) kept for recycling between handlers calls.
+ *
+ * NOTE: Handlers' objects are locked on handler exit. Pooled objects are
+ *     recycled by their destructors, that is once garbage collected, so an
+ *     object reference kept by the user code stays locked and is never
+ *     rebound to another message.
+ *
+ * Lua arguments:
+ *     pool_sz [int]: Max pool size; 0 (default) disables pooling.
+ *
+ * Lua return: None
+ */
+int l_coap_set_obj_pool_size(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer pool_sz = luaL_checkinteger(L, arg_base+1);
+
+    if (pool_sz < 0)
+        return luaL_error(L, "Invalid pool size %d", (int)pool_sz);
+
+    lib_ctx->cfg.pool_sz = (unsigned)pool_sz;
+
+    _objs_pool_resize(L, lib_ctx->pool.ref, lib_ctx->cfg.pool_sz);
+    _objs_pool_resize(L, lib_ctx->pool.conn_ref, lib_ctx->cfg.pool_sz);
+
+    return 0;
+}
+
+/**
+ * Set batched datagrams I/O. Up to batch_sz datagrams are received from an
+ * endpoint socket by a single recvmmsg(2) call and processed in a single
+ * process_step() call. Responses sent while processing the batch are queued
+ * and sent by sendmmsg(2) at the end of process_step().
+ *
+ * NOTE: Client connections (see new_connection()) are not affected by the
+ *     batched I/O unless they use shared sockets (see set_shared_sockets()).
+ *
+ * Lua arguments:
+ *     batch_sz [int]: Max batch size (up to 64); 0 or 1 (default) disables
+ *         batching.
+ *
+ * Lua return: None
+ */
+int l_coap_set_io_batch(lua_State *L)
+{
+    int arg_base;
+    mmsg_ctx_t *mmsg = NULL;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer batch_sz = luaL_checkinteger(L, arg_base+1);
+
+    if (batch_sz < 0 || batch_sz > MMSG_MAX_BATCH)
+        return luaL_error(L, "Invalid batch size %d", (int)batch_sz);
+
+    if (batch_sz > 1 && !(mmsg = mmsg_new((unsigned)batch_sz)))
+        return luaL_error(L, "Batched I/O initialization failed");
+
+    /* process datagrams buffered by the current batch context */
+    if (lib_ctx->io.mmsg) {
+        _io_batch_process(lib_ctx);
+        mmsg_free(lib_ctx->io.mmsg);
+    }
+
+    lib_ctx->io.mmsg = mmsg;
+    lib_ctx->io.batch = (mmsg ? (unsigned)batch_sz : 0);
+
+    _set_net_hooks(lib_ctx);
+
+    log_debug("Batched I/O %s (batch size: %u)\n",
+        (mmsg ? "enabled" : "disabled"), lib_ctx->io.batch);
+
+    return 0;
+}
+
+/**
+ * Set number of UDP sockets shared by client connections. With sharing
+ * enabled new_connection() creates no socket per connection; connections are
+ * assigned (round-robin) to a fixed set of sockets, each bound to an
+ * ephemeral port, and responses are demultiplexed by the peer address. Cost
+ * of a connection is reduced to its session state then.
+ *
+ * NOTE: Already created connections are not affected.
+ * NOTE: Shared sockets are libcoap endpoints, therefore batched I/O (see
+ *     set_io_batch()) applies to them, and requests received on them are
+ *     passed to the request handler.
+ *
+ * Lua arguments:
+ *     n_socks [int]: Number of shared sockets per address family (up to 16);
+ *         0 (default) for a socket per connection.
+ *
+ * Lua return: None
+ */
+int l_coap_set_shared_sockets(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer n = luaL_checkinteger(L, arg_base+1);
+
+    if (n < 0 || n > SHR_MAX_SOCKS)
+        return luaL_error(L, "Invalid number of shared sockets %d", (int)n);
+
+    lib_ctx->shr.n = (unsigned)n;
+
+    /* shared sockets sessions are demultiplexed by the read hook */
+    _set_net_hooks(lib_ctx);
+    return 0;
+}
+
+/**
+ * Set CoAP processing poll mode. In the default PollMode.SELECT mode the
+ * processing is done by libcoap's coap_run_once(), which scans all endpoints
+ * and client connections sockets on each process_step() call. In the epoll
+ * modes sockets are registered in an epoll(7) set on creation and only the
+ * ready ones are read, while retransmissions are driven by the libcoap's send
+ * queue deadline, so the cost of a step depends on the traffic rather than on
+ * the number of sockets. PollMode.EPOLL_ET registers the sockets as
+ * edge-triggered; each ready socket is drained then. PollMode.URING is the
+ * epoll mode with the endpoints datagrams I/O done by io_uring(7): receive
+ * buffers are kept posted on the endpoints sockets and sends are submitted in
+ * batches, cutting syscalls and copies per datagram. The mode falls back to
+ * PollMode.EPOLL if io_uring is not available (or the library has been built
+ * with no USE_IO_URING).
+ *
+ * NOTE: In the epoll modes get_fd() returns the epoll set descriptor and
+ *     process_ready() processes the ready sockets only.
+ * NOTE: In the PollMode.URING mode the endpoints batched I/O (see
+ *     set_io_batch()) is superseded by the ring.
+ *
+ * Lua arguments:
+ *     mode [int]: Poll mode (PollMode).
+ *
+ * Lua return: None
+ */
+int l_coap_set_poll_mode(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    int mode = luaL_checkinteger(L, arg_base+1);
+
+    if (mode < POLL_SELECT || mode > POLL_URING)
+        return luaL_error(L, "Invalid poll mode %d", mode);
+
+    if (lib_ctx->poll.n_ev)
+        return luaL_error(L, "Poll mode can't be changed while processing");
+
+    if (mode != lib_ctx->poll.mode) {
+        _poll_set_mode(L, lib_ctx, mode);
+        log_debug("Poll mode set to %d\n", mode);
+    }
+    return 0;
+}
+
+/**
+ * Set time-to-live of cached host names resolutions (see connect()). Since
+ * getaddrinfo(3) doesn't provide TTL of the DNS records, the cached
+ * resolutions expire after the configured time.
+ *
+ * Lua arguments:
+ *     ttl [int]: TTL (secs) of successful resolutions (default: 60); 0
+ *         disables caching.
+ *     neg_ttl [int|none]: TTL (secs) of failed resolutions (default: 5).
+ *
+ * Lua return: None
+ */
+int l_coap_set_dns_ttl(lua_State *L)
+{
+    int arg_base;
+    res_ctx_t *rctx;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer ttl = luaL_checkinteger(L, arg_base+1);
+    lua_Integer neg_ttl = luaL_optinteger(L, arg_base+2, RES_DEF_NEG_TTL);
+
+    if (ttl < 0 || ttl > UINT_MAX)
+        return luaL_error(L, "Invalid TTL %d", (int)ttl);
+    if (neg_ttl < 0 || neg_ttl > UINT_MAX)
+        return luaL_error(L, "Invalid negative TTL %d", (int)neg_ttl);
+
+    if (!(rctx = _get_res_ctx(lib_ctx)))
+        return luaL_error(L, "Resolver context creation failed");
+
+    res_set_ttl(rctx, (unsigned)ttl, (unsigned)neg_ttl);
+    return 0;
+}
+
+/**
+ * Configure block-wise (RFC 7959) transfer of request handlers' responses.
+ * Response payload not fitting a single PDU is sent in Block2 blocks. The
+ * transfer state is cached, so subsequent blocks requests are served with
+ * no request handler call.
+ *
+ * Lua arguments:
+ *     block_sz [int]: Max block size (power of 2 in 16..1024 range); 0
+ *         disables block-wise transfer. Default: 1024.
+ *     max_xfers [int|none]: Max number of cached transfers (default: 32).
+ *     timeout [int|none]: Expiration time (secs) of a cached transfer
+ *         (default: 30).
+ *
+ * Lua return: None
+ */
+int l_coap_set_block_transfer(lua_State *L)
+{
+    int arg_base;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer block_sz = luaL_checkinteger(L, arg_base+1);
+    lua_Integer max_xfers = luaL_optinteger(L, arg_base+2, lib_ctx->blk.max);
+    lua_Integer timeout = luaL_optinteger(L, arg_base+3, lib_ctx->blk.timeout);
+
+    if (block_sz && (block_sz < 16 || block_sz > 1024 ||
+        (block_sz & (block_sz - 1))))
+    {
+        return luaL_error(L, "Invalid block size %d", (int)block_sz);
+    }
+    if (max_xfers < 1)
+        return luaL_error(L, "Invalid max transfers %d", (int)max_xfers);
+    if (timeout < 1)
+        return luaL_error(L, "Invalid timeout %d", (int)timeout);
+
+    /* cached transfers are dropped */
+    blk_cache_clear(L, &lib_ctx->blk);
+
+    lib_ctx->blk.block_sz = (unsigned)block_sz;
+    lib_ctx->blk.max = (unsigned)max_xfers;
+    lib_ctx->blk.timeout = (unsigned)timeout;
+
+    return 0;
+}
+
+/**
+ * Configure Block1 (RFC 7959) uploads reassembly. Blocks of an upload are
+ * collected (with the reassembly buffer preallocated according to Size1
+ * option if provided) and the request handler is called once, on the last
+ * block, with the complete payload. In the streaming mode the chunk handler
+ * is called for each block instead and the request handler gets no payload.
+ *
+ * Lua arguments:
+ *     max_sz [int]: Max upload size; 0 disables reassembly (each block is
+ *         passed to the request handler as a separate request). Default:
+ *         1MB.
+ *     max_xfers [int|none]: Max number of uploads in progress (default: 8).
+ *     timeout [int|none]: Expiration time (secs) of an upload in progress
+ *         (default: 30).
+ *     chunk_handler [Lua function|string|nil|none]: Chunk handler (Lua
+ *         function or function global name) enabling the streaming mode.
+ *         The handler is called as chunk_handler(req, offset, more) where
+ *         req is the block request (its payload is the block), offset is the
+ *         block offset and more is false for the last block. If not provided
+ *         or nil the streaming mode is disabled.
+ *
+ * Lua return: None
+ */
+int l_coap_set_block_upload(lua_State *L)
+{
+    int arg_base, chunkh;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer max_sz = luaL_checkinteger(L, arg_base+1);
+    lua_Integer max_xfers =
+        luaL_optinteger(L, arg_base+2, lib_ctx->blk.up.max);
+    lua_Integer timeout =
+        luaL_optinteger(L, arg_base+3, lib_ctx->blk.up.timeout);
+
+    if (max_sz < 0)
+        return luaL_error(L, "Invalid max upload size %d", (int)max_sz);
+    if (max_xfers < 1)
+        return luaL_error(L, "Invalid max uploads %d", (int)max_xfers);
+    if (timeout < 1)
+        return luaL_error(L, "Invalid timeout %d", (int)timeout);
+
+    chunkh = _set_hndlr_ref(L, arg_base+4, LUA_NOREF);
+    if (lib_ctx->ref.chunkh != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.chunkh);
+    lib_ctx->ref.chunkh = chunkh;
+
+    lib_ctx->blk.up.max_sz = (size_t)max_sz;
+    lib_ctx->blk.up.max = (unsigned)max_xfers;
+    lib_ctx->blk.up.timeout = (unsigned)timeout;
+    lib_ctx->blk.up.stream = (chunkh != LUA_NOREF);
+
+    return 0;
+}
+
+/**
+ * Route requests of a given method and URI path to a handler. Routes are
+ * matched in C against the request's Uri-Path options (literal segments
+ * take precedence over path parameters). Requests not matching any route are
+ * passed to the request handler if set by set_req_handler(), otherwise they
+ * are answered by 4.04 (Not Found) or 4.05 (Method Not Allowed) with no Lua
+ * call made.
+ *
+ * Lua arguments:
+ *     method [int|nil]: Request method code (CoapCode.GET .. CoapCode.IPATCH);
+ *         nil for any method.
+ *     path [string]: Route URI path; segments of form ":name" capture path
+ *         parameters, e.g. "/sensors/:id/temp".
+ *     handler [function|nil]: Request handler called as:
+ *         handler(req [userdata], resp [userdata], params [table]), where
+ *         params maps parameter names to captured segments. nil removes the
+ *         route.
+ *
+ * Lua return: None
+ */
+int l_coap_route(lua_State *L)
+{
+    int arg_base, method, ref = LUA_NOREF, old_ref;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    const char *path;
+
+    method = (int)luaL_optinteger(L, arg_base+1, 0);
+    path = luaL_checkstring(L, arg_base+2);
+
+    if (method < 0 || method > RT_N_METHODS)
+        return luaL_error(L, "Invalid route method %d", method);
+
+    if (!lua_isnoneornil(L, arg_base+3)) {
+        luaL_checktype(L, arg_base+3, LUA_TFUNCTION);
+        lua_pushvalue(L, arg_base+3);
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    if (rt_add(&lib_ctx->routes, path, (unsigned)method, ref, &old_ref)) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        return luaL_error(L, "Invalid route path %s", path);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, old_ref);
+
+    return 0;
+}
+
+/**
+ * Create observable (RFC 7641) resource of a given URI path. GET requests
+ * with Observe option targeting the path register (or deregister) observers
+ * of the resource. The request is passed to the request handler as usual
+ * and its response is the first notification. Subsequent notifications are
+ * sent by the resource's notify() method.
+ *
+ * NOTE: Observe option is added to the response to the registration
+ *     request once the handler returns, so the handler may set options of
+ *     lower numbers (e.g. ETag) in the response.
+ *
+ * Lua arguments:
+ *     path [string]: Resource URI path (leading '/' is optional).
+ *
+ * Lua return:
+ *     rsrc [userdata]: Resource object.
+ */
+int l_coap_new_resource(lua_State *L)
+{
+    int arg_base;
+    obs_resource_t *rsrc;
+    ud_resource_t *ud_rsrc;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    const char *path = luaL_checkstring(L, arg_base+1);
+
+    ud_rsrc = (ud_resource_t*)lua_newuserdata(L, sizeof(ud_resource_t));
+    ud_rsrc->rsrc = NULL;
+    luaL_setmetatable(L, MT_RESOURCE);
+
+    if (!(rsrc = obs_rsrc_new(&lib_ctx->obs, path)))
+        return luaL_error(L, "Resource %s creation failed", path);
+    ud_rsrc->rsrc = rsrc;
+
+    /* the resource object refers to its context */
+    lua_pushvalue(L, SELF_IDX(arg_base));
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+/* get library context of an object (resource, timer) at 'idx' */
+static lib_ctx_t *_get_obj_lib_ctx(lua_State *L, int idx)
+{
+    lib_ctx_t *lib_ctx;
+
+    lua_getuservalue(L, idx);
+    lib_ctx = (lib_ctx_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return lib_ctx;
+}
+
+/**
+ * Get resource URI path.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     path [string]: URI path (with no leading '/').
+ */
+int l_coap_rsrc_get_path(lua_State *L)
+{
+    ud_resource_t *ud_rsrc = (ud_resource_t*)_get_self(L, NULL);
 
-    if (!_get_coap_addr(addr, port, &srv_addr))
-        return luaL_error(L, "Can't resolve address %s:%d", addr, port);
+    lua_pushstring(L, ud_rsrc->rsrc->path);
+    return 1;
+}
 
-    session = coap_new_client_session(
-        lib_ctx->coap.ctx, NULL, &srv_addr, COAP_PROTO_UDP);
-    if (!session)
-        return luaL_error(L, "coap_new_client_session() failed");
+/**
+ * Get number of resource observers.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     n [int]: Number of observers.
+ */
+int l_coap_rsrc_get_observers(lua_State *L)
+{
+    ud_resource_t *ud_rsrc = (ud_resource_t*)_get_self(L, NULL);
 
-    ud_conn = (ud_connection_t*)lua_newuserdata(L, sizeof(ud_connection_t));
-    memset(ud_conn, 0, sizeof(ud_connection_t));
-    ud_conn->session = session; 
+    lua_pushinteger(L, ud_rsrc->rsrc->n);
+    return 1;
+}
 
-    /* Connection is automatically closed by its destructor (garbage
-       collector's callback) on the end of object's lifetime. */
-    ud_conn->gc = 1; 
-    luaL_setmetatable(L, MT_CONNECTION);
+/**
+ * Set how often notifications are sent as CON messages. NON notifications
+ * are cheaper, but an observer which is gone is detected (and evicted) by
+ * a CON notification only.
+ *
+ * Lua arguments:
+ *     n [int]: Every n-th notification is sent as CON (default: 20). 1 for
+ *         CON notifications only.
+ *
+ * Lua return: None
+ */
+int l_coap_rsrc_set_con_every(lua_State *L)
+{
+    int arg_base;
+    ud_resource_t *ud_rsrc = (ud_resource_t*)_get_self(L, &arg_base);
+    lua_Integer n = luaL_checkinteger(L, arg_base+1);
 
-    log_debug("New connection object [%p] created\n", ud_conn);
+    if (n < 1)
+        return luaL_error(L, "Invalid CON notifications interval %d", (int)n);
 
-    return 1;
+    ud_rsrc->rsrc->con_every = (unsigned)n;
+    return 0;
 }
 
 /**
- * CoAP messages processing loop. The routine must be called periodically in
- * a script main loop.
+ * Notify resource observers of the resource state change. The notification
+ * is built once and sent to all the observers (with their tokens and message
+ * ids set). Observers rejecting (RST) or not acknowledging CON notification
+ * are evicted.
  *
  * Lua arguments:
- *     timeout [int]: Incomming message timeout (msec). If not provided - block
- *         until some message arrives.
+ *     code [int|none]: CoAP code (default: 205). Non-2.xx code ends the
+ *         observation (all the observers are removed).
+ *     payload [string|bytes-array (1-based)|buffer|none]: Notification
+ *         payload.
+ *     content_format [int|none]: Content-Format option. Not set if not
+ *         provided.
+ *     con [bool|none]: If true send the notification as CON message.
  *
  * Lua return:
- *      time_spent [int]: Number of msecs spent in the routine. Negative value
- *          as an error indicator.
+ *     n [int]: Number of sent notifications.
  */
-int l_coap_process_step(lua_State *L)
+int l_coap_rsrc_notify(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    int time_spent;
+    int arg, n, code = 205, cf = -1;
+    size_t len = 0, arr_sz = 0;
+    uint8_t *arr_buf = NULL;
+    const uint8_t *data = NULL;
+    ud_resource_t *ud_rsrc = (ud_resource_t*)_get_self(L, &arg);
+    lib_ctx_t *lib_ctx = _get_obj_lib_ctx(L, SELF_IDX(arg));
 
-    if (lua_gettop(L)) {
-        int timeout = luaL_checkinteger(L, 1);
+    arg++;
+    if (lua_type(L, arg) == LUA_TNUMBER)
+        code = lua_tointeger(L, arg++);
 
-        time_spent = coap_run_once(
-            lib_ctx->coap.ctx, timeout <= 0 ? COAP_RUN_NONBLOCK : timeout);
-    } else {
-        time_spent = coap_run_once(lib_ctx->coap.ctx, COAP_RUN_BLOCK);
+    if (lua_type(L, arg) == LUA_TTABLE)
+    {
+        arr_sz = luaL_len(L, arg);
+        if (arr_sz > 0 && !(arr_buf = alloca(arr_sz)))
+            return luaL_error(L, "No memory");
     }
 
-    if (time_spent < 0) {
-        log_error("coap_run_once() failed\n");
+    if (!lua_isnoneornil(L, arg) &&
+        !(data = bytes_to(L, arg, arr_buf, arr_sz, &len)))
+    {
+        return luaL_error(L, "Invalid argument passed");
     }
-    lua_pushinteger(L, time_spent);
+
+    cf = (int)luaL_optinteger(L, arg+1, -1);
+
+    n = obs_notify(ud_rsrc->rsrc, COAP_RESPONSE_CODE(code), cf, data, len,
+        lua_toboolean(L, arg+2), lib_ctx->cfg.max_pdu_sz);
+    if (n < 0)
+        return luaL_error(L, "Notification failed");
+
+    lua_pushinteger(L, n);
     return 1;
 }
 
+/* close resource object at 'idx' */
+static void _rsrc_close(lua_State *L, ud_resource_t *ud_rsrc, int idx)
+{
+    lib_ctx_t *lib_ctx = _get_obj_lib_ctx(L, idx);
+
+    obs_rsrc_free(&lib_ctx->obs, ud_rsrc->rsrc);
+    ud_rsrc->rsrc = NULL;
+}
+
 /**
- * Get libcoap log level.
+ * Close the resource. Observers are notified by 4.04 (Not Found) and
+ * removed. The resource object can't be used afterwards.
  *
  * Lua arguments: None
  *
- * Lua return:
- *     log_level [int]: libcoap log level.
+ * Lua return: None
  */
-int l_coap_get_libcoap_log_level(lua_State *L)
+int l_coap_rsrc_close(lua_State *L)
 {
-    lua_pushinteger(L, coap_get_log_level());
-    return 1;
+    int arg_base;
+    ud_resource_t *ud_rsrc = (ud_resource_t*)_get_self(L, &arg_base);
+    lib_ctx_t *lib_ctx = _get_obj_lib_ctx(L, SELF_IDX(arg_base));
+
+    obs_notify(ud_rsrc->rsrc, COAP_RESPONSE_CODE(404), -1, NULL, 0, 0,
+        lib_ctx->cfg.max_pdu_sz);
+    _rsrc_close(L, ud_rsrc, SELF_IDX(arg_base));
+
+    return 0;
 }
 
 /**
- * Set libcoap log level (default: WARNING).
+ * Observe remote resource (RFC 7641). The callback is called for the
+ * registration response and every fresh notification afterwards; stale
+ * (reordered) and duplicated notifications are dropped. The subscription
+ * is re-registered if no notification arrives before the last one expires
+ * (Max-Age). Response with no Observe option or non-2.xx code ends the
+ * subscription (the callback is called for it the last time).
  *
  * Lua arguments:
- *     log_level [int]: libcoap log level.
+ *     path [string]: URI path of the resource, optionally followed by
+ *         a query string ('?' separated).
+ *     callback [function]: Notification callback:
+ *         callback(resp [userdata], sub [userdata]), where resp is
+ *         a read-only response PDU object and sub is the subscription
+ *         object.
  *
- * Lua return: None
+ * Lua return:
+ *     sub [userdata]: Subscription object.
  */
-int l_coap_set_libcoap_log_level(lua_State *L)
+int l_coap_conn_observe(lua_State *L)
 {
-    int log_level = luaL_checkinteger(L, 1);
-    assert(log_level >= LOG_EMERG && log_level <= LOG_DEBUG);
-    coap_set_log_level(log_level);
-    return 0;
+    int arg_base;
+    obs_sub_t *sub;
+    ud_subscription_t *ud_sub;
+    coap_session_t *session =
+        ((ud_connection_t*)_get_self(L, &arg_base))->session;
+    lib_ctx_t *lib_ctx = _get_session_lib_ctx(session);
+    const char *path = luaL_checkstring(L, arg_base+1);
+
+    luaL_checktype(L, arg_base+2, LUA_TFUNCTION);
+
+    ud_sub =
+        (ud_subscription_t*)lua_newuserdata(L, sizeof(ud_subscription_t));
+    ud_sub->sub = NULL;
+    luaL_setmetatable(L, MT_SUBSCRIPTION);
+
+    /* the subscription object refers to its connection */
+    lua_pushvalue(L, SELF_IDX(arg_base));
+    lua_setuservalue(L, -2);
+
+    if (!(sub = obs_sub_new(&lib_ctx->subs, session, path)))
+        return luaL_error(L, "No memory");
+    ud_sub->sub = sub;
+
+    /* active subscription is anchored in the registry */
+    lua_pushvalue(L, arg_base+2);
+    sub->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -1);
+    sub->obj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    _sub_send(lib_ctx, sub, COAP_OBSERVE_ESTABLISH);
+
+    return 1;
 }
 
 /**
- * Get CoAP request handler.
+ * Get subscription URI path.
  *
  * Lua arguments: None
  *
  * Lua return:
- *     req_handler [Lua function|nil]: Handler function or nil (for default
- *         handler).
+ *     path [string]: URI path (with no leading '/') and query string
+ *         (if provided).
  */
-int l_coap_get_req_handler(lua_State *L)
+int l_coap_sub_get_path(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    ud_subscription_t *ud_sub = (ud_subscription_t*)_get_self(L, NULL);
 
-    if (lib_ctx->ref.reqh != LUA_NOREF) {
-        lua_pushinteger(L, lib_ctx->ref.reqh);
-        lua_gettable(L, LUA_REGISTRYINDEX);
-    } else {
-        lua_pushnil(L);
-    }
+    lua_pushstring(L, ud_sub->sub->path);
     return 1;
 }
 
 /**
- * Set CoAP request handler.
+ * Cancel the subscription. Deregistration request is sent to the server.
+ * The subscription object can't be used afterwards.
  *
- * Lua arguments:
- *     req_handler [Lua function|string|nil|none]: Request handler (Lua function
- *         or function global name). If not provided or nil use default handler.
+ * Lua arguments: None
  *
  * Lua return: None
  */
-int l_coap_set_req_handler(lua_State *L)
+int l_coap_sub_cancel(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    int reqh = _set_hndlr_ref(L, 1, LUA_NOREF);
+    obs_sub_t *sub = ((ud_subscription_t*)_get_self(L, NULL))->sub;
+    lib_ctx_t *lib_ctx = _get_session_lib_ctx(sub->session);
 
-    if (reqh != lib_ctx->ref.reqh) {
-        /* unref previous handler if set */
-        if (lib_ctx->ref.reqh != LUA_NOREF)
-            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.reqh);
+    _sub_send(lib_ctx, sub, COAP_OBSERVE_CANCEL);
+    _sub_close(L, lib_ctx, sub);
 
-        lib_ctx->ref.reqh = reqh;
-    }
     return 0;
 }
 
 /**
- * Get CoAP response handler.
+ * Create timer firing after a given time. Timers are kept in a hierarchical
+ * timer wheel (O(1) arming and cancelling) and fired by process_step() or
+ * process_ready(); process_step() doesn't sleep past the nearest timer.
  *
- * Lua arguments: None
+ * Lua arguments:
+ *     ms [int]: Time (msecs) to fire the timer after; the timer period if
+ *         repeated.
+ *     callback [function]: Timer callback: callback(tmr [userdata]), where tmr
+ *         is the timer object.
+ *     repeat [bool|none]: If true the timer is repeated until cancelled.
  *
  * Lua return:
- *     resp_handler [Lua function|nil]: Handler function or nil (for default
- *         handler).
+ *     tmr [userdata]: Timer object.
  */
-int l_coap_get_resp_handler(lua_State *L)
+int l_coap_timer(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    int arg_base;
+    tmr_t *tmr;
+    coap_tick_t now;
+    ud_timer_t *ud_tmr;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+    lua_Integer ms = luaL_checkinteger(L, arg_base+1);
+    int rep = lua_toboolean(L, arg_base+3);
+
+    luaL_checktype(L, arg_base+2, LUA_TFUNCTION);
+
+    if (ms < 0 || ms > UINT_MAX || (rep && !ms))
+        return luaL_error(L, "Invalid timer time %d", (int)ms);
+
+    ud_tmr = (ud_timer_t*)lua_newuserdata(L, sizeof(ud_timer_t));
+    ud_tmr->tmr = NULL;
+    luaL_setmetatable(L, MT_TIMER);
+
+    /* the timer object refers to its context */
+    lua_pushvalue(L, SELF_IDX(arg_base));
+    lua_setuservalue(L, -2);
+
+    if (!(tmr = (tmr_t*)calloc(1, sizeof(tmr_t))))
+        return luaL_error(L, "No memory");
+    tmr->period = (rep ? (unsigned)ms : 0);
+    ud_tmr->tmr = tmr;
+
+    /* armed timer is anchored in the registry */
+    lua_pushvalue(L, arg_base+2);
+    tmr->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -1);
+    tmr->obj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    coap_ticks(&now);
+    tmr_add(&lib_ctx->tmrs, tmr, _ticks_ms(now) + ms, _ticks_ms(now));
 
-    if (lib_ctx->ref.resph != LUA_NOREF) {
-        lua_pushinteger(L, lib_ctx->ref.resph);
-        lua_gettable(L, LUA_REGISTRYINDEX);
-    } else {
-        lua_pushnil(L);
-    }
     return 1;
 }
 
 /**
- * Set CoAP response handler.
+ * Cancel the timer. The timer object can't be used afterwards.
  *
- * Lua arguments:
- *     resp_handler [Lua function|string|nil|none]: Response handler (Lua
- *         function or function global name). If not provided or nil use default
- *         handler.
+ * Lua arguments: None
  *
  * Lua return: None
  */
-int l_coap_set_resp_handler(lua_State *L)
+int l_coap_tmr_cancel(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    int resph = _set_hndlr_ref(L, 1, LUA_NOREF);
+    int arg_base;
+    ud_timer_t *ud_tmr = (ud_timer_t*)_get_self(L, &arg_base);
 
-    if (resph != lib_ctx->ref.resph) {
-        /* unref previous handler if set */
-        if (lib_ctx->ref.resph != LUA_NOREF)
-            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.resph);
+    _tmr_close(L, _get_obj_lib_ctx(L, SELF_IDX(arg_base)), ud_tmr->tmr);
+    return 0;
+}
 
-        lib_ctx->ref.resph = resph;
+/* get non-negative integer option 'name' of options table at 'idx' */
+static lua_Integer _get_opt_uint(
+    lua_State *L, int idx, const char *name, lua_Integer def)
+{
+    int isnum;
+    lua_Integer val = def;
+
+    if (lua_getfield(L, idx, name) != LUA_TNIL) {
+        val = lua_tointegerx(L, -1, &isnum);
+        if (!isnum || val < 0 || val > UINT_MAX)
+            luaL_error(L, "Invalid %s option", name);
     }
-    return 0;
+    lua_pop(L, 1);
+
+    return val;
 }
 
 /**
- * Get CoAP NACK handler.
+ * Create connection pool. The pool keeps connections (one per destination
+ * host and port) created on demand by the pool's get(), so repeated requests
+ * to the same destination reuse a warm session (with its message ids state
+ * and transmission parameters) with no name resolution, session and socket
+ * creation.
  *
- * Lua arguments: None
+ * Pooled connections are shared objects: connection released by the pool
+ * (idle expired, evicted or the pool closed) is closed once not referenced
+ * anymore. Connections idle (not handed out and with no traffic) for the
+ * idle timeout are released by process_step() or process_ready(). If the
+ * pool is full the least recently used connection is evicted.
+ *
+ * Lua arguments:
+ *     opts [table|none]: Pool options:
+ *         max_size [int|none]: Max number of pooled connections
+ *             (default: 32).
+ *         idle_timeout [int|none]: Time (secs) after an idle connection is
+ *             released (default: 60).
  *
  * Lua return:
- *     nack_handler [Lua function|nil]: Handler function or nil (for default
- *         handler).
+ *     pool [userdata]: Connection pool object.
  */
-int l_coap_get_nack_handler(lua_State *L)
+int l_coap_connection_pool(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-
-    if (lib_ctx->ref.nackh != LUA_NOREF) {
-        lua_pushinteger(L, lib_ctx->ref.nackh);
-        lua_gettable(L, LUA_REGISTRYINDEX);
-    } else {
-        lua_pushnil(L);
+    int arg_base;
+    ud_pool_t *pool;
+    lua_Integer max = POOL_DEF_MAX, idle = POOL_DEF_IDLE;
+    lib_ctx_t *lib_ctx = _get_lib_ctx(L, &arg_base);
+
+    if (!lua_isnoneornil(L, arg_base+1)) {
+        luaL_checktype(L, arg_base+1, LUA_TTABLE);
+        max = _get_opt_uint(L, arg_base+1, "max_size", max);
+        idle = _get_opt_uint(L, arg_base+1, "idle_timeout", idle);
     }
+
+    if (!max)
+        return luaL_error(L, "Invalid max_size option");
+
+    pool = (ud_pool_t*)lua_newuserdata(L, sizeof(ud_pool_t));
+    memset(pool, 0, sizeof(ud_pool_t));
+    pool->max = (unsigned)max;
+    pool->idle = (coap_tick_t)idle * COAP_TICKS_PER_SECOND;
+    pool->map_ref = LUA_NOREF;
+
+    /* not open (ignored by the destructor) till fully initialized */
+    pool->closed = 1;
+    luaL_setmetatable(L, MT_POOL);
+
+    /* the pool object refers to its context */
+    lua_pushvalue(L, SELF_IDX(arg_base));
+    lua_setuservalue(L, -2);
+
+    lua_newtable(L);
+    pool->map_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    pool->closed = 0;
+    pool->next = lib_ctx->pools;
+    lib_ctx->pools = pool;
+
+    log_debug("New connection pool [%p] created\n", pool);
+
     return 1;
 }
 
 /**
- * Set CoAP NACK handler.
+ * Get pooled connection to a given CoAP server address and port. The
+ * connection is created (and pooled) if the pool doesn't contain one.
+ *
+ * NOTE: If called from a coroutine host names are resolved asynchronously,
+ *     with the coroutine suspended till the resolution completes (see
+ *     connect()). Otherwise names not cached are resolved synchronously.
  *
  * Lua arguments:
- *     resp_handler [Lua function|string|nil|none]: Response handler (Lua
- *         function or function global name). If not provided or nil use default
- *         handler.
+ *     addr [string]: CoAP server address.
+ *     port [int]: CoAP server port.
  *
- * Lua return: None
+ * Lua return:
+ *     conn [userdata|nil]: Connection object, nil on error.
+ *     err [string|none]: Error message.
  */
-int l_coap_set_nack_handler(lua_State *L)
+int l_coap_pool_get(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    int nackh = _set_hndlr_ref(L, 1, LUA_NOREF);
+    int arg_base;
+    coap_tick_t now;
+    res_entry_t *ent;
+    coap_address_t srv_addr, *srv;
+    const char *err = "Can't resolve address";
+    ud_pool_t *pool = (ud_pool_t*)_get_self(L, &arg_base);
+    lib_ctx_t *lib_ctx = _get_obj_lib_ctx(L, SELF_IDX(arg_base));
 
-    if (nackh != lib_ctx->ref.nackh) {
-        /* unref previous handler if set */
-        if (lib_ctx->ref.nackh != LUA_NOREF)
-            luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.nackh);
+    const char *key, *addr = luaL_checkstring(L, arg_base+1);
+    int port = luaL_checkinteger(L, arg_base+2);
 
-        lib_ctx->ref.nackh = nackh;
+    if (port < 0 || port >= 65535)
+        return luaL_error(L, "Invalid port number %d", port);
+
+    key = lua_pushfstring(L, "%s:%d", addr, port);
+
+    coap_ticks(&now);
+    if (_pool_take(L, pool, key, now))
+        return 1;
+
+    if (lua_isyieldable(L) && !_is_numeric_host(addr))
+    {
+        ent = _res_start(L, lib_ctx, addr);
+
+        if (ent->state == RES_PENDING) {
+            /* the connection is pooled on the resolution completion */
+            lua_getuservalue(L, SELF_IDX(arg_base));
+            _res_wait(L, lib_ctx, ent, port, -1, SELF_IDX(arg_base));
+            lua_pop(L, 1);
+
+            log_debug("Awaiting resolution of %s\n", addr);
+            return lua_yield(L, 0);
+        }
+
+        srv = res_get_addr(ent, port, &srv_addr);
+        if (ent->err)
+            err = gai_strerror(ent->err);
+    } else {
+        srv = _get_srv_addr(lib_ctx, addr, port, &srv_addr);
     }
-    return 0;
+
+    if (!srv) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_getuservalue(L, SELF_IDX(arg_base));
+    if (!_new_conn_obj(L, -1, lib_ctx, srv))
+        return luaL_error(L, "Client session creation failed");
+
+    if (_pool_put(L, lib_ctx, pool, key, now))
+        return luaL_error(L, "No memory");
+
+    return 1;
 }
 
 /**
- * Set max PDU size for newly created messeges.
+ * Get number of pooled connections.
  *
- * Lua arguments:
- *     max_pdu_sz [int]: Max PDU size. If not configured default value is used
- *         as specified by MAX_COAP_PDU_SIZE.
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     n [int]: Number of pooled connections.
+ */
+int l_coap_pool_size(lua_State *L)
+{
+    lua_pushinteger(L, ((ud_pool_t*)_get_self(L, NULL))->n);
+    return 1;
+}
+
+/**
+ * Close the pool. Pooled connections are released by the pool (connections
+ * still referenced remain usable). The pool object can't be used afterwards.
+ *
+ * Lua arguments: None
  *
  * Lua return: None
  */
-int l_coap_set_max_pdu_size(lua_State *L)
+int l_coap_pool_close(lua_State *L)
 {
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
-    lib_ctx->cfg.max_pdu_sz = luaL_checkinteger(L, 1);
+    int arg_base;
+    ud_pool_t *pool = (ud_pool_t*)_get_self(L, &arg_base);
+
+    _pool_close(L, _get_obj_lib_ctx(L, SELF_IDX(arg_base)), pool);
+    log_debug("Connection pool [%p] closed\n", pool);
     return 0;
 }
 
@@ -1904,8 +5581,117 @@ static int _get_coap_resp_code(int req_code)
         break;
     }
 
-    /* Empty */
-    return 0;
+    /* Empty */
+    return 0;
+}
+
+/*
+ * Push handler's PDU object on the stack. The object is taken from the pool
+ * of recycled objects if pooling is enabled. Returned object is zeroed except
+ * its pooling flag.
+ *
+ * NOTE: Payload views refer to their PDU object, therefore no view of
+ *     a recycled object exists and its generation counter may be reset.
+ */
+static ud_coap_pdu_t *_push_hndlr_pdu_obj(lua_State *L, lib_ctx_t *lib_ctx)
+{
+    ud_coap_pdu_t *ud_pdu;
+
+    if (lib_ctx->cfg.pool_sz > 0)
+    {
+        ud_pdu = (ud_coap_pdu_t*)_objs_pool_pop(
+            L, lib_ctx->pool.ref, sizeof(ud_coap_pdu_t), MT_PDU);
+        ud_pdu->access.pool = 1;
+        return ud_pdu;
+    }
+
+    ud_pdu = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
+    memset(ud_pdu, 0, sizeof(ud_coap_pdu_t));
+    luaL_setmetatable(L, MT_PDU);
+    return ud_pdu;
+}
+
+/*
+ * Release handler's PDU object on the stack top (the object is popped).
+ * The object (along with its connection object) is locked.
+ */
+static void _release_hndlr_pdu_obj(lua_State *L, lib_ctx_t *lib_ctx)
+{
+    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)lua_touserdata(L, -1);
+
+    /* lock for access; invalidates payload views */
+    ud_pdu->access.lck = 1;
+    ud_pdu->gen++;
+
+    if (ud_pdu->access.pool) {
+        if (lua_getiuservalue(L, -1, 2) == LUA_TUSERDATA)
+            ((ud_connection_t*)lua_touserdata(L, -1))->lck = 1;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/* call Block1 upload chunk handler for a received block */
+static void _call_chunk_hndlr(lua_State *L, lib_ctx_t *lib_ctx,
+    coap_session_t *session, coap_pdu_t *request, size_t off, int more)
+{
+    ud_coap_pdu_t *ud_req;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lib_ctx->ref.chunkh);
+
+    ud_req = _push_hndlr_pdu_obj(L, lib_ctx);
+    ud_req->pdu = request;
+    ud_req->session = session;
+    ud_req->access.ro = 1;
+    ud_req->access.hndlr = ACS_REQ_HNDLR;
+
+    /* keep the argument below the call frame for its release */
+    lua_pushvalue(L, -1);
+    lua_rotate(L, -3, 1);
+
+    lua_pushinteger(L, (lua_Integer)off);
+    lua_pushboolean(L, more);
+    lua_call(L, 3, 0);
+
+    _release_hndlr_pdu_obj(L, lib_ctx);
+}
+
+/* handle response received for a subscription */
+static void _sub_resp(lua_State *L, lib_ctx_t *lib_ctx,
+    obs_sub_t *sub, coap_session_t *session, coap_pdu_t *received)
+{
+    ud_coap_pdu_t *ud_rcvd;
+    ud_subscription_t *ud_sub;
+    int rx = obs_sub_rx(&lib_ctx->subs, sub, received);
+
+    if (rx == OBS_RX_STALE) {
+        log_debug("Stale notification of /%s dropped\n", sub->path);
+        return;
+    }
+
+    /* keep the subscription object and the argument below the call frame;
+       the callback may cancel the subscription */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sub->obj_ref);
+    ud_sub = (ud_subscription_t*)lua_touserdata(L, -1);
+
+    ud_rcvd = _push_hndlr_pdu_obj(L, lib_ctx);
+    ud_rcvd->pdu = received;
+    ud_rcvd->session = session;
+    ud_rcvd->access.ro = 1;
+    ud_rcvd->access.hndlr = ACS_RESP_HNDLR;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sub->cb_ref);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -4);
+    lua_call(L, 2, 0);
+
+    _release_hndlr_pdu_obj(L, lib_ctx);
+
+    if (rx == OBS_RX_END && ud_sub->sub) {
+        log_info("Subscription of /%s ended\n", ud_sub->sub->path);
+        _sub_close(L, lib_ctx, ud_sub->sub);
+    }
+    lua_pop(L, 1);
 }
 
 /* global (all-resource) CoAP request handler */
@@ -1914,12 +5700,62 @@ static void _coap_req_hndlr(
     coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
     coap_string_t *query_str, coap_pdu_t *response)
 {
+    int blk1, nargs = 2;
+    unsigned i;
+    size_t off;
+    uint8_t obs_buf[4];
+    rt_match_t route;
+    blk_xfer_t *xfer;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    obs_resource_t *rsrc = NULL;
     ud_coap_pdu_t *ud_req, *ud_resp;
-    lua_State *L = coap_get_app_data(context);
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)coap_get_app_data(context);
+    lua_State *L = lib_ctx->L;
+
+    _log_pdu(LOG_INF, "reqh", request, session, 1);
+
+    /* upload left by a handler which raised an error */
+    blk_upload_done(&lib_ctx->blk);
+
+    /* subsequent blocks are served out of the cached Block2 transfer */
+    if ((xfer = blk_xfer_find(L, &lib_ctx->blk, session, request))) {
+        blk_xfer_respond(L, &lib_ctx->blk, xfer, session, request, response);
+        _log_pdu(LOG_INF, "reqh", response, session, 0);
+        return;
+    }
 
-    _log_pdu(LOG_INF, "reqh", request, 1);
+    /* Block1 upload is reassembled (or streamed) before the handler call */
+    blk1 = blk_upload_rx(&lib_ctx->blk, session, request, response, &off);
+    if (blk1 != BLK1_NONE)
+    {
+        if (blk1 != BLK1_ERROR && lib_ctx->ref.chunkh != LUA_NOREF) {
+            _call_chunk_hndlr(
+                L, lib_ctx, session, request, off, (blk1 == BLK1_CONTINUE));
+        }
+
+        if (blk1 != BLK1_DONE) {
+            _log_pdu(LOG_INF, "reqh", response, session, 0);
+            return;
+        }
+    }
+
+    /* routed requests; unmatched ones are answered here if there is no
+       request handler to pass them to */
+    if (lib_ctx->routes &&
+        (i = rt_match(lib_ctx->routes, request, &route)) != RT_MATCH &&
+        lib_ctx->ref.reqh == LUA_NOREF)
+    {
+        response->code =
+            COAP_RESPONSE_CODE(i == RT_NOT_ALLOWED ? 405 : 404);
+        _log_pdu(LOG_INF, "reqh", response, session, 0);
+        blk_upload_done(&lib_ctx->blk);
+        return;
+    }
 
+    if (lib_ctx->routes && route.ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, route.ref);
+    } else
     if (lib_ctx->ref.reqh != LUA_NOREF) {
         lua_pushinteger(L, lib_ctx->ref.reqh);
         lua_gettable(L, LUA_REGISTRYINDEX);
@@ -1928,33 +5764,113 @@ static void _coap_req_hndlr(
     if (lua_getglobal(L, REQ_HANDLER) != LUA_TFUNCTION)
     {
         lua_pop(L, 1);
+        blk_upload_done(&lib_ctx->blk);
         return;
     }
 
-    /* create handler arguments; associate them with their metatables */
+    /* observers (RFC 7641) registration */
+    if (lib_ctx->obs && request->code == COAP_REQUEST_GET &&
+        (opt = coap_check_option(request, COAP_OPTION_OBSERVE, &it)) &&
+        (rsrc = obs_rsrc_find(lib_ctx->obs, request)))
+    {
+        if (coap_decode_var_bytes(coap_opt_value(opt),
+            coap_opt_length(opt)) != COAP_OBSERVE_ESTABLISH)
+        {
+            obs_deregister(rsrc, session, request);
+            rsrc = NULL;
+        } else
+        if (obs_register(rsrc, session, request)) {
+            log_error("Observer registration failed\n");
+            rsrc = NULL;
+        }
+    }
+
+    /* Observe option is added to the finalized response, so the handler may
+       add options of lower numbers (e.g. ETag) */
+    lib_ctx->obs_req = (rsrc ? request : NULL);
 
-    ud_req = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
-    memset(ud_req, 0, sizeof(ud_coap_pdu_t));
+    /* create handler arguments */
+
+    ud_req = _push_hndlr_pdu_obj(L, lib_ctx);
     ud_req->pdu = request;
     ud_req->session = session;
     ud_req->access.ro = 1;    /* request is read only */
     ud_req->access.hndlr = ACS_REQ_HNDLR;
-    luaL_setmetatable(L, MT_PDU);
 
-    ud_resp = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
-    memset(ud_resp, 0, sizeof(ud_coap_pdu_t));
+    if (blk1 == BLK1_DONE) {
+        /* streamed payload is not passed */
+        ud_req->blk1.set = 1;
+        ud_req->blk1.data = lib_ctx->blk.up.done->data;
+        ud_req->blk1.len =
+            (lib_ctx->blk.up.stream ? 0 : lib_ctx->blk.up.done->len);
+    }
+
+    ud_resp = _push_hndlr_pdu_obj(L, lib_ctx);
     ud_resp->pdu = response;
     ud_resp->session = session;
     ud_resp->def_code = _get_coap_resp_code(request->code);
     ud_resp->access.hndlr = ACS_REQ_HNDLR;
-    luaL_setmetatable(L, MT_PDU);
 
-    lua_call(L, 2, 0);
+    /* keep the arguments below the call frame for their release */
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rotate(L, -5, 2);
+
+    /* routed handler's path parameters */
+    if (lib_ctx->routes && route.ref != LUA_NOREF)
+    {
+        lua_createtable(L, 0, route.n_params);
+        for (i = 0; i < route.n_params; i++) {
+            lua_pushlstring(L, (const char*)route.params[i].val,
+                route.params[i].len);
+            lua_setfield(L, -2, route.params[i].name);
+        }
+        nargs = 3;
+    }
+
+    /* transfer left by a handler which raised an error */
+    if (lib_ctx->blk.pending) {
+        blk_xfer_free(L, lib_ctx->blk.pending);
+        lib_ctx->blk.pending = NULL;
+    }
+    lib_ctx->blk.req = request;
+
+    lua_call(L, nargs, 0);
+
+    lib_ctx->blk.req = NULL;
+    lib_ctx->obs_req = NULL;
+    if ((xfer = lib_ctx->blk.pending)) {
+        lib_ctx->blk.pending = NULL;
+        blk_xfer_respond(L, &lib_ctx->blk, xfer, session, request, response);
+    }
+
+    _release_hndlr_pdu_obj(L, lib_ctx);
+    _release_hndlr_pdu_obj(L, lib_ctx);
+
+    /* acknowledge completed Block1 upload by the finalized response (empty
+       ACK of a deferred response excluded) */
+    if (response->code)
+        blk_upload_ack(&lib_ctx->blk, response);
+    blk_upload_done(&lib_ctx->blk);
+
+    /* error response ends the observation (deferred one excluded) */
+    if (rsrc && response->code &&
+        (rsrc = obs_rsrc_find(lib_ctx->obs, request)))
+    {
+        if ((response->code >> 5) != 2) {
+            obs_deregister(rsrc, session, request);
+        } else
+        if (!pdu_insert_opt(response, COAP_OPTION_OBSERVE,
+            obs_encode_seq(rsrc, obs_buf), obs_buf))
+        {
+            log_error("Observe option can't be added to the response\n");
+        }
+    }
 
     /* response with non-empty code will be sent
        automatically after leaving this handler */
     if (response->code) {
-        _log_pdu(LOG_INF, "reqh", response, 0);
+        _log_pdu(LOG_INF, "reqh", response, session, 0);
     }
 }
 
@@ -1963,12 +5879,38 @@ void _coap_resp_hndlr(
     struct coap_context_t *context, coap_session_t *session,
     coap_pdu_t *sent, coap_pdu_t *received, const coap_tid_t id)
 {
+    obs_sub_t *sub;
+    pnd_req_t *req;
     ud_coap_pdu_t *ud_sent, *ud_rcvd;
-    lua_State *L = coap_get_app_data(context);
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)coap_get_app_data(context);
+    lua_State *L = lib_ctx->L;
     int ret_type, handle_ack = 1;
 
-    _log_pdu(LOG_INF, "resph", received, 1);
+    _log_pdu(LOG_INF, "resph", received, session, 1);
+
+    /* awaited responses resume their requests' coroutines */
+    if ((req = pnd_find(&lib_ctx->reqs, session, received)))
+    {
+        ud_rcvd = _push_hndlr_pdu_obj(L, lib_ctx);
+        ud_rcvd->pdu = received;
+        ud_rcvd->session = session;
+        ud_rcvd->access.ro = 1;
+        ud_rcvd->access.hndlr = ACS_RESP_HNDLR;
+
+        /* keep the argument on the stack for its release */
+        lua_pushvalue(L, -1);
+        _req_resume(lib_ctx, req, 1);
+
+        _release_hndlr_pdu_obj(L, lib_ctx);
+        goto finish;
+    }
+
+    /* subscriptions' responses are passed to their callbacks only */
+    if ((sub = obs_sub_find(&lib_ctx->subs, session, received)))
+    {
+        _sub_resp(L, lib_ctx, sub, session, received);
+        goto finish;
+    }
 
     if (lib_ctx->ref.resph != LUA_NOREF) {
         lua_pushinteger(L, lib_ctx->ref.resph);
@@ -1981,23 +5923,24 @@ void _coap_resp_hndlr(
         goto finish;
     }
 
-    /* create handler arguments; associate them with their metatables */
+    /* create handler arguments */
 
-    ud_sent = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
-    memset(ud_sent, 0, sizeof(ud_coap_pdu_t));
+    ud_sent = _push_hndlr_pdu_obj(L, lib_ctx);
     ud_sent->pdu = sent;
     ud_sent->session = session;
     ud_sent->access.ro = 1;
     ud_sent->access.hndlr = ACS_RESP_HNDLR;
-    luaL_setmetatable(L, MT_PDU);
 
-    ud_rcvd = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
-    memset(ud_rcvd, 0, sizeof(ud_coap_pdu_t));
+    ud_rcvd = _push_hndlr_pdu_obj(L, lib_ctx);
     ud_rcvd->pdu = received;
     ud_rcvd->session = session;
     ud_rcvd->access.ro = 1;
     ud_rcvd->access.hndlr = ACS_RESP_HNDLR;
-    luaL_setmetatable(L, MT_PDU);
+
+    /* keep the arguments below the call frame for their release */
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rotate(L, -5, 2);
 
     lua_call(L, 2, 1);
 
@@ -2012,13 +5955,16 @@ void _coap_resp_hndlr(
     }
     lua_pop(L, 1);
 
+    _release_hndlr_pdu_obj(L, lib_ctx);
+    _release_hndlr_pdu_obj(L, lib_ctx);
+
 finish:
     /* send ACK if required by the handled response */
     if (handle_ack && received->type == COAP_MESSAGE_CON)
     {
         coap_pdu_t *ack = coap_pdu_init(COAP_MESSAGE_ACK, 0, received->tid, 0);
         if (ack) {
-            _log_pdu(LOG_INF, "resph", ack, 0);
+            _log_pdu(LOG_INF, "resph", ack, session, 0);
         }
         if (!ack || coap_send(session, ack) == COAP_INVALID_TID) {
             log_error("coap_send() failed\n");
@@ -2030,9 +5976,39 @@ finish:
 void _coap_nack_hndlr(struct coap_context_t *context, coap_session_t *session,
     coap_pdu_t *sent, coap_nack_reason_t reason, const coap_tid_t id)
 {
+    obs_sub_t *sub;
+    pnd_req_t *req;
+    coap_tick_t now;
     ud_coap_pdu_t *ud_sent;
-    lua_State *L = coap_get_app_data(context);
-    lib_ctx_t *lib_ctx = _get_lib_ctx(L);
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)coap_get_app_data(context);
+    lua_State *L = lib_ctx->L;
+
+    /* failed request resumes its coroutine */
+    if ((req = pnd_find(&lib_ctx->reqs, session, sent))) {
+        lua_pushnil(L);
+        lua_pushinteger(L, reason);
+        _req_resume(lib_ctx, req, 2);
+        return;
+    }
+
+    /* undelivered subscription registration is retried later */
+    if ((sub = obs_sub_find(&lib_ctx->subs, session, sent)))
+    {
+        log_warn("Subscription of /%s not registered; retrying in %d secs\n",
+            sub->path, OBS_SUB_RETRY);
+
+        coap_ticks(&now);
+        obs_sub_schedule(&lib_ctx->subs, sub,
+            _ticks_ms(now) + OBS_SUB_RETRY * 1000, _ticks_ms(now));
+        return;
+    }
+
+    /* rejected or undelivered notification evicts its observer */
+    if (lib_ctx->obs && reason != COAP_NACK_TLS_FAILED &&
+        obs_evict(lib_ctx->obs, session, sent))
+    {
+        return;
+    }
 
     if (lib_ctx->ref.nackh != LUA_NOREF) {
         lua_pushinteger(L, lib_ctx->ref.nackh);
@@ -2045,196 +6021,669 @@ void _coap_nack_hndlr(struct coap_context_t *context, coap_session_t *session,
         return;
     }
 
-    /* create handler arguments; associate them with their metatables */
+    /* create handler arguments */
 
-    ud_sent = (ud_coap_pdu_t*)lua_newuserdata(L, sizeof(ud_coap_pdu_t));
-    memset(ud_sent, 0, sizeof(ud_coap_pdu_t));
+    ud_sent = _push_hndlr_pdu_obj(L, lib_ctx);
     ud_sent->pdu = sent;
     ud_sent->session = session;
     ud_sent->access.ro = 1;
     ud_sent->access.hndlr = ACS_NACK_HNDLR;
-    luaL_setmetatable(L, MT_PDU);
+
+    /* keep the argument below the call frame for its release */
+    lua_pushvalue(L, -1);
+    lua_rotate(L, -3, 1);
 
     lua_pushinteger(L, reason);
 
     lua_pushinteger(L, id);
 
     lua_call(L, 3, 0);
-}
 
-/* search for a function name in 'funcs' table */
-static lua_CFunction _get_func(const char *fname, const luaL_Reg *funcs)
-{
-    const char *n;
-    for (; (n = funcs->name) != NULL; funcs++) {
-        if (!strcmp(n, fname))
-            return funcs->func;
-    }
-    return NULL;
+    _release_hndlr_pdu_obj(L, lib_ctx);
 }
 
+/* base read access methods */
+static const luaL_Reg pdu_r_funcs[] = {
+    {"get_type", l_coap_pdu_get_type},
+    {"get_code", l_coap_pdu_get_code},
+    {"get_msg_id", l_coap_pdu_get_msg_id},
+    {"get_token", l_coap_pdu_get_token},
+    {"options", l_coap_pdu_options},
+    {"get_option", l_coap_pdu_get_option},
+    {"get_uri_path", l_coap_pdu_get_uri_path},
+    {"qstr_params", l_coap_pdu_qstr_params},
+    {"get_qstr_param", l_coap_pdu_get_qstr_param},
+    {"get_payload", l_coap_pdu_get_payload},
+    {NULL, NULL}
+};
+
+/* base write access methods */
+static const luaL_Reg pdu_w_funcs[] = {
+    {"set_type", l_coap_pdu_set_type},
+    {"set_code", l_coap_pdu_set_code},
+    {"set_msg_id", l_coap_pdu_set_msg_id},
+    {"set_token", l_coap_pdu_set_token},
+    {"set_option", l_coap_pdu_set_option},
+    {"set_uri_path", l_coap_pdu_set_uri_path},
+    {NULL, NULL}
+};
+
+/* all handlers (common) read access methods */
+static const luaL_Reg pdu_r_cmnh_funcs[] = {
+    {"get_connection", l_coap_pdu_get_connection},
+    {"payload_view", l_coap_pdu_payload_view},
+    {NULL, NULL}
+};
+
+/* request handler write access specfic methods */
+static const luaL_Reg pdu_w_reqh_funcs[] = {
+    {"send", l_coap_pdu_send_reqh},
+    {"defer", l_coap_pdu_defer},
+    {NULL, NULL}
+};
+
+/* deferred response write access specfic methods */
+static const luaL_Reg pdu_w_dfr_funcs[] = {
+    {"send", l_coap_pdu_send_dfr},
+    {NULL, NULL}
+};
+
+/*
+ * CoAP PDU object access profiles; indexed by PROF_XXX.
+ * NOTE: Response/NACK handler has no write access specific methods.
+ */
+static const luaL_Reg *pdu_new_msg_prof[] = {pdu_r_funcs, pdu_w_funcs, NULL};
+static const luaL_Reg *pdu_ro_prof[] = {pdu_r_funcs, pdu_r_cmnh_funcs, NULL};
+static const luaL_Reg *pdu_reqh_prof[] = {
+    pdu_r_funcs, pdu_r_cmnh_funcs, pdu_w_funcs, pdu_w_reqh_funcs, NULL};
+static const luaL_Reg *pdu_resph_prof[] = {
+    pdu_r_funcs, pdu_r_cmnh_funcs, pdu_w_funcs, NULL};
+static const luaL_Reg *pdu_dfr_prof[] = {
+    pdu_r_funcs, pdu_w_funcs, pdu_w_dfr_funcs, NULL};
+
+static const luaL_Reg **pdu_profs[] = {pdu_new_msg_prof,
+    pdu_ro_prof, pdu_reqh_prof, pdu_resph_prof, pdu_dfr_prof, NULL};
+
+/* connection object methods */
+static const luaL_Reg conn_funcs[] = {
+    {"get_addr", l_coap_conn_get_addr},
+    {"get_port", l_coap_conn_get_port},
+    {"get_max_pdu_size", l_coap_conn_get_max_pdu_size},
+    {"get_max_retransmit", l_coap_conn_get_max_retransmit},
+    {"set_max_retransmit", l_coap_conn_set_max_retransmit},
+    {"get_ack_timeout", l_coap_conn_get_ack_timeout},
+    {"set_ack_timeout", l_coap_conn_set_ack_timeout},
+    {"send", l_coap_conn_send},
+    {"observe", l_coap_conn_observe},
+    {"request", l_coap_conn_request},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *conn_prof[] = {conn_funcs, NULL};
+static const luaL_Reg **conn_profs[] = {conn_prof, NULL};
+
+/* endpoint object methods */
+static const luaL_Reg ep_funcs[] = {
+    {"get_addr", l_coap_ep_get_addr},
+    {"get_port", l_coap_ep_get_port},
+    {"close", l_coap_ep_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *ep_prof[] = {ep_funcs, NULL};
+static const luaL_Reg **ep_profs[] = {ep_prof, NULL};
+
+/* resource object methods */
+static const luaL_Reg rsrc_funcs[] = {
+    {"get_path", l_coap_rsrc_get_path},
+    {"get_observers", l_coap_rsrc_get_observers},
+    {"set_con_every", l_coap_rsrc_set_con_every},
+    {"notify", l_coap_rsrc_notify},
+    {"close", l_coap_rsrc_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *rsrc_prof[] = {rsrc_funcs, NULL};
+static const luaL_Reg **rsrc_profs[] = {rsrc_prof, NULL};
+
+/* subscription object methods */
+static const luaL_Reg sub_funcs[] = {
+    {"get_path", l_coap_sub_get_path},
+    {"cancel", l_coap_sub_cancel},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *sub_prof[] = {sub_funcs, NULL};
+static const luaL_Reg **sub_profs[] = {sub_prof, NULL};
+
+/* timer object methods */
+static const luaL_Reg tmr_funcs[] = {
+    {"cancel", l_coap_tmr_cancel},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *tmr_prof[] = {tmr_funcs, NULL};
+static const luaL_Reg **tmr_profs[] = {tmr_prof, NULL};
+
+/* connection pool object methods */
+static const luaL_Reg pool_funcs[] = {
+    {"get", l_coap_pool_get},
+    {"size", l_coap_pool_size},
+    {"close", l_coap_pool_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *pool_prof[] = {pool_funcs, NULL};
+static const luaL_Reg **pool_profs[] = {pool_prof, NULL};
+
+/* library context object methods */
+static const luaL_Reg ctx_funcs[] = {
+    {"bind_server", l_coap_bind_server},
+    {"get_endpoints", l_coap_get_endpoints},
+    {"new_connection", l_coap_new_connection},
+    {"connect", l_coap_connect},
+    {"connection_pool", l_coap_connection_pool},
+    {"new_resource", l_coap_new_resource},
+    {"timer", l_coap_timer},
+    {"new_msg", l_coap_new_msg},
+    {"process_step", l_coap_process_step},
+    {"process_ready", l_coap_process_ready},
+    {"get_fd", l_coap_get_fd},
+    {"get_next_timeout", l_coap_get_next_timeout},
+    {"get_req_handler", l_coap_get_req_handler},
+    {"set_req_handler", l_coap_set_req_handler},
+    {"get_resp_handler", l_coap_get_resp_handler},
+    {"set_resp_handler", l_coap_set_resp_handler},
+    {"get_nack_handler", l_coap_get_nack_handler},
+    {"set_nack_handler", l_coap_set_nack_handler},
+    {"route", l_coap_route},
+    {"set_max_pdu_size", l_coap_set_max_pdu_size},
+    {"set_obj_pool_size", l_coap_set_obj_pool_size},
+    {"set_io_batch", l_coap_set_io_batch},
+    {"set_shared_sockets", l_coap_set_shared_sockets},
+    {"set_poll_mode", l_coap_set_poll_mode},
+    {"set_dns_ttl", l_coap_set_dns_ttl},
+    {"set_block_transfer", l_coap_set_block_transfer},
+    {"set_block_upload", l_coap_set_block_upload},
+    {NULL, NULL}
+};
+
+static const luaL_Reg *ctx_prof[] = {ctx_funcs, NULL};
+static const luaL_Reg **ctx_profs[] = {ctx_prof, NULL};
+
+/*
+ * Dispatcher's upvalues:
+ * 1. Metatable name (light-userdata),
+ * 2. Array of prebuilt methods tables (one per object access profile),
+ * 3. Dispatch mode (DISP_XXX).
+ */
 #define __DECL_VARS() \
     const char *tname = (const char*)lua_touserdata(L, lua_upvalueindex(1)); \
     void *ud = luaL_checkudata(L, 1, tname); \
-    const char *fname = luaL_checkstring(L, 2); \
-    lua_CFunction f = NULL
+    const char *fname = luaL_checkstring(L, 2)
 
-/* push method on the stack along with its associated object as an upvalue */
-#define __CHECK_FUNC_PUSH() \
-    if (f) { \
-        lua_pushlightuserdata(L, ud); \
-        lua_pushcclosure(L, f, 1); \
-    } else { \
+/*
+ * Push method on the stack for a given access profile. For DISP_CLOSURE mode
+ * the method is pushed along with its associated object as an upvalue, for
+ * DISP_CACHED the prebuilt method is pushed as is (no allocation).
+ */
+#define __CHECK_FUNC_PUSH(__prof) \
+    lua_rawgeti(L, lua_upvalueindex(2), (__prof) + 1); \
+    lua_pushvalue(L, 2); \
+    if (lua_rawget(L, -2) != LUA_TFUNCTION) { \
         luaL_error(L, "Invalid method %s of object %s", fname, tname); \
+    } \
+    if (lua_tointeger(L, lua_upvalueindex(3)) == DISP_CLOSURE) { \
+        lua_CFunction f = lua_tocfunction(L, -1); \
+        lua_pop(L, 1); \
+        lua_pushvalue(L, 1); \
+        lua_pushcclosure(L, f, 1); \
+    }
+
+/* get access profile of a CoAP PDU object */
+static int _get_pdu_prof(const ud_coap_pdu_t *ud_pdu)
+{
+    if (ud_pdu->access.ro)
+        return PROF_RO;
+
+    switch (ud_pdu->access.hndlr)
+    {
+    case ACS_REQ_HNDLR:
+        return PROF_REQH;
+    case ACS_RESP_HNDLR:
+    case ACS_NACK_HNDLR:
+        return PROF_RESPH;
+    case ACS_DFR_RESP:
+        return PROF_DEFERRED;
+    default:
+        return PROF_NEW_MSG;
     }
+}
+
+/* CoAP PDU object access profile getter */
+static int _pdu_obj_prof(lua_State *L)
+{
+    const ud_coap_pdu_t *ud_pdu = (const ud_coap_pdu_t*)lua_touserdata(L, 1);
+
+    lua_pushinteger(L, (ud_pdu->access.lck ? -1 : _get_pdu_prof(ud_pdu)));
+    return 1;
+}
 
 /* CoAP PDU object methods dispatcher */
 static int _pdu_obj_dispacher(lua_State *L)
 {
-    /* base read access methods */
-    static const luaL_Reg r_funcs[] = {
-        {"get_type", l_coap_pdu_get_type},
-        {"get_code", l_coap_pdu_get_code},
-        {"get_msg_id", l_coap_pdu_get_msg_id},
-        {"get_token", l_coap_pdu_get_token},
-        {"options", l_coap_pdu_options},
-        {"get_option", l_coap_pdu_get_option},
-        {"get_uri_path", l_coap_pdu_get_uri_path},
-        {"qstr_params", l_coap_pdu_qstr_params},
-        {"get_qstr_param", l_coap_pdu_get_qstr_param},
-        {"get_payload", l_coap_pdu_get_payload},
-        {NULL, NULL}
-    };
+    __DECL_VARS();
+    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)ud;
 
-    /* base write access methods */
-    static const luaL_Reg w_funcs[] = {
-        {"set_type", l_coap_pdu_set_type},
-        {"set_code", l_coap_pdu_set_code},
-        {"set_msg_id", l_coap_pdu_set_msg_id},
-        {"set_token", l_coap_pdu_set_token},
-        {"set_option", l_coap_pdu_set_option},
-        {"set_uri_path", l_coap_pdu_set_uri_path},
-        {NULL, NULL}
-    };
+    if (ud_pdu->access.lck) {
+        return luaL_error(L,
+            "Object is locked and can not be accessed anymore");
+    }
+
+    __CHECK_FUNC_PUSH(_get_pdu_prof(ud_pdu));
+    return 1;
+}
+
+/* CoAP PDU object destructor */
+static int _pdu_obj_gc(lua_State *L)
+{
+    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)lua_touserdata(L, 1);
+
+    /* pooled handler's object; its connection object is released */
+    if (ud_pdu->access.pool) {
+        lua_pushnil(L);
+        lua_setiuservalue(L, 1, 2);
+        _objs_pool_recycle(L, MT_PDU);
+        return 0;
+    }
+
+    /* delete the PDU only in case it was created by new_msg() (or defer())
+       and has not been sent (sent messages are freed automatically by the
+       library) */
+    if ((ud_pdu->access.hndlr == ACS_NO_HNDLR ||
+        ud_pdu->access.hndlr == ACS_DFR_RESP) && !ud_pdu->access.lck)
+    {
+        coap_delete_pdu(ud_pdu->pdu);
+        log_debug("Unsent PDU object [%p] freed\n", ud_pdu);
+    }
+
+    /* deferred response refers to its session */
+    if (ud_pdu->access.hndlr == ACS_DFR_RESP)
+        coap_session_release(ud_pdu->session);
+    return 0;
+}
+
+/* connection object access profile getter */
+static int _conn_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_connection_t*)lua_touserdata(L, 1))->lck ? -1 : 0));
+    return 1;
+}
+
+/* connection object methods dispatcher */
+static int _conn_obj_dispacher(lua_State *L)
+{
+    __DECL_VARS();
+
+    if (((ud_connection_t*)ud)->lck) {
+        return luaL_error(L,
+            "Object is locked and can not be accessed anymore");
+    }
+
+    __CHECK_FUNC_PUSH(0);
+    return 1;
+}
+
+/* connection object destructor */
+static int _conn_obj_gc(lua_State *L)
+{
+    ud_connection_t *ud_conn = (ud_connection_t*)lua_touserdata(L, 1);
+
+    if (ud_conn->pool) {
+        _objs_pool_recycle(L, MT_CONNECTION);
+        return 0;
+    }
+
+    /* close the connection only in case it's eligible */
+    if (ud_conn->gc)
+    {
+        coap_session_t *session = ud_conn->session;
+        int polled = (coap_session_get_app_data(session) != NULL);
+
+        if (ud_conn->shared)
+            shr_remove(&_get_session_lib_ctx(session)->shr.tab, session);
+        coap_session_release(session);
+
+        /* the epoll registration is the last session's owner */
+        if (polled && session->ref == 1)
+            _poll_del_session(_get_session_lib_ctx(session), session);
+
+        log_debug("Connection object [%p] freed\n", ud_conn);
+    }
+    return 0;
+}
+
+/* endpoint object access profile getter */
+static int _ep_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_endpoint_t*)lua_touserdata(L, 1))->ep ? 0 : -1));
+    return 1;
+}
+
+/* endpoint object methods dispatcher */
+static int _ep_obj_dispacher(lua_State *L)
+{
+    __DECL_VARS();
+
+    if (!((ud_endpoint_t*)ud)->ep) {
+        return luaL_error(L,
+            "Endpoint is closed and can not be accessed anymore");
+    }
+
+    __CHECK_FUNC_PUSH(0);
+    return 1;
+}
+
+/* endpoint object destructor */
+static int _ep_obj_gc(lua_State *L)
+{
+    /* endpoint is owned by its library context */
+    return 0;
+}
+
+/*
+ * Resource object access profile getter (see _get_self()). Pushes 0 (the only
+ * profile) or -1 if the resource is closed (close()).
+ */
+static int _rsrc_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_resource_t*)lua_touserdata(L, 1))->rsrc ? 0 : -1));
+    return 1;
+}
+
+/**
+ * Resource object methods dispatcher (__index metamethod). Raises an error
+ * if the resource is closed (close()).
+ *
+ * Lua arguments:
+ *     obj [userdata]: Resource object.
+ *     name [string]: Method name.
+ *
+ * Lua return:
+ *     method [function]: Object's method.
+ */
+static int _rsrc_obj_dispacher(lua_State *L)
+{
+    __DECL_VARS();
+
+    if (!((ud_resource_t*)ud)->rsrc) {
+        return luaL_error(L,
+            "Resource is closed and can not be accessed anymore");
+    }
+
+    __CHECK_FUNC_PUSH(0);
+    return 1;
+}
+
+/**
+ * Resource object destructor (__gc metamethod). Closes the resource if not
+ * closed yet (observers are dropped with no notification).
+ *
+ * Lua arguments:
+ *     obj [userdata]: Resource object.
+ *
+ * Lua return: None
+ */
+static int _rsrc_obj_gc(lua_State *L)
+{
+    ud_resource_t *ud_rsrc = (ud_resource_t*)lua_touserdata(L, 1);
+
+    /* resource gone with no close(); observers are silently dropped */
+    if (ud_rsrc->rsrc)
+        _rsrc_close(L, ud_rsrc, 1);
+    return 0;
+}
+
+/*
+ * Subscription object access profile getter (see _get_self()). Pushes 0
+ * (the only profile) or -1 if the subscription is cancelled.
+ */
+static int _sub_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_subscription_t*)lua_touserdata(L, 1))->sub ? 0 : -1));
+    return 1;
+}
+
+/**
+ * Subscription object methods dispatcher (__index metamethod). Raises an
+ * error if the subscription is cancelled.
+ *
+ * Lua arguments:
+ *     obj [userdata]: Subscription object.
+ *     name [string]: Method name.
+ *
+ * Lua return:
+ *     method [function]: Object's method.
+ */
+static int _sub_obj_dispacher(lua_State *L)
+{
+    __DECL_VARS();
+
+    if (!((ud_subscription_t*)ud)->sub) {
+        return luaL_error(L,
+            "Subscription is closed and can not be accessed anymore");
+    }
+
+    __CHECK_FUNC_PUSH(0);
+    return 1;
+}
 
-    /* all handlers (common) read access methods */
-    static const luaL_Reg r_cmnh_funcs[] = {
-        {"get_connection", l_coap_pdu_get_connection},
-        {NULL, NULL}
-    };
+/**
+ * Subscription object destructor (__gc metamethod). Closes the subscription
+ * if not cancelled yet.
+ *
+ * Lua arguments:
+ *     obj [userdata]: Subscription object.
+ *
+ * Lua return: None
+ */
+static int _sub_obj_gc(lua_State *L)
+{
+    ud_subscription_t *ud_sub = (ud_subscription_t*)lua_touserdata(L, 1);
 
-    /* request handler write access specfic methods */
-    static const luaL_Reg w_reqh_funcs[] = {
-        {"send", l_coap_pdu_send_reqh},
-        {NULL, NULL}
-    };
+    /* active subscription is anchored in the registry, therefore it may be
+       collected on the Lua state closure only */
+    if (ud_sub->sub) {
+        _sub_close(L, _get_session_lib_ctx(ud_sub->sub->session), ud_sub->sub);
+    }
+    return 0;
+}
 
-    /* response/NACK handler has no write access specific methods */
-    static const luaL_Reg null_funcs[] = {
-        {NULL, NULL}
-    };
+/*
+ * Timer object access profile getter (see _get_self()). Pushes 0 (the only
+ * profile) or -1 if the timer has fired (one-shot) or is cancelled.
+ */
+static int _tmr_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_timer_t*)lua_touserdata(L, 1))->tmr ? 0 : -1));
+    return 1;
+}
 
+/**
+ * Timer object methods dispatcher (__index metamethod). Raises an error
+ * if the timer has fired (one-shot) or is cancelled.
+ *
+ * Lua arguments:
+ *     obj [userdata]: Timer object.
+ *     name [string]: Method name.
+ *
+ * Lua return:
+ *     method [function]: Object's method.
+ */
+static int _tmr_obj_dispacher(lua_State *L)
+{
     __DECL_VARS();
-    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)ud;
 
-    do {
-        if (ud_pdu->access.lck) {
-            return luaL_error(L,
-                "Object is locked and can not be accessed anymore");
-        }
+    if (!((ud_timer_t*)ud)->tmr) {
+        return luaL_error(L,
+            "Timer is closed and can not be accessed anymore");
+    }
 
-        /* read access
-         */
+    __CHECK_FUNC_PUSH(0);
+    return 1;
+}
 
-        /* base read access methods are common for all types of objects */
-        if ((f = _get_func(fname, r_funcs)) != NULL) break;
+/**
+ * Timer object destructor (__gc metamethod). Closes the timer if still
+ * armed.
+ *
+ * Lua arguments:
+ *     obj [userdata]: Timer object.
+ *
+ * Lua return: None
+ */
+static int _tmr_obj_gc(lua_State *L)
+{
+    ud_timer_t *ud_tmr = (ud_timer_t*)lua_touserdata(L, 1);
 
-        switch (ud_pdu->access.hndlr)
-        {
-        case ACS_REQ_HNDLR:
-        case ACS_RESP_HNDLR:
-        case ACS_NACK_HNDLR:
-            f = _get_func(fname, r_cmnh_funcs);
-            break;
-        }
-        if (f != NULL) break;
+    /* armed timer is anchored in the registry, therefore it may be
+       collected on the Lua state closure only */
+    if (ud_tmr->tmr)
+        _tmr_close(L, _get_obj_lib_ctx(L, 1), ud_tmr->tmr);
+    return 0;
+}
 
-        /* write access
-         */
-        if (ud_pdu->access.ro) break;
+/*
+ * Connection pool object access profile getter (see _get_self()). Pushes 0
+ * (the only profile) or -1 if the pool is closed (close()).
+ */
+static int _pool_obj_prof(lua_State *L)
+{
+    lua_pushinteger(L,
+        (((const ud_pool_t*)lua_touserdata(L, 1))->closed ? -1 : 0));
+    return 1;
+}
 
-        if ((f = _get_func(fname, w_funcs)) != NULL) break;
+/**
+ * Connection pool object methods dispatcher (__index metamethod). Raises
+ * an error if the pool is closed (close()).
+ *
+ * Lua arguments:
+ *     obj [userdata]: Connection pool object.
+ *     name [string]: Method name.
+ *
+ * Lua return:
+ *     method [function]: Object's method.
+ */
+static int _pool_obj_dispacher(lua_State *L)
+{
+    __DECL_VARS();
 
-        switch (ud_pdu->access.hndlr)
-        {
-        case ACS_REQ_HNDLR:
-            f = _get_func(fname, w_reqh_funcs);
-            break;
-        case ACS_RESP_HNDLR:
-        case ACS_NACK_HNDLR:
-            f = _get_func(fname, null_funcs);
-            break;
-        }
-        if (f != NULL) break;
+    if (((ud_pool_t*)ud)->closed) {
+        return luaL_error(L,
+            "Pool is closed and can not be accessed anymore");
     }
-    while (0);
 
-    __CHECK_FUNC_PUSH();
+    __CHECK_FUNC_PUSH(0);
     return 1;
 }
 
-/* CoAP PDU object destructor */
-static int _pdu_obj_gc(lua_State *L)
+/**
+ * Connection pool object destructor (__gc metamethod). Closes the pool if
+ * not closed yet (pooled connections are released).
+ *
+ * Lua arguments:
+ *     obj [userdata]: Connection pool object.
+ *
+ * Lua return: None
+ */
+static int _pool_obj_gc(lua_State *L)
 {
-    ud_coap_pdu_t *ud_pdu = (ud_coap_pdu_t*)lua_touserdata(L, 1);
+    ud_pool_t *pool = (ud_pool_t*)lua_touserdata(L, 1);
 
-    /* delete the PDU only in case it was created by new_msg() and has not
-       been sent (sent messages are freed automatically by the library) */
-    if (ud_pdu->access.hndlr == ACS_NO_HNDLR && !ud_pdu->access.lck) {
-        coap_delete_pdu(ud_pdu->pdu);
-        log_debug("Unsent PDU object [%p] freed\n", ud_pdu);
-    }
+    if (!pool->closed)
+        _pool_close(L, _get_obj_lib_ctx(L, 1), pool);
     return 0;
 }
 
-/* connection object methods dispatcher */
-static int _conn_obj_dispacher(lua_State *L)
+/* library context object access profile getter */
+static int _ctx_obj_prof(lua_State *L)
 {
-    static const luaL_Reg funcs[] = {
-        {"get_addr", l_coap_conn_get_addr},
-        {"get_port", l_coap_conn_get_port},
-        {"get_max_pdu_size", l_coap_conn_get_max_pdu_size},
-        {"get_max_retransmit", l_coap_conn_get_max_retransmit},
-        {"set_max_retransmit", l_coap_conn_set_max_retransmit},
-        {"get_ack_timeout", l_coap_conn_get_ack_timeout},
-        {"set_ack_timeout", l_coap_conn_set_ack_timeout},
-        {"send", l_coap_conn_send},
-        {NULL, NULL}
-    };
+    lua_pushinteger(L,
+        (((const lib_ctx_t*)lua_touserdata(L, 1))->coap.ctx ? 0 : -1));
+    return 1;
+}
 
+/* library context object methods dispatcher */
+static int _ctx_obj_dispacher(lua_State *L)
+{
     __DECL_VARS();
 
-    f = _get_func(fname, funcs);
-    __CHECK_FUNC_PUSH();
+    if (!((lib_ctx_t*)ud)->coap.ctx)
+        return luaL_error(L, "Library context not initialized");
 
+    __CHECK_FUNC_PUSH(0);
     return 1;
 }
 
-/* connection object destructor */
-static int _conn_obj_gc(lua_State *L)
-{
-    ud_connection_t *ud_conn = (ud_connection_t*)lua_touserdata(L, 1);
+#undef __CHECK_FUNC_PUSH
+#undef __DECL_VARS
 
-    /* close the connection only in case it's eligible */
-    if (ud_conn->gc) {
-        coap_session_release(ud_conn->session);
-        log_debug("Connection object [%p] freed\n", ud_conn);
+/* get mask of access profiles providing method 'func' */
+static lua_Integer _method_profs(
+    const luaL_Reg ***profs, lua_CFunction func)
+{
+    int i, j;
+    lua_Integer mask = 0;
+    const luaL_Reg *funcs;
+
+    for (i = 0; profs[i]; i++) {
+        for (j = 0; (funcs = profs[i][j]) != NULL; j++) {
+            for (; funcs->name; funcs++) {
+                if (funcs->func == func)
+                    mask |= (lua_Integer)1 << i;
+            }
+        }
     }
-    return 0;
+    return mask;
 }
 
-#undef __CHECK_FUNC_PUSH
-#undef __DECL_VARS
+/*
+ * Create array of methods tables (one per object access profile) for a
+ * metatable on the stack top. Methods are created as C-closures with the
+ * metatable, mask of access profiles providing the method and the objects
+ * profile getter as their upvalues (see _get_self()). The array is left on
+ * the stack.
+ */
+static void _new_methods_tabs(
+    lua_State *L, const luaL_Reg ***profs, lua_CFunction obj_prof)
+{
+    int i, j;
+    const luaL_Reg *funcs;
+
+    lua_newtable(L);
+
+    for (i = 0; profs[i]; i++)
+    {
+        lua_newtable(L);
+
+        for (j = 0; (funcs = profs[i][j]) != NULL; j++) {
+            for (; funcs->name; funcs++) {
+                lua_pushvalue(L, -3);
+                lua_pushinteger(L, _method_profs(profs, funcs->func));
+                lua_pushcfunction(L, obj_prof);
+                lua_pushcclosure(L, funcs->func, 3);
+                lua_setfield(L, -2, funcs->name);
+            }
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+}
 
 /*
  * Create and initialize object's metatable:
@@ -2242,6 +6691,7 @@ static int _conn_obj_gc(lua_State *L)
  * 2. Set destructor method.
  */
 static void _set_obj_metatable(lua_State *L, const char *tname,
+    const luaL_Reg ***profs, lua_CFunction obj_prof,
     lua_CFunction obj_dispatcher, lua_CFunction obj_gc)
 {
     if (luaL_newmetatable(L, tname)) {
@@ -2249,11 +6699,16 @@ static void _set_obj_metatable(lua_State *L, const char *tname,
          * metatable.__index = obj_dispatcher
          * metatable.__gc = obj_gc
          *
-         * NOTE: Dispatcher upvalue set to the metatable name as light-userdata.
+         * NOTE: Dispatcher upvalues set to the metatable name as light-userdata,
+         * prebuilt methods tables and dispatch mode (see __DECL_VARS).
          */
         lua_pushstring(L, "__index");
         lua_pushlightuserdata(L, (void*)tname);
-        lua_pushcclosure(L, obj_dispatcher, 1);
+        lua_pushvalue(L, -3);
+        _new_methods_tabs(L, profs, obj_prof);
+        lua_remove(L, -2);
+        lua_pushinteger(L, DISP_CLOSURE);
+        lua_pushcclosure(L, obj_dispatcher, 3);
         lua_settable(L, -3);
 
         lua_pushstring(L, "__gc");
@@ -2263,21 +6718,109 @@ static void _set_obj_metatable(lua_State *L, const char *tname,
     lua_pop(L, 1);
 }
 
-/* initialize library context */
+/* set dispatch mode for objects of a given metatable */
+static void _set_obj_dispatch_mode(lua_State *L, const char *tname, int mode)
+{
+    luaL_getmetatable(L, tname);
+    lua_getfield(L, -1, "__index");
+    lua_pushinteger(L, mode);
+    lua_setupvalue(L, -2, 3);
+    lua_pop(L, 2);
+}
+
+/**
+ * Get objects methods dispatch mode.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     mode [int]: Dispatch mode (DispatchMode enum).
+ */
+int l_coap_get_dispatch_mode(lua_State *L)
+{
+    luaL_getmetatable(L, MT_PDU);
+    lua_getfield(L, -1, "__index");
+    lua_getupvalue(L, -1, 3);
+    return 1;
+}
+
+/**
+ * Set objects (CoAP PDU, connection, endpoint, context) methods dispatch
+ * mode.
+ *
+ * NOTE: In DispatchMode.CACHED mode methods are resolved from tables prebuilt
+ *     per object access profile and no allocation takes place on a method
+ *     call. The mode requires obj:method() call syntax; obj.method() is not
+ *     supported.
+ *
+ * Lua arguments:
+ *     mode [int]: Dispatch mode (DispatchMode enum). DispatchMode.CLOSURE by
+ *         default.
+ *
+ * Lua return: None
+ */
+int l_coap_set_dispatch_mode(lua_State *L)
+{
+    int mode = luaL_checkinteger(L, 1);
+
+    if (mode != DISP_CLOSURE && mode != DISP_CACHED)
+        return luaL_error(L, "Invalid dispatch mode %d", mode);
+
+    _set_obj_dispatch_mode(L, MT_PDU, mode);
+    _set_obj_dispatch_mode(L, MT_CONNECTION, mode);
+    _set_obj_dispatch_mode(L, MT_ENDPOINT, mode);
+    _set_obj_dispatch_mode(L, MT_RESOURCE, mode);
+    _set_obj_dispatch_mode(L, MT_SUBSCRIPTION, mode);
+    _set_obj_dispatch_mode(L, MT_TIMER, mode);
+    _set_obj_dispatch_mode(L, MT_POOL, mode);
+    _set_obj_dispatch_mode(L, MT_CONTEXT, mode);
+    return 0;
+}
+
+/*
+ * Initialize library context. The context userdata is expected on the stack
+ * top.
+ */
 static void _init_lib_ctx(lib_ctx_t *lib_ctx, lua_State *L)
 {
     memset(lib_ctx, 0, sizeof(lib_ctx_t));
+
+    /* libcoap handlers are called in the main thread of the Lua state */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lib_ctx->L = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
     lib_ctx->cfg.max_pdu_sz = MAX_COAP_PDU_SIZE;
+    lib_ctx->ev.epfd = -1;
+    lib_ctx->poll.epfd = -1;
     lib_ctx->ref.reqh = LUA_NOREF;
     lib_ctx->ref.resph = LUA_NOREF;
     lib_ctx->ref.nackh = LUA_NOREF;
+    lib_ctx->ref.chunkh = LUA_NOREF;
+    lib_ctx->ref.logh = LUA_NOREF;
+    lib_ctx->res.wait_ref = LUA_NOREF;
+    blk_cache_init(&lib_ctx->blk);
+
+    /* workers bind their endpoints to the same port */
+    lib_ctx->cfg.reuse_port =
+        (lua_getfield(L, LUA_REGISTRYINDEX, REG_WORKER_ID) != LUA_TNIL);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lib_ctx->pool.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    lib_ctx->pool.conn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    /* endpoints objects set is kept as the context's user value */
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
 
     if (!(lib_ctx->coap.ctx = coap_new_context(NULL))) {
         luaL_error(L, "coap_new_context() failed");
     }
 
-    /* CoAP context is associated with its Lua state */
-    coap_set_app_data(lib_ctx->coap.ctx, L);
+    /* CoAP context is associated with its library context */
+    coap_set_app_data(lib_ctx->coap.ctx, lib_ctx);
 
     coap_register_nack_handler(lib_ctx->coap.ctx, _coap_nack_hndlr);
 
@@ -2300,6 +6843,7 @@ static void _init_lib_ctx(lib_ctx_t *lib_ctx, lua_State *L)
 /* free library context */
 static int _free_lib_ctx(lua_State *L)
 {
+    tmr_t *tmr;
     lib_ctx_t *lib_ctx = (lib_ctx_t*)lua_touserdata(L, 1);
 
     if (lib_ctx->ref.reqh != LUA_NOREF) {
@@ -2317,9 +6861,58 @@ static int _free_lib_ctx(lua_State *L)
         lib_ctx->ref.nackh = LUA_NOREF;
     }
 
-    if (lib_ctx->coap.ep) {
-        coap_free_endpoint(lib_ctx->coap.ep);
-        lib_ctx->coap.ep = NULL;
+    if (lib_ctx->ref.chunkh != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->ref.chunkh);
+        lib_ctx->ref.chunkh = LUA_NOREF;
+    }
+
+    _free_log_sink(L, lib_ctx);
+
+    blk_cache_clear(L, &lib_ctx->blk);
+
+    /* observers and subscriptions refer to their sessions */
+    while (lib_ctx->obs)
+        obs_rsrc_free(&lib_ctx->obs, lib_ctx->obs);
+
+    while (lib_ctx->subs.list)
+        _sub_close(L, lib_ctx, lib_ctx->subs.list);
+    obs_sub_clear(&lib_ctx->subs);
+
+    rt_free(L, lib_ctx->routes);
+    lib_ctx->routes = NULL;
+
+    while ((tmr = tmr_any(&lib_ctx->tmrs)))
+        _tmr_close(L, lib_ctx, tmr);
+
+    while (lib_ctx->pools)
+        _pool_close(L, lib_ctx, lib_ctx->pools);
+
+    pnd_clear(L, &lib_ctx->reqs);
+
+    shr_clear(&lib_ctx->shr.tab);
+
+    /* coroutines awaiting names resolutions are never resumed */
+    if (lib_ctx->res.wait_ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->res.wait_ref);
+        lib_ctx->res.wait_ref = LUA_NOREF;
+    }
+
+    if (lib_ctx->res.ctx) {
+        res_free(lib_ctx->res.ctx);
+        lib_ctx->res.ctx = NULL;
+    }
+
+    /* objects finalized afterwards are not recycled */
+    if (lib_ctx->pool.ref != LUA_NOREF) {
+        _objs_pool_resize(L, lib_ctx->pool.ref, 0);
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->pool.ref);
+        lib_ctx->pool.ref = LUA_NOREF;
+    }
+
+    if (lib_ctx->pool.conn_ref != LUA_NOREF) {
+        _objs_pool_resize(L, lib_ctx->pool.conn_ref, 0);
+        luaL_unref(L, LUA_REGISTRYINDEX, lib_ctx->pool.conn_ref);
+        lib_ctx->pool.conn_ref = LUA_NOREF;
     }
 
     if (lib_ctx->coap.rsrc) {
@@ -2327,6 +6920,19 @@ static int _free_lib_ctx(lua_State *L)
         lib_ctx->coap.rsrc = NULL;
     }
 
+    if (lib_ctx->io.mmsg) {
+        mmsg_free(lib_ctx->io.mmsg);
+        lib_ctx->io.mmsg = NULL;
+    }
+
+    if (lib_ctx->ev.epfd >= 0) {
+        close(lib_ctx->ev.epfd);
+        lib_ctx->ev.epfd = -1;
+    }
+
+    /* release sessions referenced by the epoll registration */
+    _poll_set_mode(L, lib_ctx, POLL_SELECT);
+
     if (lib_ctx->coap.ctx) {
         coap_free_context(lib_ctx->coap.ctx);
         lib_ctx->coap.ctx = NULL;
@@ -2341,6 +6947,171 @@ static int _free_lib_ctx(lua_State *L)
     return 0;
 }
 
+/**
+ * Create a new library context. The context is independent of the library
+ * default one (used by the library functions) and has its own CoAP endpoint,
+ * handlers and configuration. The context object provides the same methods as
+ * the library functions it is bound to (see ctx_funcs[]), e.g. bind_server(),
+ * new_connection(), process_step().
+ *
+ * NOTE: The context is freed when garbage collected. Handlers set for the
+ *     context are referenced by the Lua registry, therefore a handler
+ *     referencing its context object extends the context lifetime up to the
+ *     Lua state lifetime.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     ctx [userdata]: Library context object.
+ */
+int l_coap_new_context(lua_State *L)
+{
+    lib_ctx_t *lib_ctx = (lib_ctx_t*)lua_newuserdata(L, sizeof(lib_ctx_t));
+    _init_lib_ctx(lib_ctx, L);
+    luaL_setmetatable(L, MT_CONTEXT);
+
+    log_debug("New library context object [%p] created\n", lib_ctx);
+
+    return 1;
+}
+
+/* worker thread */
+typedef struct
+{
+    pthread_t thrd;
+    int id;
+    int err;
+
+    /* script and its arguments */
+    const char *script;
+    const char **args;
+    int n_args;
+} worker_t;
+
+/* worker thread routine; runs the worker's script in its own Lua state */
+static void *_worker_thrd(void *arg)
+{
+    int i;
+    worker_t *wrk = (worker_t*)arg;
+    lua_State *L = luaL_newstate();
+
+    if (!L) {
+        log_error("Worker %d: Can't create Lua state\n", wrk->id);
+        wrk->err = 1;
+        return NULL;
+    }
+    luaL_openlibs(L);
+
+    /* mark the Lua state as a worker one */
+    lua_pushinteger(L, wrk->id);
+    lua_setfield(L, LUA_REGISTRYINDEX, REG_WORKER_ID);
+
+    log_debug("Worker %d started for Lua state %p\n", wrk->id, L);
+
+    if (luaL_loadfile(L, wrk->script) == LUA_OK) {
+        for (i = 0; i < wrk->n_args; i++)
+            lua_pushstring(L, wrk->args[i]);
+
+        if (lua_pcall(L, wrk->n_args, 0, 0) != LUA_OK)
+            wrk->err = 1;
+    } else {
+        wrk->err = 1;
+    }
+
+    if (wrk->err)
+        log_error("Worker %d: %s\n", wrk->id, lua_tostring(L, -1));
+
+    lua_close(L);
+    log_debug("Worker %d finished\n", wrk->id);
+
+    return NULL;
+}
+
+/**
+ * Run multi-core server workers. Each worker is an OS thread with its own Lua
+ * state running the same script. Library default context of a worker binds
+ * its endpoints with SO_REUSEPORT option set (see bind_server()), therefore
+ * all workers may be bound to the same port and the kernel spreads incoming
+ * datagrams across them. The routine blocks until all the workers finish.
+ *
+ * NOTE: Workers' Lua states are independent of each other and of the calling
+ *     Lua state, therefore they don't share any Lua data.
+ *
+ * Lua arguments:
+ *     n [int]: Number of workers (> 0).
+ *     script [string]: Path of the script run by workers.
+ *     arg(s) [string(s)|none]: 0 or more arguments passed to the script (as
+ *         its vararg expression).
+ *
+ * Lua return:
+ *     n_err [int]: Number of workers finished with an error.
+ */
+int l_coap_run_workers(lua_State *L)
+{
+    int i, n_err = 0, n_args;
+    worker_t *wrks;
+    const char **args;
+
+    int n = luaL_checkinteger(L, 1);
+    const char *script = luaL_checkstring(L, 2);
+
+    if (n <= 0)
+        return luaL_error(L, "Invalid number of workers %d", n);
+
+    n_args = lua_gettop(L) - 2;
+    args = (const char**)lua_newuserdata(L, (n_args + 1) * sizeof(*args));
+    for (i = 0; i < n_args; i++)
+        args[i] = luaL_checkstring(L, i+3);
+
+    wrks = (worker_t*)lua_newuserdata(L, n * sizeof(worker_t));
+    memset(wrks, 0, n * sizeof(worker_t));
+
+    for (i = 0; i < n; i++)
+    {
+        wrks[i].id = i;
+        wrks[i].script = script;
+        wrks[i].args = args;
+        wrks[i].n_args = n_args;
+
+        if (pthread_create(&wrks[i].thrd, NULL, _worker_thrd, &wrks[i])) {
+            log_error("pthread_create() failed for worker %d\n", i);
+            break;
+        }
+    }
+    n_err = n - i;
+
+    /* wait for started workers */
+    for (n = i, i = 0; i < n; i++) {
+        pthread_join(wrks[i].thrd, NULL);
+        if (wrks[i].err) n_err++;
+    }
+
+    lua_pushinteger(L, n_err);
+    return 1;
+}
+
+/**
+ * Get worker id.
+ *
+ * Lua arguments: None
+ *
+ * Lua return:
+ *     id [int|nil]: Worker id (0-based) of the Lua state running this routine,
+ *         nil if not a worker's Lua state (see run_workers()).
+ */
+int l_coap_get_worker_id(lua_State *L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_WORKER_ID);
+    return 1;
+}
+
+/* libcoap process-wide initialization */
+static void _init_coap(void)
+{
+    coap_startup();
+    coap_set_log_handler(_coap_log_hndlr);
+}
+
 /* contains initialization script as 'init_code' definition */
 #define MOD_INIT_SCRIPT_HDR_STR XSTR(MOD_INIT_SCRIPT_HDR)
 #include MOD_INIT_SCRIPT_HDR_STR
@@ -2350,58 +7121,88 @@ static int _free_lib_ctx(lua_State *L)
  */
 int MOD_INIT_NAME(lua_State *L)
 {
+    lib_ctx_t *lib_ctx;
+
     static const luaL_Reg lib_funcs[] = {
         {"bind_server", l_coap_bind_server},
+        {"get_endpoints", l_coap_get_endpoints},
         {"new_connection", l_coap_new_connection},
+        {"connect", l_coap_connect},
+        {"connection_pool", l_coap_connection_pool},
+        {"new_resource", l_coap_new_resource},
+        {"timer", l_coap_timer},
         {"new_msg", l_coap_new_msg},
         {"process_step", l_coap_process_step},
+        {"process_ready", l_coap_process_ready},
+        {"get_fd", l_coap_get_fd},
+        {"get_next_timeout", l_coap_get_next_timeout},
         {"get_libcoap_log_level", l_coap_get_libcoap_log_level},
         {"set_libcoap_log_level", l_coap_set_libcoap_log_level},
+        {"get_log_level", l_coap_get_log_level},
+        {"set_log_level", l_coap_set_log_level},
+        {"set_log_sink", l_coap_set_log_sink},
+        {"get_log_ring", l_coap_get_log_ring},
+        {"flush_log", l_coap_flush_log},
         {"get_req_handler", l_coap_get_req_handler},
         {"set_req_handler", l_coap_set_req_handler},
         {"get_resp_handler", l_coap_get_resp_handler},
         {"set_resp_handler", l_coap_set_resp_handler},
         {"get_nack_handler", l_coap_get_nack_handler},
         {"set_nack_handler", l_coap_set_nack_handler},
+        {"route", l_coap_route},
         {"set_max_pdu_size", l_coap_set_max_pdu_size},
+        {"set_obj_pool_size", l_coap_set_obj_pool_size},
+        {"set_io_batch", l_coap_set_io_batch},
+        {"set_shared_sockets", l_coap_set_shared_sockets},
+        {"set_poll_mode", l_coap_set_poll_mode},
+        {"set_dns_ttl", l_coap_set_dns_ttl},
+        {"set_block_transfer", l_coap_set_block_transfer},
+        {"set_block_upload", l_coap_set_block_upload},
+        {"get_dispatch_mode", l_coap_get_dispatch_mode},
+        {"set_dispatch_mode", l_coap_set_dispatch_mode},
+        {"new_context", l_coap_new_context},
+        {"new_buffer", l_coap_new_buffer},
+        {"run_workers", l_coap_run_workers},
+        {"get_worker_id", l_coap_get_worker_id},
         {NULL, NULL}
     };
 
-    /* init libcoap (reinit safe) */
-    coap_startup();
-
-    /* set objects metatables */
-    _set_obj_metatable(L, MT_PDU, _pdu_obj_dispacher, _pdu_obj_gc);
-    _set_obj_metatable(L, MT_CONNECTION, _conn_obj_dispacher, _conn_obj_gc);
-
-    /* create the library context (as a userdata with its metatable) */
-    if (luaL_newmetatable(L, MT_CONTEXT))
-    {
-        lib_ctx_t *lib_ctx = (lib_ctx_t*)lua_newuserdata(L, sizeof(lib_ctx_t));
-        _init_lib_ctx(lib_ctx, L);
-
-        /* swap userdata with metatable pushed on the stack */
-        lua_insert(L, -2);
-
-        /* set destructor for the library context */
-        lua_pushstring(L, "__gc");
-        lua_pushcfunction(L, _free_lib_ctx);
-        lua_settable(L, -3);
-
-        /* associate metatable with the userdata (pops the metatable) */
-        lua_setmetatable(L, -2);
+    /* init libcoap (once per process, since workers' Lua states are
+       initialized concurrently) */
+    static pthread_once_t coap_init = PTHREAD_ONCE_INIT;
+    pthread_once(&coap_init, _init_coap);
 
-        /* add library context pointer to registry */
-        lua_pushstring(L, MT_CONTEXT);
-        lua_pushlightuserdata(L, lib_ctx);
-        lua_settable(L, LUA_REGISTRYINDEX);
+    buffer_open(L);
 
-        /* create a reference to the library context userdata extending
-           its lifetime up to the Lua state lifetime (pops the userdata) */
-        luaL_ref(L, LUA_REGISTRYINDEX);
-    } else {
-        lua_pop(L, 1);
-    }
+    /* set objects metatables */
+    _set_obj_metatable(L, MT_PDU,
+        pdu_profs, _pdu_obj_prof, _pdu_obj_dispacher, _pdu_obj_gc);
+    _set_obj_metatable(L, MT_CONNECTION,
+        conn_profs, _conn_obj_prof, _conn_obj_dispacher, _conn_obj_gc);
+
+    _set_obj_metatable(L, MT_ENDPOINT,
+        ep_profs, _ep_obj_prof, _ep_obj_dispacher, _ep_obj_gc);
+    _set_obj_metatable(L, MT_RESOURCE,
+        rsrc_profs, _rsrc_obj_prof, _rsrc_obj_dispacher, _rsrc_obj_gc);
+    _set_obj_metatable(L, MT_SUBSCRIPTION,
+        sub_profs, _sub_obj_prof, _sub_obj_dispacher, _sub_obj_gc);
+    _set_obj_metatable(L, MT_TIMER,
+        tmr_profs, _tmr_obj_prof, _tmr_obj_dispacher, _tmr_obj_gc);
+    _set_obj_metatable(L, MT_POOL,
+        pool_profs, _pool_obj_prof, _pool_obj_dispacher, _pool_obj_gc);
+    _set_obj_metatable(L, MT_CONTEXT,
+        ctx_profs, _ctx_obj_prof, _ctx_obj_dispacher, _free_lib_ctx);
+
+    /* create the library default context (as a userdata with its
+       metatable) */
+    lib_ctx = (lib_ctx_t*)lua_newuserdata(L, sizeof(lib_ctx_t));
+    _init_lib_ctx(lib_ctx, L);
+    luaL_setmetatable(L, MT_CONTEXT);
+
+    /* create a reference to the library context userdata extending
+       its lifetime up to the Lua state lifetime */
+    lua_pushvalue(L, -1);
+    luaL_ref(L, LUA_REGISTRYINDEX);
 
     /* call the library initial code */
     if (luaL_loadbuffer(
@@ -2411,8 +7212,11 @@ int MOD_INIT_NAME(lua_State *L)
     }
     lua_call(L, 0, 0);
 
-    /* register library public interface */
-    luaL_newlib(L, lib_funcs);
+    /* register library public interface; the library context userdata
+       (on the stack top) is set as the upvalue of the library functions */
+    luaL_newlibtable(L, lib_funcs);
+    lua_insert(L, -2);
+    luaL_setfuncs(L, lib_funcs, 1);
 
     log_debug(MOD_NAME_STR " library context initialized for Lua state %p\n", L);
 
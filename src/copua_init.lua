@@ -165,6 +165,63 @@ NackReasonCode = {
     NACK_NOT_DELIVERABLE = 1,
     NACK_RST = 2,
     NACK_TLS_FAILED = 3,
-    NACK_ICMP_ISSUE = 4
+    NACK_ICMP_ISSUE = 4,
+
+    -- request() timeout (library specific)
+    NACK_TIMEOUT = -1
 }
 NackReasonCodeName = _make_rev(NackReasonCode)
+
+--
+-- Objects methods dispatch modes
+--
+DispatchMode = {
+    CLOSURE = 0,
+    CACHED = 1
+}
+DispatchModeName = _make_rev(DispatchMode)
+
+--
+-- CoAP processing poll modes
+--
+PollMode = {
+    SELECT = 0,
+    EPOLL = 1,
+    EPOLL_ET = 2,
+    URING = 3
+}
+PollModeName = _make_rev(PollMode)
+
+--
+-- Library log levels
+--
+LogLevel = {
+    ERROR = 0,
+    WARN = 1,
+    INFO = 2,
+    NOTE = 3,
+    DEBUG = 4
+}
+LogLevelName = _make_rev(LogLevel)
+
+--
+-- Library log sinks
+--
+LogSink = {
+    STDOUT = 0,
+    FILE = 1,
+    FUNC = 2,
+    RING = 3,
+    TRACE = 4
+}
+LogSinkName = _make_rev(LogSink)
+
+--
+-- Bytes representation types
+--
+BytesType = {
+    STRING = 0,
+    ARRAY = 1,
+    BUFFER = 2
+}
+BytesTypeName = _make_rev(BytesType)
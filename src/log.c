@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+__thread int log_level = LOG_LEVEL;
+
+/* in-memory ring of messages */
+typedef struct
+{
+    unsigned n;         /* ring size */
+    unsigned head;      /* oldest message */
+    unsigned cnt;       /* number of messages */
+    char lines[][LOG_LINE_MAX];
+} log_ring_t;
+
+#define REC_MSG     0
+#define REC_PDU     1
+
+/* trace record */
+typedef struct
+{
+    struct timespec ts;
+    uint8_t level;
+    uint8_t type;
+
+    union {
+        char msg[LOG_REC_MSG_MAX];
+
+        struct {
+            char hndlr_name[8];
+            uint8_t recv;
+            uint8_t type;
+            uint8_t code;
+            uint8_t token_len;
+            uint16_t msg_id;
+            uint16_t port;
+            uint8_t token[8];
+            uint8_t family;
+            uint8_t addr[16];
+        } pdu;
+    };
+} log_rec_t;
+
+/*
+ * Trace records ring. There is a single producer (thread owning the sink)
+ * writing records with no locking. Consumers (log_flush() and the flush
+ * thread) are serialized by a mutex.
+ */
+typedef struct
+{
+    unsigned n;                 /* ring size */
+    atomic_ulong head;          /* next record to write (producer) */
+    atomic_ulong tail;          /* next record to read (consumer) */
+    atomic_ulong dropped;       /* number of dropped records */
+
+    FILE *f;
+    pthread_mutex_t cons_lck;
+
+    /* flush thread */
+    struct {
+        int on;
+        int stop;
+        unsigned ms;
+        pthread_t thrd;
+        pthread_mutex_t lck;
+        pthread_cond_t cond;
+    } flush;
+
+    log_rec_t recs[];
+} log_trace_t;
+
+/* per thread sink */
+static __thread struct
+{
+    int type;
+    void *owner;
+    FILE *f;
+    struct {
+        log_func_t func;
+        void *arg;
+    } func;
+    log_ring_t *ring;
+    log_trace_t *trace;
+} sink;
+
+static void _free_trace(log_trace_t *trace);
+
+/* get next free trace record; NULL if the ring is full */
+static log_rec_t *_trace_rec_get(log_trace_t *trace, int level, int type)
+{
+    log_rec_t *rec;
+    unsigned long h = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    if (h - atomic_load_explicit(&trace->tail, memory_order_acquire) >=
+        trace->n)
+    {
+        atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    rec = &trace->recs[h % trace->n];
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->level = level;
+    rec->type = type;
+
+    return rec;
+}
+
+/* publish record got by _trace_rec_get() to consumers */
+static void _trace_rec_put(log_trace_t *trace)
+{
+    atomic_fetch_add_explicit(&trace->head, 1, memory_order_release);
+}
+
+static const char *lvl_pfx[] =
+    {"[ERR] ", "[WRN] ", "[INF] ", "[NOTE] ", "[DBG] "};
+
+/* release resources of the current sink */
+static void _free_sink(void)
+{
+    if (sink.f) {
+        fclose(sink.f);
+        sink.f = NULL;
+    }
+    if (sink.ring) {
+        free(sink.ring);
+        sink.ring = NULL;
+    }
+    if (sink.trace) {
+        _free_trace(sink.trace);
+        sink.trace = NULL;
+    }
+    sink.owner = NULL;
+    sink.func.func = NULL;
+    sink.func.arg = NULL;
+    sink.type = LOG_SINK_STDOUT;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    va_list args;
+    char *line;
+    size_t len;
+
+    va_start(args, fmt);
+
+    switch (sink.type)
+    {
+    default:
+    case LOG_SINK_STDOUT:
+    case LOG_SINK_FILE:
+      {
+        FILE *f = (sink.type == LOG_SINK_FILE ? sink.f : stdout);
+
+        fputs(lvl_pfx[level], f);
+        vfprintf(f, fmt, args);
+        break;
+      }
+
+    case LOG_SINK_FUNC:
+      {
+        char buf[LOG_LINE_MAX];
+
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        sink.func.func(level, buf, sink.func.arg);
+        break;
+      }
+
+    case LOG_SINK_RING:
+        /* the oldest message is overwritten if the ring is full */
+        if (sink.ring->cnt < sink.ring->n) {
+            line = sink.ring->lines[
+                (sink.ring->head + sink.ring->cnt++) % sink.ring->n];
+        } else {
+            line = sink.ring->lines[sink.ring->head];
+            sink.ring->head = (sink.ring->head + 1) % sink.ring->n;
+        }
+
+        len = strlen(lvl_pfx[level]);
+        memcpy(line, lvl_pfx[level], len);
+        vsnprintf(line + len, LOG_LINE_MAX - len, fmt, args);
+        break;
+
+    case LOG_SINK_TRACE:
+      {
+        log_rec_t *rec = _trace_rec_get(sink.trace, level, REC_MSG);
+
+        if (rec) {
+            vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+            _trace_rec_put(sink.trace);
+        }
+        break;
+      }
+    }
+
+    va_end(args);
+}
+
+void log_sink_stdout(void)
+{
+    _free_sink();
+}
+
+int log_sink_file(const char *path)
+{
+    FILE *f = fopen(path, "a");
+
+    if (!f) return -1;
+
+    /* messages are flushed line by line */
+    setvbuf(f, NULL, _IOLBF, 0);
+
+    _free_sink();
+    sink.f = f;
+    sink.type = LOG_SINK_FILE;
+
+    return 0;
+}
+
+void log_sink_func(log_func_t func, void *arg)
+{
+    _free_sink();
+    sink.owner = arg;
+    sink.func.func = func;
+    sink.func.arg = arg;
+    sink.type = LOG_SINK_FUNC;
+}
+
+int log_sink_ring(unsigned n)
+{
+    log_ring_t *ring;
+
+    if (!n || !(ring = (log_ring_t*)malloc(
+        sizeof(log_ring_t) + n * LOG_LINE_MAX))) return -1;
+
+    ring->n = n;
+    ring->head = ring->cnt = 0;
+
+    _free_sink();
+    sink.ring = ring;
+    sink.type = LOG_SINK_RING;
+
+    return 0;
+}
+
+int log_get_sink(void **owner)
+{
+    if (owner) *owner = sink.owner;
+    return sink.type;
+}
+
+static const char *rec_type_name[] = {"CON", "NON", "ACK", "RST"};
+
+/* format trace record */
+static void _write_rec(FILE *f, const log_rec_t *rec)
+{
+    unsigned i;
+    char addr[INET6_ADDRSTRLEN];
+
+    fprintf(f, "%s%ld.%06ld ", lvl_pfx[rec->level],
+        (long)rec->ts.tv_sec, rec->ts.tv_nsec / 1000);
+
+    if (rec->type == REC_MSG) {
+        /* message is usually new line terminated */
+        fputs(rec->msg, f);
+        if (!*rec->msg || rec->msg[strlen(rec->msg) - 1] != '\n')
+            fputc('\n', f);
+        return;
+    }
+
+    fprintf(f, "(%.*s) %s %s %u.%02u mid:%u tkn:",
+        (int)sizeof(rec->pdu.hndlr_name), rec->pdu.hndlr_name,
+        (rec->pdu.recv ? "->" : "<-"),
+        (rec->pdu.type < 4 ? rec_type_name[rec->pdu.type] : "?"),
+        rec->pdu.code >> 5, rec->pdu.code & 0x1f, rec->pdu.msg_id);
+
+    for (i = 0; i < rec->pdu.token_len; i++)
+        fprintf(f, "%02x", rec->pdu.token[i]);
+
+    if (rec->pdu.family == AF_INET || rec->pdu.family == AF_INET6) {
+        inet_ntop(rec->pdu.family, rec->pdu.addr, addr, sizeof(addr));
+        fprintf(f, (rec->pdu.family == AF_INET6 ?
+            " peer:[%s]:%u\n" : " peer:%s:%u\n"), addr, rec->pdu.port);
+    } else {
+        fputc('\n', f);
+    }
+}
+
+/* format and write out trace records */
+static unsigned _flush_trace(log_trace_t *trace)
+{
+    unsigned n = 0;
+    unsigned long t, h, dropped;
+
+    pthread_mutex_lock(&trace->cons_lck);
+
+    t = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    h = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+    for (; t != h; t++, n++) {
+        _write_rec(trace->f, &trace->recs[t % trace->n]);
+        atomic_store_explicit(&trace->tail, t + 1, memory_order_release);
+    }
+
+    dropped =
+        atomic_exchange_explicit(&trace->dropped, 0, memory_order_relaxed);
+    if (dropped)
+        fprintf(trace->f, "[WRN] %lu trace record(s) dropped\n", dropped);
+
+    if (n || dropped)
+        fflush(trace->f);
+
+    pthread_mutex_unlock(&trace->cons_lck);
+    return n;
+}
+
+static void *_flush_thrd(void *arg)
+{
+    struct timespec ts;
+    log_trace_t *trace = (log_trace_t*)arg;
+
+    pthread_mutex_lock(&trace->flush.lck);
+    while (!trace->flush.stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += trace->flush.ms / 1000;
+        ts.tv_nsec += (trace->flush.ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        if (pthread_cond_timedwait(
+            &trace->flush.cond, &trace->flush.lck, &ts) == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&trace->flush.lck);
+            _flush_trace(trace);
+            pthread_mutex_lock(&trace->flush.lck);
+        }
+    }
+    pthread_mutex_unlock(&trace->flush.lck);
+
+    return NULL;
+}
+
+/* stop flush thread, flush remaining records and free the ring */
+static void _free_trace(log_trace_t *trace)
+{
+    if (trace->flush.on) {
+        pthread_mutex_lock(&trace->flush.lck);
+        trace->flush.stop = 1;
+        pthread_cond_signal(&trace->flush.cond);
+        pthread_mutex_unlock(&trace->flush.lck);
+
+        pthread_join(trace->flush.thrd, NULL);
+    }
+
+    _flush_trace(trace);
+
+    if (trace->f != stdout)
+        fclose(trace->f);
+
+    pthread_cond_destroy(&trace->flush.cond);
+    pthread_mutex_destroy(&trace->flush.lck);
+    pthread_mutex_destroy(&trace->cons_lck);
+    free(trace);
+}
+
+int log_sink_trace(
+    unsigned n, const char *path, unsigned flush_ms, void *owner)
+{
+    log_trace_t *trace;
+
+    if (!n || !(trace = (log_trace_t*)calloc(
+        1, sizeof(log_trace_t) + n * sizeof(log_rec_t)))) return -1;
+
+    trace->n = n;
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->dropped, 0);
+
+    if (!path) {
+        trace->f = stdout;
+    } else
+    if (!(trace->f = fopen(path, "a"))) {
+        free(trace);
+        return -1;
+    }
+
+    pthread_mutex_init(&trace->cons_lck, NULL);
+    pthread_mutex_init(&trace->flush.lck, NULL);
+    pthread_cond_init(&trace->flush.cond, NULL);
+
+    if (flush_ms) {
+        trace->flush.ms = flush_ms;
+        if (pthread_create(&trace->flush.thrd, NULL, _flush_thrd, trace)) {
+            trace->flush.on = 0;
+            _free_trace(trace);
+            return -1;
+        }
+        trace->flush.on = 1;
+    }
+
+    _free_sink();
+    sink.owner = owner;
+    sink.trace = trace;
+    sink.type = LOG_SINK_TRACE;
+
+    return 0;
+}
+
+void log_pdu_rec(int level, const char *hndlr_name, int recv,
+    unsigned type, unsigned code, unsigned msg_id, const uint8_t *token,
+    size_t token_len, const struct sockaddr *peer)
+{
+    log_rec_t *rec;
+
+    if (sink.type != LOG_SINK_TRACE ||
+        !(rec = _trace_rec_get(sink.trace, level, REC_PDU))) return;
+
+    strncpy(rec->pdu.hndlr_name, hndlr_name, sizeof(rec->pdu.hndlr_name));
+    rec->pdu.recv = recv;
+    rec->pdu.type = type;
+    rec->pdu.code = code;
+    rec->pdu.msg_id = msg_id;
+
+    if (token_len > sizeof(rec->pdu.token))
+        token_len = sizeof(rec->pdu.token);
+    rec->pdu.token_len = token_len;
+    memcpy(rec->pdu.token, token, token_len);
+
+    rec->pdu.family = (peer ? peer->sa_family : AF_UNSPEC);
+    if (rec->pdu.family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)peer;
+
+        memcpy(rec->pdu.addr, &sin->sin_addr, sizeof(sin->sin_addr));
+        rec->pdu.port = ntohs(sin->sin_port);
+    } else
+    if (rec->pdu.family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)peer;
+
+        memcpy(rec->pdu.addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        rec->pdu.port = ntohs(sin6->sin6_port);
+    }
+
+    _trace_rec_put(sink.trace);
+}
+
+unsigned log_flush(void)
+{
+    return (sink.type == LOG_SINK_TRACE ? _flush_trace(sink.trace) : 0);
+}
+
+unsigned log_ring_read(void (*cb)(const char *msg, void *arg), void *arg)
+{
+    unsigned n = 0;
+    log_ring_t *ring = sink.ring;
+
+    if (sink.type != LOG_SINK_RING)
+        return 0;
+
+    for (; ring->cnt; ring->cnt--, n++) {
+        cb(ring->lines[ring->head], arg);
+        ring->head = (ring->head + 1) % ring->n;
+    }
+    return n;
+}
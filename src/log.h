@@ -13,42 +13,119 @@
 #ifndef __LOG_H
 #define __LOG_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct sockaddr;
+
 #define LOG_ERROR   0
 #define LOG_WARN    1
 #define LOG_INF     2
 #define LOG_NOTE    3
 #define LOG_DBG     4
 
-#define LOG_LEVEL LOG_DBG
-
-#if LOG_LEVEL >= LOG_ERROR
-# define log_error(...)  printf("[ERR] " __VA_ARGS__)
-#else
-# define log_error(...)
+/* max log level compiled in; messages of higher levels are compiled out */
+#ifndef LOG_LEVEL
+# define LOG_LEVEL LOG_DBG
 #endif
 
-#if LOG_LEVEL >= LOG_WARN
-# define log_warn(...)   printf("[WRN] " __VA_ARGS__)
-#else
-# define log_warn(...)
-#endif
+/* log sinks */
+#define LOG_SINK_STDOUT 0
+#define LOG_SINK_FILE   1
+#define LOG_SINK_FUNC   2
+#define LOG_SINK_RING   3
+#define LOG_SINK_TRACE  4
 
-#if LOG_LEVEL >= LOG_INF
-# define log_info(...)   printf("[INF] "  __VA_ARGS__)
-#else
-# define log_info(...)
-#endif
+/* max length of a log message (longer ones are truncated) */
+#define LOG_LINE_MAX    256
 
-#if LOG_LEVEL >= LOG_NOTE
-# define log_notice(...) printf("[NOTE] " __VA_ARGS__)
-#else
-# define log_notice(...)
-#endif
+/*
+ * Runtime log level. The level and the log sink are set per thread, so
+ * workers (each running its own Lua state) are configured independently.
+ */
+extern __thread int log_level;
 
-#if LOG_LEVEL >= LOG_DBG
-# define log_debug(...)  printf("[DBG] " __VA_ARGS__)
-#else
-# define log_debug(...)
-#endif
+/* check if messages of a given level are logged */
+#define log_enabled(__lvl) ((__lvl) <= LOG_LEVEL && (__lvl) <= log_level)
+
+/* max length of a message kept in a trace record (longer are truncated) */
+#define LOG_REC_MSG_MAX 96
+
+/* log sink function; 'msg' is passed with no level prefix */
+typedef void (*log_func_t)(int level, const char *msg, void *arg);
+
+/**
+ * Write log message to the current sink. Use log_xxx() macros instead of
+ * calling the routine directly.
+ */
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Set stdout sink (default).
+ */
+void log_sink_stdout(void);
+
+/**
+ * Set file sink; the file is opened in append mode. Returns 0 on success,
+ * -1 on error (the current sink is not changed then).
+ */
+int log_sink_file(const char *path);
+
+/**
+ * Set function sink. 'arg' is the sink owner (see log_get_sink()).
+ */
+void log_sink_func(log_func_t func, void *arg);
+
+/**
+ * Set in-memory ring sink keeping up to 'n' last messages. Returns 0 on
+ * success, -1 on error (the current sink is not changed then).
+ */
+int log_sink_ring(unsigned n);
+
+/**
+ * Set trace sink. Messages and PDUs are written as fixed-size binary records
+ * to a lock-free ring of 'n' records and are formatted (to 'path' file or
+ * stdout if NULL) on flush. The ring is flushed by log_flush() and, if
+ * 'flush_ms' is not 0, by a background thread every 'flush_ms' msecs.
+ * Records not fitting in the ring are dropped. 'owner' identifies the sink
+ * (see log_get_sink()). Returns 0 on success, -1 on error (the current sink
+ * is not changed then).
+ */
+int log_sink_trace(
+    unsigned n, const char *path, unsigned flush_ms, void *owner);
+
+/**
+ * Get current sink type and its owner (function or trace sink).
+ */
+int log_get_sink(void **owner);
+
+/**
+ * Write CoAP PDU record to the trace sink. 'peer' may be NULL.
+ */
+void log_pdu_rec(int level, const char *hndlr_name, int recv,
+    unsigned type, unsigned code, unsigned msg_id, const uint8_t *token,
+    size_t token_len, const struct sockaddr *peer);
+
+/**
+ * Format and write out records of the trace sink. Returns number of written
+ * records.
+ */
+unsigned log_flush(void);
+
+/**
+ * Read (and remove) messages from the ring sink, from the oldest one. Each
+ * message is passed to 'cb'. Returns number of read messages.
+ */
+unsigned log_ring_read(void (*cb)(const char *msg, void *arg), void *arg);
+
+#define __LOG(__lvl, ...) \
+    do { if (log_enabled(__lvl)) log_write(__lvl, __VA_ARGS__); } while (0)
+
+#define log_error(...)  __LOG(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)   __LOG(LOG_WARN, __VA_ARGS__)
+#define log_info(...)   __LOG(LOG_INF, __VA_ARGS__)
+#define log_notice(...) __LOG(LOG_NOTE, __VA_ARGS__)
+#define log_debug(...)  __LOG(LOG_DBG, __VA_ARGS__)
 
 #endif
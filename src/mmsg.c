@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "mmsg.h"
+
+/* received datagrams batch of a socket */
+typedef struct rx_batch_t
+{
+    struct rx_batch_t *next;
+
+    int fd;
+    unsigned head;      /* next datagram to read */
+    unsigned cnt;       /* number of received datagrams */
+
+    struct mmsghdr hdrs[MMSG_MAX_BATCH];
+    struct iovec iov[MMSG_MAX_BATCH];
+    struct sockaddr_storage addrs[MMSG_MAX_BATCH];
+    mmsg_ctrl_t ctrls[MMSG_MAX_BATCH];
+
+    /* datagrams buffers, each of COAP_RXBUFFER_SIZE size */
+    uint8_t bufs[];
+} rx_batch_t;
+
+/* outgoing datagram */
+typedef struct
+{
+    int fd;
+    struct iovec iov;
+    struct sockaddr_storage dst;
+    mmsg_ctrl_t ctrl;
+    uint8_t buf[COAP_RXBUFFER_SIZE];
+} tx_dgram_t;
+
+struct mmsg_ctx_t
+{
+    unsigned n;         /* batch size */
+
+    rx_batch_t *rx;     /* batches list (per socket) */
+
+    struct {
+        unsigned cnt;   /* number of queued datagrams */
+        struct mmsghdr hdrs[MMSG_MAX_BATCH];
+        tx_dgram_t *dgrams;
+    } tx;
+};
+
+mmsg_ctx_t *mmsg_new(unsigned n)
+{
+    mmsg_ctx_t *mctx;
+
+    if (!n || n > MMSG_MAX_BATCH)
+        return NULL;
+
+    if (!(mctx = (mmsg_ctx_t*)calloc(1, sizeof(mmsg_ctx_t))))
+        return NULL;
+
+    if (!(mctx->tx.dgrams = (tx_dgram_t*)malloc(n * sizeof(tx_dgram_t)))) {
+        free(mctx);
+        return NULL;
+    }
+    mctx->n = n;
+
+    return mctx;
+}
+
+void mmsg_free(mmsg_ctx_t *mctx)
+{
+    rx_batch_t *rx, *next;
+
+    mmsg_flush(mctx);
+
+    for (rx = mctx->rx; rx; rx = next) {
+        next = rx->next;
+        free(rx);
+    }
+    free(mctx->tx.dgrams);
+    free(mctx);
+}
+
+static rx_batch_t *_get_rx(const mmsg_ctx_t *mctx, int fd)
+{
+    rx_batch_t *rx;
+
+    for (rx = mctx->rx; rx; rx = rx->next) {
+        if (rx->fd == fd) break;
+    }
+    return rx;
+}
+
+/* create socket's batch with its buffers set up for recvmmsg(2) */
+static rx_batch_t *_new_rx(mmsg_ctx_t *mctx, int fd)
+{
+    unsigned i;
+    rx_batch_t *rx = (rx_batch_t*)malloc(
+        sizeof(rx_batch_t) + mctx->n * COAP_RXBUFFER_SIZE);
+
+    if (!rx) return NULL;
+
+    memset(rx, 0, sizeof(rx_batch_t));
+    rx->fd = fd;
+
+    for (i = 0; i < mctx->n; i++) {
+        rx->iov[i].iov_base = &rx->bufs[i * COAP_RXBUFFER_SIZE];
+        rx->iov[i].iov_len = COAP_RXBUFFER_SIZE;
+
+        rx->hdrs[i].msg_hdr.msg_name = &rx->addrs[i];
+        rx->hdrs[i].msg_hdr.msg_iov = &rx->iov[i];
+        rx->hdrs[i].msg_hdr.msg_iovlen = 1;
+        rx->hdrs[i].msg_hdr.msg_control = rx->ctrls[i].buf;
+    }
+
+    rx->next = mctx->rx;
+    mctx->rx = rx;
+
+    return rx;
+}
+
+void mmsg_get_pktinfo(coap_packet_t *packet, struct msghdr *mhdr)
+{
+    struct cmsghdr *cmsg;
+    coap_address_t *local = &packet->addr_info.local;
+
+    for (cmsg = CMSG_FIRSTHDR(mhdr); cmsg; cmsg = CMSG_NXTHDR(mhdr, cmsg))
+    {
+        if (cmsg->cmsg_level == IPPROTO_IPV6 &&
+            cmsg->cmsg_type == IPV6_PKTINFO)
+        {
+            struct in6_pktinfo *pi = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+
+            packet->ifindex = pi->ipi6_ifindex;
+            memcpy(&local->addr.sin6.sin6_addr,
+                &pi->ipi6_addr, sizeof(local->addr.sin6.sin6_addr));
+            break;
+        } else
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+        {
+            struct in_pktinfo *pi = (struct in_pktinfo*)CMSG_DATA(cmsg);
+
+            packet->ifindex = pi->ipi_ifindex;
+            if (local->addr.sa.sa_family == AF_INET6) {
+                /* IPv4 mapped address */
+                uint8_t *a = local->addr.sin6.sin6_addr.s6_addr;
+
+                memset(a, 0, 10);
+                a[10] = a[11] = 0xff;
+                memcpy(&a[12], &pi->ipi_addr, 4);
+            } else {
+                local->addr.sin.sin_addr = pi->ipi_addr;
+            }
+            break;
+        }
+    }
+}
+
+ssize_t mmsg_read(mmsg_ctx_t *mctx, coap_socket_t *sock, coap_packet_t *packet)
+{
+    int res;
+    unsigned i;
+    struct msghdr *mhdr;
+    rx_batch_t *rx = _get_rx(mctx, sock->fd);
+
+    if (!rx || rx->head >= rx->cnt)
+    {
+        /* nothing buffered; receive a new batch */
+        if (!(sock->flags & COAP_SOCKET_CAN_READ))
+            return -1;
+        sock->flags &= ~COAP_SOCKET_CAN_READ;
+
+        if (!rx && !(rx = _new_rx(mctx, sock->fd))) {
+            log_error("Batch allocation failed\n");
+            return -1;
+        }
+
+        for (i = 0; i < mctx->n; i++) {
+            rx->hdrs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+            rx->hdrs[i].msg_hdr.msg_controllen = sizeof(rx->ctrls[i]);
+        }
+
+        rx->head = rx->cnt = 0;
+        res = recvmmsg(sock->fd, rx->hdrs, mctx->n, MSG_DONTWAIT, NULL);
+        if (res <= 0) {
+            if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                log_warn("recvmmsg() failed: %s\n", strerror(errno));
+            return -1;
+        }
+        rx->cnt = res;
+    } else {
+        sock->flags &= ~COAP_SOCKET_CAN_READ;
+    }
+
+    i = rx->head++;
+    mhdr = &rx->hdrs[i].msg_hdr;
+
+    if (mhdr->msg_flags & MSG_TRUNC) {
+        log_warn("Truncated datagram discarded\n");
+        return -1;
+    }
+
+    packet->length = rx->hdrs[i].msg_len;
+    memcpy(packet->payload, rx->iov[i].iov_base, packet->length);
+
+    packet->addr_info.remote.size = mhdr->msg_namelen;
+    memcpy(&packet->addr_info.remote.addr, mhdr->msg_name, mhdr->msg_namelen);
+
+    mmsg_get_pktinfo(packet, mhdr);
+
+    return packet->length;
+}
+
+int mmsg_rx_pending(const mmsg_ctx_t *mctx, const coap_socket_t *sock)
+{
+    rx_batch_t *rx = _get_rx(mctx, sock->fd);
+    return (rx && rx->head < rx->cnt);
+}
+
+void mmsg_rx_drop(mmsg_ctx_t *mctx, const coap_socket_t *sock)
+{
+    rx_batch_t **prx, *rx;
+
+    for (prx = &mctx->rx; (rx = *prx); prx = &rx->next) {
+        if (rx->fd == sock->fd) {
+            *prx = rx->next;
+            free(rx);
+            break;
+        }
+    }
+}
+
+void mmsg_tx_drop(mmsg_ctx_t *mctx, const coap_socket_t *sock)
+{
+    unsigned i, j;
+    tx_dgram_t *dgram;
+    struct msghdr *mhdr;
+
+    for (i = j = 0; i < mctx->tx.cnt; i++)
+    {
+        if (mctx->tx.dgrams[i].fd == sock->fd)
+            continue;
+
+        if (i != j) {
+            dgram = &mctx->tx.dgrams[j];
+            mhdr = &mctx->tx.hdrs[j].msg_hdr;
+
+            *dgram = mctx->tx.dgrams[i];
+            *mhdr = mctx->tx.hdrs[i].msg_hdr;
+
+            /* re-point the header at the moved datagram */
+            dgram->iov.iov_base = dgram->buf;
+            mhdr->msg_name = &dgram->dst;
+            mhdr->msg_iov = &dgram->iov;
+            mhdr->msg_control = dgram->ctrl.buf;
+        }
+        j++;
+    }
+    mctx->tx.cnt = j;
+}
+
+size_t mmsg_set_pktinfo(mmsg_ctrl_t *ctrl, const coap_session_t *session)
+{
+    struct cmsghdr *cmsg = (struct cmsghdr*)ctrl->buf;
+    const coap_address_t *local = &session->addr_info.local;
+
+    memset(ctrl, 0, sizeof(*ctrl));
+
+    if (local->addr.sa.sa_family == AF_INET6 &&
+        !IN6_IS_ADDR_V4MAPPED(&local->addr.sin6.sin6_addr))
+    {
+        struct in6_pktinfo *pi = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+        pi->ipi6_ifindex = session->ifindex;
+        memcpy(&pi->ipi6_addr,
+            &local->addr.sin6.sin6_addr, sizeof(pi->ipi6_addr));
+
+        return CMSG_SPACE(sizeof(struct in6_pktinfo));
+    } else {
+        struct in_pktinfo *pi = (struct in_pktinfo*)CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+        pi->ipi_ifindex = session->ifindex;
+        if (local->addr.sa.sa_family == AF_INET6) {
+            /* IPv4 mapped address */
+            memcpy(&pi->ipi_spec_dst,
+                &local->addr.sin6.sin6_addr.s6_addr[12], 4);
+        } else {
+            pi->ipi_spec_dst = local->addr.sin.sin_addr;
+        }
+
+        return CMSG_SPACE(sizeof(struct in_pktinfo));
+    }
+}
+
+ssize_t mmsg_send(mmsg_ctx_t *mctx, coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen)
+{
+    tx_dgram_t *dgram;
+    struct msghdr *mhdr;
+    const coap_address_t *remote = &session->addr_info.remote;
+
+    if (datalen > sizeof(dgram->buf)) {
+        /* too large to be queued; keep datagrams order */
+        mmsg_flush(mctx);
+        return coap_network_send(sock, session, data, datalen);
+    }
+
+    if (mctx->tx.cnt >= mctx->n)
+        mmsg_flush(mctx);
+
+    dgram = &mctx->tx.dgrams[mctx->tx.cnt];
+    mhdr = &mctx->tx.hdrs[mctx->tx.cnt].msg_hdr;
+
+    dgram->fd = sock->fd;
+    memcpy(dgram->buf, data, datalen);
+    dgram->iov.iov_base = dgram->buf;
+    dgram->iov.iov_len = datalen;
+    memcpy(&dgram->dst, &remote->addr, remote->size);
+
+    memset(mhdr, 0, sizeof(*mhdr));
+    mhdr->msg_name = &dgram->dst;
+    mhdr->msg_namelen = remote->size;
+    mhdr->msg_iov = &dgram->iov;
+    mhdr->msg_iovlen = 1;
+    mhdr->msg_control = dgram->ctrl.buf;
+    mhdr->msg_controllen = mmsg_set_pktinfo(&dgram->ctrl, session);
+
+    mctx->tx.cnt++;
+    return datalen;
+}
+
+int mmsg_flush(mmsg_ctx_t *mctx)
+{
+    int res, n_sent = 0;
+    unsigned i = 0, j;
+
+    while (i < mctx->tx.cnt)
+    {
+        /* datagrams to the same socket are sent by a single call */
+        for (j = i + 1;
+            j < mctx->tx.cnt && mctx->tx.dgrams[j].fd == mctx->tx.dgrams[i].fd;
+            j++);
+
+        res = sendmmsg(mctx->tx.dgrams[i].fd, &mctx->tx.hdrs[i], j - i, 0);
+        if (res <= 0) {
+            /* UDP datagrams may be lost anyway; CON messages are
+               retransmitted by libcoap */
+            log_warn("sendmmsg() failed: %s; %u datagram(s) dropped\n",
+                (res < 0 ? strerror(errno) : "none sent"), j - i);
+            i = j;
+        } else {
+            n_sent += res;
+            i += res;
+        }
+    }
+    mctx->tx.cnt = 0;
+
+    return n_sent;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __MMSG_H__
+#define __MMSG_H__
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "coap2/coap.h"
+
+/* max number of datagrams in a batch */
+#define MMSG_MAX_BATCH 64
+
+/* control message buffer (packet info) */
+typedef union
+{
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    struct cmsghdr align;
+} mmsg_ctrl_t;
+
+/*
+ * Batched datagrams I/O context. Datagrams are received by recvmmsg(2) in
+ * batches of up to n datagrams per socket and handed one by one to libcoap.
+ * Outgoing datagrams are queued and sent by sendmmsg(2) on flush.
+ *
+ * NOTE: Only unconnected (endpoints) sockets are handled by the batched I/O.
+ */
+typedef struct mmsg_ctx_t mmsg_ctx_t;
+
+/**
+ * Create batched I/O context for batches of 'n' (<= MMSG_MAX_BATCH)
+ * datagrams. Returns NULL on error.
+ */
+mmsg_ctx_t *mmsg_new(unsigned n);
+
+/**
+ * Free batched I/O context. Queued outgoing datagrams are flushed, received
+ * and not yet read ones are discarded.
+ */
+void mmsg_free(mmsg_ctx_t *mctx);
+
+/**
+ * libcoap network_read() compatible routine. If no datagrams are buffered
+ * for the socket, receive a new batch of them (the socket must be marked as
+ * readable then). Returns the read datagram length, -1 if nothing was read.
+ */
+ssize_t mmsg_read(mmsg_ctx_t *mctx, coap_socket_t *sock, coap_packet_t *packet);
+
+/**
+ * Check if there are received datagrams still buffered for the socket.
+ */
+int mmsg_rx_pending(const mmsg_ctx_t *mctx, const coap_socket_t *sock);
+
+/**
+ * Discard datagrams buffered for the socket (e.g. before the socket close).
+ */
+void mmsg_rx_drop(mmsg_ctx_t *mctx, const coap_socket_t *sock);
+
+/**
+ * Discard datagrams queued for sending via the socket (e.g. before the socket
+ * close).
+ */
+void mmsg_tx_drop(mmsg_ctx_t *mctx, const coap_socket_t *sock);
+
+/**
+ * libcoap network_send() compatible routine. The datagram is queued to be
+ * sent on the next flush (the queue is flushed if full). Returns 'datalen'
+ * on success, -1 on error.
+ */
+ssize_t mmsg_send(mmsg_ctx_t *mctx, coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen);
+
+/**
+ * Send all queued datagrams. Returns number of datagrams sent.
+ */
+int mmsg_flush(mmsg_ctx_t *mctx);
+
+/**
+ * Fill packet's local address & interface index out of the packet info of
+ * a received message.
+ */
+void mmsg_get_pktinfo(coap_packet_t *packet, struct msghdr *mhdr);
+
+/**
+ * Set source address & interface of an outgoing message as for the session.
+ * Returns the control message length.
+ */
+size_t mmsg_set_pktinfo(mmsg_ctrl_t *ctrl, const coap_session_t *session);
+
+#endif
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "observe.h"
+
+/* check if request URI path matches the path */
+static int _path_match(coap_pdu_t *req, const char *path)
+{
+    size_t len;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    coap_opt_filter_t filter;
+    int first = 1;
+
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_URI_PATH);
+    coap_option_iterator_init(req, &it, filter);
+
+    while ((opt = coap_option_next(&it)))
+    {
+        if (!first) {
+            if (*path != '/')
+                return 0;
+            path++;
+        }
+        first = 0;
+
+        len = coap_opt_length(opt);
+        if (strncmp(path, (const char*)coap_opt_value(opt), len) ||
+            memchr(path, 0, len))
+        {
+            return 0;
+        }
+        path += len;
+    }
+    return (*path == 0);
+}
+
+/* free observer */
+static void _observer_free(obs_observer_t *obs)
+{
+    coap_session_release(obs->session);
+    free(obs);
+}
+
+obs_resource_t *obs_rsrc_new(obs_resource_t **list, const char *path)
+{
+    obs_resource_t *rsrc;
+    size_t len;
+
+    while (*path == '/') path++;
+
+    for (rsrc = *list; rsrc; rsrc = rsrc->next) {
+        if (!strcmp(rsrc->path, path))
+            return NULL;
+    }
+
+    len = strlen(path);
+    if (!(rsrc = (obs_resource_t*)calloc(1, sizeof(obs_resource_t) + len + 1)))
+        return NULL;
+
+    memcpy(rsrc->path, path, len + 1);
+    rsrc->con_every = OBS_DEF_CON_EVERY;
+
+    rsrc->next = *list;
+    *list = rsrc;
+
+    return rsrc;
+}
+
+void obs_rsrc_free(obs_resource_t **list, obs_resource_t *rsrc)
+{
+    obs_resource_t **pp;
+    obs_observer_t *obs, *next;
+
+    for (pp = list; *pp; pp = &(*pp)->next) {
+        if (*pp == rsrc) {
+            *pp = rsrc->next;
+            break;
+        }
+    }
+
+    for (obs = rsrc->observers; obs; obs = next) {
+        next = obs->next;
+        _observer_free(obs);
+    }
+    free(rsrc);
+}
+
+obs_resource_t *obs_rsrc_find(obs_resource_t *list, coap_pdu_t *req)
+{
+    for (; list; list = list->next) {
+        if (_path_match(req, list->path))
+            return list;
+    }
+    return NULL;
+}
+
+int obs_register(obs_resource_t *rsrc,
+    coap_session_t *session, const coap_pdu_t *req)
+{
+    obs_observer_t *obs;
+
+    for (obs = rsrc->observers; obs; obs = obs->next)
+    {
+        if (obs->session == session && obs->token_len == req->token_length &&
+            !memcmp(obs->token, req->token, obs->token_len))
+        {
+            /* re-registration */
+            return 0;
+        }
+    }
+
+    if (req->token_length > sizeof(obs->token) ||
+        !(obs = (obs_observer_t*)calloc(1, sizeof(obs_observer_t))))
+    {
+        return -1;
+    }
+
+    obs->session = coap_session_reference(session);
+    obs->token_len = req->token_length;
+    memcpy(obs->token, req->token, obs->token_len);
+
+    obs->next = rsrc->observers;
+    rsrc->observers = obs;
+    rsrc->n++;
+
+    log_debug("Observer registered for /%s (%u observers)\n",
+        rsrc->path, rsrc->n);
+    return 0;
+}
+
+/* remove observers matching the session and the token */
+static int _remove(obs_resource_t *rsrc,
+    const coap_session_t *session, const coap_pdu_t *pdu)
+{
+    int n = 0;
+    obs_observer_t **pp, *obs;
+
+    for (pp = &rsrc->observers; (obs = *pp);)
+    {
+        if (obs->session == session && obs->token_len == pdu->token_length &&
+            !memcmp(obs->token, pdu->token, obs->token_len))
+        {
+            *pp = obs->next;
+            _observer_free(obs);
+            rsrc->n--;
+            n++;
+        } else
+            pp = &obs->next;
+    }
+    return n;
+}
+
+void obs_deregister(obs_resource_t *rsrc,
+    const coap_session_t *session, const coap_pdu_t *pdu)
+{
+    if (_remove(rsrc, session, pdu)) {
+        log_debug("Observer deregistered from /%s (%u observers)\n",
+            rsrc->path, rsrc->n);
+    }
+}
+
+int obs_evict(obs_resource_t *list,
+    const coap_session_t *session, const coap_pdu_t *sent)
+{
+    int n = 0;
+
+    for (; list; list = list->next) {
+        if (_remove(list, session, sent)) {
+            log_info("Observer of /%s evicted\n", list->path);
+            n = 1;
+        }
+    }
+    return n;
+}
+
+unsigned obs_encode_seq(const obs_resource_t *rsrc, uint8_t *buf)
+{
+    return coap_encode_var_safe(buf, 4, rsrc->seq);
+}
+
+/* clone the notification template for an observer */
+static coap_pdu_t *_clone_tmpl(
+    const coap_pdu_t *tmpl, const obs_observer_t *obs, uint8_t type)
+{
+    coap_pdu_t *pdu;
+    size_t tkl = obs->token_len;
+
+    pdu = coap_pdu_init(type, tmpl->code,
+        coap_new_message_id(obs->session), tmpl->max_size);
+    if (!pdu)
+        return NULL;
+
+    if (!coap_add_token(pdu, tkl, obs->token) ||
+        !coap_pdu_resize(pdu, tkl + tmpl->used_size))
+    {
+        coap_delete_pdu(pdu);
+        return NULL;
+    }
+
+    /* the template has no token; its options and payload follow the token */
+    memcpy(pdu->token + tkl, tmpl->token, tmpl->used_size);
+    pdu->used_size = tkl + tmpl->used_size;
+    pdu->max_delta = tmpl->max_delta;
+    pdu->data = (tmpl->data ? pdu->token + tkl + (tmpl->data - tmpl->token) :
+        NULL);
+
+    return pdu;
+}
+
+int obs_notify(obs_resource_t *rsrc, uint8_t code, int cf,
+    const uint8_t *data, size_t len, int con, size_t max_pdu_sz)
+{
+    uint8_t buf[4];
+    int n = 0, ok = ((code >> 5) == 2);
+    coap_pdu_t *tmpl, *pdu;
+    obs_observer_t *obs, *next;
+
+    if (!rsrc->observers)
+        return 0;
+
+    if (!(tmpl = coap_pdu_init(COAP_MESSAGE_NON, code, 0, max_pdu_sz)))
+        return -1;
+
+    /* non-2.xx notification ends the observation (no Observe option) */
+    if (ok) {
+        rsrc->seq = (rsrc->seq + 1) & 0xffffff;
+        coap_add_option(
+            tmpl, COAP_OPTION_OBSERVE, obs_encode_seq(rsrc, buf), buf);
+    }
+    if (cf >= 0) {
+        coap_add_option(tmpl, COAP_OPTION_CONTENT_FORMAT,
+            coap_encode_var_safe(buf, sizeof(buf), (unsigned)cf), buf);
+    }
+    if (len > 0 && !coap_add_data(tmpl, len, data)) {
+        log_error("Notification of /%s too large\n", rsrc->path);
+        coap_delete_pdu(tmpl);
+        return -1;
+    }
+
+    for (obs = rsrc->observers; obs; obs = obs->next)
+    {
+        uint8_t type = COAP_MESSAGE_NON;
+
+        /* CON notification from time to time checks the observer is alive */
+        if (con || ++obs->non_cnt >= rsrc->con_every) {
+            type = COAP_MESSAGE_CON;
+            obs->non_cnt = 0;
+        }
+
+        if (!(pdu = _clone_tmpl(tmpl, obs, type))) {
+            log_error("Notification PDU creation failed\n");
+            continue;
+        }
+
+        /* coap_send() takes the PDU ownership */
+        if (coap_send(obs->session, pdu) == COAP_INVALID_TID) {
+            log_warn("Notification of /%s not sent to %s\n",
+                rsrc->path, coap_session_str(obs->session));
+        } else
+            n++;
+    }
+    coap_delete_pdu(tmpl);
+
+    if (!ok) {
+        for (obs = rsrc->observers; obs; obs = next) {
+            next = obs->next;
+            _observer_free(obs);
+        }
+        rsrc->observers = NULL;
+        rsrc->n = 0;
+    }
+
+    log_debug("/%s notification sent to %d observers\n", rsrc->path, n);
+    return n;
+}
+
+/* FNV-1a hash of the session and token */
+static uint32_t _sub_hash(
+    const coap_session_t *session, const uint8_t *token, size_t len)
+{
+    size_t i;
+    uintptr_t s = (uintptr_t)session;
+    uint32_t h = 2166136261U;
+
+    for (i = 0; i < sizeof(s); i++, s >>= 8)
+        h = (h ^ (uint8_t)s) * 16777619U;
+    for (i = 0; i < len; i++)
+        h = (h ^ token[i]) * 16777619U;
+
+    return h;
+}
+
+static inline obs_sub_t **_sub_bucket(const obs_sub_tab_t *tab,
+    const coap_session_t *session, const uint8_t *token, size_t len)
+{
+    return &tab->buckets[
+        _sub_hash(session, token, len) & (tab->n_buckets - 1)];
+}
+
+/* resize the subscriptions hash table to 'n_buckets' */
+static int _sub_resize(obs_sub_tab_t *tab, unsigned n_buckets)
+{
+    obs_sub_t *sub, **b, **buckets;
+
+    if (!(buckets = (obs_sub_t**)calloc(n_buckets, sizeof(obs_sub_t*))))
+        return -1;
+
+    free(tab->buckets);
+    tab->buckets = buckets;
+    tab->n_buckets = n_buckets;
+
+    for (sub = tab->list; sub; sub = sub->next) {
+        b = _sub_bucket(tab, sub->session, sub->token, sub->token_len);
+        sub->hnext = *b;
+        *b = sub;
+    }
+    return 0;
+}
+
+/* convert libcoap ticks to msecs */
+static inline uint64_t _ticks_ms(coap_tick_t t)
+{
+    return (uint64_t)t * 1000 / COAP_TICKS_PER_SECOND;
+}
+
+obs_sub_t *obs_sub_new(
+    obs_sub_tab_t *tab, coap_session_t *session, const char *path)
+{
+    obs_sub_t *sub, **b;
+    size_t len;
+
+    while (*path == '/') path++;
+
+    /* keep load factor below 1 */
+    if (tab->n >= tab->n_buckets && _sub_resize(tab,
+        (tab->n_buckets ? 2 * tab->n_buckets : OBS_SUB_INIT_BUCKETS)))
+    {
+        return NULL;
+    }
+
+    len = strlen(path);
+    if (!(sub = (obs_sub_t*)calloc(1, sizeof(obs_sub_t) + len + 1)))
+        return NULL;
+
+    memcpy(sub->path, path, len + 1);
+    sub->token_len = sizeof(sub->token);
+    prng(sub->token, sub->token_len);
+    sub->session = coap_session_reference(session);
+
+    sub->next = tab->list;
+    tab->list = sub;
+
+    b = _sub_bucket(tab, session, sub->token, sub->token_len);
+    sub->hnext = *b;
+    *b = sub;
+    tab->n++;
+
+    return sub;
+}
+
+void obs_sub_free(obs_sub_tab_t *tab, obs_sub_t *sub)
+{
+    obs_sub_t **pp;
+
+    for (pp = &tab->list; *pp; pp = &(*pp)->next) {
+        if (*pp == sub) {
+            *pp = sub->next;
+            break;
+        }
+    }
+
+    pp = _sub_bucket(tab, sub->session, sub->token, sub->token_len);
+    for (; *pp; pp = &(*pp)->hnext) {
+        if (*pp == sub) {
+            *pp = sub->hnext;
+            tab->n--;
+            break;
+        }
+    }
+
+    tmr_del(&tab->refresh, &sub->refresh);
+    coap_session_release(sub->session);
+    free(sub);
+}
+
+obs_sub_t *obs_sub_find(const obs_sub_tab_t *tab,
+    const coap_session_t *session, const coap_pdu_t *pdu)
+{
+    obs_sub_t *sub;
+
+    if (!tab->n)
+        return NULL;
+
+    sub = *_sub_bucket(tab, session, pdu->token, pdu->token_length);
+    for (; sub; sub = sub->hnext)
+    {
+        if (sub->session == session &&
+            sub->token_len == pdu->token_length &&
+            !memcmp(sub->token, pdu->token, sub->token_len))
+        {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+void obs_sub_schedule(
+    obs_sub_tab_t *tab, obs_sub_t *sub, uint64_t at, uint64_t now)
+{
+    if (at) {
+        tmr_add(&tab->refresh, &sub->refresh, at, now);
+    } else {
+        tmr_del(&tab->refresh, &sub->refresh);
+    }
+}
+
+obs_sub_t *obs_sub_due(obs_sub_tab_t *tab, uint64_t now)
+{
+    tmr_t *tmr;
+
+    tmr_advance(&tab->refresh, now);
+    if (!(tmr = tmr_pop_due(&tab->refresh)))
+        return NULL;
+
+    return (obs_sub_t*)((char*)tmr - offsetof(obs_sub_t, refresh));
+}
+
+uint64_t obs_sub_next(const obs_sub_tab_t *tab)
+{
+    return tmr_next(&tab->refresh);
+}
+
+void obs_sub_clear(obs_sub_tab_t *tab)
+{
+    obs_sub_t *sub, *next;
+
+    for (sub = tab->list; sub; sub = next) {
+        next = sub->next;
+        coap_session_release(sub->session);
+        free(sub);
+    }
+
+    free(tab->buckets);
+    memset(tab, 0, sizeof(*tab));
+}
+
+/* add URI path (or query) options out of 'str' segments */
+static int _add_uri_opts(
+    coap_pdu_t *pdu, uint16_t type, const char *str, size_t len, char sep)
+{
+    const char *seg;
+    size_t seg_len;
+
+    while (len > 0)
+    {
+        seg = str;
+        for (seg_len = 0; seg_len < len && seg[seg_len] != sep; seg_len++);
+
+        if (seg_len > 0 &&
+            !coap_add_option(pdu, type, seg_len, (const uint8_t*)seg))
+        {
+            return -1;
+        }
+
+        str += seg_len;
+        len -= seg_len;
+        if (len > 0) {
+            /* skip separator */
+            str++;
+            len--;
+        }
+    }
+    return 0;
+}
+
+coap_pdu_t *obs_sub_req(obs_sub_t *sub, unsigned observe, size_t max_pdu_sz)
+{
+    uint8_t buf[4];
+    coap_pdu_t *pdu;
+    const char *qs = strchr(sub->path, '?');
+    size_t path_len = (qs ? (size_t)(qs - sub->path) : strlen(sub->path));
+
+    pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+        coap_new_message_id(sub->session), max_pdu_sz);
+    if (!pdu)
+        return NULL;
+
+    if (!coap_add_token(pdu, sub->token_len, sub->token) ||
+        !coap_add_option(pdu, COAP_OPTION_OBSERVE,
+            coap_encode_var_safe(buf, sizeof(buf), observe), buf) ||
+        _add_uri_opts(pdu, COAP_OPTION_URI_PATH, sub->path, path_len, '/') ||
+        (qs && _add_uri_opts(
+            pdu, COAP_OPTION_URI_QUERY, qs + 1, strlen(qs + 1), '&')))
+    {
+        coap_delete_pdu(pdu);
+        return NULL;
+    }
+
+    /* new registration resets the freshness state */
+    if (observe == COAP_OBSERVE_ESTABLISH)
+        sub->seq_set = 0;
+
+    return pdu;
+}
+
+int obs_sub_rx(obs_sub_tab_t *tab, obs_sub_t *sub, coap_pdu_t *rcvd)
+{
+    coap_tick_t now;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    unsigned seq, max_age = 60;
+
+    if ((rcvd->code >> 5) != 2 ||
+        !(opt = coap_check_option(rcvd, COAP_OPTION_OBSERVE, &it)))
+    {
+        /* error or the resource is not observable */
+        return OBS_RX_END;
+    }
+
+    coap_ticks(&now);
+    seq = coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+
+    /* RFC 7641, 3.4: newer sequence number or 128 secs passed */
+    if (sub->seq_set &&
+        !(sub->seq < seq && seq - sub->seq < (1U << 23)) &&
+        !(sub->seq > seq && sub->seq - seq > (1U << 23)) &&
+        !(now > sub->ts + 128 * COAP_TICKS_PER_SECOND))
+    {
+        return OBS_RX_STALE;
+    }
+
+    sub->seq_set = 1;
+    sub->seq = seq;
+    sub->ts = now;
+
+    /* re-register if no notification arrives before the state expires */
+    if ((opt = coap_check_option(rcvd, COAP_OPTION_MAXAGE, &it))) {
+        max_age =
+            coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+    }
+    obs_sub_schedule(tab, sub, _ticks_ms(now) +
+        (uint64_t)(max_age + OBS_SUB_MARGIN) * 1000, _ticks_ms(now));
+
+    return OBS_RX_FRESH;
+}
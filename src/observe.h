@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __OBSERVE_H__
+#define __OBSERVE_H__
+
+#include "coap2/coap.h"
+#include "timer.h"
+
+/* every n-th notification is sent as CON (RFC 7641, 4.5) by default */
+#define OBS_DEF_CON_EVERY   20
+
+/* client subscription re-registration margin and retry interval (secs) */
+#define OBS_SUB_MARGIN      2
+#define OBS_SUB_RETRY       10
+
+/* initial number of subscriptions hash table buckets (power of 2) */
+#define OBS_SUB_INIT_BUCKETS 16
+
+/* notification reception results */
+#define OBS_RX_FRESH        0   /* fresh notification */
+#define OBS_RX_STALE        1   /* stale or duplicated notification */
+#define OBS_RX_END          2   /* response ending the subscription */
+
+/* resource observer */
+typedef struct obs_observer_t
+{
+    struct obs_observer_t *next;
+
+    coap_session_t *session;    /* referenced by the observer */
+    uint8_t token[8];
+    size_t token_len;
+
+    unsigned non_cnt;           /* NON notifications sent since last CON */
+} obs_observer_t;
+
+/* observable resource */
+typedef struct obs_resource_t
+{
+    struct obs_resource_t *next;
+
+    unsigned seq;               /* Observe sequence number (24 bits) */
+    unsigned con_every;         /* send every n-th notification as CON */
+
+    unsigned n;                 /* number of observers */
+    obs_observer_t *observers;
+
+    char path[];                /* URI path with no leading '/' */
+} obs_resource_t;
+
+/* client subscription (observation of a remote resource) */
+typedef struct obs_sub_t
+{
+    struct obs_sub_t *next;     /* next in the subscriptions list */
+    struct obs_sub_t *hnext;    /* next in the hash bucket */
+
+    coap_session_t *session;    /* referenced by the subscription */
+    uint8_t token[8];
+    size_t token_len;
+
+    /* Lua registry references of the callback and the subscription object */
+    int cb_ref;
+    int obj_ref;
+
+    /* freshness state of the last notification (RFC 7641, 3.4) */
+    int seq_set;
+    unsigned seq;
+    coap_tick_t ts;
+
+    tmr_t refresh;              /* re-registration; not armed if not
+                                   scheduled */
+
+    char path[];                /* URI path (and query string) */
+} obs_sub_t;
+
+/*
+ * Client subscriptions table (hashed by the session and token).
+ * Subscriptions re-registrations are kept on the table's timer wheel.
+ */
+typedef struct
+{
+    obs_sub_t *list;            /* all subscriptions */
+    unsigned n;                 /* number of subscriptions */
+    unsigned n_buckets;         /* 0 if not allocated */
+    obs_sub_t **buckets;
+    tmr_wheel_t refresh;
+} obs_sub_tab_t;
+
+/**
+ * Create observable resource of a given URI path and add it to the list.
+ * Returns NULL on error (including the path already registered).
+ */
+obs_resource_t *obs_rsrc_new(obs_resource_t **list, const char *path);
+
+/**
+ * Remove resource from the list and free it along with its observers.
+ */
+void obs_rsrc_free(obs_resource_t **list, obs_resource_t *rsrc);
+
+/**
+ * Find resource by the request URI path. Returns NULL if not found.
+ */
+obs_resource_t *obs_rsrc_find(obs_resource_t *list, coap_pdu_t *req);
+
+/**
+ * Register (or refresh) observer of the resource. Returns 0 on success,
+ * -1 on error.
+ */
+int obs_register(obs_resource_t *rsrc,
+    coap_session_t *session, const coap_pdu_t *req);
+
+/**
+ * Deregister observer identified by the session and the token of 'pdu'.
+ */
+void obs_deregister(obs_resource_t *rsrc,
+    const coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Evict observer (of any resource) the notification 'sent' was sent to.
+ * Returns 1 if the observer was found, 0 otherwise.
+ */
+int obs_evict(obs_resource_t *list,
+    const coap_session_t *session, const coap_pdu_t *sent);
+
+/**
+ * Send notification to all the resource observers. The notification PDU is
+ * built once and cloned per observer with its token and message id patched.
+ * CON type is forced by 'con', otherwise every con_every notification is
+ * sent as CON. 'cf' is Content-Format (-1: not set). Observers are removed
+ * after non-2.xx notification. Returns number of sent notifications, -1 on
+ * error.
+ */
+int obs_notify(obs_resource_t *rsrc, uint8_t code, int cf,
+    const uint8_t *data, size_t len, int con, size_t max_pdu_sz);
+
+/**
+ * Encode Observe option value of the current resource state.
+ */
+unsigned obs_encode_seq(const obs_resource_t *rsrc, uint8_t *buf);
+
+/**
+ * Create client subscription of a given URI path (optionally followed by
+ * a query string) and add it to the table. Returns NULL on error.
+ */
+obs_sub_t *obs_sub_new(
+    obs_sub_tab_t *tab, coap_session_t *session, const char *path);
+
+/**
+ * Remove subscription from the table and free it.
+ */
+void obs_sub_free(obs_sub_tab_t *tab, obs_sub_t *sub);
+
+/**
+ * Find subscription the PDU (sent or received) belongs to. Returns NULL if
+ * not found.
+ */
+obs_sub_t *obs_sub_find(const obs_sub_tab_t *tab,
+    const coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Schedule re-registration of the subscription at 'at' (msecs; 0: cancel
+ * the scheduled one), 'now' is the current time (msecs).
+ */
+void obs_sub_schedule(
+    obs_sub_tab_t *tab, obs_sub_t *sub, uint64_t at, uint64_t now);
+
+/**
+ * Get next subscription due for re-registration at 'now' (msecs); the
+ * re-registration is not scheduled anymore. Returns NULL if there is no one.
+ */
+obs_sub_t *obs_sub_due(obs_sub_tab_t *tab, uint64_t now);
+
+/**
+ * Get time (msecs) the subscriptions shall be checked for re-registration
+ * at (not later than the nearest one); 0 if there are no scheduled.
+ */
+uint64_t obs_sub_next(const obs_sub_tab_t *tab);
+
+/**
+ * Free the table along with the subscriptions left (their Lua references
+ * shall be released by the caller).
+ */
+void obs_sub_clear(obs_sub_tab_t *tab);
+
+/**
+ * Create GET request (re)registering (observe: 0) or deregistering
+ * (observe: 1) the subscription. Returns NULL on error.
+ */
+coap_pdu_t *obs_sub_req(obs_sub_t *sub, unsigned observe, size_t max_pdu_sz);
+
+/**
+ * Process response received for the subscription; check the notification
+ * freshness and schedule re-registration according to Max-Age. Returns
+ * OBS_RX_XXX.
+ */
+int obs_sub_rx(obs_sub_tab_t *tab, obs_sub_t *sub, coap_pdu_t *rcvd);
+
+#endif
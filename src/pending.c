@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "common.h"
+#include "pending.h"
+
+/* FNV-1a hash of the session and token */
+static uint32_t _hash(
+    const coap_session_t *session, const uint8_t *token, size_t len)
+{
+    size_t i;
+    uintptr_t s = (uintptr_t)session;
+    uint32_t h = 2166136261U;
+
+    for (i = 0; i < sizeof(s); i++, s >>= 8)
+        h = (h ^ (uint8_t)s) * 16777619U;
+    for (i = 0; i < len; i++)
+        h = (h ^ token[i]) * 16777619U;
+
+    return h;
+}
+
+static inline pnd_req_t **_bucket(const pnd_tab_t *tab,
+    const coap_session_t *session, const uint8_t *token, size_t len)
+{
+    return &tab->buckets[_hash(session, token, len) & (tab->n_buckets - 1)];
+}
+
+/* resize the hash table to 'n_buckets' */
+static int _resize(pnd_tab_t *tab, unsigned n_buckets)
+{
+    unsigned i;
+    pnd_req_t *req, *next, **buckets, **old = tab->buckets;
+    unsigned n_old = tab->n_buckets;
+
+    if (!(buckets = (pnd_req_t**)calloc(n_buckets, sizeof(pnd_req_t*))))
+        return -1;
+
+    tab->buckets = buckets;
+    tab->n_buckets = n_buckets;
+
+    for (i = 0; i < n_old; i++) {
+        for (req = old[i]; req; req = next) {
+            pnd_req_t **b =
+                _bucket(tab, req->session, req->token, req->token_len);
+
+            next = req->next;
+            req->next = *b;
+            *b = req;
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+pnd_req_t *pnd_add(pnd_tab_t *tab, coap_session_t *session,
+    const coap_pdu_t *pdu, uint64_t expire, uint64_t now)
+{
+    pnd_req_t *req, **b;
+
+    if (pdu->token_length > sizeof(req->token) ||
+        pnd_find(tab, session, pdu))
+    {
+        return NULL;
+    }
+
+    /* keep load factor below 1 */
+    if (tab->n >= tab->n_buckets &&
+        _resize(tab, (tab->n_buckets ? 2 * tab->n_buckets : PND_INIT_BUCKETS)))
+    {
+        return NULL;
+    }
+
+    if (!(req = (pnd_req_t*)calloc(1, sizeof(pnd_req_t))))
+        return NULL;
+
+    memcpy(req->token, pdu->token, pdu->token_length);
+    req->token_len = pdu->token_length;
+    req->session = coap_session_reference(session);
+    req->co_ref = LUA_NOREF;
+    if (expire)
+        tmr_add(&tab->tmos, &req->tmo, expire, now);
+
+    b = _bucket(tab, session, req->token, req->token_len);
+    req->next = *b;
+    *b = req;
+    tab->n++;
+
+    return req;
+}
+
+pnd_req_t *pnd_find(
+    const pnd_tab_t *tab, const coap_session_t *session, const coap_pdu_t *pdu)
+{
+    pnd_req_t *req;
+
+    if (!tab->n)
+        return NULL;
+
+    req = *_bucket(tab, session, pdu->token, pdu->token_length);
+    for (; req; req = req->next)
+    {
+        if (req->session == session &&
+            req->token_len == pdu->token_length &&
+            !memcmp(req->token, pdu->token, req->token_len))
+        {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+void pnd_remove(pnd_tab_t *tab, pnd_req_t *req)
+{
+    pnd_req_t **pp = _bucket(tab, req->session, req->token, req->token_len);
+
+    for (; *pp; pp = &(*pp)->next) {
+        if (*pp == req) {
+            *pp = req->next;
+            tab->n--;
+            break;
+        }
+    }
+
+    tmr_del(&tab->tmos, &req->tmo);
+    coap_session_release(req->session);
+    free(req);
+}
+
+pnd_req_t *pnd_expired(pnd_tab_t *tab, uint64_t now)
+{
+    tmr_t *tmo;
+
+    tmr_advance(&tab->tmos, now);
+    if (!(tmo = tmr_pop_due(&tab->tmos)))
+        return NULL;
+
+    return (pnd_req_t*)((char*)tmo - offsetof(pnd_req_t, tmo));
+}
+
+uint64_t pnd_next_expire(const pnd_tab_t *tab)
+{
+    return tmr_next(&tab->tmos);
+}
+
+void pnd_clear(lua_State *L, pnd_tab_t *tab)
+{
+    unsigned i;
+    pnd_req_t *req, *next;
+
+    for (i = 0; i < tab->n_buckets; i++) {
+        for (req = tab->buckets[i]; req; req = next) {
+            next = req->next;
+            luaL_unref(L, LUA_REGISTRYINDEX, req->co_ref);
+            coap_session_release(req->session);
+            free(req);
+        }
+    }
+
+    free(tab->buckets);
+    memset(tab, 0, sizeof(*tab));
+}
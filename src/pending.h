@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __PENDING_H__
+#define __PENDING_H__
+
+#include "coap2/coap.h"
+#include "lua.h"
+#include "timer.h"
+
+/* default pending request timeout (secs) */
+#define PND_DEF_TIMEOUT     30
+
+/* NACK reason code passed on a request timeout (libcoap's ones are >= 0) */
+#define PND_NACK_TIMEOUT    (-1)
+
+/* initial number of hash table buckets (power of 2) */
+#define PND_INIT_BUCKETS    64
+
+/* request awaiting its response */
+typedef struct pnd_req_t
+{
+    struct pnd_req_t *next;     /* next in the hash bucket */
+
+    coap_session_t *session;    /* referenced by the request */
+    uint8_t token[8];
+    size_t token_len;
+
+    int co_ref;                 /* Lua registry reference of the coroutine
+                                   (LUA_NOREF till the request is sent) */
+    tmr_t tmo;                  /* timeout; not armed if no timeout */
+} pnd_req_t;
+
+/*
+ * Pending requests table (hashed by the session and token). Requests
+ * timeouts are kept on the table's timer wheel.
+ */
+typedef struct
+{
+    unsigned n;                 /* number of pending requests */
+    unsigned n_buckets;         /* 0 if not allocated */
+    pnd_req_t **buckets;
+    tmr_wheel_t tmos;
+} pnd_tab_t;
+
+/**
+ * Add request of a given PDU (session and token) to the table. 'expire' is
+ * the request timeout time (msecs; 0: no timeout), 'now' the current time
+ * (msecs). Returns NULL on error (including the token already pending for
+ * the session).
+ */
+pnd_req_t *pnd_add(pnd_tab_t *tab, coap_session_t *session,
+    const coap_pdu_t *pdu, uint64_t expire, uint64_t now);
+
+/**
+ * Find request the PDU (sent or received) belongs to. Returns NULL if not
+ * found.
+ */
+pnd_req_t *pnd_find(
+    const pnd_tab_t *tab, const coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Remove request from the table and free it.
+ */
+void pnd_remove(pnd_tab_t *tab, pnd_req_t *req);
+
+/**
+ * Get next request expired at 'now' (msecs). Returns NULL if there is no one.
+ */
+pnd_req_t *pnd_expired(pnd_tab_t *tab, uint64_t now);
+
+/**
+ * Get time (msecs) the pending requests shall be checked for expiration at
+ * (not later than the nearest expiration); 0 if there are no timeouts.
+ */
+uint64_t pnd_next_expire(const pnd_tab_t *tab);
+
+/**
+ * Free the table along with references of the awaiting coroutines (the
+ * coroutines are never resumed).
+ */
+void pnd_clear(lua_State *L, pnd_tab_t *tab);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "resolve.h"
+
+struct res_ctx_t
+{
+    /* shared with the resolver threads */
+    pthread_mutex_t lck;
+    pthread_cond_t cond;
+    int stop;                   /* the owner frees the context */
+    unsigned refs;              /* owner and resolver threads */
+    unsigned n_idle;            /* threads waiting for a job */
+    unsigned n_jobs;            /* queued resolutions */
+    res_entry_t *jobs;          /* queued resolutions (FIFO) */
+    res_entry_t **jobs_tail;
+    res_entry_t *done;          /* completed resolutions */
+
+    /* eventfd(2) readable while there are completed resolutions */
+    int efd;
+
+    /* owner's thread only */
+    unsigned n_thrds;           /* started resolver threads */
+    unsigned n_pending;         /* resolutions in progress */
+    unsigned ttl;
+    unsigned neg_ttl;
+
+    /* cache hash table (owner's thread only) */
+    unsigned n;
+    unsigned n_buckets;         /* 0 if not allocated */
+    res_entry_t **buckets;
+};
+
+/* FNV-1a hash of the name */
+static uint32_t _hash(const char *host)
+{
+    uint32_t h = 2166136261U;
+
+    for (; *host; host++)
+        h = (h ^ (uint8_t)*host) * 16777619U;
+    return h;
+}
+
+static inline res_entry_t **_bucket(const res_ctx_t *rctx, const char *host)
+{
+    return &rctx->buckets[_hash(host) & (rctx->n_buckets - 1)];
+}
+
+/* resize the cache hash table to 'n_buckets' */
+static int _resize(res_ctx_t *rctx, unsigned n_buckets)
+{
+    unsigned i;
+    res_entry_t *ent, *next, **b, **buckets, **old = rctx->buckets;
+    unsigned n_old = rctx->n_buckets;
+
+    if (!(buckets = (res_entry_t**)calloc(n_buckets, sizeof(res_entry_t*))))
+        return -1;
+
+    rctx->buckets = buckets;
+    rctx->n_buckets = n_buckets;
+
+    for (i = 0; i < n_old; i++) {
+        for (ent = old[i]; ent; ent = next) {
+            b = _bucket(rctx, ent->host);
+            next = ent->next;
+            ent->next = *b;
+            *b = ent;
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+/* free the context (by its last referrer) */
+static void _free(res_ctx_t *rctx)
+{
+    unsigned i;
+    res_entry_t *ent, *next;
+
+    for (i = 0; i < rctx->n_buckets; i++) {
+        for (ent = rctx->buckets[i]; ent; ent = next) {
+            next = ent->next;
+            free(ent);
+        }
+    }
+    free(rctx->buckets);
+
+    close(rctx->efd);
+    pthread_cond_destroy(&rctx->cond);
+    pthread_mutex_destroy(&rctx->lck);
+    free(rctx);
+}
+
+/* resolve the entry's name */
+static void _resolve(res_entry_t *ent)
+{
+    struct addrinfo *res = NULL, *ainfo;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    ent->n_addrs = 0;
+    if ((ent->err = getaddrinfo(ent->host, NULL, &hints, &res)) != 0)
+        return;
+
+    for (ainfo = res;
+        ainfo && ent->n_addrs < RES_MAX_ADDRS; ainfo = ainfo->ai_next)
+    {
+        if (ainfo->ai_family == AF_INET || ainfo->ai_family == AF_INET6) {
+            coap_address_t *addr = &ent->addrs[ent->n_addrs++];
+
+            addr->size = ainfo->ai_addrlen;
+            memcpy(&addr->addr.sa, ainfo->ai_addr, addr->size);
+        }
+    }
+    freeaddrinfo(res);
+
+    if (!ent->n_addrs)
+        ent->err = EAI_NONAME;
+}
+
+/* resolver thread */
+static void *_res_thrd(void *arg)
+{
+    int last;
+    uint64_t one = 1;
+    res_entry_t *ent;
+    res_ctx_t *rctx = (res_ctx_t*)arg;
+
+    pthread_mutex_lock(&rctx->lck);
+
+    for (;;)
+    {
+        while (!rctx->stop && !rctx->jobs) {
+            rctx->n_idle++;
+            pthread_cond_wait(&rctx->cond, &rctx->lck);
+            rctx->n_idle--;
+        }
+
+        if (rctx->stop)
+            break;
+
+        ent = rctx->jobs;
+        if (!(rctx->jobs = ent->qnext))
+            rctx->jobs_tail = &rctx->jobs;
+        rctx->n_jobs--;
+
+        pthread_mutex_unlock(&rctx->lck);
+        _resolve(ent);
+        pthread_mutex_lock(&rctx->lck);
+
+        if (rctx->stop)
+            break;
+
+        /* signalled under the lock, so the eventfd is drained by
+           res_done() along with the last completed resolution */
+        if (!rctx->done && write(rctx->efd, &one, sizeof(one)) < 0)
+            log_error("Resolver completion signal failed\n");
+
+        ent->qnext = rctx->done;
+        rctx->done = ent;
+    }
+
+    last = !--rctx->refs;
+    pthread_mutex_unlock(&rctx->lck);
+
+    if (last)
+        _free(rctx);
+    return NULL;
+}
+
+res_ctx_t *res_new(void)
+{
+    res_ctx_t *rctx = (res_ctx_t*)calloc(1, sizeof(res_ctx_t));
+
+    if (!rctx)
+        return NULL;
+
+    if (pthread_mutex_init(&rctx->lck, NULL)) {
+        free(rctx);
+        return NULL;
+    }
+    if (pthread_cond_init(&rctx->cond, NULL)) {
+        pthread_mutex_destroy(&rctx->lck);
+        free(rctx);
+        return NULL;
+    }
+    if ((rctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        pthread_cond_destroy(&rctx->cond);
+        pthread_mutex_destroy(&rctx->lck);
+        free(rctx);
+        return NULL;
+    }
+
+    rctx->refs = 1;
+    rctx->jobs_tail = &rctx->jobs;
+    rctx->ttl = RES_DEF_TTL;
+    rctx->neg_ttl = RES_DEF_NEG_TTL;
+
+    return rctx;
+}
+
+void res_free(res_ctx_t *rctx)
+{
+    int last;
+
+    /* threads blocked in getaddrinfo(3) aren't waited for; the context is
+       freed by the last thread finishing its resolution in progress */
+    pthread_mutex_lock(&rctx->lck);
+    rctx->stop = 1;
+    pthread_cond_broadcast(&rctx->cond);
+    last = !--rctx->refs;
+    pthread_mutex_unlock(&rctx->lck);
+
+    if (last)
+        _free(rctx);
+}
+
+int res_fd(const res_ctx_t *rctx)
+{
+    return rctx->efd;
+}
+
+void res_set_ttl(res_ctx_t *rctx, unsigned ttl, unsigned neg_ttl)
+{
+    rctx->ttl = ttl;
+    rctx->neg_ttl = neg_ttl;
+}
+
+res_entry_t *res_lookup(res_ctx_t *rctx, const char *host, coap_tick_t now)
+{
+    res_entry_t **pp, *ent;
+
+    if (!rctx->n)
+        return NULL;
+
+    for (pp = _bucket(rctx, host); (ent = *pp); pp = &ent->next)
+    {
+        if (strcmp(ent->host, host))
+            continue;
+
+        if (ent->state == RES_DONE && ent->expire <= now) {
+            *pp = ent->next;
+            rctx->n--;
+            free(ent);
+            return NULL;
+        }
+        return ent;
+    }
+    return NULL;
+}
+
+/* mark the entry as done */
+static void _set_done(res_ctx_t *rctx, res_entry_t *ent, coap_tick_t now)
+{
+    ent->state = RES_DONE;
+    ent->expire = now +
+        (coap_tick_t)(ent->err ? rctx->neg_ttl : rctx->ttl) *
+            COAP_TICKS_PER_SECOND;
+}
+
+res_entry_t *res_resolve(
+    res_ctx_t *rctx, const char *host, int sync, coap_tick_t now)
+{
+    res_entry_t *ent, **b;
+    size_t len = strlen(host);
+
+    /* keep load factor below 1 */
+    if (rctx->n >= rctx->n_buckets && _resize(rctx,
+        (rctx->n_buckets ? 2 * rctx->n_buckets : RES_INIT_BUCKETS)))
+    {
+        return NULL;
+    }
+
+    if (!(ent = (res_entry_t*)calloc(1, sizeof(res_entry_t) + len + 1)))
+        return NULL;
+    memcpy(ent->host, host, len + 1);
+
+    b = _bucket(rctx, host);
+    ent->next = *b;
+    *b = ent;
+    rctx->n++;
+
+    if (sync) {
+        _resolve(ent);
+        _set_done(rctx, ent, now);
+        return ent;
+    }
+
+    ent->state = RES_PENDING;
+
+    pthread_mutex_lock(&rctx->lck);
+
+    /* start a new thread if there is no one idle to take the job */
+    if (rctx->n_jobs >= rctx->n_idle && rctx->n_thrds < RES_MAX_THREADS)
+    {
+        pthread_t thrd;
+
+        if (!pthread_create(&thrd, NULL, _res_thrd, rctx)) {
+            pthread_detach(thrd);
+            rctx->n_thrds++;
+            rctx->refs++;
+        } else {
+            log_warn("Resolver thread creation failed\n");
+        }
+    }
+
+    if (!rctx->n_thrds) {
+        /* no threads to resolve the name */
+        pthread_mutex_unlock(&rctx->lck);
+        _resolve(ent);
+        _set_done(rctx, ent, now);
+        return ent;
+    }
+
+    ent->qnext = NULL;
+    *rctx->jobs_tail = ent;
+    rctx->jobs_tail = &ent->qnext;
+    rctx->n_jobs++;
+    pthread_cond_signal(&rctx->cond);
+
+    pthread_mutex_unlock(&rctx->lck);
+
+    rctx->n_pending++;
+    return ent;
+}
+
+res_entry_t *res_done(res_ctx_t *rctx, coap_tick_t now)
+{
+    res_entry_t *ent;
+
+    if (!rctx->n_pending)
+        return NULL;
+
+    pthread_mutex_lock(&rctx->lck);
+    if ((ent = rctx->done) && !(rctx->done = ent->qnext))
+    {
+        uint64_t cnt;
+
+        /* no more completed resolutions */
+        if (read(rctx->efd, &cnt, sizeof(cnt)) < 0)
+            log_error("Resolver completion signal reset failed\n");
+    }
+    pthread_mutex_unlock(&rctx->lck);
+
+    if (ent) {
+        rctx->n_pending--;
+        _set_done(rctx, ent, now);
+    }
+    return ent;
+}
+
+unsigned res_pending(const res_ctx_t *rctx)
+{
+    return rctx->n_pending;
+}
+
+coap_address_t *res_get_addr(res_entry_t *ent, int port, coap_address_t *dst)
+{
+    if (ent->state != RES_DONE || ent->err || !ent->n_addrs)
+        return NULL;
+
+    *dst = ent->addrs[ent->next_addr++ % ent->n_addrs];
+
+    if (dst->addr.sa.sa_family == AF_INET6) {
+        dst->addr.sin6.sin6_port = htons((uint16_t)port);
+    } else {
+        dst->addr.sin.sin_port = htons((uint16_t)port);
+    }
+    return dst;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include "coap2/coap.h"
+
+/* max number of addresses kept per name */
+#define RES_MAX_ADDRS       8
+
+/*
+ * Default time-to-live (secs) of cached resolutions. getaddrinfo(3) doesn't
+ * provide the TTL of the DNS records, therefore it's configured.
+ */
+#define RES_DEF_TTL         60
+
+/* default time-to-live (secs) of cached failed resolutions */
+#define RES_DEF_NEG_TTL     5
+
+/* max number of resolver threads */
+#ifndef RES_MAX_THREADS
+# define RES_MAX_THREADS    4
+#endif
+
+/* initial number of cache hash table buckets (power of 2) */
+#define RES_INIT_BUCKETS    64
+
+/* resolution states */
+#define RES_PENDING         0
+#define RES_DONE            1
+
+/* resolved name (cache entry) */
+typedef struct res_entry_t
+{
+    struct res_entry_t *next;   /* next in the hash bucket */
+    struct res_entry_t *qnext;  /* next in the resolver queue */
+
+    int state;
+    int err;                    /* getaddrinfo(3) error code; 0: resolved */
+    coap_tick_t expire;         /* RES_DONE entry expiration time */
+
+    unsigned n_addrs;
+    unsigned next_addr;         /* next address to be handed out */
+    coap_address_t addrs[RES_MAX_ADDRS];
+
+    char host[];
+} res_entry_t;
+
+/*
+ * Resolver context. Names are resolved by a pool of threads (started on
+ * demand) with the results handed back by res_done() and cached. Completed
+ * resolutions are signalled by the context's file descriptor (see res_fd()).
+ */
+typedef struct res_ctx_t res_ctx_t;
+
+/**
+ * Create resolver context. Returns NULL on error.
+ */
+res_ctx_t *res_new(void);
+
+/**
+ * Free resolver context. Queued resolutions are abandoned and the resolver
+ * threads are stopped. The call doesn't wait for the threads; resolutions in
+ * progress are finished in the background and the context is released by
+ * the last of the threads.
+ */
+void res_free(res_ctx_t *rctx);
+
+/**
+ * Get file descriptor of the resolver context, readable while there are
+ * completed resolutions to be got by res_done().
+ */
+int res_fd(const res_ctx_t *rctx);
+
+/**
+ * Set time-to-live (secs) of the cached resolutions (successful and failed
+ * ones).
+ */
+void res_set_ttl(res_ctx_t *rctx, unsigned ttl, unsigned neg_ttl);
+
+/**
+ * Look up the cache for a name. Returns the name's entry (possibly still
+ * pending), NULL if not cached (or expired).
+ */
+res_entry_t *res_lookup(res_ctx_t *rctx, const char *host, coap_tick_t now);
+
+/**
+ * Start resolution of a name not cached yet. If 'sync' is set the name is
+ * resolved by the calling thread and the returned entry is already done.
+ * Returns NULL on error.
+ */
+res_entry_t *res_resolve(
+    res_ctx_t *rctx, const char *host, int sync, coap_tick_t now);
+
+/**
+ * Get next resolution completed by the resolver threads (the entry is done
+ * then). Returns NULL if there is no one.
+ */
+res_entry_t *res_done(res_ctx_t *rctx, coap_tick_t now);
+
+/**
+ * Get number of resolutions in progress.
+ */
+unsigned res_pending(const res_ctx_t *rctx);
+
+/**
+ * Get address of a resolved name with a given port. Addresses of a name with
+ * many of them are handed out in turn. Returns NULL if the name has not been
+ * resolved.
+ */
+coap_address_t *res_get_addr(res_entry_t *ent, int port, coap_address_t *dst);
+
+#endif
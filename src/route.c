@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "common.h"
+#include "route.h"
+
+/* URI path segment */
+typedef struct
+{
+    const uint8_t *val;
+    size_t len;
+} rt_seg_t;
+
+/* create trie node */
+static rt_node_t *_node_new(const char *seg, size_t len)
+{
+    unsigned i;
+    rt_node_t *node = (rt_node_t*)calloc(1, sizeof(rt_node_t) + len + 1);
+
+    if (node)
+    {
+        for (i = 0; i <= RT_N_METHODS; i++)
+            node->refs[i] = LUA_NOREF;
+
+        memcpy(node->seg, seg, len);
+        node->len = len;
+    }
+    return node;
+}
+
+/*
+ * Get child node of a route segment; created if not exist and 'create' is
+ * set. Returns NULL if not found (or on error).
+ */
+static rt_node_t *_node_child(
+    rt_node_t *node, const char *seg, size_t len, int create)
+{
+    rt_node_t *child;
+
+    if (*seg == ':')
+    {
+        /* path parameter */
+        seg++;
+        len--;
+
+        if ((child = node->param)) {
+            /* parameter name must be the same for all the routes */
+            return ((child->len == len && !memcmp(child->seg, seg, len)) ?
+                child : NULL);
+        }
+
+        if (create && (child = _node_new(seg, len)))
+            node->param = child;
+        return child;
+    }
+
+    for (child = node->child; child; child = child->next) {
+        if (child->len == len && !memcmp(child->seg, seg, len))
+            return child;
+    }
+
+    if (create && (child = _node_new(seg, len))) {
+        child->next = node->child;
+        node->child = child;
+    }
+    return child;
+}
+
+int rt_add(rt_node_t **root,
+    const char *path, unsigned method, int ref, int *old_ref)
+{
+    size_t len;
+    const char *seg;
+    unsigned n_segs = 0, n_params = 0;
+    int create = (ref != LUA_NOREF);
+    rt_node_t *node;
+
+    *old_ref = LUA_NOREF;
+
+    if (method > RT_N_METHODS)
+        return -1;
+
+    if (!*root && (!create || !(*root = _node_new("", 0))))
+        return (create ? -1 : 0);
+
+    for (node = *root; *path;)
+    {
+        /* skip separators */
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+
+        seg = path;
+        for (len = 0; seg[len] && seg[len] != '/'; len++);
+        path += len;
+
+        if (++n_segs > RT_MAX_SEGS ||
+            (*seg == ':' && (len < 2 || ++n_params > RT_MAX_PARAMS)))
+        {
+            return -1;
+        }
+
+        if (!(node = _node_child(node, seg, len, create)))
+            return (create ? -1 : 0);
+    }
+
+    *old_ref = node->refs[method];
+    node->refs[method] = ref;
+
+    return 0;
+}
+
+/* check if the node has any handler routed */
+static int _node_routed(const rt_node_t *node)
+{
+    unsigned i;
+
+    for (i = 0; i <= RT_N_METHODS; i++) {
+        if (node->refs[i] != LUA_NOREF)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Match remaining 'n' segments against the node's subtrie. Literal segments
+ * take precedence over path parameters.
+ */
+static int _match(const rt_node_t *node,
+    const rt_seg_t *segs, unsigned n, unsigned method, rt_match_t *match)
+{
+    int ret, res = RT_NOT_FOUND;
+    const rt_node_t *child;
+
+    if (!n)
+    {
+        if (node->refs[method] != LUA_NOREF) {
+            match->ref = node->refs[method];
+            return RT_MATCH;
+        }
+        if (node->refs[0] != LUA_NOREF) {
+            match->ref = node->refs[0];
+            return RT_MATCH;
+        }
+        return (_node_routed(node) ? RT_NOT_ALLOWED : RT_NOT_FOUND);
+    }
+
+    for (child = node->child; child; child = child->next)
+    {
+        if (child->len == segs->len &&
+            !memcmp(child->seg, segs->val, child->len))
+        {
+            ret = _match(child, segs + 1, n - 1, method, match);
+            if (ret == RT_MATCH)
+                return ret;
+            if (ret == RT_NOT_ALLOWED)
+                res = ret;
+            break;
+        }
+    }
+
+    if ((child = node->param) && match->n_params < RT_MAX_PARAMS)
+    {
+        match->params[match->n_params].name = child->seg;
+        match->params[match->n_params].val = segs->val;
+        match->params[match->n_params].len = segs->len;
+        match->n_params++;
+
+        ret = _match(child, segs + 1, n - 1, method, match);
+        if (ret == RT_MATCH)
+            return ret;
+        if (ret == RT_NOT_ALLOWED)
+            res = ret;
+
+        match->n_params--;
+    }
+    return res;
+}
+
+int rt_match(const rt_node_t *root, coap_pdu_t *req, rt_match_t *match)
+{
+    unsigned n = 0;
+    coap_opt_t *opt;
+    coap_opt_iterator_t it;
+    coap_opt_filter_t filter;
+    rt_seg_t segs[RT_MAX_SEGS];
+
+    match->ref = LUA_NOREF;
+    match->n_params = 0;
+
+    if (!root)
+        return RT_NOT_FOUND;
+
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_URI_PATH);
+    coap_option_iterator_init(req, &it, filter);
+
+    while ((opt = coap_option_next(&it)))
+    {
+        /* empty segments are not routed */
+        if (!coap_opt_length(opt))
+            continue;
+
+        if (n >= RT_MAX_SEGS)
+            return RT_NOT_FOUND;
+
+        segs[n].val = coap_opt_value(opt);
+        segs[n].len = coap_opt_length(opt);
+        n++;
+    }
+
+    return _match(root, segs, n,
+        (req->code <= RT_N_METHODS ? req->code : 0), match);
+}
+
+void rt_free(lua_State *L, rt_node_t *root)
+{
+    unsigned i;
+    rt_node_t *next;
+
+    for (; root; root = next)
+    {
+        next = root->next;
+
+        rt_free(L, root->child);
+        rt_free(L, root->param);
+
+        for (i = 0; i <= RT_N_METHODS; i++)
+            luaL_unref(L, LUA_REGISTRYINDEX, root->refs[i]);
+        free(root);
+    }
+}
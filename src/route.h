@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include "coap2/coap.h"
+#include "lua.h"
+
+/* number of routed methods (GET .. iPATCH codes) */
+#define RT_N_METHODS    7
+
+/* max number of path parameters and segments of a routed request */
+#define RT_MAX_PARAMS   8
+#define RT_MAX_SEGS     32
+
+/* request routing results */
+#define RT_MATCH        0   /* route found */
+#define RT_NOT_FOUND    1   /* no route for the path (4.04) */
+#define RT_NOT_ALLOWED  2   /* path routed, but not for the method (4.05) */
+
+/*
+ * Routes trie node. Each node matches a single URI path segment, either
+ * literally or capturing it as a path parameter (":name" route segment).
+ */
+typedef struct rt_node_t
+{
+    struct rt_node_t *next;     /* next sibling */
+    struct rt_node_t *child;    /* literal segments children */
+    struct rt_node_t *param;    /* path parameter child */
+
+    /* Lua registry references of handlers per method code; [0] for any
+       method. LUA_NOREF if not routed. */
+    int refs[RT_N_METHODS + 1];
+
+    size_t len;
+    char seg[];                 /* literal segment or parameter name */
+} rt_node_t;
+
+/* captured path parameter */
+typedef struct
+{
+    const char *name;
+    const uint8_t *val;
+    size_t len;
+} rt_param_t;
+
+/* request routing result */
+typedef struct
+{
+    int ref;                    /* matched handler reference */
+    unsigned n_params;
+    rt_param_t params[RT_MAX_PARAMS];
+} rt_match_t;
+
+/**
+ * Add (or replace) route of a given path and method code (0: any method).
+ * 'ref' is the handler reference (LUA_NOREF removes the route). Reference
+ * of the replaced handler (LUA_NOREF if none) is written under 'old_ref'.
+ * Returns 0 on success, -1 on error (invalid path or no memory).
+ */
+int rt_add(rt_node_t **root,
+    const char *path, unsigned method, int ref, int *old_ref);
+
+/**
+ * Route request by its URI path options and method. Returns RT_XXX.
+ */
+int rt_match(const rt_node_t *root, coap_pdu_t *req, rt_match_t *match);
+
+/**
+ * Free routes trie along with its handlers references.
+ */
+void rt_free(lua_State *L, rt_node_t *root);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "shared.h"
+
+/* FNV-1a hash of the endpoint and the peer address (IP and port) */
+static uint32_t _hash(const coap_endpoint_t *ep, const coap_address_t *addr)
+{
+    size_t i, len;
+    uint16_t port;
+    const uint8_t *ip;
+    uintptr_t e = (uintptr_t)ep;
+    uint32_t h = 2166136261U;
+
+    if (addr->addr.sa.sa_family == AF_INET6) {
+        ip = (const uint8_t*)&addr->addr.sin6.sin6_addr;
+        len = sizeof(addr->addr.sin6.sin6_addr);
+        port = addr->addr.sin6.sin6_port;
+    } else {
+        ip = (const uint8_t*)&addr->addr.sin.sin_addr;
+        len = sizeof(addr->addr.sin.sin_addr);
+        port = addr->addr.sin.sin_port;
+    }
+
+    for (i = 0; i < sizeof(e); i++, e >>= 8)
+        h = (h ^ (uint8_t)e) * 16777619U;
+    for (i = 0; i < len; i++)
+        h = (h ^ ip[i]) * 16777619U;
+    h = (h ^ (uint8_t)port) * 16777619U;
+    h = (h ^ (uint8_t)(port >> 8)) * 16777619U;
+
+    return h;
+}
+
+static inline shr_sess_t **_bucket(const shr_tab_t *tab,
+    const coap_endpoint_t *ep, const coap_address_t *addr)
+{
+    return &tab->buckets[_hash(ep, addr) & (tab->n_buckets - 1)];
+}
+
+static inline shr_sess_t **_bucket_of(
+    const shr_tab_t *tab, const coap_session_t *session)
+{
+    return _bucket(tab, session->endpoint, &session->addr_info.remote);
+}
+
+/* resize the hash table to 'n_buckets' */
+static int _resize(shr_tab_t *tab, unsigned n_buckets)
+{
+    unsigned i;
+    shr_sess_t *ss, *next, **buckets, **old = tab->buckets;
+    unsigned n_old = tab->n_buckets;
+
+    if (!(buckets = (shr_sess_t**)calloc(n_buckets, sizeof(shr_sess_t*))))
+        return -1;
+
+    tab->buckets = buckets;
+    tab->n_buckets = n_buckets;
+
+    for (i = 0; i < n_old; i++) {
+        for (ss = old[i]; ss; ss = next) {
+            shr_sess_t **b = _bucket_of(tab, ss->session);
+
+            next = ss->next;
+            ss->next = *b;
+            *b = ss;
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+int shr_add(shr_tab_t *tab, coap_session_t *session)
+{
+    shr_sess_t *ss, **b;
+
+    if (tab->n_buckets) {
+        for (ss = *_bucket_of(tab, session); ss; ss = ss->next) {
+            if (ss->session == session) {
+                ss->n_conns++;
+                return 0;
+            }
+        }
+    }
+
+    /* keep load factor below 1 */
+    if (tab->n >= tab->n_buckets &&
+        _resize(tab, (tab->n_buckets ? 2 * tab->n_buckets : SHR_INIT_BUCKETS)))
+    {
+        return -1;
+    }
+
+    if (!(ss = (shr_sess_t*)malloc(sizeof(shr_sess_t))))
+        return -1;
+
+    ss->session = session;
+    ss->n_conns = 1;
+
+    b = _bucket_of(tab, session);
+    ss->next = *b;
+    *b = ss;
+    tab->n++;
+
+    return 0;
+}
+
+coap_session_t *shr_find(const shr_tab_t *tab,
+    const coap_endpoint_t *ep, const coap_address_t *remote)
+{
+    shr_sess_t *ss;
+
+    if (!tab->n)
+        return NULL;
+
+    for (ss = *_bucket(tab, ep, remote); ss; ss = ss->next)
+    {
+        if (ss->session->endpoint == ep &&
+            coap_address_equals(&ss->session->addr_info.remote, remote))
+        {
+            return ss->session;
+        }
+    }
+    return NULL;
+}
+
+void shr_remove(shr_tab_t *tab, const coap_session_t *session)
+{
+    shr_sess_t *ss, **pp;
+
+    if (!tab->n)
+        return;
+
+    for (pp = _bucket_of(tab, session); (ss = *pp); pp = &ss->next)
+    {
+        if (ss->session == session) {
+            if (!--ss->n_conns) {
+                *pp = ss->next;
+                tab->n--;
+                free(ss);
+            }
+            break;
+        }
+    }
+}
+
+void shr_clear(shr_tab_t *tab)
+{
+    unsigned i;
+    shr_sess_t *ss, *next;
+
+    for (i = 0; i < tab->n_buckets; i++) {
+        for (ss = tab->buckets[i]; ss; ss = next) {
+            next = ss->next;
+            free(ss);
+        }
+    }
+
+    free(tab->buckets);
+    memset(tab, 0, sizeof(*tab));
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __SHARED_H__
+#define __SHARED_H__
+
+#include "coap2/coap.h"
+
+/* initial number of hash table buckets (power of 2) */
+#define SHR_INIT_BUCKETS    64
+
+/* client session of a shared socket */
+typedef struct shr_sess_t
+{
+    struct shr_sess_t *next;    /* next in the hash bucket */
+
+    coap_session_t *session;
+    unsigned n_conns;           /* number of connections using the session */
+} shr_sess_t;
+
+/*
+ * Shared sockets sessions table (hashed by the socket's endpoint and the
+ * peer address). Datagrams received on shared sockets are demultiplexed by
+ * the table, with no libcoap's endpoint sessions lookup.
+ */
+typedef struct
+{
+    unsigned n;                 /* number of sessions */
+    unsigned n_buckets;         /* 0 if not allocated */
+    shr_sess_t **buckets;
+} shr_tab_t;
+
+/**
+ * Add connection of the session (of a shared socket endpoint) to the table.
+ * The session is added on its 1st connection. Returns -1 on error.
+ */
+int shr_add(shr_tab_t *tab, coap_session_t *session);
+
+/**
+ * Find session of the endpoint for a given peer address. Returns NULL if not
+ * found.
+ */
+coap_session_t *shr_find(const shr_tab_t *tab,
+    const coap_endpoint_t *ep, const coap_address_t *remote);
+
+/**
+ * Remove connection of the session from the table. The session is removed
+ * with its last connection.
+ */
+void shr_remove(shr_tab_t *tab, const coap_session_t *session);
+
+/**
+ * Free the table. Sessions are not released.
+ */
+void shr_clear(shr_tab_t *tab);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <stddef.h>
+
+#include "common.h"
+#include "timer.h"
+
+#define TMR_MASK    (TMR_SLOTS - 1)
+
+/* wheel range (msecs) */
+#define TMR_RANGE   (1ULL << (TMR_LEVELS * TMR_LVL_BITS))
+
+/* link timer into a list */
+static inline void _link(tmr_t **head, tmr_t *tmr)
+{
+    if ((tmr->next = *head))
+        tmr->next->pprev = &tmr->next;
+    tmr->pprev = head;
+    *head = tmr;
+}
+
+/* unlink timer from its list */
+static inline void _unlink(tmr_t *tmr)
+{
+    if (tmr->next)
+        tmr->next->pprev = tmr->pprev;
+    *tmr->pprev = tmr->next;
+
+    tmr->next = NULL;
+    tmr->pprev = NULL;
+}
+
+/* insert timer into the wheel slot according to its expiration */
+static void _insert(tmr_wheel_t *w, tmr_t *tmr)
+{
+    unsigned lvl;
+    uint64_t exp = tmr->expire, delta;
+
+    if (exp < w->now)
+        exp = w->now;
+    delta = exp - w->now;
+
+    if (delta >= TMR_RANGE) {
+        /* parked till the top level cascading */
+        exp = w->now + TMR_RANGE - 1;
+        lvl = TMR_LEVELS - 1;
+    } else {
+        for (lvl = 0;
+            lvl < TMR_LEVELS - 1 &&
+                delta >= (1ULL << ((lvl + 1) * TMR_LVL_BITS));
+            lvl++);
+    }
+
+    _link(&w->slots[lvl][(exp >> (lvl * TMR_LVL_BITS)) & TMR_MASK], tmr);
+}
+
+void tmr_add(tmr_wheel_t *w, tmr_t *tmr, uint64_t expire, uint64_t now)
+{
+    tmr_del(w, tmr);
+
+    /* empty wheel catches up with the time at once */
+    if (!w->n && w->now < now)
+        w->now = now;
+
+    /* the current slot has been already processed */
+    tmr->expire = (expire > w->now ? expire : w->now + 1);
+
+    _insert(w, tmr);
+    w->n++;
+}
+
+void tmr_del(tmr_wheel_t *w, tmr_t *tmr)
+{
+    if (!tmr->pprev)
+        return;
+
+    _unlink(tmr);
+    if (tmr->due)
+        tmr->due = 0;
+    else
+        w->n--;
+}
+
+/* re-insert timers of a higher level slot */
+static void _cascade(tmr_wheel_t *w, unsigned lvl, unsigned idx)
+{
+    tmr_t *tmr, *list = w->slots[lvl][idx];
+
+    /* move the slot's list head */
+    w->slots[lvl][idx] = NULL;
+    if (list)
+        list->pprev = &list;
+
+    while ((tmr = list)) {
+        _unlink(tmr);
+        _insert(w, tmr);
+    }
+}
+
+/*
+ * Get time (msecs) of the nearest wheel event: the nearest non-empty slot of
+ * the lowest level or cascading of a higher level non-empty slot; 0 if there
+ * are no timers in the wheel.
+ */
+static uint64_t _next_event(const tmr_wheel_t *w)
+{
+    unsigned lvl, i;
+    uint64_t base, next = 0, t;
+
+    for (lvl = 0; w->n && lvl < TMR_LEVELS; lvl++)
+    {
+        base = w->now >> (lvl * TMR_LVL_BITS);
+
+        for (i = 1; i <= TMR_SLOTS; i++)
+        {
+            if (w->slots[lvl][(base + i) & TMR_MASK]) {
+                /* start of a higher level slot is its cascading time */
+                t = (lvl ? (base + i) << (lvl * TMR_LVL_BITS) : base + i);
+                if (!next || t < next)
+                    next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void tmr_advance(tmr_wheel_t *w, uint64_t now)
+{
+    unsigned lvl, idx;
+    uint64_t next;
+    tmr_t *tmr;
+
+    while (w->now < now)
+    {
+        /* jump straight to the nearest event; no timers expire and no slots
+           are cascaded in between */
+        next = _next_event(w);
+        if (!next || next > now) {
+            w->now = now;
+            break;
+        }
+        w->now = next;
+
+        /* cascade higher levels on the lower level wrap */
+        for (lvl = 1; lvl < TMR_LEVELS &&
+            !((w->now >> ((lvl - 1) * TMR_LVL_BITS)) & TMR_MASK); lvl++)
+        {
+            _cascade(w, lvl, (w->now >> (lvl * TMR_LVL_BITS)) & TMR_MASK);
+        }
+
+        /* move expired timers to the due list */
+        idx = w->now & TMR_MASK;
+        while ((tmr = w->slots[0][idx])) {
+            _unlink(tmr);
+            _link(&w->due, tmr);
+            tmr->due = 1;
+            w->n--;
+        }
+    }
+}
+
+tmr_t *tmr_pop_due(tmr_wheel_t *w)
+{
+    tmr_t *tmr = w->due;
+
+    if (tmr) {
+        _unlink(tmr);
+        tmr->due = 0;
+    }
+    return tmr;
+}
+
+uint64_t tmr_next(const tmr_wheel_t *w)
+{
+    return (w->due ? w->now : _next_event(w));
+}
+
+tmr_t *tmr_any(const tmr_wheel_t *w)
+{
+    unsigned lvl, i;
+
+    if (w->due)
+        return w->due;
+
+    for (lvl = 0; w->n && lvl < TMR_LEVELS; lvl++) {
+        for (i = 0; i < TMR_SLOTS; i++) {
+            if (w->slots[lvl][i])
+                return w->slots[lvl][i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel of 1 msec resolution. Each level consists of
+ * TMR_SLOTS slots, each of a level's slot spanning the whole range of the
+ * lower level. Timers beyond the wheel range are parked in the top level and
+ * re-inserted on its cascading.
+ */
+#define TMR_LVL_BITS    6
+#define TMR_SLOTS       (1U << TMR_LVL_BITS)
+#define TMR_LEVELS      4
+
+/* timer */
+typedef struct tmr_t
+{
+    struct tmr_t *next;
+    struct tmr_t **pprev;       /* NULL if not armed */
+    int due;                    /* on the due list */
+
+    uint64_t expire;            /* expiration time (msecs) */
+    unsigned period;            /* repeat period (msecs); 0: one-shot */
+
+    /* Lua registry references of the callback and the timer object */
+    int cb_ref;
+    int obj_ref;
+} tmr_t;
+
+/* timer wheel */
+typedef struct
+{
+    uint64_t now;               /* wheel time (msecs) */
+    unsigned n;                 /* number of timers in the wheel */
+    tmr_t *slots[TMR_LEVELS][TMR_SLOTS];
+    tmr_t *due;                 /* expired timers to be fired */
+} tmr_wheel_t;
+
+/**
+ * Arm timer to expire at 'expire' (msecs). Expiration in the past fires the
+ * timer on the next wheel advance. Armed timer is re-armed. O(1).
+ */
+void tmr_add(tmr_wheel_t *w, tmr_t *tmr, uint64_t expire, uint64_t now);
+
+/**
+ * Disarm timer (no-op if not armed). O(1).
+ */
+void tmr_del(tmr_wheel_t *w, tmr_t *tmr);
+
+/**
+ * Advance the wheel to 'now' (msecs). Expired timers are moved to the due
+ * list. The wheel jumps between its events (see tmr_next()), so the cost
+ * doesn't depend on the time span advanced.
+ */
+void tmr_advance(tmr_wheel_t *w, uint64_t now);
+
+/**
+ * Pop (disarm) the next due timer. Returns NULL if there is no one.
+ */
+tmr_t *tmr_pop_due(tmr_wheel_t *w);
+
+/**
+ * Get time (msecs) of the nearest wheel event (a timer expiration or
+ * cascading of a higher level slot); 0 if there are no timers.
+ */
+uint64_t tmr_next(const tmr_wheel_t *w);
+
+/**
+ * Get any armed timer (including due ones). Returns NULL if there is no one.
+ */
+tmr_t *tmr_any(const tmr_wheel_t *w);
+
+#endif
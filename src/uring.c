@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "mmsg.h"
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include <liburing.h>
+
+/* request slots kinds */
+#define SLOT_RX     0
+#define SLOT_TX     1
+
+/* receive request slot */
+typedef struct rx_slot_t
+{
+    int kind;                   /* SLOT_RX (must be the first field) */
+    struct rx_slot_t *next;     /* next registered slot */
+
+    int fd;
+    int posted;                 /* request in flight */
+    int busy;                   /* datagram handed out by uring_rx_next() */
+
+    uring_dgram_t dgram;
+    coap_address_t local;       /* socket's local address */
+
+    struct msghdr mhdr;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    mmsg_ctrl_t ctrl;
+    uint8_t buf[COAP_RXBUFFER_SIZE];
+} rx_slot_t;
+
+/* send request slot */
+typedef struct tx_slot_t
+{
+    int kind;                   /* SLOT_TX (must be the first field) */
+    struct tx_slot_t *next;     /* next free slot */
+
+    struct msghdr mhdr;
+    struct iovec iov;
+    struct sockaddr_storage dst;
+    mmsg_ctrl_t ctrl;
+    uint8_t buf[COAP_RXBUFFER_SIZE];
+} tx_slot_t;
+
+struct uring_ctx_t
+{
+    struct io_uring ring;
+    unsigned n_inflight;        /* requests in flight (cancels included) */
+
+    rx_slot_t *rx;              /* registered receive slots */
+    tx_slot_t *tx_free;         /* free send slots */
+};
+
+uring_ctx_t *uring_new(void)
+{
+    int res;
+    uring_ctx_t *uctx = (uring_ctx_t*)calloc(1, sizeof(uring_ctx_t));
+
+    if (!uctx)
+        return NULL;
+
+    if ((res = io_uring_queue_init(URING_ENTRIES, &uctx->ring, 0)) < 0) {
+        log_warn("io_uring_queue_init() failed: %s\n", strerror(-res));
+        free(uctx);
+        return NULL;
+    }
+    return uctx;
+}
+
+/* get submission queue entry; the queue is submitted if full */
+static struct io_uring_sqe *_get_sqe(uring_ctx_t *uctx)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uctx->ring);
+
+    if (!sqe) {
+        io_uring_submit(&uctx->ring);
+        sqe = io_uring_get_sqe(&uctx->ring);
+    }
+    if (sqe)
+        uctx->n_inflight++;
+    return sqe;
+}
+
+/* cancel request of a given slot */
+static void _cancel(uring_ctx_t *uctx, void *slot)
+{
+    struct io_uring_sqe *sqe = _get_sqe(uctx);
+
+    if (sqe) {
+        io_uring_prep_cancel(sqe, slot, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+}
+
+/* post receive request of the slot */
+static void _post_rx(uring_ctx_t *uctx, rx_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = _get_sqe(uctx);
+
+    if (!sqe) {
+        /* the slot remains idle */
+        log_error("io_uring submission queue full\n");
+        return;
+    }
+
+    slot->mhdr.msg_namelen = sizeof(slot->addr);
+    slot->mhdr.msg_controllen = sizeof(slot->ctrl);
+    slot->mhdr.msg_flags = 0;
+
+    io_uring_prep_recvmsg(sqe, slot->fd, &slot->mhdr, 0);
+    io_uring_sqe_set_data(sqe, slot);
+    slot->posted = 1;
+}
+
+/* process completion of a request (except a datagram reception) */
+static void _complete(uring_ctx_t *uctx, void *data, int res)
+{
+    rx_slot_t *rx;
+    tx_slot_t *tx;
+
+    uctx->n_inflight--;
+
+    if (!data) {
+        /* cancel request */
+        return;
+    }
+
+    if (*(int*)data == SLOT_TX)
+    {
+        tx = (tx_slot_t*)data;
+        if (res < 0) {
+            /* UDP datagrams may be lost anyway; CON messages are
+               retransmitted by libcoap */
+            log_warn("io_uring send failed: %s\n", strerror(-res));
+        }
+        tx->next = uctx->tx_free;
+        uctx->tx_free = tx;
+        return;
+    }
+
+    rx = (rx_slot_t*)data;
+    rx->posted = 0;
+
+    if (!rx->dgram.sock) {
+        /* unregistered socket's slot */
+        free(rx);
+    } else
+    if (res != -ECANCELED && res != -EBADF && res != -ENOTSOCK) {
+        if (res < 0)
+            log_warn("io_uring receive failed: %s\n", strerror(-res));
+        else
+            log_warn("Truncated datagram discarded\n");
+        _post_rx(uctx, rx);
+    }
+}
+
+void uring_free(uring_ctx_t *uctx)
+{
+    rx_slot_t *rx, *next;
+    tx_slot_t *tx;
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts = { 1, 0 };
+
+    /* posted buffers must not be freed until their requests complete */
+    for (rx = uctx->rx; rx; rx = next) {
+        next = rx->next;
+        rx->dgram.sock = NULL;
+        if (rx->posted)
+            _cancel(uctx, rx);
+        else
+            free(rx);
+    }
+    uctx->rx = NULL;
+
+    io_uring_submit(&uctx->ring);
+
+    while (uctx->n_inflight &&
+        !io_uring_wait_cqe_timeout(&uctx->ring, &cqe, &ts))
+    {
+        void *data = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&uctx->ring, cqe);
+        _complete(uctx, data, res);
+    }
+
+    if (uctx->n_inflight) {
+        /* leak the buffers rather than risk their reuse */
+        log_error("%u io_uring request(s) not completed\n", uctx->n_inflight);
+    }
+
+    io_uring_queue_exit(&uctx->ring);
+
+    while ((tx = uctx->tx_free)) {
+        uctx->tx_free = tx->next;
+        free(tx);
+    }
+    free(uctx);
+}
+
+int uring_fd(const uring_ctx_t *uctx)
+{
+    return uctx->ring.ring_fd;
+}
+
+int uring_add_sock(uring_ctx_t *uctx, coap_socket_t *sock)
+{
+    unsigned i;
+    rx_slot_t *slot;
+    coap_address_t local;
+
+    local.size = sizeof(local.addr);
+    if (getsockname(sock->fd, &local.addr.sa, &local.size)) {
+        log_error("getsockname() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < URING_RX_BUFS; i++)
+    {
+        if (!(slot = (rx_slot_t*)calloc(1, sizeof(rx_slot_t)))) {
+            log_error("io_uring buffers allocation failed\n");
+            return -1;
+        }
+
+        slot->kind = SLOT_RX;
+        slot->fd = sock->fd;
+        slot->local = local;
+        slot->dgram.sock = sock;
+        slot->dgram.data = slot->buf;
+
+        slot->iov.iov_base = slot->buf;
+        slot->iov.iov_len = sizeof(slot->buf);
+        slot->mhdr.msg_name = &slot->addr;
+        slot->mhdr.msg_iov = &slot->iov;
+        slot->mhdr.msg_iovlen = 1;
+        slot->mhdr.msg_control = slot->ctrl.buf;
+
+        slot->next = uctx->rx;
+        uctx->rx = slot;
+
+        _post_rx(uctx, slot);
+    }
+    return 0;
+}
+
+void uring_del_sock(uring_ctx_t *uctx, const coap_socket_t *sock)
+{
+    rx_slot_t **pp, *slot;
+
+    for (pp = &uctx->rx; (slot = *pp);)
+    {
+        if (slot->dgram.sock != sock) {
+            pp = &slot->next;
+            continue;
+        }
+
+        *pp = slot->next;
+        slot->dgram.sock = NULL;
+
+        /* posted and busy slots are freed on completion and release */
+        if (slot->posted) {
+            _cancel(uctx, slot);
+        } else if (!slot->busy) {
+            free(slot);
+        }
+    }
+
+    /* cancel before the socket is closed */
+    io_uring_submit(&uctx->ring);
+}
+
+const uring_dgram_t *uring_rx_next(uring_ctx_t *uctx, coap_packet_t *packet)
+{
+    int res;
+    void *data;
+    rx_slot_t *slot;
+    struct io_uring_cqe *cqe;
+
+    while (!io_uring_peek_cqe(&uctx->ring, &cqe))
+    {
+        data = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&uctx->ring, cqe);
+
+        slot = (rx_slot_t*)data;
+        if (!data || slot->kind != SLOT_RX || !slot->dgram.sock || res < 0 ||
+            (slot->mhdr.msg_flags & MSG_TRUNC))
+        {
+            _complete(uctx, data, res);
+            continue;
+        }
+
+        uctx->n_inflight--;
+        slot->posted = 0;
+        slot->busy = 1;
+        slot->dgram.len = (size_t)res;
+
+        memset(packet, 0, offsetof(coap_packet_t, payload));
+        packet->length = (size_t)res;
+        packet->addr_info.remote.size = slot->mhdr.msg_namelen;
+        memcpy(&packet->addr_info.remote.addr,
+            slot->mhdr.msg_name, slot->mhdr.msg_namelen);
+        packet->addr_info.local = slot->local;
+        mmsg_get_pktinfo(packet, &slot->mhdr);
+
+        return &slot->dgram;
+    }
+    return NULL;
+}
+
+void uring_rx_done(uring_ctx_t *uctx, const uring_dgram_t *dgram)
+{
+    rx_slot_t *slot = (rx_slot_t*)((char*)dgram - offsetof(rx_slot_t, dgram));
+
+    slot->busy = 0;
+
+    if (!slot->dgram.sock) {
+        /* unregistered while handed out */
+        free(slot);
+    } else {
+        _post_rx(uctx, slot);
+    }
+}
+
+ssize_t uring_send(uring_ctx_t *uctx, coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen)
+{
+    tx_slot_t *slot;
+    struct io_uring_sqe *sqe;
+    const coap_address_t *remote = &session->addr_info.remote;
+
+    if (datalen > sizeof(slot->buf))
+        return coap_network_send(sock, session, data, datalen);
+
+    if ((slot = uctx->tx_free)) {
+        uctx->tx_free = slot->next;
+    } else if (!(slot = (tx_slot_t*)malloc(sizeof(tx_slot_t)))) {
+        return coap_network_send(sock, session, data, datalen);
+    }
+
+    if (!(sqe = _get_sqe(uctx))) {
+        slot->next = uctx->tx_free;
+        uctx->tx_free = slot;
+        return coap_network_send(sock, session, data, datalen);
+    }
+
+    slot->kind = SLOT_TX;
+    memcpy(slot->buf, data, datalen);
+    slot->iov.iov_base = slot->buf;
+    slot->iov.iov_len = datalen;
+    memcpy(&slot->dst, &remote->addr, remote->size);
+
+    memset(&slot->mhdr, 0, sizeof(slot->mhdr));
+    slot->mhdr.msg_name = &slot->dst;
+    slot->mhdr.msg_namelen = remote->size;
+    slot->mhdr.msg_iov = &slot->iov;
+    slot->mhdr.msg_iovlen = 1;
+    slot->mhdr.msg_control = slot->ctrl.buf;
+    slot->mhdr.msg_controllen = mmsg_set_pktinfo(&slot->ctrl, session);
+
+    io_uring_prep_sendmsg(sqe, sock->fd, &slot->mhdr, 0);
+    io_uring_sqe_set_data(sqe, slot);
+
+    return datalen;
+}
+
+void uring_flush(uring_ctx_t *uctx)
+{
+    int res = io_uring_submit(&uctx->ring);
+
+    if (res < 0)
+        log_error("io_uring_submit() failed: %s\n", strerror(-res));
+}
+
+#else /* !USE_IO_URING */
+
+uring_ctx_t *uring_new(void)
+{
+    log_warn("io_uring support not compiled in\n");
+    return NULL;
+}
+
+void uring_free(uring_ctx_t *uctx) {}
+
+int uring_fd(const uring_ctx_t *uctx)
+{
+    return -1;
+}
+
+int uring_add_sock(uring_ctx_t *uctx, coap_socket_t *sock)
+{
+    return -1;
+}
+
+void uring_del_sock(uring_ctx_t *uctx, const coap_socket_t *sock) {}
+
+const uring_dgram_t *uring_rx_next(uring_ctx_t *uctx, coap_packet_t *packet)
+{
+    return NULL;
+}
+
+void uring_rx_done(uring_ctx_t *uctx, const uring_dgram_t *dgram) {}
+
+ssize_t uring_send(uring_ctx_t *uctx, coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen)
+{
+    return coap_network_send(sock, session, data, datalen);
+}
+
+void uring_flush(uring_ctx_t *uctx) {}
+
+#endif /* USE_IO_URING */
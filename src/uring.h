@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2021 Piotr Stolarz
+ * Copua: Lua CoAP library
+ *
+ * Distributed under the 2-clause BSD License (the License)
+ * see accompanying file LICENSE for details.
+ *
+ * This software is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the License for more information.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "coap2/coap.h"
+
+/* number of receive buffers pre-posted per socket */
+#ifndef URING_RX_BUFS
+# define URING_RX_BUFS  32
+#endif
+
+/* submission queue size */
+#ifndef URING_ENTRIES
+# define URING_ENTRIES  256
+#endif
+
+/*
+ * io_uring datagrams I/O context. Receive requests (each with its own buffer)
+ * are kept posted on the registered sockets, received datagrams are handed
+ * out of the completion queue directly from the buffers. Outgoing datagrams
+ * are submitted as send requests in batches.
+ *
+ * NOTE: Only unconnected (endpoints) sockets are handled by the context.
+ * NOTE: The library must be built with USE_IO_URING defined (and liburing
+ *     available), otherwise uring_new() always fails.
+ */
+typedef struct uring_ctx_t uring_ctx_t;
+
+/* datagram received by the ring */
+typedef struct
+{
+    coap_socket_t *sock;    /* NULL if the socket has been unregistered */
+    const uint8_t *data;
+    size_t len;
+} uring_dgram_t;
+
+/**
+ * Create io_uring I/O context. Returns NULL if io_uring is not available.
+ */
+uring_ctx_t *uring_new(void);
+
+/**
+ * Free io_uring I/O context. Requests in flight are cancelled.
+ */
+void uring_free(uring_ctx_t *uctx);
+
+/**
+ * Get the ring file descriptor. The descriptor is readable if there are
+ * completions to be processed by uring_rx_next().
+ */
+int uring_fd(const uring_ctx_t *uctx);
+
+/**
+ * Register socket and post its receive requests. Returns 0 on success, -1
+ * on error.
+ */
+int uring_add_sock(uring_ctx_t *uctx, coap_socket_t *sock);
+
+/**
+ * Unregister socket. Its requests are cancelled, datagrams already received
+ * are dropped.
+ */
+void uring_del_sock(uring_ctx_t *uctx, const coap_socket_t *sock);
+
+/**
+ * Get next datagram received by the ring. The datagram's source and
+ * destination addresses are written to the 'packet' header (its payload is
+ * not used). The datagram shall be released by uring_rx_done() before the
+ * next call. Returns NULL if there are no more datagrams received.
+ */
+const uring_dgram_t *uring_rx_next(uring_ctx_t *uctx, coap_packet_t *packet);
+
+/**
+ * Release datagram received by uring_rx_next(). Its buffer is posted for
+ * reception again.
+ */
+void uring_rx_done(uring_ctx_t *uctx, const uring_dgram_t *dgram);
+
+/**
+ * libcoap network_send() compatible routine. The datagram is queued as a send
+ * request submitted on the next flush. Returns 'datalen' on success, -1 on
+ * error.
+ */
+ssize_t uring_send(uring_ctx_t *uctx, coap_socket_t *sock,
+    const coap_session_t *session, const uint8_t *data, size_t datalen);
+
+/**
+ * Submit all queued requests (receives and sends).
+ */
+void uring_flush(uring_ctx_t *uctx);
+
+#endif
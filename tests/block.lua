@@ -0,0 +1,153 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Block-wise transfers (Block2 responses, Block1 uploads) tests (loopback)
+--
+
+local coap = require("copua")
+
+local PORT = 56832
+
+-- block size (SZX 0)
+local BLK_SZ = 16
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        t = t + math.max(spent, 1)
+    end
+end
+
+-- Block option value
+local function block(num, more, szx)
+    return (num << 4) | ((more and 1 or 0) << 3) | (szx or 0)
+end
+
+local BIG = string.rep("0123456789abcdef", 6) .. "tail"
+
+local n_big, uploaded = 0, nil
+
+coap.bind_server("127.0.0.1", PORT, function(req, resp)
+    local path = req.get_uri_path()
+
+    if path == "big" then
+        n_big = n_big + 1
+        resp.send(BIG)
+    elseif path == "up" then
+        uploaded = req.get_payload()
+        resp.send(CoapCode.CHANGED)
+    end
+end)
+
+coap.set_block_transfer(BLK_SZ)
+coap.set_block_upload(1024)
+
+local conn = coap.new_connection("127.0.0.1", PORT)
+local msg_id = 0
+
+-- send request with given options ({type, value} pairs in ascending order)
+-- and payload; returns the response
+local function request(method, path, opts, payload, handler)
+    local done
+
+    msg_id = msg_id + 1
+    coroutine.wrap(function()
+        local msg = coap.new_msg(CoapType.CON, method, msg_id)
+        msg.set_uri_path(path)
+        for _, opt in ipairs(opts) do
+            msg.set_option(opt[1], opt[2])
+        end
+
+        local resp, reason = conn.request(msg, payload, 2000)
+        assert(resp, "No response: " .. tostring(NackReasonCodeName[reason]))
+        handler(resp)
+        done = true
+    end)()
+
+    process(300)
+    assert(done, "Request of " .. path .. " not completed")
+end
+
+--
+-- Block2: the payload is served in blocks out of the transfer cached on the
+-- first block (the request handler is called once)
+--
+local data, num, more = "", 0, true
+
+while more do
+    request(CoapCode.GET, "big", {{CoapOption.BLOCK2, block(num)}}, nil,
+        function(resp)
+            local b2 = resp.get_option(CoapOption.BLOCK2)
+
+            assert(resp.get_code() == CoapCode.CONTENT)
+            assert(b2 and (b2 >> 4) == num, "Invalid Block2 number")
+            more = ((b2 & 0x08) ~= 0)
+            data = data .. resp.get_payload()
+        end)
+    num = num + 1
+end
+
+assert(data == BIG, "Block2 payload mismatch")
+assert(num == math.ceil(#BIG / BLK_SZ))
+assert(n_big == 1, string.format("Request handler called %d times", n_big))
+
+--
+-- Block1: the upload is reassembled and passed to the request handler once;
+-- the final response acknowledges the last block
+--
+local UPLOAD = string.rep("ABCDEFGHIJKLMNOP", 4) .. "end"
+local n_blks = math.ceil(#UPLOAD / BLK_SZ)
+
+for i = 0, n_blks - 1 do
+    local last = (i == n_blks - 1)
+    local opts = {{CoapOption.BLOCK1, block(i, not last)}}
+
+    if i == 0 then
+        table.insert(opts, {CoapOption.SIZE1, #UPLOAD})
+    end
+
+    request(CoapCode.PUT, "up", opts,
+        UPLOAD:sub(i * BLK_SZ + 1, (i + 1) * BLK_SZ),
+        function(resp)
+            local b1 = resp.get_option(CoapOption.BLOCK1)
+
+            assert(resp.get_code() ==
+                (last and CoapCode.CHANGED or CoapCode.CONTINUE))
+            assert(b1 == block(i, not last), "Invalid Block1 acknowledgement")
+        end)
+end
+
+assert(uploaded == UPLOAD, "Block1 payload mismatch")
+
+--
+-- Block1 of an upload not started (or out of order) is rejected with 4.08
+--
+uploaded = nil
+request(CoapCode.PUT, "up", {{CoapOption.BLOCK1, block(2, true)}},
+    UPLOAD:sub(1, BLK_SZ),
+    function(resp)
+        assert(resp.get_code() == CoapCode.REQUEST_ENTITY_INCOMPLETE,
+            "4.08 expected")
+    end)
+
+assert(uploaded == nil)
+
+--
+-- upload exceeding the max upload size is rejected with 4.13 (the max size
+-- is returned as Size1)
+--
+coap.set_block_upload(64)
+
+request(CoapCode.PUT, "up",
+    {{CoapOption.BLOCK1, block(0, true)}, {CoapOption.SIZE1, 1000}},
+    UPLOAD:sub(1, BLK_SZ),
+    function(resp)
+        assert(resp.get_code() == CoapCode.REQUEST_ENTITY_TOO_LARGE,
+            "4.13 expected")
+        assert(resp.get_option(CoapOption.SIZE1) == 64)
+    end)
+
+assert(uploaded == nil)
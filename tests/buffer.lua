@@ -0,0 +1,35 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Buffer object tests
+--
+
+local coap = require("copua")
+
+local str = "abc"
+local buf = coap.new_buffer(str)
+
+--
+-- sub() and tostring() follow string.sub() semantics
+--
+local function check_range(i, j)
+    local exp = str:sub(i, j)
+
+    assert(buf:tostring(i, j) == exp, string.format(
+        "tostring(%s, %s): '%s' expected", tostring(i), tostring(j), exp))
+    assert(buf:sub(i, j):tostring() == exp, string.format(
+        "sub(%s, %s): '%s' expected", tostring(i), tostring(j), exp))
+end
+
+for i = -5, 5 do
+    for j = -5, 5 do
+        check_range(i, j)
+    end
+end
+
+-- negative out of range end positions give empty ranges
+assert(buf:tostring(1, -4) == "")
+assert(buf:tostring(1, -5) == "")
+assert(buf:tostring(-10, -5) == "")
+assert(buf:sub(1, math.mininteger):len() == 0)
@@ -0,0 +1,98 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Resources observation (RFC 7641) tests (loopback)
+--
+
+local coap = require("copua")
+
+local PORT = 56833
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        t = t + math.max(spent, 1)
+    end
+end
+
+local n_regs = 0
+
+coap.bind_server("127.0.0.1", PORT, function(req, resp)
+    n_regs = n_regs + 1
+
+    -- options of numbers lower than Observe may be set by the handler; the
+    -- first registration expires soon (re-registered by the client)
+    resp.set_option(CoapOption.ETAG, "e" .. n_regs)
+    if n_regs == 1 then
+        resp.set_option(CoapOption.MAXAGE, 1)
+    end
+    resp.send("v0")
+end)
+
+local rsrc = coap.new_resource("obs")
+local conn = coap.new_connection("127.0.0.1", PORT)
+
+-- received notifications
+local notifs = {}
+
+local sub = conn.observe("obs", function(resp, sub)
+    table.insert(notifs, {
+        code = resp.get_code(),
+        seq = resp.get_option(CoapOption.OBSERVE),
+        etag = resp.get_option(CoapOption.ETAG, BytesType.STRING),
+        payload = resp.get_payload()
+    })
+end)
+
+--
+-- registration response is the first notification (with the handler's
+-- options and Observe added)
+--
+process(300)
+
+assert(n_regs == 1, "Observer not registered")
+assert(rsrc.get_observers() == 1)
+assert(#notifs == 1, string.format("%d notifications received", #notifs))
+assert(notifs[1].code == CoapCode.CONTENT)
+assert(notifs[1].seq ~= nil, "Registration response with no Observe")
+assert(notifs[1].etag == "e1", "Registration response with no ETag")
+assert(notifs[1].payload == "v0")
+
+--
+-- subscription is re-registered once the notification expires (Max-Age and
+-- the re-registration margin)
+--
+process(3500)
+
+assert(n_regs == 2, string.format("%d registrations", n_regs))
+assert(rsrc.get_observers() == 1)
+assert(#notifs == 2 and notifs[2].etag == "e2")
+
+--
+-- fresh notifications are passed to the callback once and in order
+--
+for i = 1, 3 do
+    assert(rsrc.notify(CoapCode.CONTENT, "v" .. i) == 1)
+    process(200)
+end
+
+assert(#notifs == 5, string.format("%d notifications received", #notifs))
+for i = 3, 5 do
+    assert(notifs[i].payload == "v" .. (i - 2))
+    assert(notifs[i].seq > notifs[i - 1].seq, "Stale notification passed")
+end
+
+--
+-- cancelled subscription deregisters the observer
+--
+sub.cancel()
+process(300)
+
+assert(rsrc.get_observers() == 0, "Observer not deregistered")
+assert(rsrc.notify(CoapCode.CONTENT, "v4") == 0)
+process(200)
+
+assert(#notifs == 5, "Notification passed after cancel")
@@ -0,0 +1,107 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Awaited (pending) requests tests (loopback)
+--
+
+local coap = require("copua")
+
+local PORT = 56834
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        t = t + math.max(spent, 1)
+    end
+end
+
+coap.bind_server("127.0.0.1", PORT, function(req, resp)
+    local path = req.get_uri_path()
+
+    if path == "echo" then
+        resp.send(req.get_payload())
+    elseif path == "later" then
+        -- separate response sent by a timer
+        local dfr = resp.defer()
+        coap.timer(200, function()
+            dfr.send(CoapCode.CONTENT, "later")
+        end)
+    elseif path == "never" then
+        -- empty ACK only, the response is never sent
+        resp.defer()
+    end
+end)
+
+local conn = coap.new_connection("127.0.0.1", PORT)
+local msg_id = 0
+
+local function new_req(path)
+    msg_id = msg_id + 1
+    local msg = coap.new_msg(CoapType.CON, CoapCode.GET, msg_id)
+    msg.set_uri_path(path)
+    return msg
+end
+
+--
+-- awaiting coroutine is resumed with the response; concurrent requests are
+-- matched by their tokens
+--
+local results = {}
+
+for _, path in ipairs({"later", "echo"}) do
+    coroutine.wrap(function()
+        local resp, reason = conn.request(new_req(path), path, 2000)
+        assert(resp, "No response: " .. tostring(NackReasonCodeName[reason]))
+        table.insert(results, resp.get_payload())
+    end)()
+end
+
+process(500)
+
+assert(#results == 2, string.format("%d requests completed", #results))
+assert(results[1] == "echo" and results[2] == "later",
+    "Responses mismatched")
+
+--
+-- request with no response times out
+--
+local done, resp, reason
+
+coroutine.wrap(function()
+    resp, reason = conn.request(new_req("never"), nil, 500)
+    done = true
+end)()
+
+process(300)
+assert(not done, "Request completed before the timeout")
+
+process(500)
+assert(done and resp == nil, "Request not timed out")
+assert(reason == NackReasonCode.NACK_TIMEOUT,
+    "Unexpected NACK reason: " .. tostring(NackReasonCodeName[reason]))
+
+--
+-- request failing to be sent (invalid payload) is not left pending: the
+-- coroutine is not resumed after it's gone
+--
+local ok, err
+
+coroutine.wrap(function()
+    ok, err = pcall(conn.request, new_req("echo"), true, 200)
+end)()
+
+assert(not ok and err, "Invalid payload accepted")
+process(500)
+
+-- processing goes on fine afterwards
+done = false
+coroutine.wrap(function()
+    resp = conn.request(new_req("echo"), "again", 2000)
+    done = (resp and resp.get_payload() == "again")
+end)()
+
+process(300)
+assert(done, "Request after the failed one not completed")
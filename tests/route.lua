@@ -0,0 +1,88 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Request routes tests (loopback)
+--
+
+local coap = require("copua")
+
+local PORT = 56831
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        t = t + math.max(spent, 1)
+    end
+end
+
+-- no request handler: unmatched requests are answered by the library
+coap.bind_server("127.0.0.1", PORT)
+
+coap.route(CoapCode.GET, "/sensors/:id", function(req, resp, params)
+    resp.send("param:" .. params.id)
+end)
+
+coap.route(CoapCode.GET, "/sensors/all", function(req, resp)
+    resp.send("literal")
+end)
+
+coap.route(nil, "/sensors/:id/temp", function(req, resp, params)
+    resp.send("temp:" .. params.id)
+end)
+
+local conn = coap.new_connection("127.0.0.1", PORT)
+local msg_id = 0
+
+-- send request of a given method and path; returns the response code and
+-- payload
+local function request(method, path)
+    local code, payload
+
+    msg_id = msg_id + 1
+    coroutine.wrap(function()
+        local msg = coap.new_msg(CoapType.CON, method, msg_id)
+        msg.set_uri_path(path)
+
+        local resp, reason = conn.request(msg, nil, 2000)
+        assert(resp, "No response: " .. tostring(NackReasonCodeName[reason]))
+        code, payload = resp.get_code(), resp.get_payload()
+    end)()
+
+    process(300)
+    assert(code, "Request of " .. path .. " not completed")
+    return code, payload
+end
+
+local code, payload
+
+-- literal segment takes precedence over path parameter
+code, payload = request(CoapCode.GET, "sensors/all")
+assert(code == CoapCode.CONTENT and payload == "literal")
+
+code, payload = request(CoapCode.GET, "sensors/12")
+assert(code == CoapCode.CONTENT and payload == "param:12")
+
+-- route of any method
+code, payload = request(CoapCode.PUT, "sensors/7/temp")
+assert(code == CoapCode.CONTENT and payload == "temp:7")
+
+-- matched path of a method not routed
+code = request(CoapCode.POST, "sensors/all")
+assert(code == CoapCode.METHOD_NOT_ALLOWED,
+    "4.05 expected, got " .. tostring(code))
+
+-- unmatched path
+code = request(CoapCode.GET, "actuators/1")
+assert(code == CoapCode.NOT_FOUND, "4.04 expected, got " .. tostring(code))
+
+code = request(CoapCode.GET, "sensors/1/2/3")
+assert(code == CoapCode.NOT_FOUND, "4.04 expected, got " .. tostring(code))
+
+-- removed route
+coap.route(CoapCode.GET, "/sensors/all", nil)
+
+code, payload = request(CoapCode.GET, "sensors/all")
+assert(code == CoapCode.CONTENT and payload == "param:all")
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Run library tests (all tests/*.lua scripts or the ones provided)
+#
+
+export LUA_CPATH="$(dirname $0)/../src/?.so;${LUA_CPATH}"
+
+lua=$(dirname $0)/../external/lua/lua
+
+if [ $# -lt 1 ]; then
+    set -- $(dirname $0)/*.lua
+fi
+
+failed=0
+for script in "$@"; do
+    if $lua $script; then
+        echo "PASS: $(basename $script)"
+    else
+        echo "FAIL: $(basename $script)"
+        failed=$((failed + 1))
+    fi
+done
+
+[ $failed -eq 0 ]
@@ -0,0 +1,76 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Shared sockets tests (loopback)
+--
+
+local coap = require("copua")
+
+local PORT = 56830
+
+-- wait time (msecs) exceeding the 1st CON retransmission timeout
+-- (ACK_TIMEOUT * ACK_RANDOM_FACTOR)
+local RETRANS_WAIT = 4000
+
+local n_reqs = 0
+
+coap.bind_server("127.0.0.1", PORT, function(req, resp)
+    n_reqs = n_reqs + 1
+    resp.send("pong")
+end)
+
+coap.set_shared_sockets(1)
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        t = t + math.max(spent, 1)
+    end
+end
+
+--
+-- CON request on a shared socket gets its response (the response is matched
+-- to the request's session) and is not retransmitted (the piggybacked ACK
+-- clears the retransmission queue)
+--
+local code, payload
+local conn = coap.new_connection("127.0.0.1", PORT)
+
+coroutine.wrap(function()
+    local msg = coap.new_msg(CoapType.CON, CoapCode.GET, 1)
+    msg.set_uri_path("ping")
+
+    local resp, reason = conn.request(msg, nil, RETRANS_WAIT)
+    assert(resp, "No response: " .. tostring(NackReasonCodeName[reason]))
+    code, payload = resp.get_code(), resp.get_payload()
+end)()
+
+process(RETRANS_WAIT)
+
+assert(code == CoapCode.CONTENT, "2.05 response expected")
+assert(payload == "pong")
+assert(n_reqs == 1, string.format("Request retransmitted (%d received)", n_reqs))
+
+--
+-- connections to the same server on the same shared socket share the session
+--
+local conn2 = coap.new_connection("127.0.0.1", PORT)
+local n_done = 0
+
+for i, c in ipairs({conn, conn2}) do
+    coroutine.wrap(function()
+        local msg = coap.new_msg(CoapType.CON, CoapCode.GET, 1 + i)
+        msg.set_uri_path("ping")
+
+        assert(c.request(msg))
+        n_done = n_done + 1
+    end)()
+end
+
+process(RETRANS_WAIT)
+
+assert(n_done == 2)
+assert(n_reqs == 3, string.format("Request retransmitted (%d received)", n_reqs))
@@ -0,0 +1,93 @@
+--
+-- Copyright (c) 2021 Piotr Stolarz
+-- Copua: Lua CoAP library
+--
+-- Timers (timer wheel) tests
+--
+
+local coap = require("copua")
+
+-- processing time (msecs) measured by process_step()
+local clock = 0
+
+local function process(ms)
+    local t = 0
+    while t < ms do
+        local spent = coap.process_step(100)
+        assert(spent >= 0)
+        spent = math.max(spent, 1)
+        t = t + spent
+        clock = clock + spent
+    end
+end
+
+-- max accepted timer firing delay (msecs)
+local LATE = 200
+
+--
+-- timers of expirations spread across the wheel levels (6 bits per level)
+-- fire in order and not before their time (the 4200 msecs one is cascaded
+-- twice before it fires)
+--
+local fired = {}
+
+for _, ms in ipairs({4200, 10, 700, 70}) do
+    coap.timer(ms, function(tmr)
+        table.insert(fired, {ms = ms, at = clock})
+    end)
+end
+
+process(4200 + LATE)
+
+assert(#fired == 4, string.format("%d timers fired", #fired))
+for i, ms in ipairs({10, 70, 700, 4200}) do
+    assert(fired[i].ms == ms, "Timers fired out of order")
+    assert(fired[i].at >= ms, string.format("%d msecs timer fired early", ms))
+    assert(fired[i].at <= ms + LATE,
+        string.format("%d msecs timer fired late (%d)", ms, fired[i].at))
+end
+
+--
+-- cancelled timer doesn't fire
+--
+local n_fired = 0
+local tmr = coap.timer(50, function() n_fired = n_fired + 1 end)
+
+tmr.cancel()
+process(100)
+
+assert(n_fired == 0, "Cancelled timer fired")
+
+--
+-- repeated timer is re-armed till cancelled (by its callback)
+--
+local n_ticks = 0
+
+coap.timer(30, function(tmr)
+    n_ticks = n_ticks + 1
+    if n_ticks == 5 then
+        tmr.cancel()
+    end
+end, true)
+
+process(500)
+
+assert(n_ticks == 5, string.format("Repeated timer fired %d times", n_ticks))
+
+--
+-- timer armed by a timer callback (re-armed one-shot timer)
+--
+local n_rearmed = 0
+
+local function rearm()
+    n_rearmed = n_rearmed + 1
+    if n_rearmed < 3 then
+        coap.timer(20, rearm)
+    end
+end
+
+coap.timer(20, rearm)
+process(200)
+
+assert(n_rearmed == 3,
+    string.format("Re-armed timer fired %d times", n_rearmed))